@@ -0,0 +1,524 @@
+/* Scale benchmarks for the responder, run against a scratch directory through a loopback transport.
+   Every option is "--name value"; the defaults are the reference workloads */
+
+#include <cstring>
+#include <string>
+
+#include "harness.hpp"
+#include "delta.hpp"
+#include "compress.hpp"
+#include "archive.hpp"
+
+#define BENCH_STORAGE 0x00010001
+#define BENCH_ROOT 0xFFFFFFFF
+#define BENCH_CHUNK 0x100000UL
+
+static u64 g_rng;
+
+static u64 _xorshift() {
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+static size_t g_peak_handles = 0;
+
+static void _report(BenchHarness &harness, const char *name, u64 start, u64 bytes, u64 ops) {
+    u64 ns = statsNow() - start;
+    g_peak_handles = std::max(g_peak_handles, harness.responder.objectHandleMemory());
+
+    double secs = ns / 1e9;
+    printf("%-18s %10.3fs %10.2f MB/s %12.1f ops/s\n", name, secs, bytes / 1e6 / secs, ops / secs);
+}
+
+/* Pseudo-random content that's produced without touching the allocator */
+static MTPDataSource _pattern(u8 *pattern) {
+    return [pattern](u8 *buf, size_t size) {
+        for (size_t pos = 0; pos < size; pos += BENCH_CHUNK)
+            memcpy(buf + pos, pattern, std::min(size - pos, BENCH_CHUNK));
+        return size;
+    };
+}
+
+static void _sequential(BenchHarness &harness, u8 *pattern, u64 size, u32 *handle) {
+    u64 start = statsNow();
+    *handle = harness.initiator.sendObject(BENCH_STORAGE, BENCH_ROOT, u"large.bin", size, _pattern(pattern));
+    _report(harness, "sequential-write", start, size, 2);
+
+    start = statsNow();
+    u64 received = harness.initiator.getObject(*handle, size);
+    if (received != size)
+        printf("  short read: %#lx of %#lx\n", received, size);
+    _report(harness, "sequential-read", start, received, 1);
+}
+
+static void _randomReads(BenchHarness &harness, u32 handle, u64 file_size, u64 count, u64 size) {
+    /* GetPartialObject only takes 32-bit offsets */
+    u64 span = std::min(file_size, 0xFFFFFFFFUL);
+    if (span <= size)
+        return;
+
+    u64 start = statsNow(), bytes = 0;
+    for (u64 i=0; i<count; i++) {
+        u32 offset = (_xorshift() % (span - size)) & ~0xFFFUL;
+        bytes += harness.initiator.getPartialObject(handle, offset, size);
+    }
+    _report(harness, "partial-random", start, bytes, count);
+}
+
+/* How a host that mounts the device streams a file: one GetPartialObject after another */
+static void _partialStream(BenchHarness &harness, u32 handle, u64 file_size, u64 size) {
+    u64 span = std::min(file_size, 0xFFFFFFFFUL);
+    if (span < size)
+        return;
+
+    u64 start = statsNow(), bytes = 0, count = 0;
+    for (u64 offset = 0; offset + size <= span; offset += size, count++)
+        bytes += harness.initiator.getPartialObject(handle, offset, size);
+    _report(harness, "partial-stream", start, bytes, count);
+}
+
+static u32 _tinyFiles(BenchHarness &harness, u8 *pattern, u64 count, u64 size) {
+    u32 folder = harness.initiator.createFolder(BENCH_STORAGE, BENCH_ROOT, u"tiny");
+
+    u64 start = statsNow();
+    for (u64 i=0; i<count; i++) {
+        std::u16string name = fs::path("file" + std::to_string(i) + ".bin").u16string();
+        harness.initiator.sendObject(BENCH_STORAGE, folder, name, size, _pattern(pattern));
+    }
+    _report(harness, "tiny-files", start, count * size, count);
+
+    return folder;
+}
+
+static u64 _walk(BenchHarness &harness, u32 parent) {
+    u64 ops = 1;
+    for (u32 handle : harness.initiator.getObjectHandles(BENCH_STORAGE, 0, parent)) {
+        MTPObjectInfo info;
+        if (!harness.initiator.getObjectInfo(handle, &info))
+            continue;
+        ops++;
+
+        if (info.format == FormatAssociation)
+            ops += _walk(harness, handle);
+    }
+
+    return ops;
+}
+
+static void _deepTree(BenchHarness &harness, u8 *pattern, u64 depth) {
+    u64 start = statsNow();
+    u32 parent = harness.initiator.createFolder(BENCH_STORAGE, BENCH_ROOT, u"deep");
+    u32 top = parent;
+    for (u64 i=0; i<depth && parent != 0; i++) {
+        harness.initiator.sendObject(BENCH_STORAGE, parent, u"leaf.bin", 0x1000, _pattern(pattern));
+        parent = harness.initiator.createFolder(BENCH_STORAGE, parent, u"d" + fs::path(std::to_string(i)).u16string());
+    }
+    _report(harness, "deep-create", start, depth * 0x1000, depth * 3);
+
+    start = statsNow();
+    u64 ops = _walk(harness, top);
+    _report(harness, "deep-walk", start, 0, ops);
+}
+
+/* The whole storage in one transaction, which is what sync tools want instead of a walk */
+static void _manifest(BenchHarness &harness) {
+    u64 start = statsNow();
+    size_t count = harness.initiator.getObjectHandles(BENCH_STORAGE, 0, 0).size();
+    _report(harness, "manifest", start, count * sizeof(u32), 1);
+}
+
+static void _browse(BenchHarness &harness, u32 folder, u64 iterations) {
+    u64 start = statsNow(), ops = 0;
+    for (u64 i=0; i<iterations; i++) {
+        for (u32 handle : harness.initiator.getObjectHandles(BENCH_STORAGE, 0, folder)) {
+            MTPObjectInfo info;
+            harness.initiator.getObjectInfo(handle, &info);
+            ops++;
+        }
+        ops++;
+    }
+    _report(harness, "browse", start, 0, ops);
+}
+
+/* Backing up a folder of small files, one GetObject each and then all of them as one archive */
+static void _backup(BenchHarness &harness, u32 folder, u64 size) {
+    std::vector<u32> handles = harness.initiator.getObjectHandles(BENCH_STORAGE, 0, folder);
+
+    u64 start = statsNow(), bytes = 0;
+    for (u32 handle : handles)
+        bytes += harness.initiator.getObject(handle, size);
+    _report(harness, "tiny-get", start, bytes, handles.size());
+
+    bytes = 0;
+    start = statsNow();
+    u16 code = harness.initiator.transact(OperationTuphlosGetArchive, {folder}, NULL, 0, NULL, [&bytes](const u8 *buf, size_t chunk) {
+        bytes += chunk;
+    });
+    if (code != ResponseOk)
+        printf("  archive failed: %#x\n", code);
+    _report(harness, "tiny-archive", start, bytes, handles.size());
+}
+
+/* A folder view refreshing: the same few hundred small files fetched again and again */
+static void _refresh(BenchHarness &harness, u32 folder, u64 size, u64 passes) {
+    std::vector<u32> handles = harness.initiator.getObjectHandles(BENCH_STORAGE, 0, folder);
+    handles.resize(std::min<size_t>(handles.size(), 500));
+
+    u64 start = statsNow(), bytes = 0;
+    for (u64 pass = 0; pass < passes; pass++) {
+        for (u32 handle : handles)
+            bytes += harness.initiator.getObject(handle, size);
+    }
+    _report(harness, "tiny-refresh", start, bytes, passes * handles.size());
+}
+
+/* Copies made on the device, without the data going anywhere near the host */
+static void _copy(BenchHarness &harness, u32 folder, u64 folder_size, u64 count, u32 large, u64 large_size) {
+    u32 copies = harness.initiator.createFolder(BENCH_STORAGE, BENCH_ROOT, u"copies");
+
+    u64 start = statsNow();
+    if (large != 0) {
+        u16 code = harness.initiator.transact(OperationCopyObject, {large, BENCH_STORAGE, copies});
+        if (code != ResponseOk)
+            printf("  copy failed: %#x\n", code);
+        _report(harness, "copy-large", start, large_size, 1);
+    }
+
+    start = statsNow();
+    u16 code = harness.initiator.transact(OperationCopyObject, {folder, BENCH_STORAGE, copies});
+    if (code != ResponseOk)
+        printf("  copy failed: %#x\n", code);
+    _report(harness, "copy-tree", start, folder_size, count);
+}
+
+/* Half of the tiny files are moved to another folder one MoveObject at a time, the other half with one batch */
+static void _reorganize(BenchHarness &harness, u32 folder) {
+    std::vector<u32> handles = harness.initiator.getObjectHandles(BENCH_STORAGE, 0, folder);
+    u32 moved = harness.initiator.createFolder(BENCH_STORAGE, BENCH_ROOT, u"moved");
+    size_t half = handles.size() / 2;
+
+    u64 start = statsNow();
+    for (size_t i=0; i<half; i++)
+        harness.initiator.transact(OperationMoveObject, {handles[i], BENCH_STORAGE, moved});
+    _report(harness, "move-each", start, 0, half);
+
+    std::vector<u8> batch(sizeof(u32));
+    *(u32 *) batch.data() = handles.size() - half;
+    for (size_t i=half; i<handles.size(); i++) {
+        MTPBatchEntry entry = {BatchMove, 0, handles[i], BENCH_STORAGE, moved};
+        batch.insert(batch.end(), (u8 *) &entry, (u8 *) (&entry + 1));
+    }
+
+    start = statsNow();
+    u64 pos = 0;
+    std::vector<u32> params;
+    u16 code = harness.initiator.transact(OperationTuphlosSendBatch, {}, &params, batch.size(), [&](u8 *buf, size_t chunk) {
+        memcpy(buf, batch.data() + pos, chunk);
+        pos += chunk;
+        return chunk;
+    });
+    if (code != ResponseOk || params.size() < 2 || params[1] != 0)
+        printf("  batch failed: %#x\n", code);
+    _report(harness, "move-batch", start, 0, handles.size() - half);
+}
+
+/* The same number of tiny files again, as one tar with a folder for every hundred of them */
+static void _restore(BenchHarness &harness, u8 *pattern, u64 count, u64 size) {
+    std::vector<u8> archive;
+    for (u64 i=0; i<count; i++) {
+        std::string name = "restore/" + std::to_string(i / 100) + "/file" + std::to_string(i) + ".bin";
+        tarHeader(name, size, 0, false, &archive);
+        archive.insert(archive.end(), pattern, pattern + size);
+        archive.resize(archive.size() + tarPadding(size));
+    }
+    archive.resize(archive.size() + 2 * TAR_BLOCK_SIZE);
+
+    u64 start = statsNow(), pos = 0;
+    std::vector<u32> params;
+    u16 code = harness.initiator.transact(OperationTuphlosSendArchive, {BENCH_STORAGE, BENCH_ROOT}, &params, archive.size(),
+        [&](u8 *buf, size_t chunk) {
+            memcpy(buf, archive.data() + pos, chunk);
+            pos += chunk;
+            return chunk;
+        });
+    if (code != ResponseOk)
+        printf("  restore failed: %#x\n", code);
+    _report(harness, "tiny-restore", start, count * size, count);
+}
+
+/* Host side of a delta update: a file gets a few scattered edits and only what changed is sent back */
+static void _deltaUpdate(BenchHarness &harness, u64 size, u64 edits) {
+    u8 *content = (u8 *) malloc(size);
+    for (u64 i=0; i<size; i += sizeof(u64)) {
+        u64 word = _xorshift();
+        memcpy(content + i, &word, std::min<u64>(size - i, sizeof(word)));
+    }
+
+    u64 sent = 0;
+    u32 handle = harness.initiator.sendObject(BENCH_STORAGE, BENCH_ROOT, u"delta.bin", size, [&](u8 *buf, size_t chunk) {
+        memcpy(buf, content + sent, chunk);
+        sent += chunk;
+        return chunk;
+    });
+
+    for (u64 i=0; i<edits; i++) {
+        u64 offset = _xorshift() % size;
+        content[offset] ^= 0xFF;
+    }
+
+    u64 start = statsNow();
+    std::vector<u8> signatures;
+    harness.initiator.transact(OperationTuphlosGetSignatures, {handle, 0}, NULL, 0, NULL, [&](const u8 *buf, size_t chunk) {
+        signatures.insert(signatures.end(), buf, buf + chunk);
+    });
+
+    MTPDeltaSignatureHeader header;
+    memcpy(&header, signatures.data(), sizeof(header));
+    std::vector<MTPDeltaSignature> blocks(header.count);
+    memcpy(blocks.data(), signatures.data() + sizeof(header), header.count * sizeof(MTPDeltaSignature));
+
+    std::vector<u8> delta;
+    deltaEncode(header, blocks, content, size, &delta);
+
+    u64 expected = hashXXH3(content, size), pos = 0;
+    u16 code = harness.initiator.transact(OperationTuphlosSendDelta, {handle, header.block_size, (u32) (expected >> 32), (u32) expected},
+        NULL, delta.size(), [&](u8 *buf, size_t chunk) {
+            memcpy(buf, delta.data() + pos, chunk);
+            pos += chunk;
+            return chunk;
+        });
+    if (code != ResponseOk)
+        printf("  delta rejected: %#x\n", code);
+    _report(harness, "delta-update", start, size, 2);
+    printf("  %lu signature bytes and %lu delta bytes for %lu bytes of content\n", signatures.size(), delta.size(), size);
+
+    free(content);
+}
+
+/* Log-like text, which LZ4 gets a few times smaller. The link is throttled so it's the bottleneck, like USB2 is */
+static void _compressed(BenchHarness &harness, u64 size, u64 rate) {
+    static const char *levels[] = {"INFO", "WARN", "DEBUG"};
+    u8 *content = (u8 *) malloc(size);
+    for (u64 pos = 0; pos < size;) {
+        char line[0x80];
+        u64 length = snprintf(line, sizeof(line), "%010lu [%s] worker %lu: request %#lx took %lu us\n",
+            pos, levels[_xorshift() % 3], _xorshift() % 8, _xorshift() & 0xFFFFFF, _xorshift() % 10000);
+        memcpy(content + pos, line, std::min(length, size - pos));
+        pos += length;
+    }
+
+    u64 sent = 0;
+    MTPDataSource source = [&](u8 *buf, size_t chunk) {
+        memcpy(buf, content + sent, chunk);
+        sent += chunk;
+        return chunk;
+    };
+
+    harness.transport.setRate(rate);
+
+    u64 start = statsNow();
+    u32 handle = harness.initiator.sendObject(BENCH_STORAGE, BENCH_ROOT, u"plain.log", size, source);
+    _report(harness, "plain-send", start, size, 2);
+
+    start = statsNow();
+    harness.initiator.getObject(handle, size);
+    _report(harness, "plain-get", start, size, 1);
+
+    harness.initiator.transact(OperationTuphlosSetCompression, {CompressionLZ4});
+
+    std::vector<u8> wire;
+    start = statsNow();
+    harness.initiator.getObject(handle, 0, [&wire](const u8 *buf, size_t chunk) {
+        wire.insert(wire.end(), buf, buf + chunk);
+    });
+    _report(harness, "lz4-get", start, size, 1);
+
+    /* The host side, which also checks what came back */
+    u8 *raw = (u8 *) malloc(COMPRESS_BLOCK_SIZE);
+    u32 *table = (u32 *) calloc(1 << 14, sizeof(u32));
+    u64 pos = 0;
+    for (size_t i = 0; i + sizeof(MTPCompressedBlockHeader) <= wire.size();) {
+        MTPCompressedBlockHeader header;
+        memcpy(&header, wire.data() + i, sizeof(header));
+        i += sizeof(header);
+        bool ok = header.packed_size == header.raw_size ?
+            (memcpy(raw, wire.data() + i, header.raw_size), true) :
+            lz4Decompress(wire.data() + i, header.packed_size, raw, header.raw_size) == header.raw_size;
+        if (!ok || pos + header.raw_size > size || memcmp(raw, content + pos, header.raw_size) != 0) {
+            printf("  bad block at %#lx\n", pos);
+            break;
+        }
+        i += header.packed_size;
+        pos += header.raw_size;
+    }
+    if (pos != size)
+        printf("  got %#lx of %#lx\n", pos, size);
+    printf("  %lu bytes on the wire for %lu bytes of content\n", wire.size(), size);
+
+    std::vector<u8> stream;
+    for (u64 offset = 0; offset < size; offset += COMPRESS_BLOCK_SIZE) {
+        MTPCompressedBlockHeader header;
+        header.raw_size = std::min<u64>(size - offset, COMPRESS_BLOCK_SIZE);
+        header.packed_size = compressBlock(content + offset, header.raw_size, raw, table);
+        stream.insert(stream.end(), (u8 *) &header, (u8 *) &header + sizeof(header));
+        const u8 *packed = header.packed_size == header.raw_size ? content + offset : raw;
+        stream.insert(stream.end(), packed, packed + header.packed_size);
+    }
+
+    sent = 0;
+    start = statsNow();
+    u32 copy = harness.initiator.sendObject(BENCH_STORAGE, BENCH_ROOT, u"lz4.log", size, [&](u8 *buf, size_t chunk) {
+        memcpy(buf, stream.data() + sent, chunk);
+        sent += chunk;
+        return chunk;
+    }, stream.size());
+    _report(harness, "lz4-send", start, size, 2);
+
+    harness.initiator.transact(OperationTuphlosSetCompression, {CompressionNone});
+    harness.transport.setRate(0);
+
+    /* HashObject has no data phase to compress, so it can say whether the upload came out right */
+    u64 expected = hashXXH3(content, size), digest = 0;
+    harness.initiator.transact(OperationTuphlosHashObject, {copy, HashXXH3, 0, 0, 0}, NULL, 0, NULL, [&digest](const u8 *buf, size_t chunk) {
+        if (chunk >= 26)
+            digest = __builtin_bswap64(*(u64 *) (buf + 18));
+    });
+    if (digest != expected)
+        printf("  upload doesn't match: %#lx, expected %#lx\n", digest, expected);
+
+    free(table);
+    free(raw);
+    free(content);
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options(argc, argv, {
+        {"scratch", "DIR", "Where the bench storage goes, emptied first (/tmp/tuphlos-bench)"},
+        {"large-size", "BYTES", "Size of the large file (8 GiB)"},
+        {"tiny-files", "N", "How many tiny files to send (50000)"},
+        {"tiny-size", "BYTES", "Size of each tiny file (256)"},
+        {"depth", "N", "Depth of the nested folder tree (64)"},
+        {"browse", "N", "Passes listing the tiny files and getting each one's info (10)"},
+        {"random-reads", "N", "GetPartialObjects at random offsets (10000)"},
+        {"read-size", "BYTES", "Size of each random read (64 KiB)"},
+        {"stream-size", "BYTES", "Size of each read when streaming (128 KiB)"},
+        {"delta-size", "BYTES", "Size of the file updated by SendDelta (256 MiB)"},
+        {"delta-edits", "N", "Edits made to it before the update (16)"},
+        {"compress-size", "BYTES", "Size of the file sent and read compressed (64 MiB)"},
+        {"link-rate", "BYTES/S", "Simulated link speed for the compressed runs (40000000)"},
+        {"memory", "BYTES", "Use a RAM backed storage this big instead of the scratch directory (0, off)"},
+        {"content-cache", "BYTES", "Budget of the content cache"},
+        {"path-cache", "BYTES", "Budget of the path cache"},
+        {"hash-cache", "BYTES", "Budget of the hash cache"},
+        {"handle-cache", "BYTES", "Budget of the handle database entries kept in memory"},
+        {"sd-latency", "NS", "Cost of each read from the RAM backed storage (0)"},
+        {"sd-rate", "BYTES/S", "Read speed of the RAM backed storage (0, unlimited)"},
+        {"seed", "N", "Seed for the generated content"},
+        {"capture", "FILE", "Record every transaction there, for tuphlos-replay"},
+        {"keep", "0|1", "Leave the scratch directory behind (0)"},
+    });
+
+    std::string scratch = options.get("scratch", std::string("/tmp/tuphlos-bench"));
+    u64 large_size = options.get("large-size", 0x200000000UL);
+    u64 tiny_count = options.get("tiny-files", 50000UL);
+    u64 tiny_size = options.get("tiny-size", 0x100UL);
+    u64 depth = options.get("depth", 64UL);
+    u64 browse = options.get("browse", 10UL);
+    u64 reads = options.get("random-reads", 10000UL);
+    u64 read_size = options.get("read-size", 0x10000UL);
+    u64 stream_size = options.get("stream-size", 0x20000UL); // Per GetPartialObject when streaming
+    u64 delta_size = options.get("delta-size", 0x10000000UL);
+    u64 delta_edits = options.get("delta-edits", 16UL);
+    u64 compress_size = options.get("compress-size", 0x4000000UL);
+    u64 link_rate = options.get("link-rate", 40000000UL); // Bytes per second, about what USB2 gets in practice
+    u64 memory = options.get("memory", 0UL); // Size of a RAM backed storage to use instead of the scratch directory
+    u64 content_cache = options.get("content-cache", (u64) CONTENT_CACHE_BUDGET);
+    u64 path_cache = options.get("path-cache", (u64) MEMORY_PATH_BUDGET);
+    u64 hash_cache = options.get("hash-cache", (u64) MEMORY_HASH_BUDGET);
+    u64 handle_cache = options.get("handle-cache", (u64) MEMORY_HANDLE_BUDGET);
+    u64 sd_latency = options.get("sd-latency", 0UL); // Nanoseconds per read from the RAM backed storage
+    u64 sd_rate = options.get("sd-rate", 0UL); // and its read speed in bytes per second
+    g_rng = options.get("seed", 0x5475706869UL);
+
+    fs::remove_all(scratch);
+
+    u8 *pattern = (u8 *) malloc(BENCH_CHUNK);
+    for (size_t i=0; i<BENCH_CHUNK; i += sizeof(u64)) {
+        u64 word = _xorshift();
+        memcpy(pattern + i, &word, sizeof(word));
+    }
+
+    {
+        BenchHarness harness(scratch);
+        if (memory != 0)
+            harness.insertMemoryStorage(BENCH_STORAGE, "bench", u"Bench", memory)->setReadCost(sd_latency, sd_rate);
+        else
+            harness.insertStorage(BENCH_STORAGE, "bench", u"Bench");
+
+        std::string capture = options.get("capture", std::string());
+        if (!capture.empty() && !harness.capture.start(capture.c_str()))
+            printf("Can't capture to %s\n", capture.c_str());
+
+        harness.responder.setMemoryBudget(MemoryContents, content_cache);
+        harness.responder.setMemoryBudget(MemoryObjectPaths, path_cache);
+        harness.responder.setMemoryBudget(MemoryHashes, hash_cache);
+        harness.responder.setMemoryBudget(MemoryHandles, handle_cache);
+        harness.start();
+
+        harness.initiator.openSession(1);
+        harness.initiator.getStorageIds();
+
+        u32 large = 0;
+        if (large_size != 0) {
+            _sequential(harness, pattern, large_size, &large);
+            _randomReads(harness, large, large_size, reads, read_size);
+            _partialStream(harness, large, large_size, stream_size);
+        }
+
+        u32 folder = 0;
+        if (tiny_count != 0)
+            folder = _tinyFiles(harness, pattern, tiny_count, tiny_size);
+        if (depth != 0)
+            _deepTree(harness, pattern, depth);
+        if (folder != 0 && browse != 0)
+            _browse(harness, folder, browse);
+        if (folder != 0)
+            _backup(harness, folder, tiny_size);
+        if (folder != 0)
+            _refresh(harness, folder, tiny_size, 10);
+        if (folder != 0)
+            _copy(harness, folder, tiny_count * tiny_size, tiny_count, large, large_size);
+        if (folder != 0)
+            _reorganize(harness, folder);
+        if (tiny_count != 0)
+            _restore(harness, pattern, tiny_count, tiny_size);
+        if (delta_size != 0)
+            _deltaUpdate(harness, delta_size, delta_edits);
+        if (compress_size != 0)
+            _compressed(harness, compress_size, link_rate);
+        _manifest(harness);
+
+        harness.initiator.closeSession();
+        harness.stop();
+
+        printf("\nHost side latency per operation:\n");
+        benchPrintLatencies(stdout, harness.initiator.latencies);
+
+        printf("\nResponder side breakdown:\n");
+        harness.responder.stats.print(stdout);
+
+        printf("\nResponder memory:\n");
+        harness.responder.memoryReport().print(stdout);
+
+        printf("\nHandle table peak: %lu bytes; process peak RSS: %lu bytes\n", g_peak_handles, benchPeakRss());
+    }
+
+    free(pattern);
+
+    if (options.get("keep", 0UL) == 0)
+        fs::remove_all(scratch);
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "harness.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+BenchHarness::BenchHarness(std::string scratch) : capture(&transport), responder(&capture), initiator(&transport) {
+    fs::create_directories(scratch);
+    if (chdir(scratch.c_str()) != 0)
+        fprintf(stderr, "Can't enter %s\n", scratch.c_str());
+    this->responder.setCacheDirectory("cache");
+    this->running = false;
+}
+
+BenchHarness::~BenchHarness() {
+    this->stop();
+}
+
+void BenchHarness::insertStorage(u32 id, std::string drive, std::u16string name) {
+    fs::create_directories(drive + ":");
+    this->responder.insertStorage(id, drive, name);
+}
+
+MTPMemoryStorage *BenchHarness::insertMemoryStorage(u32 id, std::string drive, std::u16string name, u64 limit) {
+    MTPMemoryStorage *storage = new MTPMemoryStorage(drive, limit);
+    this->responder.insertStorage(id, storage, name);
+    return storage;
+}
+
+void BenchHarness::start() {
+    this->running = true;
+    this->thread = std::thread([this] {
+        while (this->running)
+            this->responder.loop();
+    });
+}
+
+void BenchHarness::stop() {
+    if (!this->running)
+        return;
+
+    this->running = false;
+    this->transport.close();
+    this->thread.join();
+    this->capture.stop();
+}
+
+static void _benchUsage(FILE *f, const char *program, const std::vector<BenchOption> &known) {
+    fprintf(f, "Usage: %s [--option value]...\n", program);
+    for (auto &option : known) {
+        std::string name = std::string("--") + option.name + " " + option.value;
+        fprintf(f, "  %-24s %s\n", name.c_str(), option.help);
+    }
+    fprintf(f, "  %-24s %s\n", "--help", "Show this and exit");
+}
+
+BenchOptions::BenchOptions(int argc, char **argv, const std::vector<BenchOption> &known) {
+    for (int i=1; i<argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            _benchUsage(stdout, argv[0], known);
+            exit(0);
+        }
+
+        std::string name = arg.rfind("--", 0) == 0 ? arg.substr(2) : "";
+        auto it = std::find_if(known.begin(), known.end(), [&name](const BenchOption &option) { return name == option.name; });
+        if (it == known.end() || i + 1 >= argc) {
+            fprintf(stderr, it == known.end() ? "Unknown argument %s\n" : "%s needs a value\n", arg.c_str());
+            _benchUsage(stderr, argv[0], known);
+            exit(1);
+        }
+
+        this->values[name] = argv[i + 1];
+    }
+}
+
+std::string BenchOptions::get(std::string name, std::string def) {
+    auto it = this->values.find(name);
+    return it == this->values.end() ? def : it->second;
+}
+
+u64 BenchOptions::get(std::string name, u64 def) {
+    auto it = this->values.find(name);
+    return it == this->values.end() ? def : strtoull(it->second.c_str(), NULL, 0);
+}
+
+u64 benchPercentile(std::vector<u64> samples, u64 percentile) {
+    if (samples.empty())
+        return 0;
+
+    size_t index = std::min(samples.size() - 1, (samples.size() * percentile) / 100);
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+void benchPrintLatencies(FILE *f, const std::map<u16, std::vector<u64>> &latencies) {
+    fprintf(f, "%-6s %10s %10s %10s %10s\n", "OP", "COUNT", "P50(us)", "P99(us)", "MAX(us)");
+    for (auto &entry : latencies) {
+        fprintf(f, "%#06x %10lu %10lu %10lu %10lu\n", entry.first, entry.second.size(),
+            benchPercentile(entry.second, 50) / 1000,
+            benchPercentile(entry.second, 99) / 1000,
+            *std::max_element(entry.second.begin(), entry.second.end()) / 1000);
+    }
+}
+
+u64 benchPeakRss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024UL;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mtp.hpp"
+#include "ramfs.hpp"
+#include "capture.hpp"
+#include "loopback.hpp"
+#include "initiator.hpp"
+
+/* A responder running on its own thread, wired to an initiator through a loopback. Storages
+   live under the scratch directory, which becomes the working directory so "drive:/" paths resolve */
+class BenchHarness {
+    public:
+        BenchHarness(std::string scratch);
+        ~BenchHarness();
+
+        void insertStorage(u32 id, std::string drive, std::u16string name);
+        MTPMemoryStorage *insertMemoryStorage(u32 id, std::string drive, std::u16string name, u64 limit); // Keeps the disk out of the numbers
+        void start();
+        void stop();
+
+        LoopbackTransport transport;
+        CaptureTransport capture; // Sits between the loopback and the responder, idle unless started
+        MTPResponder responder;
+        MTPInitiator initiator;
+
+    private:
+        std::thread thread;
+        std::atomic<bool> running;
+};
+
+struct BenchOption {
+    const char *name; // Without the leading --
+    const char *value; // What it takes, for the usage message
+    const char *help;
+};
+
+/* Every option is --name value. Anything not in known, or --help, prints the usage and exits */
+struct BenchOptions {
+    std::map<std::string, std::string> values;
+
+    BenchOptions(int argc, char **argv, const std::vector<BenchOption> &known);
+
+    std::string get(std::string name, std::string def);
+    u64 get(std::string name, u64 def);
+};
+
+u64 benchPercentile(std::vector<u64> samples, u64 percentile);
+void benchPrintLatencies(FILE *f, const std::map<u16, std::vector<u64>> &latencies);
+u64 benchPeakRss();
@@ -0,0 +1,282 @@
+#include "initiator.hpp"
+
+#include <cstring>
+
+#include <malloc.h>
+
+#define INITIATOR_BUF_SIZE 0x100000UL // Multiple of the packet size, so only the last transfer is short
+#define PACKET_SIZE 0x200UL
+
+MTPInitiator::MTPInitiator(LoopbackTransport *transport) {
+    this->transport = transport;
+    this->transaction_id = 0;
+    this->buffer = (u8 *) memalign(0x1000, INITIATOR_BUF_SIZE);
+}
+
+MTPInitiator::~MTPInitiator() {
+    free(this->buffer);
+}
+
+bool MTPInitiator::sendContainer(u16 type, u16 code, std::vector<u32> params) {
+    MTPContainerHeader header;
+    header.length = sizeof(header) + params.size() * sizeof(u32);
+    header.type = type;
+    header.code = code;
+    header.transaction_id = this->transaction_id;
+
+    memcpy(this->buffer, &header, sizeof(header));
+    memcpy(this->buffer + sizeof(header), params.data(), params.size() * sizeof(u32));
+
+    return this->transport->send(this->buffer, header.length);
+}
+
+bool MTPInitiator::sendData(u16 code, u64 size, MTPDataSource source) {
+    MTPContainerHeader header;
+    header.length = sizeof(header) + std::min(size, 0xFFFFFFFFUL - sizeof(header));
+    header.type = ContainerTypeData;
+    header.code = code;
+    header.transaction_id = this->transaction_id;
+
+    memcpy(this->buffer, &header, sizeof(header));
+    size_t chunk = std::min(size, INITIATOR_BUF_SIZE - sizeof(header));
+    source(this->buffer + sizeof(header), chunk);
+    if (!this->transport->send(this->buffer, sizeof(header) + chunk))
+        return false;
+
+    u64 pos = chunk;
+    while (pos < size) {
+        chunk = std::min(size - pos, INITIATOR_BUF_SIZE);
+        source(this->buffer, chunk);
+        if (!this->transport->send(this->buffer, chunk))
+            return false;
+        pos += chunk;
+    }
+
+    /* Past 4GiB the responder can only find the end through a short packet */
+    if (header.length == 0xFFFFFFFF && (sizeof(header) + size) % PACKET_SIZE == 0)
+        return this->transport->send(this->buffer, 0);
+
+    return true;
+}
+
+/* Expects the first transfer of the data phase to already be in the buffer */
+bool MTPInitiator::receiveData(size_t first_xferd, MTPDataSink sink, u64 in_size) {
+    MTPContainerHeader *header = (MTPContainerHeader *) this->buffer;
+    u64 size = header->length - sizeof(MTPContainerHeader);
+    if (header->length == 0xFFFFFFFF)
+        size = in_size;
+
+    /* Without a size to go by, the data phase runs until a short packet */
+    bool until_short = header->length == 0xFFFFFFFF && in_size == 0;
+    if (until_short)
+        size = U64_MAX;
+
+    u64 pos = first_xferd - sizeof(MTPContainerHeader);
+    if (sink)
+        sink(this->buffer + sizeof(MTPContainerHeader), pos);
+
+    /* A short packet ends it whatever the length said, the way it does on a real host */
+    bool ended = first_xferd % PACKET_SIZE != 0;
+    while (!ended && pos < size) {
+        size_t xferd = 0;
+        if (!this->transport->receive(this->buffer, INITIATOR_BUF_SIZE, &xferd))
+            return false;
+        if (sink)
+            sink(this->buffer, xferd);
+        pos += xferd;
+        ended = xferd % PACKET_SIZE != 0;
+    }
+
+    return true;
+}
+
+u16 MTPInitiator::transact(u16 code, std::vector<u32> params, std::vector<u32> *resp_params,
+    u64 out_size, MTPDataSource source, MTPDataSink sink, u64 in_size) {
+    u64 start = statsNow();
+
+    if (!this->sendContainer(ContainerTypeOperation, code, params))
+        return ResponseGeneralError;
+
+    if (source && !this->sendData(code, out_size, source))
+        return ResponseGeneralError;
+
+    size_t xferd = 0;
+    if (!this->transport->receive(this->buffer, INITIATOR_BUF_SIZE, &xferd))
+        return ResponseGeneralError;
+
+    if (((MTPContainerHeader *) this->buffer)->type == ContainerTypeData) {
+        if (!this->receiveData(xferd, sink, in_size))
+            return ResponseGeneralError;
+        if (!this->transport->receive(this->buffer, INITIATOR_BUF_SIZE, &xferd))
+            return ResponseGeneralError;
+    }
+
+    MTPContainerHeader *header = (MTPContainerHeader *) this->buffer;
+    if (header->type != ContainerTypeResponse)
+        return ResponseGeneralError;
+
+    if (resp_params) {
+        resp_params->clear();
+        for (size_t i=sizeof(MTPContainerHeader); i + sizeof(u32) <= xferd; i += sizeof(u32)) {
+            u32 param;
+            memcpy(&param, this->buffer + i, sizeof(param));
+            resp_params->push_back(param);
+        }
+    }
+
+    this->latencies[code].push_back(statsNow() - start);
+    this->transaction_id++;
+
+    return header->code;
+}
+
+u16 MTPInitiator::openSession(u32 session_id) {
+    this->transaction_id = 0;
+    return this->transact(OperationOpenSession, {session_id});
+}
+
+u16 MTPInitiator::closeSession() {
+    return this->transact(OperationCloseSession, {});
+}
+
+/* Collects a whole data phase so it can be parsed through MTPContainer */
+static MTPDataSink _collect(std::vector<u8> *out) {
+    return [out](const u8 *buf, size_t size) {
+        out->insert(out->end(), buf, buf + size);
+    };
+}
+
+static MTPContainer _toContainer(std::vector<u8> &data) {
+    MTPContainerHeader header;
+    header.length = sizeof(header) + data.size();
+    header.type = ContainerTypeData;
+    header.code = 0;
+    header.transaction_id = 0;
+
+    MTPContainer cont(header);
+    cont.data = (u8 *) malloc(data.size());
+    memcpy(cont.data, data.data(), data.size());
+    return cont;
+}
+
+static std::vector<u32> _readHandles(std::vector<u8> &data) {
+    std::vector<u32> handles;
+    if (data.size() < sizeof(u32))
+        return handles;
+
+    u32 count;
+    memcpy(&count, data.data(), sizeof(count));
+    handles.resize(std::min<size_t>(count, (data.size() - sizeof(u32)) / sizeof(u32)));
+    memcpy(handles.data(), data.data() + sizeof(u32), handles.size() * sizeof(u32));
+    return handles;
+}
+
+std::vector<u32> MTPInitiator::getStorageIds() {
+    std::vector<u8> data;
+    this->transact(OperationGetStorageIds, {}, NULL, 0, NULL, _collect(&data));
+    return _readHandles(data);
+}
+
+std::vector<u32> MTPInitiator::getObjectHandles(u32 storage_id, u32 format, u32 parent) {
+    std::vector<u8> data;
+    this->transact(OperationGetObjectHandles, {storage_id, format, parent}, NULL, 0, NULL, _collect(&data));
+    return _readHandles(data);
+}
+
+bool MTPInitiator::getObjectInfo(u32 handle, MTPObjectInfo *info) {
+    std::vector<u8> data;
+    if (this->transact(OperationGetObjectInfo, {handle}, NULL, 0, NULL, _collect(&data)) != ResponseOk)
+        return false;
+
+    MTPContainer cont = _toContainer(data);
+    info->storage_id = cont.read<u32>();
+    info->format = cont.read<u16>();
+    cont.read<u16>(); // Protection Status
+    info->size = cont.read<u32>();
+    cont.read<u16>(); // Thumb Format
+    for (int i=0; i<6; i++)
+        cont.read<u32>();
+    info->parent = cont.read<u32>();
+    cont.read<u16>(); // Association Type
+    cont.read<u32>(); // Association Description
+    cont.read<u32>(); // Sequence Number
+    info->filename = cont.read();
+
+    return true;
+}
+
+u64 MTPInitiator::getObject(u32 handle, u64 size, MTPDataSink sink) {
+    u64 received = 0;
+    MTPDataSink counter = [&](const u8 *buf, size_t xferd) {
+        received += xferd;
+        if (sink)
+            sink(buf, xferd);
+    };
+
+    if (this->transact(OperationGetObject, {handle}, NULL, 0, NULL, counter, size) != ResponseOk)
+        return 0;
+    return received;
+}
+
+u64 MTPInitiator::getPartialObject(u32 handle, u32 offset, u32 size, MTPDataSink sink) {
+    u64 received = 0;
+    MTPDataSink counter = [&](const u8 *buf, size_t xferd) {
+        received += xferd;
+        if (sink)
+            sink(buf, xferd);
+    };
+
+    if (this->transact(OperationGetPartialObject, {handle, offset, size}, NULL, 0, NULL, counter, size) != ResponseOk)
+        return 0;
+    return received;
+}
+
+u32 MTPInitiator::sendObjectInfo(u32 storage_id, u32 parent, u16 format, std::u16string name, u64 size) {
+    MTPContainerHeader header = {sizeof(MTPContainerHeader), ContainerTypeData, OperationSendObjectInfo, 0};
+    MTPContainer cont(header);
+    cont.write(storage_id);
+    cont.write(format);
+    cont.write<u16>(0); // Protection Status
+    cont.write<u32>(std::min(size, 0xFFFFFFFFUL)); // Object Compressed Size
+    cont.write<u16>(FormatUndefined); // Thumb Format
+    for (int i=0; i<6; i++)
+        cont.write<u32>(0);
+    cont.write(parent);
+    cont.write<u16>(format == FormatAssociation ? 1 : 0); // Association Type
+    cont.write<u32>(0); // Association Description
+    cont.write<u32>(0); // Sequence Number
+    cont.write(name);
+    cont.write(u""); // Date Created
+    cont.write(u""); // Date Modified
+    cont.write(u""); // Keywords
+
+    size_t length = cont.header.length - sizeof(MTPContainerHeader), pos = 0;
+    MTPDataSource source = [&](u8 *buf, size_t size) {
+        memcpy(buf, cont.data + pos, size);
+        pos += size;
+        return size;
+    };
+
+    std::vector<u32> params;
+    if (this->transact(OperationSendObjectInfo, {storage_id, parent}, &params, length, source) != ResponseOk || params.size() < 3)
+        return 0;
+    return params[2];
+}
+
+u32 MTPInitiator::sendObject(u32 storage_id, u32 parent, std::u16string name, u64 size, MTPDataSource source, u64 data_size) {
+    u32 handle = this->sendObjectInfo(storage_id, parent, FormatUndefined, name, size);
+    if (handle == 0)
+        return 0;
+
+    if (this->transact(OperationSendObject, {}, NULL, data_size != 0 ? data_size : size, source) != ResponseOk)
+        return 0;
+    return handle;
+}
+
+u32 MTPInitiator::createFolder(u32 storage_id, u32 parent, std::u16string name) {
+    return this->sendObjectInfo(storage_id, parent, FormatAssociation, name, 0);
+}
+
+u16 MTPInitiator::deleteObject(u32 handle) {
+    return this->transact(OperationDeleteObject, {handle});
+}
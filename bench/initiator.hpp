@@ -0,0 +1,57 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mtp.hpp"
+#include "loopback.hpp"
+
+typedef std::function<size_t(u8 *buf, size_t size)> MTPDataSource; // Fills buf, returns how much it wrote
+typedef std::function<void(const u8 *buf, size_t size)> MTPDataSink;
+
+struct MTPObjectInfo {
+    u32 storage_id;
+    u16 format;
+    u32 size;
+    u32 parent;
+    std::u16string filename;
+};
+
+/* Just enough of an MTP initiator to drive a responder through a LoopbackTransport */
+class MTPInitiator {
+    public:
+        MTPInitiator(LoopbackTransport *transport);
+        ~MTPInitiator();
+
+        /* Runs one transaction. out_size/source feed a host to device data phase,
+           sink receives a device to host one (in_size is only needed past 4GiB) */
+        u16 transact(u16 code, std::vector<u32> params, std::vector<u32> *resp_params = NULL,
+            u64 out_size = 0, MTPDataSource source = NULL, MTPDataSink sink = NULL, u64 in_size = 0);
+
+        u16 openSession(u32 session_id);
+        u16 closeSession();
+        std::vector<u32> getStorageIds();
+        std::vector<u32> getObjectHandles(u32 storage_id, u32 format, u32 parent);
+        bool getObjectInfo(u32 handle, MTPObjectInfo *info);
+        u64 getObject(u32 handle, u64 size, MTPDataSink sink = NULL);
+        u64 getPartialObject(u32 handle, u32 offset, u32 size, MTPDataSink sink = NULL);
+        u32 sendObject(u32 storage_id, u32 parent, std::u16string name, u64 size, MTPDataSource source,
+            u64 data_size = 0); // Length of the data phase, when it isn't size because it's compressed
+        u32 createFolder(u32 storage_id, u32 parent, std::u16string name);
+        u16 deleteObject(u32 handle);
+
+        /* Host side latency of every transaction, by operation code */
+        std::map<u16, std::vector<u64>> latencies;
+
+    private:
+        LoopbackTransport *transport;
+        u32 transaction_id;
+        u8 *buffer;
+
+        bool sendContainer(u16 type, u16 code, std::vector<u32> params);
+        bool sendData(u16 code, u64 size, MTPDataSource source);
+        bool receiveData(size_t first_xferd, MTPDataSink sink, u64 in_size);
+        u32 sendObjectInfo(u32 storage_id, u32 parent, u16 format, std::u16string name, u64 size);
+};
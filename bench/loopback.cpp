@@ -0,0 +1,137 @@
+#include "loopback.hpp"
+
+#include <cstring>
+#include <thread>
+
+#define LOOPBACK_LIMIT 0x800000UL // Bytes in flight per direction
+#define LOOPBACK_PACKET_SIZE 0x200UL
+
+LoopbackPipe::LoopbackPipe(size_t limit, bool packets) {
+    this->head_cursor = 0;
+    this->queued = 0;
+    this->limit = limit;
+    this->packets = packets;
+    this->closed = false;
+    this->rate = 0;
+}
+
+bool LoopbackPipe::push(const void *buf, size_t size) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    if (this->rate != 0) {
+        auto now = std::chrono::steady_clock::now();
+        this->next_push = std::max(this->next_push, now) + std::chrono::nanoseconds(size * 1000000000UL / this->rate);
+        auto until = this->next_push;
+        lock.unlock();
+        std::this_thread::sleep_until(until);
+        lock.lock();
+    }
+
+    this->cond.wait(lock, [this] { return this->closed || this->queued < this->limit; });
+    if (this->closed)
+        return false;
+
+    this->transfers.emplace_back((const u8 *) buf, (const u8 *) buf + size);
+    this->queued += size;
+    this->cond.notify_all();
+    return true;
+}
+
+bool LoopbackPipe::pop(void *buf, size_t size, size_t *out_xferd) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    size_t xferd = 0;
+
+    while (true) {
+        this->cond.wait(lock, [this] { return this->closed || !this->transfers.empty(); });
+        if (this->transfers.empty())
+            return false;
+
+        std::vector<u8> &head = this->transfers.front();
+        size_t chunk = std::min(size - xferd, head.size() - this->head_cursor);
+        memcpy((u8 *) buf + xferd, head.data() + this->head_cursor, chunk);
+        this->head_cursor += chunk;
+        xferd += chunk;
+
+        bool short_packet = head.size() % LOOPBACK_PACKET_SIZE != 0 || head.empty();
+        bool ended = this->head_cursor == head.size();
+        if (ended) {
+            this->queued -= head.size();
+            this->transfers.pop_front();
+            this->head_cursor = 0;
+        }
+
+        this->cond.notify_all();
+
+        if (!this->packets || xferd == size || (ended && short_packet))
+            break;
+    }
+
+    if (out_xferd) *out_xferd = xferd;
+
+    return true;
+}
+
+bool LoopbackPipe::wait(u64 timeout) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    return this->cond.wait_for(lock, std::chrono::nanoseconds(timeout), [this] { return this->closed || !this->transfers.empty(); });
+}
+
+void LoopbackPipe::setRate(u64 rate) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->rate = rate;
+    this->next_push = std::chrono::steady_clock::now();
+}
+
+void LoopbackPipe::close() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->closed = true;
+    this->cond.notify_all();
+}
+
+LoopbackTransport::LoopbackTransport() : out(LOOPBACK_LIMIT, true), in(LOOPBACK_LIMIT), interrupt(LOOPBACK_LIMIT) { }
+
+Result LoopbackTransport::transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) {
+    bool ok;
+    switch (ep) {
+        case EndpointOut:
+            ok = this->out.pop(buf, size, out_xferd);
+            break;
+        case EndpointIn:
+            ok = this->in.push(buf, size);
+            if (out_xferd) *out_xferd = size;
+            break;
+        default:
+            ok = this->interrupt.push(buf, size);
+            if (out_xferd) *out_xferd = size;
+            break;
+    }
+
+    return ok ? 0 : 1;
+}
+
+bool LoopbackTransport::waitReceive(void *buf, size_t size, u64 timeout) {
+    return this->out.wait(timeout);
+}
+
+bool LoopbackTransport::send(const void *buf, size_t size) {
+    return this->out.push(buf, size);
+}
+
+bool LoopbackTransport::receive(void *buf, size_t size, size_t *out_xferd) {
+    return this->in.pop(buf, size, out_xferd);
+}
+
+bool LoopbackTransport::receiveEvent(void *buf, size_t size, size_t *out_xferd) {
+    return this->interrupt.pop(buf, size, out_xferd);
+}
+
+void LoopbackTransport::close() {
+    this->out.close();
+    this->in.close();
+    this->interrupt.close();
+}
+
+void LoopbackTransport::setRate(u64 rate) {
+    this->out.setRate(rate);
+    this->in.setRate(rate);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <deque>
+#include <chrono>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "transport.hpp"
+
+/* One direction of the loopback. Every push is one USB transfer. By default a reader only gets
+   the rest of the current transfer. With packets set, reads behave like a bulk endpoint instead
+   and carry on into the next transfer until the buffer is full or a short packet ends it */
+class LoopbackPipe {
+    public:
+        LoopbackPipe(size_t limit, bool packets = false);
+
+        bool push(const void *buf, size_t size);
+        bool pop(void *buf, size_t size, size_t *out_xferd);
+        bool wait(u64 timeout); // True once there's something to pop, or it's closed
+
+        void close();
+
+        /* Bytes per second a push can go at, like a slow link would. Zero for no limit */
+        void setRate(u64 rate);
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<std::vector<u8>> transfers;
+        size_t head_cursor;
+        size_t queued;
+        size_t limit;
+        bool packets;
+        bool closed;
+        u64 rate;
+        std::chrono::steady_clock::time_point next_push;
+};
+
+/* Connects a responder to an in-process initiator */
+class LoopbackTransport : public MTPTransport {
+    public:
+        LoopbackTransport();
+
+        Result transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) override;
+        bool waitReceive(void *buf, size_t size, u64 timeout) override;
+
+        /* Initiator side */
+        bool send(const void *buf, size_t size);
+        bool receive(void *buf, size_t size, size_t *out_xferd);
+        bool receiveEvent(void *buf, size_t size, size_t *out_xferd);
+
+        void close();
+        void setRate(u64 rate);
+
+    private:
+        LoopbackPipe out;
+        LoopbackPipe in;
+        LoopbackPipe interrupt;
+};
@@ -0,0 +1,210 @@
+/* Microbenchmarks for the MTPContainer serialization primitives. The datasets mirror the
+   fields GetDeviceInfo, GetObjectInfo and SendObjectInfo encode and decode */
+
+#include <atomic>
+#include <cstring>
+#include <string>
+
+#include <malloc.h>
+
+#include "harness.hpp"
+
+/* Replacing malloc and friends catches both the containers' own buffers and anything behind operator new */
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t nmemb, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void __libc_free(void *ptr);
+}
+
+static std::atomic<u64> g_allocations(0);
+static std::atomic<u64> g_allocated(0);
+
+extern "C" void *malloc(size_t size) {
+    g_allocations++;
+    g_allocated += size;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) {
+    g_allocations++;
+    g_allocated += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+    g_allocations++;
+    g_allocated += size;
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+static volatile u64 g_sink;
+
+template<typename F>
+static void _run(const char *name, u64 iterations, F body) {
+    body(); // Warm up
+
+    u64 allocations = g_allocations, allocated = g_allocated;
+    u64 start = statsNow();
+    for (u64 i=0; i<iterations; i++)
+        body();
+    u64 ns = statsNow() - start;
+
+    allocations = g_allocations - allocations;
+    allocated = g_allocated - allocated;
+    printf("%-22s %10lu %12.1f %12.2f %12.1f\n", name, iterations,
+        (double) ns / iterations, (double) allocations / iterations, (double) allocated / iterations);
+}
+
+static MTPContainer _dataContainer(MTPArena *arena = NULL) {
+    MTPContainerHeader header = {sizeof(MTPContainerHeader), ContainerTypeData, OperationGetObjectInfo, 1};
+    return MTPContainer(header, arena);
+}
+
+static void _writeDeviceInfo(MTPContainer &cont) {
+    cont.write<u16>(100);
+    cont.write<u32>(0xFFFFFFFF);
+    cont.write<u16>(100);
+    cont.write(u"microsoft.com: 1.0;");
+    cont.write<u16>(0);
+
+    /* Static, as in the responder, so nothing but the container is built each time */
+    static const std::vector<u16> operations_supported({
+        OperationGetDeviceInfo, OperationOpenSession, OperationCloseSession, OperationGetStorageIds,
+        OperationGetStorageInfo, OperationGetObjectHandles, OperationGetObjectInfo, OperationGetObject,
+        OperationDeleteObject, OperationSendObjectInfo, OperationSendObject, OperationGetDevicePropValue,
+        OperationGetObjectPropsSupported, OperationGetObjectPropDesc, OperationSetObjectPropValue,
+        OperationGetPartialObject, OperationGetObjectPropValue, OperationMoveObject, OperationCopyObject,
+    });
+    cont.write(operations_supported);
+
+    static const std::vector<u16> events_supported({EventStoreFull, EventStorageInfoChanged});
+    cont.write(events_supported);
+
+    static const std::vector<u16> properties_supported({PropertyDeviceFriendlyName, PropertyTuphlosStatistics});
+    cont.write(properties_supported);
+    cont.write<u32>(0);
+
+    static const std::vector<u16> formats_supported({FormatUndefined, FormatAssociation});
+    cont.write(formats_supported);
+
+    cont.write(u"Nintendo");
+    cont.write(u"Nintendo Switch");
+    cont.write(u"1.0");
+    cont.write(u"SerialNumber");
+}
+
+static void _writeObjectInfo(MTPContainer &cont, const fs::path &path) {
+    cont.write<u32>(0x00010001);
+    cont.write<u16>(FormatUndefined);
+    cont.write<u16>(0);
+    cont.write<u32>(0x12345);
+    cont.write<u16>(FormatUndefined);
+    for (int i=0; i<6; i++)
+        cont.write<u32>(0);
+    cont.write<u32>(42);
+    cont.write<u16>(1);
+    cont.write<u32>(1);
+    cont.write<u32>(0);
+    cont.writeFilename(path);
+    cont.write(u"20200101T000000");
+    cont.write(u"20200101T000000");
+    cont.write(u"");
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options(argc, argv, {
+        {"scale", "N", "Multiplies every benchmark's iterations (1)"},
+    });
+    u64 scale = options.get("scale", 1UL);
+
+    printf("%-22s %10s %12s %12s %12s\n", "BENCHMARK", "ITERS", "NS/ITER", "ALLOCS/ITER", "BYTES/ITER");
+
+    _run("encode-deviceinfo", 100000 * scale, [] {
+        MTPContainer cont = _dataContainer();
+        _writeDeviceInfo(cont);
+        g_sink = cont.header.length;
+    });
+
+    fs::path path = "DCIM/100NINTENDO/20200101123456-0123456789ABCDEF0123456789ABCDEF.jpg";
+    _run("encode-objectinfo", 100000 * scale, [&] {
+        MTPContainer cont = _dataContainer();
+        _writeObjectInfo(cont, path);
+        g_sink = cont.header.length;
+    });
+
+    /* The same, built the way the responder builds them: in its transaction arena, emptied every time */
+    MTPArena arena(TRANSACTION_ARENA_SIZE);
+    _run("arena-deviceinfo", 100000 * scale, [&] {
+        arena.reset();
+        MTPContainer cont = _dataContainer(&arena);
+        _writeDeviceInfo(cont);
+        g_sink = cont.header.length;
+    });
+
+    _run("arena-objectinfo", 100000 * scale, [&] {
+        arena.reset();
+        MTPContainer cont = _dataContainer(&arena);
+        _writeObjectInfo(cont, path);
+        g_sink = cont.header.length;
+    });
+
+    std::vector<u32> handles(100000);
+    for (size_t i=0; i<handles.size(); i++)
+        handles[i] = i + 1;
+    _run("encode-handles-100k", 100 * scale, [&] {
+        MTPContainer cont = _dataContainer();
+        cont.write(handles);
+        g_sink = cont.header.length;
+    });
+
+    std::u16string long_name(255, u'a');
+    _run("encode-string-255", 100000 * scale, [&] {
+        MTPContainer cont = _dataContainer();
+        cont.write(long_name);
+        g_sink = cont.header.length;
+    });
+
+    /* Parsing is measured on a prebuilt buffer, so only toOperation/read themselves are counted.
+       Reading a string still makes the one std::u16string it returns */
+    MTPContainer string_cont = _dataContainer();
+    string_cont.write(long_name);
+    _run("decode-string-255", 100000 * scale, [&] {
+        string_cont.read_cursor = 0;
+        g_sink = string_cont.read().size();
+    });
+
+    MTPContainerHeader op_header = {sizeof(MTPContainerHeader) + 5 * sizeof(u32), ContainerTypeOperation, OperationGetObjectHandles, 7};
+    MTPContainer op_cont(op_header);
+    op_cont.data = (u8 *) malloc(5 * sizeof(u32));
+    memset(op_cont.data, 0xFF, 5 * sizeof(u32));
+    _run("decode-operation", 1000000 * scale, [&] {
+        op_cont.read_cursor = 0;
+        MTPOperation op = op_cont.toOperation();
+        g_sink = op.params.size();
+    });
+
+    MTPContainer info_cont = _dataContainer();
+    _writeObjectInfo(info_cont, path);
+    _run("decode-objectinfo", 1000000 * scale, [&] {
+        info_cont.read_cursor = 0;
+        u64 sum = info_cont.read<u32>();
+        sum += info_cont.read<u16>();
+        sum += info_cont.read<u16>();
+        sum += info_cont.read<u32>();
+        sum += info_cont.read<u16>();
+        for (int i=0; i<7; i++)
+            sum += info_cont.read<u32>();
+        sum += info_cont.read<u16>();
+        sum += info_cont.read<u32>();
+        sum += info_cont.read<u32>();
+        sum += info_cont.read().size();
+        g_sink = sum;
+    });
+
+    return 0;
+}
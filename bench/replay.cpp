@@ -0,0 +1,294 @@
+/* Replays a session recorded by CaptureTransport against a seeded scratch filesystem and
+   reports how the timing of each transaction diverges from the recording.
+   The seed directory holds one subdirectory per drive, e.g. seed/sdmc and seed/user */
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include "harness.hpp"
+
+#define REPLAY_CHUNK 0x100000UL // Multiple of the packet size
+
+struct CaptureRecord {
+    u8 ep;
+    u8 kind;
+    u64 us;
+    u64 length;
+    std::vector<u8> content;
+};
+
+struct ReplayTransaction {
+    u16 code;
+    size_t first; // Index of the operation record
+    size_t last; // One past the last host to device record of the transaction
+    u64 recorded_us;
+    u16 recorded_resp;
+    u64 replayed_us;
+    u16 replayed_resp;
+};
+
+static bool _load(const char *path, std::vector<CaptureRecord> *records) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    char magic[sizeof(CAPTURE_MAGIC)];
+    u16 version;
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, f) != 1 || version != CAPTURE_VERSION) {
+        fclose(f);
+        return false;
+    }
+
+    u64 us = 0;
+    int tag;
+    while ((tag = fgetc(f)) != EOF) {
+        CaptureRecord record;
+        u64 delta;
+        if (captureReadVarint(f, &delta) == 0 || captureReadVarint(f, &record.length) == 0)
+            break;
+
+        us += delta;
+        record.ep = tag & 3;
+        record.kind = tag >> 2;
+        record.us = us;
+
+        if (record.kind == CaptureContainer) {
+            record.content.resize(record.length);
+            if (fread(record.content.data(), 1, record.length, f) != record.length)
+                break;
+        }
+
+        records->push_back(std::move(record));
+    }
+
+    fclose(f);
+    return true;
+}
+
+static const MTPContainerHeader *_header(const CaptureRecord &record) {
+    if (record.kind != CaptureContainer || record.content.size() < sizeof(MTPContainerHeader))
+        return NULL;
+    return (const MTPContainerHeader *) record.content.data();
+}
+
+static std::vector<ReplayTransaction> _transactions(std::vector<CaptureRecord> &records) {
+    std::vector<ReplayTransaction> transactions;
+
+    for (size_t i=0; i<records.size(); i++) {
+        const MTPContainerHeader *header = _header(records[i]);
+        if (records[i].ep != EndpointOut || header == NULL || header->type != ContainerTypeOperation)
+            continue;
+
+        ReplayTransaction transaction = {header->code, i, records.size(), 0, ResponseUndefined, 0, ResponseUndefined};
+        for (size_t j=i + 1; j<records.size(); j++) {
+            const MTPContainerHeader *next = _header(records[j]);
+            if (records[j].ep == EndpointOut && next != NULL && next->type == ContainerTypeOperation) {
+                transaction.last = j;
+                break;
+            }
+
+            if (records[j].ep == EndpointIn && next != NULL && next->type == ContainerTypeResponse && transaction.recorded_resp == ResponseUndefined) {
+                transaction.recorded_us = records[j].us - records[i].us;
+                transaction.recorded_resp = next->code;
+            }
+        }
+
+        transactions.push_back(transaction);
+    }
+
+    return transactions;
+}
+
+static bool _sendRecord(LoopbackTransport &transport, const CaptureRecord &record, u8 *filler) {
+    switch (record.kind) {
+        case CaptureContainer:
+            return transport.send(record.content.data(), record.content.size());
+        case CaptureZeroLength:
+            return transport.send(filler, 0);
+    }
+
+    for (u64 pos = 0; pos < record.length; pos += REPLAY_CHUNK) {
+        if (!transport.send(filler, std::min(record.length - pos, REPLAY_CHUNK)))
+            return false;
+    }
+    return true;
+}
+
+/* Consumes whatever the responder sends until its response container */
+static u16 _receiveResponse(LoopbackTransport &transport, u8 *buffer) {
+    u64 remaining = 0;
+    bool until_short = false;
+
+    while (true) {
+        size_t xferd = 0;
+        if (!transport.receive(buffer, REPLAY_CHUNK, &xferd))
+            return ResponseUndefined;
+
+        /* Reads stop at the end of each of the responder's transfers, so only a packet that isn't full, or
+           none at all, ends a phase */
+        bool ends = xferd == 0 || xferd % CAPTURE_PACKET_SIZE != 0;
+        if (remaining != 0 || until_short) {
+            remaining -= std::min<u64>(remaining, xferd);
+            if (ends)
+                until_short = false;
+            continue;
+        }
+
+        if (xferd < sizeof(MTPContainerHeader))
+            continue;
+
+        MTPContainerHeader *header = (MTPContainerHeader *) buffer;
+        if (header->type == ContainerTypeResponse)
+            return header->code;
+
+        /* Only a short transfer ends a data phase of unknown length, and that can be the first one */
+        until_short = header->length == 0xFFFFFFFF && !ends;
+        remaining = header->length != 0xFFFFFFFF && header->length > xferd ? header->length - xferd : 0;
+    }
+}
+
+static void _seed(BenchHarness &harness, std::string seed, std::string storages) {
+    size_t pos = 0;
+    while (pos < storages.size()) {
+        size_t end = storages.find(',', pos);
+        if (end == std::string::npos)
+            end = storages.size();
+
+        std::string entry = storages.substr(pos, end - pos);
+        size_t eq = entry.find('=');
+        if (eq != std::string::npos) {
+            std::string drive = entry.substr(0, eq);
+            u32 id = strtoul(entry.substr(eq + 1).c_str(), NULL, 0);
+
+            harness.insertStorage(id, drive, fs::path(drive).u16string());
+
+            std::error_code ec;
+            if (!seed.empty() && fs::is_directory(fs::path(seed) / drive, ec))
+                fs::copy(fs::path(seed) / drive, drive + ":", fs::copy_options::recursive, ec);
+        }
+
+        pos = end + 1;
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options(argc, argv, {
+        {"capture", "FILE", "Capture to replay, required"},
+        {"seed", "DIR", "One folder per drive, copied into the storages before replaying"},
+        {"storages", "DRIVE=ID,...", "Storages to put in the scratch directory (sdmc=0x00010001,user=0x00020001)"},
+        {"scratch", "DIR", "Where the storages go, emptied first (/tmp/tuphlos-replay)"},
+        {"top", "N", "How many mismatches and most divergent transactions to list (10)"},
+        {"keep", "0|1", "Leave the scratch directory behind (0)"},
+    });
+
+    std::string capture = options.get("capture", std::string());
+    std::string seed = options.get("seed", std::string());
+    std::string scratch = options.get("scratch", std::string("/tmp/tuphlos-replay"));
+    std::string storages = options.get("storages", std::string("sdmc=0x00010001,user=0x00020001"));
+    u64 top = options.get("top", 10UL);
+
+    if (capture.empty()) {
+        fprintf(stderr, "%s: --capture is required, see --help\n", argv[0]);
+        return 1;
+    }
+
+    /* Relative paths have to be resolved before the harness changes directory */
+    if (!seed.empty())
+        seed = fs::absolute(seed).string();
+
+    std::vector<CaptureRecord> records;
+    if (!_load(capture.c_str(), &records)) {
+        fprintf(stderr, "Can't read capture %s\n", capture.c_str());
+        return 1;
+    }
+
+    std::vector<ReplayTransaction> transactions = _transactions(records);
+    printf("%lu records, %lu transactions\n", records.size(), transactions.size());
+
+    fs::remove_all(scratch);
+
+    u8 *buffer = (u8 *) malloc(REPLAY_CHUNK);
+    u8 *filler = (u8 *) calloc(1, REPLAY_CHUNK);
+
+    {
+        BenchHarness harness(scratch);
+        _seed(harness, seed, storages);
+        harness.start();
+
+        for (ReplayTransaction &transaction : transactions) {
+            u64 start = statsNow();
+
+            bool sent = true;
+            for (size_t i=transaction.first; i<transaction.last && sent; i++) {
+                if (records[i].ep == EndpointOut)
+                    sent = _sendRecord(harness.transport, records[i], filler);
+            }
+
+            transaction.replayed_resp = sent ? _receiveResponse(harness.transport, buffer) : ResponseUndefined;
+            transaction.replayed_us = (statsNow() - start) / 1000;
+        }
+
+        harness.stop();
+    }
+
+    std::map<u16, std::vector<u64>> recorded, replayed;
+    size_t mismatches = 0, unanswered = 0;
+    for (ReplayTransaction &transaction : transactions) {
+        /* A data phase the capture or the replay got the end of wrong takes the response with it */
+        if (transaction.recorded_resp == ResponseUndefined || transaction.replayed_resp == ResponseUndefined)
+            unanswered++;
+
+        recorded[transaction.code].push_back(transaction.recorded_us * 1000);
+        replayed[transaction.code].push_back(transaction.replayed_us * 1000);
+
+        if (transaction.recorded_resp != transaction.replayed_resp) {
+            if (mismatches < top)
+                printf("Transaction %lu (%#06x): recorded response %#06x, replayed %#06x\n", &transaction - transactions.data(),
+                    transaction.code, transaction.recorded_resp, transaction.replayed_resp);
+            mismatches++;
+        }
+    }
+
+    printf("\n%-6s %8s %12s %12s %8s %10s %10s %10s %10s\n", "OP", "COUNT", "REC(ms)", "REPLAY(ms)", "RATIO",
+        "REC P50", "REC P99", "REP P50", "REP P99");
+    for (auto &entry : recorded) {
+        u64 rec = 0, rep = 0;
+        for (u64 ns : entry.second)
+            rec += ns;
+        for (u64 ns : replayed[entry.first])
+            rep += ns;
+
+        printf("%#06x %8lu %12.2f %12.2f %8.2f %10lu %10lu %10lu %10lu\n", entry.first, entry.second.size(),
+            rec / 1e6, rep / 1e6, rec != 0 ? (double) rep / rec : 0.0,
+            benchPercentile(entry.second, 50) / 1000, benchPercentile(entry.second, 99) / 1000,
+            benchPercentile(replayed[entry.first], 50) / 1000, benchPercentile(replayed[entry.first], 99) / 1000);
+    }
+
+    std::vector<ReplayTransaction *> divergent;
+    for (ReplayTransaction &transaction : transactions)
+        divergent.push_back(&transaction);
+    std::sort(divergent.begin(), divergent.end(), [](ReplayTransaction *a, ReplayTransaction *b) {
+        return std::max(a->recorded_us, a->replayed_us) - std::min(a->recorded_us, a->replayed_us) >
+            std::max(b->recorded_us, b->replayed_us) - std::min(b->recorded_us, b->replayed_us);
+    });
+
+    printf("\nMost divergent transactions:\n%-8s %-6s %12s %12s\n", "INDEX", "OP", "REC(us)", "REPLAY(us)");
+    for (size_t i=0; i<divergent.size() && i<top; i++) {
+        printf("%-8lu %#06x %12lu %12lu\n", divergent[i] - transactions.data(), divergent[i]->code,
+            divergent[i]->recorded_us, divergent[i]->replayed_us);
+    }
+
+    printf("\n%lu of %lu responses differ from the recording\n", mismatches, transactions.size());
+    if (unanswered != 0)
+        printf("%lu transactions have no response, recorded or replayed\n", unanswered);
+
+    free(buffer);
+    free(filler);
+
+    if (options.get("keep", 0UL) == 0)
+        fs::remove_all(scratch);
+
+    return unanswered != 0 ? 1 : 0;
+}
@@ -0,0 +1,48 @@
+/* Runs the responder as a Linux USB gadget. The function has to be set up through configfs with
+   its functionfs instance mounted, and the gadget bound to a device controller once this is running.
+   Each drive is a directory "drive:" under the root, e.g. "sdmc:" */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "mtp.hpp"
+#include "ffs.hpp"
+#include "capture.hpp"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s MOUNT ROOT [DRIVE...]\n", argv[0]);
+        return 1;
+    }
+
+    if (chdir(argv[2]) != 0) {
+        fprintf(stderr, "Can't enter %s\n", argv[2]);
+        return 1;
+    }
+
+    FunctionFSTransport ffs(argv[1]);
+    if (!ffs.ready()) {
+        fprintf(stderr, "Can't set up the function at %s\n", argv[1]);
+        return 1;
+    }
+
+    CaptureTransport capture(&ffs);
+    MTPResponder responder(&capture);
+
+    std::vector<std::string> drives(argv + 3, argv + argc);
+    if (drives.empty())
+        drives.push_back("sdmc");
+
+    for (size_t i=0; i<drives.size(); i++) {
+        std::error_code ec;
+        fs::create_directories(drives[i] + ":", ec);
+        responder.insertStorage(0x00010001 + (i << 16), drives[i], fs::path(drives[i]).u16string());
+    }
+
+    printf("Tuphlos: serving %lu storages from %s\n", drives.size(), argv[2]);
+
+    while (true)
+        responder.loop();
+
+    return 0;
+}
@@ -0,0 +1,375 @@
+#include "archive.hpp"
+
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <malloc.h>
+
+#define TAR_OCTAL_SIZE_MAX 0x200000000UL // 11 octal digits
+
+static void _octal(char *field, size_t width, u64 value) {
+    field[width - 1] = '\0';
+    for (size_t i=width - 1; i-- > 0; value >>= 3)
+        field[i] = '0' + (value & 7);
+}
+
+static void _append(std::vector<u8> *out, const void *data, size_t size) {
+    out->insert(out->end(), (const u8 *) data, (const u8 *) data + size);
+}
+
+static void _finish(MTPTarHeader *header, char type, u64 size, s64 mtime, bool is_dir) {
+    _octal(header->mode, sizeof(header->mode), is_dir ? 0755 : 0644);
+    _octal(header->uid, sizeof(header->uid), 0);
+    _octal(header->gid, sizeof(header->gid), 0);
+    _octal(header->mtime, sizeof(header->mtime), std::max<s64>(mtime, 0));
+    header->type = type;
+    memcpy(header->magic, "ustar", sizeof(header->magic));
+    memcpy(header->version, "00", sizeof(header->version));
+
+    if (size < TAR_OCTAL_SIZE_MAX) {
+        _octal(header->size, sizeof(header->size), size);
+    } else {
+        header->size[0] = (char) 0x80;
+        for (size_t i=sizeof(header->size) - 1; i > 0; i--, size >>= 8)
+            header->size[i] = size & 0xFF;
+    }
+
+    /* Worked out with the checksum field itself as spaces */
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    u32 checksum = 0;
+    for (size_t i=0; i<sizeof(MTPTarHeader); i++)
+        checksum += ((u8 *) header)[i];
+    _octal(header->checksum, sizeof(header->checksum) - 1, checksum);
+}
+
+void tarHeader(const std::string &name, u64 size, s64 mtime, bool is_dir, std::vector<u8> *out) {
+    std::string path = is_dir ? name + "/" : name;
+
+    MTPTarHeader header;
+    memset(&header, 0, sizeof(header));
+
+    if (path.size() <= sizeof(header.name)) {
+        memcpy(header.name, path.data(), path.size());
+    } else {
+        /* The latest slash that leaves the start fitting in prefix leaves the most of it for name */
+        size_t split = path.rfind('/', sizeof(header.prefix));
+        size_t rest = split != std::string::npos ? path.size() - split - 1 : 0;
+        if (split != std::string::npos && split > 0 && rest > 0 && rest <= sizeof(header.name)) {
+            memcpy(header.prefix, path.data(), split);
+            memcpy(header.name, path.data() + split + 1, rest);
+        } else {
+            MTPTarHeader link;
+            memset(&link, 0, sizeof(link));
+            strcpy(link.name, "././@LongLink");
+            _finish(&link, 'L', path.size() + 1, 0, false);
+            _append(out, &link, sizeof(link));
+            _append(out, path.c_str(), path.size() + 1);
+            out->resize(out->size() + tarPadding(path.size() + 1));
+
+            memcpy(header.name, path.data(), sizeof(header.name));
+        }
+    }
+
+    _finish(&header, is_dir ? '5' : '0', is_dir ? 0 : size, mtime, is_dir);
+    _append(out, &header, sizeof(header));
+}
+
+static u64 _readOctal(const char *field, size_t width) {
+    u64 value = 0;
+    for (size_t i=0; i<width && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+bool tarRead(const MTPTarHeader *header, std::string *name, u64 *size) {
+    u32 checksum = 0;
+    for (size_t i=0; i<sizeof(MTPTarHeader); i++) {
+        bool in_field = i >= offsetof(MTPTarHeader, checksum) && i < offsetof(MTPTarHeader, checksum) + sizeof(header->checksum);
+        checksum += in_field ? ' ' : ((const u8 *) header)[i];
+    }
+
+    /* Leading spaces are allowed in numeric fields */
+    const char *field = header->checksum;
+    while (field < header->checksum + sizeof(header->checksum) && *field == ' ')
+        field++;
+    if (_readOctal(field, header->checksum + sizeof(header->checksum) - field) != checksum)
+        return false;
+
+    if ((u8) header->size[0] & 0x80) {
+        *size = 0;
+        for (size_t i=1; i<sizeof(header->size); i++)
+            *size = *size << 8 | (u8) header->size[i];
+    } else {
+        field = header->size;
+        while (field < header->size + sizeof(header->size) && *field == ' ')
+            field++;
+        *size = _readOctal(field, header->size + sizeof(header->size) - field);
+    }
+
+    name->assign(header->name, strnlen(header->name, sizeof(header->name)));
+    if (memcmp(header->magic, "ustar", 5) == 0 && header->prefix[0] != '\0')
+        *name = std::string(header->prefix, strnlen(header->prefix, sizeof(header->prefix))) + "/" + *name;
+
+    return true;
+}
+
+bool tarPath(const std::string &name, std::string *out) {
+    out->clear();
+
+    for (size_t start = 0, end; start <= name.size(); start = end + 1) {
+        end = std::min(name.find('/', start), name.size());
+        std::string component = name.substr(start, end - start);
+        if (component.empty() || component == ".")
+            continue;
+        if (component == "..")
+            return false;
+
+        if (!out->empty())
+            *out += '/';
+        *out += component;
+    }
+
+    return true;
+}
+
+MTPArchiveQueue::MTPArchiveQueue() {
+    for (Slot &slot : this->slots)
+        slot.piece.data = (u8 *) memalign(0x1000, ARCHIVE_SLOT_SIZE);
+
+    this->reset();
+    this->producing = false;
+}
+
+MTPArchiveQueue::~MTPArchiveQueue() {
+    for (Slot &slot : this->slots)
+        free(slot.piece.data);
+}
+
+void MTPArchiveQueue::reset() {
+    for (Slot &slot : this->slots)
+        slot.full = false;
+
+    this->produced = 0;
+    this->consumed = 0;
+    this->producing = true;
+    this->cancelled = false;
+}
+
+MTPArchivePiece *MTPArchiveQueue::acquire() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    Slot *slot = &this->slots[this->produced % ARCHIVE_SLOTS];
+    this->cond.wait(lock, [this, slot] { return this->cancelled || !slot->full; });
+
+    return this->cancelled ? NULL : &slot->piece;
+}
+
+void MTPArchiveQueue::submit(MTPArchivePiece *piece) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->slots[this->produced % ARCHIVE_SLOTS].full = true;
+    this->produced++;
+    this->cond.notify_all();
+}
+
+void MTPArchiveQueue::close() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->producing = false;
+    this->cond.notify_all();
+}
+
+MTPArchivePiece *MTPArchiveQueue::next() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    Slot *slot = &this->slots[this->consumed % ARCHIVE_SLOTS];
+    this->cond.wait(lock, [this, slot] {
+        return slot->full || (!this->producing && this->consumed == this->produced);
+    });
+
+    return slot->full ? &slot->piece : NULL;
+}
+
+void MTPArchiveQueue::release(MTPArchivePiece *piece) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->slots[this->consumed % ARCHIVE_SLOTS].full = false;
+    this->consumed++;
+    this->cond.notify_all();
+}
+
+void MTPArchiveQueue::cancel() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->cancelled = true;
+    this->cond.notify_all();
+}
+
+MTPArchiveReader::~MTPArchiveReader() {
+    this->finish();
+}
+
+void MTPArchiveReader::start(std::vector<std::pair<MTPStorage *, fs::path>> roots, int mode) {
+    this->queue.reset();
+    this->ok = true;
+    this->roots = roots;
+    this->mode = mode;
+
+    this->thread = std::thread(&MTPArchiveReader::reader, this);
+}
+
+bool MTPArchiveReader::finish() {
+    this->queue.cancel();
+    if (this->thread.joinable())
+        this->thread.join();
+
+    return this->ok;
+}
+
+void MTPArchiveReader::reader() {
+    for (auto &root : this->roots) {
+        MTPStorage *storage = root.first;
+        MTPStorageStat stat;
+        if (!storage->stat(root.second, &stat)) {
+            this->ok = false;
+            continue;
+        }
+
+        std::string base = root.second.filename().string();
+        bool more = this->add(storage, root.second, base, stat.is_dir);
+        if (more && stat.is_dir) {
+            size_t skip = root.second.native().size() + 1;
+            more = storage->walk(root.second, [this, storage, &base, skip](const fs::path &path, bool is_dir) {
+                return this->add(storage, path, base + "/" + path.native().substr(skip), is_dir);
+            });
+        }
+
+        if (!more)
+            break;
+    }
+
+    this->queue.close();
+}
+
+/* False only once the archive's been given up on. Whatever can't be opened is left out */
+bool MTPArchiveReader::add(MTPStorage *storage, const fs::path &path, const std::string &name, bool is_dir) {
+    MTPStorageStat stat;
+    MTPStorageFile *file = NULL;
+    if (!storage->stat(path, &stat) || (!is_dir && (file = storage->open(path, FileRead | this->mode)) == NULL)) {
+        this->ok = false;
+        return true;
+    }
+
+    u64 size = is_dir ? 0 : stat.size, pos = 0;
+    do {
+        MTPArchivePiece *piece = this->queue.acquire();
+        if (piece == NULL) {
+            delete file;
+            return false;
+        }
+
+        piece->first = pos == 0;
+        if (piece->first) {
+            piece->name = name;
+            piece->size = size;
+            piece->mtime = stat.mtime;
+            piece->is_dir = is_dir;
+        }
+
+        /* The header already says how long it is, so whatever can't be read is sent as zeros */
+        piece->length = std::min<u64>(size - pos, ARCHIVE_SLOT_SIZE);
+        s64 xferd = piece->length != 0 ? file->read(pos, piece->data, piece->length) : 0;
+        if (xferd != (s64) piece->length) {
+            memset(piece->data + std::max<s64>(xferd, 0), 0, piece->length - std::max<s64>(xferd, 0));
+            this->ok = false;
+        }
+
+        this->queue.submit(piece);
+        pos += piece->length;
+    } while (pos < size);
+
+    delete file;
+    return true;
+}
+
+MTPArchiveWriter::MTPArchiveWriter() {
+    this->file = NULL;
+}
+
+MTPArchiveWriter::~MTPArchiveWriter() {
+    this->finish();
+}
+
+void MTPArchiveWriter::start(MTPStorage *storage, fs::path parent) {
+    this->queue.reset();
+    this->begin(storage, parent, 0);
+
+    this->thread = std::thread(&MTPArchiveWriter::writer, this);
+}
+
+void MTPArchiveWriter::finish() {
+    this->queue.close();
+    if (this->thread.joinable())
+        this->thread.join();
+}
+
+void MTPArchiveWriter::begin(MTPStorage *storage, fs::path parent, int mode) {
+    this->entries.clear();
+    this->storage = storage;
+    this->parent = parent;
+    this->mode = mode;
+    this->file = NULL;
+    this->pos = 0;
+}
+
+void MTPArchiveWriter::write(const MTPArchivePiece *piece) {
+    if (piece->first) {
+        this->close();
+
+        fs::path path = this->parent / piece->name;
+        MTPStorageStat stat;
+        bool exists = this->storage->stat(path, &stat);
+
+        Entry entry = {piece->name, piece->size, 0, piece->is_dir, false};
+        if (piece->is_dir) {
+            entry.ok = exists ? stat.is_dir : this->storage->createDirectory(path);
+        } else if (!exists || !stat.is_dir) {
+            this->file = this->storage->open(path, FileWrite | FileCreate | this->mode);
+            entry.replaced = exists && this->file != NULL ? stat.size : 0;
+            if (this->file != NULL && !this->file->reserve(piece->size)) {
+                delete this->file;
+                this->file = NULL;
+                this->storage->remove(path);
+            }
+            entry.ok = this->file != NULL;
+        }
+
+        if (!entry.ok)
+            entry.size = 0;
+
+        this->entries.push_back(entry);
+        this->pos = 0;
+    }
+
+    if (this->file != NULL && piece->length != 0) {
+        if (this->file->write(this->pos, piece->data, piece->length) != (s64) piece->length)
+            this->entries.back().ok = false;
+        this->pos += piece->length;
+    }
+}
+
+/* A stream that ended early leaves the last file as long as what made it */
+void MTPArchiveWriter::close() {
+    if (this->file == NULL)
+        return;
+
+    Entry &entry = this->entries.back();
+    entry.ok = this->file->setSize(this->pos) && entry.ok && this->pos == entry.size;
+    entry.size = this->pos;
+    delete this->file;
+    this->file = NULL;
+}
+
+void MTPArchiveWriter::writer() {
+    MTPArchivePiece *piece;
+    while ((piece = this->queue.next()) != NULL) {
+        this->write(piece);
+        this->queue.release(piece);
+    }
+
+    this->close();
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "platform.hpp"
+#include "storage.hpp"
+
+#define TAR_BLOCK_SIZE 0x200
+#define ARCHIVE_SLOTS 32
+#define ARCHIVE_SLOT_SIZE 0x40000 // Files bigger than this come through in several pieces
+
+/* POSIX ustar. Names that don't fit name and prefix get a GNU long name entry before them,
+   sizes of 8GiB or more are written base-256 the way GNU tar does */
+struct PACKED MTPTarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char device_major[8];
+    char device_minor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+/* Appends the header blocks for an entry. Folder names get a trailing slash */
+void tarHeader(const std::string &name, u64 size, s64 mtime, bool is_dir, std::vector<u8> *out);
+
+/* Checks a header block's checksum and reads what's in it, with the prefix joined on to the name */
+bool tarRead(const MTPTarHeader *header, std::string *name, u64 *size);
+
+/* An entry's name relative to where it's unpacked, with "." and empty components dropped, so
+   empty for the folder itself. False for one that would end up outside of it */
+bool tarPath(const std::string &name, std::string *out);
+
+/* Zeros after an entry's content, up to the next block */
+inline size_t tarPadding(u64 size) {
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+/* A run of an entry's content, or just its header for a folder or empty file. name, size,
+   mtime and is_dir are only set on an entry's first piece */
+struct MTPArchivePiece {
+    std::string name;
+    u64 size;
+    s64 mtime;
+    bool is_dir;
+    bool first;
+    u8 *data;
+    u32 length;
+};
+
+/* Pieces handed from one thread to another in order, through a ring of buffers */
+class MTPArchiveQueue {
+    public:
+        MTPArchiveQueue();
+        ~MTPArchiveQueue();
+
+        void reset();
+
+        /* Producer side. acquire() gives NULL once the queue's been cancelled */
+        MTPArchivePiece *acquire();
+        void submit(MTPArchivePiece *piece);
+        void close();
+
+        /* Consumer side. next() gives NULL after the last piece */
+        MTPArchivePiece *next();
+        void release(MTPArchivePiece *piece);
+        void cancel();
+
+    private:
+        struct Slot {
+            MTPArchivePiece piece;
+            bool full;
+        };
+
+        std::mutex mutex;
+        std::condition_variable cond;
+
+        Slot slots[ARCHIVE_SLOTS];
+        u64 produced;
+        u64 consumed;
+        bool producing;
+        bool cancelled;
+};
+
+/* Walks objects and reads their content on its own thread, ahead of whoever is sending it.
+   On an SD card most of the time for a small file is opening it, and this is where that waits */
+class MTPArchiveReader {
+    public:
+        ~MTPArchiveReader();
+
+        /* Every root goes in under its own name, a folder with everything in it. mode is
+           added to the flags files are opened with */
+        void start(std::vector<std::pair<MTPStorage *, fs::path>> roots, int mode = 0);
+
+        /* Pieces in archive order, NULL after the last one */
+        MTPArchivePiece *next() { return this->queue.next(); }
+        void release(MTPArchivePiece *piece) { this->queue.release(piece); }
+
+        /* Stops the reader wherever it got to. False if anything had to be left out or padded */
+        bool finish();
+
+    private:
+        MTPArchiveQueue queue;
+        std::thread thread;
+        std::atomic<bool> ok;
+
+        std::vector<std::pair<MTPStorage *, fs::path>> roots;
+        int mode;
+
+        void reader();
+        bool add(MTPStorage *storage, const fs::path &path, const std::string &name, bool is_dir);
+};
+
+/* The other way round: pieces are queued as they're taken off the stream, and folders and files
+   are created and written on a thread of its own. Files are preallocated before anything goes in them */
+class MTPArchiveWriter {
+    public:
+        struct Entry {
+            std::string name; // Relative to the parent, '/' between components
+            u64 size; // As written
+            u64 replaced; // Size of the file that was there before
+            bool is_dir;
+            bool ok;
+        };
+
+        MTPArchiveWriter();
+        ~MTPArchiveWriter();
+
+        /* Names are relative to parent. Folders have to come before what's in them */
+        void start(MTPStorage *storage, fs::path parent);
+
+        MTPArchivePiece *acquire() { return this->queue.acquire(); }
+        void submit(MTPArchivePiece *piece) { this->queue.submit(piece); }
+
+        /* Waits for everything queued to be written */
+        void finish();
+
+        /* The same without the thread, for pieces that already come from one, like an MTPArchiveReader's.
+           mode is added to the flags files are opened with */
+        void begin(MTPStorage *storage, fs::path parent, int mode);
+        void write(const MTPArchivePiece *piece);
+        void end() { this->close(); }
+
+        std::vector<Entry> entries; // Everything that was tried, in archive order
+
+    private:
+        MTPArchiveQueue queue;
+        std::thread thread;
+
+        MTPStorage *storage;
+        fs::path parent;
+        int mode;
+        MTPStorageFile *file; // The one being written
+        u64 pos;
+
+        void writer();
+        void close();
+};
@@ -0,0 +1,55 @@
+#include "arena.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <malloc.h>
+
+MTPArena::MTPArena(size_t size) {
+    this->base = (u8 *) memalign(0x1000, size);
+    this->capacity = this->base != NULL ? size : 0;
+    this->used = 0;
+    this->high = 0;
+    this->last = NULL;
+}
+
+MTPArena::~MTPArena() {
+    free(this->base);
+}
+
+void *MTPArena::allocate(size_t size) {
+    size_t start = (this->used + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (start > this->capacity || size > this->capacity - start)
+        return NULL;
+
+    this->last = this->base + start;
+    this->used = start + size;
+    this->high = std::max(this->high, this->used);
+    return this->last;
+}
+
+void *MTPArena::grow(void *block, size_t size, size_t new_size) {
+    if (block == NULL)
+        return this->allocate(new_size);
+
+    if (block == this->last) {
+        size_t start = this->last - this->base;
+        if (new_size > this->capacity - start)
+            return NULL;
+
+        this->used = start + new_size;
+        this->high = std::max(this->high, this->used);
+        return block;
+    }
+
+    /* Something else was handed out after it. The old copy stays where it is until the next reset */
+    void *moved = this->allocate(new_size);
+    if (moved != NULL)
+        memcpy(moved, block, std::min(size, new_size));
+    return moved;
+}
+
+void MTPArena::reset() {
+    this->used = 0;
+    this->last = NULL;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "platform.hpp"
+
+#define TRANSACTION_ARENA_SIZE 0x10000UL // Every container of a transaction but the odd huge one fits
+#define ARENA_ALIGNMENT 16
+
+/* Bump allocator for whatever only has to last one transaction. Nothing is freed on its own,
+   it all goes at once with reset() before the next one */
+class MTPArena {
+    public:
+        MTPArena(size_t size);
+        ~MTPArena();
+
+        /* NULL once it's full, for the caller to go to the heap instead */
+        void *allocate(size_t size);
+
+        /* Extends block in place when it's the last one handed out, otherwise moves it to the end.
+           NULL if there's no room for new_size, and then block is left as it was */
+        void *grow(void *block, size_t size, size_t new_size);
+
+        void reset();
+
+        size_t size() const { return this->capacity; }
+        size_t peak() const { return this->high; } // Most that was in use at once
+
+    private:
+        u8 *base;
+        size_t capacity;
+        size_t used;
+        size_t high;
+        u8 *last; // Start of the last block handed out
+};
@@ -0,0 +1,167 @@
+#include "capacity.hpp"
+
+#include <chrono>
+
+#include "mtp.hpp"
+
+MTPCapacityCache::MTPCapacityCache() {
+    this->running = true;
+    this->thread = std::thread(&MTPCapacityCache::refresher, this);
+}
+
+MTPCapacityCache::~MTPCapacityCache() {
+    this->stop();
+}
+
+void MTPCapacityCache::stop() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->cond.notify_all();
+
+    if (this->thread.joinable())
+        this->thread.join();
+}
+
+void MTPCapacityCache::insert(u32 storage_id, MTPStorage *storage) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->entries[storage_id] = {storage, 0, 0, 1, 0, 0, false, true, false};
+    this->cond.notify_all();
+}
+
+bool MTPCapacityCache::get(u32 storage_id, u64 *total, u64 *free) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    auto it = this->entries.find(storage_id);
+    if (it == this->entries.end())
+        return false;
+
+    this->cond.wait(lock, [&it] { return it->second.seeded; });
+
+    *total = it->second.total;
+    *free = it->second.free;
+    it->second.reported_free = it->second.free;
+    return true;
+}
+
+u64 MTPCapacityCache::available(u32 storage_id) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    auto it = this->entries.find(storage_id);
+    if (it == this->entries.end())
+        return 0;
+
+    this->cond.wait(lock, [&it] { return it->second.seeded; });
+    return it->second.free;
+}
+
+void MTPCapacityCache::adjust(u32 storage_id, s64 bytes) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    auto it = this->entries.find(storage_id);
+    if (it == this->entries.end() || !it->second.seeded)
+        return;
+
+    Entry &entry = it->second;
+    u64 clusters = ((bytes < 0 ? -bytes : bytes) + entry.block_size - 1) / entry.block_size * entry.block_size;
+    if (bytes < 0)
+        entry.free = std::min(entry.total, entry.free + clusters);
+    else
+        entry.free -= std::min(entry.free, clusters);
+    entry.adjustments++;
+
+    this->check(storage_id, entry);
+}
+
+void MTPCapacityCache::invalidate(u32 storage_id) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    auto it = this->entries.find(storage_id);
+    if (it != this->entries.end()) {
+        it->second.stale = true;
+        this->cond.notify_all();
+    }
+}
+
+bool MTPCapacityCache::pollEvent(MTPCapacityEvent *event) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->events.empty())
+        return false;
+
+    *event = this->events.front();
+    this->events.pop_front();
+    return true;
+}
+
+void MTPCapacityCache::check(u32 storage_id, Entry &entry) {
+    u64 drift = std::max(entry.free, entry.reported_free) - std::min(entry.free, entry.reported_free);
+    if (drift >= CAPACITY_CHANGE_THRESHOLD) {
+        this->events.push_back({EventStorageInfoChanged, storage_id});
+        entry.reported_free = entry.free; // Don't keep nagging until the host catches up
+    }
+
+    bool full = entry.free < CAPACITY_FULL_THRESHOLD;
+    if (full && !entry.full)
+        this->events.push_back({EventStoreFull, storage_id});
+    entry.full = full;
+}
+
+void MTPCapacityCache::refresher() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(CAPACITY_REFRESH_MS);
+
+    while (this->running) {
+        if (std::chrono::steady_clock::now() >= next) {
+            for (auto &it : this->entries)
+                it.second.stale = true;
+            next = std::chrono::steady_clock::now() + std::chrono::milliseconds(CAPACITY_REFRESH_MS);
+        }
+
+        bool refreshed = false;
+        for (auto &it : this->entries) {
+            if (!it.second.stale)
+                continue;
+
+            u32 storage_id = it.first;
+            MTPStorage *storage = it.second.storage;
+            it.second.stale = false;
+            it.second.adjustments = 0;
+
+            /* Don't hold up the responder while the filesystem thinks */
+            lock.unlock();
+            MTPStorageCapacity capacity;
+            bool ok = storage->capacity(&capacity);
+            lock.lock();
+
+            auto entry = this->entries.find(storage_id);
+            if (entry == this->entries.end())
+                break; // The map changed under us, start over
+
+            /* Free space from before a write or delete that finished meanwhile would undo it, and there's
+               no telling whether the storage had counted it yet. The adjusted number stands until the next one */
+            if (ok) {
+                entry->second.total = capacity.total;
+                if (entry->second.adjustments == 0)
+                    entry->second.free = capacity.free;
+                entry->second.block_size = std::max<u64>(capacity.block_size, 1);
+            }
+            if (!entry->second.seeded) {
+                entry->second.seeded = true;
+                entry->second.reported_free = entry->second.free;
+            }
+            this->check(storage_id, entry->second);
+
+            refreshed = true;
+            break; // Iterators don't survive the unlock
+        }
+
+        if (refreshed) {
+            this->cond.notify_all();
+            continue;
+        }
+
+        this->cond.wait_until(lock, next);
+    }
+}
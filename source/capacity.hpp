@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "platform.hpp"
+#include "storage.hpp"
+
+#define CAPACITY_REFRESH_MS 30000 // How often the storage is asked for the real numbers
+#define CAPACITY_CHANGE_THRESHOLD 0x4000000UL // Drift from what the host last saw before it's told to ask again
+#define CAPACITY_FULL_THRESHOLD 0x100000UL // Free space under which a storage counts as full
+
+struct MTPCapacityEvent {
+    u16 code;
+    u32 storage_id;
+};
+
+/* Free space per storage, kept up to date from the writes and deletes the responder does itself.
+   Asking the storage can mean scanning the whole allocation table on FAT, so it's only ever done
+   from a background thread, once to seed a storage and then every CAPACITY_REFRESH_MS */
+class MTPCapacityCache {
+    public:
+        MTPCapacityCache();
+        ~MTPCapacityCache();
+
+        void insert(u32 storage_id, MTPStorage *storage);
+
+        /* Has to happen before any storage goes away */
+        void stop();
+
+        /* Blocks until the storage has been seeded */
+        bool get(u32 storage_id, u64 *total, u64 *free);
+
+        /* Free space as last known, without counting as having been reported to the host */
+        u64 available(u32 storage_id);
+
+        /* Positive for a file written, negative for one released; rounded up to whole clusters */
+        void adjust(u32 storage_id, s64 bytes);
+
+        /* Something was changed by an amount that's too expensive to work out, e.g. a whole tree got deleted */
+        void invalidate(u32 storage_id);
+
+        bool pollEvent(MTPCapacityEvent *event);
+
+    private:
+        struct Entry {
+            MTPStorage *storage;
+            u64 total;
+            u64 free;
+            u64 block_size;
+            u64 reported_free; // As of the last StorageInfo sent to the host
+            u32 adjustments; // Since the last refresh started, which may or may not have seen them
+            bool seeded;
+            bool stale;
+            bool full;
+        };
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::thread thread;
+        bool running;
+
+        std::unordered_map<u32, Entry> entries;
+        std::deque<MTPCapacityEvent> events;
+
+        void refresher();
+        void check(u32 storage_id, Entry &entry);
+};
@@ -0,0 +1,158 @@
+#include "capture.hpp"
+
+#include <cstring>
+
+#include "mtp.hpp"
+
+CaptureTransport::CaptureTransport(MTPTransport *inner) {
+    this->inner = inner;
+    this->file = NULL;
+}
+
+CaptureTransport::~CaptureTransport() {
+    this->stop();
+}
+
+bool CaptureTransport::start(const char *path) {
+    this->stop();
+
+    this->file = fopen(path, "wb");
+    if (this->file == NULL)
+        return false;
+    setvbuf(this->file, NULL, _IOFBF, 0x10000);
+
+    u16 version = CAPTURE_VERSION;
+    fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), this->file);
+    fwrite(&version, sizeof(version), 1, this->file);
+
+    this->last_us = statsNow() / 1000;
+    memset(this->remaining, 0, sizeof(this->remaining));
+    memset(this->until_short, 0, sizeof(this->until_short));
+    this->pending_ep = -1;
+    this->pending_bytes = 0;
+
+    return true;
+}
+
+void CaptureTransport::stop() {
+    if (this->file == NULL)
+        return;
+
+    this->flush();
+    fclose(this->file);
+    this->file = NULL;
+}
+
+void CaptureTransport::writeVarint(u64 value) {
+    u8 bytes[10];
+    size_t length = 0;
+    do {
+        bytes[length] = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            bytes[length] |= 0x80;
+        length++;
+    } while (value != 0);
+
+    fwrite(bytes, 1, length, this->file);
+}
+
+void CaptureTransport::record(u8 tag, u64 us, const void *buf, size_t length) {
+    fputc(tag, this->file);
+    this->writeVarint(us - std::min(us, this->last_us));
+    this->last_us = us;
+
+    this->writeVarint(length);
+    if (tag >> 2 == CaptureContainer)
+        fwrite(buf, 1, length, this->file);
+}
+
+void CaptureTransport::flush() {
+    if (this->pending_ep < 0)
+        return;
+
+    this->record(this->pending_ep | (CaptureData << 2), this->pending_us, NULL, this->pending_bytes);
+    this->pending_ep = -1;
+    this->pending_bytes = 0;
+}
+
+Result CaptureTransport::transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) {
+    size_t xferd = 0;
+    Result rc = this->inner->transfer(ep, buf, size, &xferd);
+    if (out_xferd) *out_xferd = xferd;
+
+    if (this->file == NULL)
+        return rc;
+
+    u64 now = statsNow() / 1000;
+
+    if (R_FAILED(rc)) {
+        this->remaining[ep] = 0;
+        this->until_short[ep] = false;
+        return rc;
+    }
+
+    if (xferd == 0) {
+        this->flush();
+        this->record(ep | (CaptureZeroLength << 2), now, NULL, 0);
+        this->remaining[ep] = 0;
+        this->until_short[ep] = false;
+        return rc;
+    }
+
+    /* Both a short transfer and a packet that isn't full end a data phase of unknown length */
+    bool ends = xferd < size || xferd % CAPTURE_PACKET_SIZE != 0;
+
+    if (this->remaining[ep] == 0 && !this->until_short[ep]) {
+        this->flush();
+
+        size_t kept = std::min(xferd, (size_t) CAPTURE_CONTENT_MAX);
+        this->record(ep | (CaptureContainer << 2), now, buf, kept);
+
+        /* A length of 0xFFFFFFFF says nothing about where it ends, only the short transfer does */
+        if (xferd >= sizeof(MTPContainerHeader)) {
+            u32 length = ((MTPContainerHeader *) buf)->length;
+            this->until_short[ep] = length == 0xFFFFFFFF && !ends;
+            this->remaining[ep] = length != 0xFFFFFFFF && length > xferd ? length - xferd : 0;
+        }
+
+        if (xferd == kept)
+            return rc;
+        xferd -= kept;
+    } else {
+        this->remaining[ep] -= std::min<u64>(this->remaining[ep], xferd);
+    }
+
+    if (this->pending_ep != (int) ep) {
+        this->flush();
+        this->pending_ep = ep;
+        this->pending_us = now;
+    }
+    this->pending_bytes += xferd;
+
+    if (ends)
+        this->until_short[ep] = false;
+
+    return rc;
+}
+
+bool CaptureTransport::transferFile(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out) {
+    /* While recording, every transfer has to come through here */
+    if (this->file != NULL)
+        return false;
+    return this->inner->transferFile(ep, file, offset, size, out);
+}
+
+size_t captureReadVarint(FILE *f, u64 *value) {
+    *value = 0;
+    for (size_t i=0; i<10; i++) {
+        int c = fgetc(f);
+        if (c == EOF)
+            return 0;
+
+        *value |= (u64) (c & 0x7F) << (7 * i);
+        if ((c & 0x80) == 0)
+            return i + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "transport.hpp"
+
+#define CAPTURE_MAGIC "TPCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_CONTENT_MAX 0x200 // Bytes kept from the first transfer of each container
+#define CAPTURE_PACKET_SIZE 0x200
+
+/* Record tags: the low two bits hold the MTPEndpoint, the next two the kind */
+enum MTPCaptureKind {
+    CaptureContainer, // First transfer of a container, kept verbatim
+    CaptureData, // Run of transfers continuing a container, only the byte count is kept
+    CaptureZeroLength, // Zero length transfer, which ends a data phase of unknown length
+};
+
+/* Wraps another transport and records every transfer to a compact file, with timestamps.
+   Each record is: u8 tag, varint microseconds since the previous record, then either
+   varint length + content (CaptureContainer) or a varint byte count */
+class CaptureTransport : public MTPTransport {
+    public:
+        CaptureTransport(MTPTransport *inner);
+        ~CaptureTransport();
+
+        bool start(const char *path);
+        void stop();
+        bool active() const { return this->file != NULL; }
+
+        Result transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) override;
+        bool transferFile(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out) override;
+        bool waitReady(u64 timeout) override { return this->inner->waitReady(timeout); }
+        bool waitReceive(void *buf, size_t size, u64 timeout) override { return this->inner->waitReceive(buf, size, timeout); }
+        u32 connection() override { return this->inner->connection(); }
+
+    private:
+        MTPTransport *inner;
+        FILE *file;
+        u64 last_us;
+
+        u64 remaining[3]; // Bytes left in the current container, per endpoint
+        bool until_short[3]; // The current container is 4GiB or more and ends with a short transfer
+
+        int pending_ep; // Coalesced run of CaptureData transfers
+        u64 pending_bytes;
+        u64 pending_us;
+
+        void record(u8 tag, u64 us, const void *buf, size_t length);
+        void writeVarint(u64 value);
+        void flush();
+};
+
+size_t captureReadVarint(FILE *f, u64 *value);
@@ -0,0 +1,418 @@
+#include "compress.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <malloc.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // The format wants a block to end in at least this many literals
+#define LZ4_MATCH_LIMIT 12 // and no match to start closer than this to the end
+#define LZ4_MAX_OFFSET 0xFFFF
+#define LZ4_HASH_BITS 14
+
+static inline u32 _read32(const u8 *p) {
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u64 _read64(const u8 *p) {
+    u64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u32 _hash(u32 sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static u8 *_writeLength(u8 *op, size_t length) {
+    for (; length >= 0xFF; length -= 0xFF)
+        *op++ = 0xFF;
+    *op++ = length;
+    return op;
+}
+
+static bool _readLength(const u8 **ip, const u8 *ip_end, size_t *length) {
+    u8 byte;
+    do {
+        if (*ip >= ip_end)
+            return false;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 0xFF);
+
+    return true;
+}
+
+/* The table only ever gives candidates, which are checked against the data, so whatever an
+   earlier block left in it is harmless and it never needs clearing */
+size_t lz4Compress(const u8 *src, size_t size, u8 *dst, size_t capacity, u32 *table) {
+    u8 *op = dst, *op_end = dst + capacity;
+    size_t anchor = 0;
+
+    auto sequence = [&](size_t literals, size_t offset, size_t match) {
+        if ((size_t) (op_end - op) < 1 + literals + literals / 0xFF + 1 + 2 + match / 0xFF + 1)
+            return false;
+
+        u8 *token = op++;
+        *token = std::min<size_t>(literals, 15) << 4;
+        if (literals >= 15)
+            op = _writeLength(op, literals - 15);
+        memcpy(op, src + anchor, literals);
+        op += literals;
+
+        /* The last sequence is literals alone */
+        if (match == 0)
+            return true;
+
+        *op++ = offset;
+        *op++ = offset >> 8;
+        match -= LZ4_MIN_MATCH;
+        *token |= std::min<size_t>(match, 15);
+        if (match >= 15)
+            op = _writeLength(op, match - 15);
+        return true;
+    };
+
+    if (size > LZ4_MATCH_LIMIT) {
+        size_t ip = 0, limit = size - LZ4_MATCH_LIMIT, match_end = size - LZ4_LAST_LITERALS;
+
+        /* Steps get longer the longer nothing matches, which gets through incompressible stretches quickly */
+        u32 misses = 0;
+        while (ip < limit) {
+            u32 value = _read32(src + ip);
+            u32 hash = _hash(value);
+            size_t candidate = table[hash];
+            table[hash] = ip;
+
+            if (candidate >= ip || ip - candidate > LZ4_MAX_OFFSET || _read32(src + candidate) != value) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && candidate > 0 && src[ip - 1] == src[candidate - 1]) {
+                ip--;
+                candidate--;
+            }
+
+            size_t length = LZ4_MIN_MATCH;
+            while (ip + length + sizeof(u64) <= match_end) {
+                u64 diff = _read64(src + ip + length) ^ _read64(src + candidate + length);
+                if (diff != 0) {
+                    length += __builtin_ctzll(diff) >> 3;
+                    goto matched;
+                }
+                length += sizeof(u64);
+            }
+            while (ip + length < match_end && src[ip + length] == src[candidate + length])
+                length++;
+
+        matched:
+            if (!sequence(ip - anchor, ip - candidate, length))
+                return 0;
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    if (!sequence(size - anchor, 0, 0))
+        return 0;
+
+    return op - dst;
+}
+
+s64 lz4Decompress(const u8 *src, size_t size, u8 *dst, size_t capacity) {
+    const u8 *ip = src, *ip_end = src + size;
+    u8 *op = dst, *op_end = dst + capacity;
+
+    while (ip < ip_end) {
+        u8 token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !_readLength(&ip, ip_end, &literals))
+            return -1;
+        if ((size_t) (ip_end - ip) < literals || (size_t) (op_end - op) < literals)
+            return -1;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == ip_end)
+            break;
+
+        if (ip_end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst))
+            return -1;
+
+        size_t match = token & 15;
+        if (match == 15 && !_readLength(&ip, ip_end, &match))
+            return -1;
+        match += LZ4_MIN_MATCH;
+        if ((size_t) (op_end - op) < match)
+            return -1;
+
+        /* An offset shorter than the match repeats a pattern. Whole periods of it can be copied at once,
+           and there are more of them behind op the further it gets */
+        u8 *start = op - offset;
+        while (match > 0) {
+            size_t span = (op - start) / offset * offset;
+            size_t chunk = std::min(span, match);
+            memcpy(op, op - span, chunk);
+            op += chunk;
+            match -= chunk;
+        }
+    }
+
+    return (size_t) (op - dst) == capacity ? capacity : -1;
+}
+
+size_t compressBlock(const u8 *src, size_t size, u8 *dst, u32 *table) {
+    if (size == 0)
+        return 0;
+
+    /* Media and archives are already compressed, and four small samples give that away
+       for a fraction of what trying the whole block would cost */
+    if (size >= COMPRESS_SAMPLE_SIZE * 8) {
+        size_t packed = 0;
+        for (int i=0; i<4; i++) {
+            const u8 *sample = src + (size - COMPRESS_SAMPLE_SIZE) * i / 3;
+            size_t length = lz4Compress(sample, COMPRESS_SAMPLE_SIZE, dst, COMPRESS_SAMPLE_SIZE, table);
+            packed += length != 0 ? length : COMPRESS_SAMPLE_SIZE;
+        }
+
+        if (packed * 8 > COMPRESS_SAMPLE_SIZE * 4 * COMPRESS_SAMPLE_LIMIT)
+            return size;
+    }
+
+    size_t packed = lz4Compress(src, size, dst, size - 1, table);
+    return packed != 0 ? packed : size;
+}
+
+MTPCompressor::MTPCompressor() {
+    for (Slot &slot : this->slots) {
+        slot.block.raw = (u8 *) memalign(0x1000, COMPRESS_BLOCK_SIZE);
+        slot.block.packed = (u8 *) memalign(0x1000, COMPRESS_BLOCK_SIZE);
+    }
+
+    this->reset(true);
+    this->producing = false;
+    this->file = NULL;
+
+    this->running = true;
+    for (int i=0; i<COMPRESS_WORKERS; i++)
+        this->workers.emplace_back(&MTPCompressor::worker, this, i);
+}
+
+MTPCompressor::~MTPCompressor() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+        this->cancelled = true;
+        this->producing = false;
+    }
+    this->cond.notify_all();
+
+    if (this->thread.joinable())
+        this->thread.join();
+    for (std::thread &worker : this->workers)
+        worker.join();
+
+    for (Slot &slot : this->slots) {
+        free(slot.block.raw);
+        free(slot.block.packed);
+    }
+}
+
+void MTPCompressor::reset(bool packing) {
+    for (Slot &slot : this->slots)
+        slot.state = SlotFree;
+
+    this->produced = 0;
+    this->consumed = 0;
+    this->packing = packing;
+    this->producing = true;
+    this->cancelled = false;
+    this->transferred = 0;
+    this->ok = true;
+}
+
+void MTPCompressor::worker(int core) {
+#ifdef __SWITCH__
+    /* Threads all start out on the same core otherwise */
+    svcSetThreadCoreMask(CUR_THREAD_HANDLE, core, 0x7);
+#endif
+
+    u32 *table = (u32 *) calloc(1 << LZ4_HASH_BITS, sizeof(u32));
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        Slot *slot = NULL;
+        this->cond.wait(lock, [this, &slot] {
+            for (u64 i=this->consumed; i<this->produced && slot == NULL; i++) {
+                if (this->slots[i % COMPRESS_SLOTS].state == SlotFilled)
+                    slot = &this->slots[i % COMPRESS_SLOTS];
+            }
+            return !this->running || slot != NULL;
+        });
+        if (!this->running)
+            break;
+
+        slot->state = SlotWorking;
+        bool packing = this->packing;
+        lock.unlock();
+
+        MTPCompressedBlock &block = slot->block;
+        if (packing)
+            block.packed_size = compressBlock(block.raw, block.raw_size, block.packed, table);
+        else
+            block.ok = block.ok && lz4Decompress(block.packed, block.packed_size, block.raw, block.raw_size) == block.raw_size;
+
+        lock.lock();
+        slot->state = SlotDone;
+        this->cond.notify_all();
+    }
+
+    free(table);
+}
+
+void MTPCompressor::reader() {
+    for (u64 pos = 0; pos < this->size;) {
+        Slot *slot = &this->slots[this->produced % COMPRESS_SLOTS];
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cond.wait(lock, [this, slot] { return this->cancelled || slot->state == SlotFree; });
+            if (this->cancelled)
+                break;
+        }
+
+        size_t to_read = std::min<u64>(this->size - pos, COMPRESS_BLOCK_SIZE);
+        s64 xferd = this->file->read(pos, slot->block.raw, to_read);
+        slot->block.raw_size = std::max<s64>(xferd, 0);
+        slot->block.ok = xferd == (s64) to_read;
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        slot->state = SlotFilled;
+        this->produced++;
+        this->transferred += slot->block.raw_size;
+        this->cond.notify_all();
+
+        /* The file got shorter underneath us, there's nothing more to send */
+        if (!slot->block.ok) {
+            this->ok = false;
+            break;
+        }
+        pos += to_read;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->producing = false;
+    this->cond.notify_all();
+}
+
+void MTPCompressor::writer() {
+    while (true) {
+        Slot *slot = &this->slots[this->consumed % COMPRESS_SLOTS];
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->cond.wait(lock, [this, slot] {
+                return slot->state == SlotDone || (!this->producing && this->consumed == this->produced);
+            });
+            if (slot->state != SlotDone)
+                break;
+        }
+
+        /* Once something has failed the rest still gets taken off the stream, only not written */
+        MTPCompressedBlock &block = slot->block;
+        const u8 *data = block.packed_size == block.raw_size ? block.packed : block.raw;
+        bool written = this->ok && block.ok && this->file->write(this->transferred, data, block.raw_size) == block.raw_size;
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (written)
+            this->transferred += block.raw_size;
+        else
+            this->ok = false;
+        slot->state = SlotFree;
+        this->consumed++;
+        this->cond.notify_all();
+    }
+}
+
+void MTPCompressor::startRead(MTPStorageFile *file, u64 size) {
+    this->reset(true);
+    this->file = file;
+    this->size = size;
+    this->thread = std::thread(&MTPCompressor::reader, this);
+}
+
+MTPCompressedBlock *MTPCompressor::next() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    Slot *slot = &this->slots[this->consumed % COMPRESS_SLOTS];
+    this->cond.wait(lock, [this, slot] {
+        return slot->state == SlotDone || (!this->producing && this->consumed == this->produced);
+    });
+
+    return slot->state == SlotDone ? &slot->block : NULL;
+}
+
+void MTPCompressor::release(MTPCompressedBlock *block) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->slots[this->consumed % COMPRESS_SLOTS].state = SlotFree;
+    this->consumed++;
+    this->cond.notify_all();
+}
+
+void MTPCompressor::startWrite(MTPStorageFile *file) {
+    this->reset(false);
+    this->file = file;
+    this->thread = std::thread(&MTPCompressor::writer, this);
+}
+
+MTPCompressedBlock *MTPCompressor::acquire() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    Slot *slot = &this->slots[this->produced % COMPRESS_SLOTS];
+    this->cond.wait(lock, [slot] { return slot->state == SlotFree; });
+
+    return &slot->block;
+}
+
+void MTPCompressor::submit(MTPCompressedBlock *block) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    /* Stored blocks have nothing for the workers to do */
+    Slot *slot = &this->slots[this->produced % COMPRESS_SLOTS];
+    slot->state = block->packed_size == block->raw_size ? SlotDone : SlotFilled;
+    this->produced++;
+    this->cond.notify_all();
+}
+
+bool MTPCompressor::finish(u64 *out_size) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->cancelled = true;
+        if (!this->packing)
+            this->producing = false;
+    }
+    this->cond.notify_all();
+
+    if (this->thread.joinable())
+        this->thread.join();
+
+    /* Blocks the sender never got to may still be with a worker */
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->cond.wait(lock, [this] {
+        for (Slot &slot : this->slots) {
+            if (slot.state == SlotFilled || slot.state == SlotWorking)
+                return false;
+        }
+        return true;
+    });
+
+    if (out_size) *out_size = this->transferred;
+
+    return this->ok;
+}
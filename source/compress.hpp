@@ -0,0 +1,104 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "platform.hpp"
+#include "storage.hpp"
+
+#define COMPRESS_BLOCK_SIZE 0x40000 // Raw bytes per block, each compressed on its own
+#define COMPRESS_WORKERS 3 // The cores an application gets
+#define COMPRESS_SLOTS 16 // Raw data for a few full transfers, so the workers keep going while one is sent
+#define COMPRESS_SAMPLE_SIZE 0x1000 // Per sample, there are four spread over every block
+#define COMPRESS_SAMPLE_LIMIT 7 // In eighths: samples that don't shrink below this get the block stored as is
+
+enum MTPCompression : u32 {
+    CompressionNone,
+    CompressionLZ4, // LZ4 block format, no frame around it
+};
+
+/* In compressed mode, object data phases are a run of these, each followed by packed_size bytes.
+   A block whose packed_size equals its raw_size is stored as is. The data phase's length is
+   0xFFFFFFFF either way and a short packet ends it */
+struct PACKED MTPCompressedBlockHeader {
+    u32 raw_size;
+    u32 packed_size;
+};
+
+/* Both return the size they produced. Compression gives 0 when the output wouldn't fit in capacity,
+   decompression -1 for input that isn't a valid block or doesn't come out at capacity bytes */
+size_t lz4Compress(const u8 *src, size_t size, u8 *dst, size_t capacity, u32 *table);
+s64 lz4Decompress(const u8 *src, size_t size, u8 *dst, size_t capacity);
+
+/* Packs a block the way the responder sends it, into dst of at least size bytes. Returns
+   packed_size, which is size when it wasn't worth compressing and the block should go out as is */
+size_t compressBlock(const u8 *src, size_t size, u8 *dst, u32 *table);
+
+struct MTPCompressedBlock {
+    u8 *raw;
+    u8 *packed;
+    u32 raw_size;
+    u32 packed_size;
+    bool ok; // Read or written in full, and valid
+};
+
+/* Blocks go through in order: one end fills them, the workers pack or unpack them, the other end drains them.
+   For GetObject a reader thread fills and the responder sends, for SendObject the responder fills from the
+   stream and a writer thread puts them in the file. Workers stay up between transfers */
+class MTPCompressor {
+    public:
+        MTPCompressor();
+        ~MTPCompressor();
+
+        /* Device to host. next() hands out packed blocks in order and NULL once the file's been read */
+        void startRead(MTPStorageFile *file, u64 size);
+        MTPCompressedBlock *next();
+        void release(MTPCompressedBlock *block);
+
+        /* Host to device. Blocks come from acquire() with packed and raw_size/packed_size filled in */
+        void startWrite(MTPStorageFile *file);
+        MTPCompressedBlock *acquire();
+        void submit(MTPCompressedBlock *block);
+
+        /* Waits for the thread on the far end, wherever it got to. Returns whether every block made it,
+           with how many raw bytes went through */
+        bool finish(u64 *out_size);
+
+    private:
+        enum SlotState {
+            SlotFree,
+            SlotFilled,
+            SlotWorking,
+            SlotDone,
+        };
+
+        struct Slot {
+            MTPCompressedBlock block;
+            SlotState state;
+        };
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::vector<std::thread> workers;
+        std::thread thread; // Reader or writer, for the length of one transfer
+        bool running;
+
+        Slot slots[COMPRESS_SLOTS];
+        u64 produced;
+        u64 consumed;
+        bool packing;
+        bool producing; // Cleared once no more blocks are coming
+        bool cancelled;
+
+        MTPStorageFile *file;
+        u64 size;
+        u64 transferred;
+        bool ok;
+
+        void reset(bool packing);
+        void worker(int core);
+        void reader();
+        void writer();
+};
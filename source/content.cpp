@@ -0,0 +1,54 @@
+#include "content.hpp"
+
+MTPContentCache::MTPContentCache() {
+    this->budget = CONTENT_CACHE_BUDGET;
+    this->used = 0;
+}
+
+void MTPContentCache::setBudget(u64 budget) {
+    this->budget = budget;
+    this->evict(0);
+}
+
+const std::vector<u8> *MTPContentCache::lookup(u32 handle) {
+    auto it = this->entries.find(handle);
+    if (it == this->entries.end())
+        return NULL;
+
+    this->order.splice(this->order.begin(), this->order, it->second.position);
+    return &it->second.data;
+}
+
+void MTPContentCache::store(u32 handle, std::vector<u8> &&data) {
+    if (!this->wants(data.size()))
+        return;
+
+    auto it = this->entries.find(handle);
+    if (it != this->entries.end()) {
+        this->used -= it->second.data.size();
+        this->order.erase(it->second.position);
+        this->entries.erase(it);
+    }
+
+    this->evict(data.size());
+
+    this->order.push_front(handle);
+    this->used += data.size();
+    this->entries[handle] = {std::move(data), this->order.begin()};
+}
+
+void MTPContentCache::clear() {
+    this->entries.clear();
+    this->order.clear();
+    this->used = 0;
+}
+
+/* Least recently used first, until needed more bytes fit */
+void MTPContentCache::evict(u64 needed) {
+    while (!this->order.empty() && this->used + needed > this->budget) {
+        auto it = this->entries.find(this->order.back());
+        this->used -= it->second.data.size();
+        this->entries.erase(it);
+        this->order.pop_back();
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+
+#include "platform.hpp"
+
+#define CONTENT_CACHE_BUDGET 0x800000UL // Default, in bytes of content
+#define CONTENT_CACHE_OBJECT_MAX 0x20000UL // Anything bigger is read from the storage every time
+
+/* Whole contents of small objects that hosts keep asking for again, like icons, .nacp and config
+   files, or images that get fetched again every time a folder view refreshes. Keyed by handle and
+   never checked against the storage, so the responder has to drop it whenever it changes anything */
+class MTPContentCache {
+    public:
+        MTPContentCache();
+
+        void setBudget(u64 budget); // Zero turns the cache off
+
+        /* Counts as a use, so it's the last to go */
+        const std::vector<u8> *lookup(u32 handle);
+        void store(u32 handle, std::vector<u8> &&data);
+        bool wants(u64 size) { return size <= CONTENT_CACHE_OBJECT_MAX && size <= this->budget; }
+
+        void clear();
+        size_t memory() { return this->used; }
+
+    private:
+        struct Entry {
+            std::vector<u8> data;
+            std::list<u32>::iterator position;
+        };
+
+        u64 budget;
+        u64 used;
+        std::unordered_map<u32, Entry> entries;
+        std::list<u32> order; // Most recently used first
+
+        void evict(u64 needed);
+};
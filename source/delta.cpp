@@ -0,0 +1,114 @@
+#include "delta.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include "hash.hpp"
+
+void MTPRollingChecksum::reset(const u8 *data, size_t size) {
+    this->a = this->b = 0;
+    this->length = size;
+    for (size_t i=0; i<size; i++) {
+        this->a += data[i];
+        this->b += this->a;
+    }
+}
+
+u32 deltaWeakChecksum(const u8 *data, size_t size) {
+    MTPRollingChecksum checksum;
+    checksum.reset(data, size);
+    return checksum.value();
+}
+
+/* Like rsync, about the square root of the size, so a 4GiB file gets 64KiB blocks and as many signatures */
+u32 deltaBlockSize(u64 size) {
+    u64 block_size = ((u64) sqrt((double) size) + 0x3FF) & ~0x3FFUL;
+    return std::clamp<u64>(block_size, DELTA_BLOCK_MIN, DELTA_BLOCK_MAX);
+}
+
+static void _append(std::vector<u8> *out, const void *data, size_t size) {
+    out->insert(out->end(), (const u8 *) data, (const u8 *) data + size);
+}
+
+static void _literal(std::vector<u8> *out, const u8 *data, u64 size) {
+    while (size > 0) {
+        u32 length = std::min<u64>(size, DELTA_LITERAL_MAX);
+        out->push_back(DeltaLiteral);
+        _append(out, &length, sizeof(length));
+        _append(out, data, length);
+        data += length;
+        size -= length;
+    }
+}
+
+void deltaEncode(const MTPDeltaSignatureHeader &header, const std::vector<MTPDeltaSignature> &signatures,
+        const u8 *data, u64 size, std::vector<u8> *out) {
+    _append(out, &size, sizeof(size));
+
+    /* Only whole blocks are looked for, the short one at the end of the old content is sent as is */
+    u64 block_size = header.block_size;
+    std::unordered_multimap<u32, u32> blocks;
+    for (u32 i=0; i<signatures.size() && (u64) (i + 1) * block_size <= header.size; i++)
+        blocks.emplace(signatures[i].weak, i);
+
+    u64 pos = 0, literal = 0;
+    u32 copy_first = 0, copy_count = 0;
+    auto flush_copy = [&]() {
+        if (copy_count == 0)
+            return;
+        out->push_back(DeltaCopy);
+        _append(out, &copy_first, sizeof(copy_first));
+        _append(out, &copy_count, sizeof(copy_count));
+        copy_count = 0;
+    };
+
+    MTPRollingChecksum checksum;
+    bool rolling = false;
+    while (block_size != 0 && pos + block_size <= size) {
+        if (!rolling)
+            checksum.reset(data + pos, block_size);
+        rolling = true;
+
+        /* The strong hash is only worked out when the weak one already matched */
+        s64 match = -1;
+        auto range = blocks.equal_range(checksum.value());
+        if (range.first != range.second) {
+            u64 strong = hashXXH3(data + pos, block_size);
+            for (auto it = range.first; it != range.second; it++) {
+                if (signatures[it->second].strong == strong) {
+                    match = it->second;
+                    break;
+                }
+            }
+        }
+
+        if (match < 0) {
+            if (pos + block_size < size)
+                checksum.roll(data[pos], data[pos + block_size]);
+            pos++;
+            continue;
+        }
+
+        if (literal < pos) {
+            flush_copy();
+            _literal(out, data + literal, pos - literal);
+        }
+        if (copy_count != 0 && copy_first + copy_count == (u32) match) {
+            copy_count++;
+        } else {
+            flush_copy();
+            copy_first = match;
+            copy_count = 1;
+        }
+
+        pos += block_size;
+        literal = pos;
+        rolling = false;
+    }
+
+    flush_copy();
+    _literal(out, data + literal, size - literal);
+    out->push_back(DeltaEnd);
+}
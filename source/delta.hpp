@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+
+#include "platform.hpp"
+
+#define DELTA_BLOCK_MIN 0x800
+#define DELTA_BLOCK_MAX 0x20000
+#define DELTA_LITERAL_MAX 0x40000000 // Longer runs are split over several instructions
+
+/* A delta stream starts with the u64 size of the new content, then has instructions until DeltaEnd.
+   DeltaCopy is followed by a u32 block index and a u32 block count, copied from the old content.
+   DeltaLiteral is followed by a u32 length and that many bytes of new content */
+enum MTPDeltaInstruction : u8 {
+    DeltaEnd,
+    DeltaCopy,
+    DeltaLiteral,
+};
+
+/* Precedes the signatures of an object's blocks. The last block is short unless size is a multiple of block_size */
+struct PACKED MTPDeltaSignatureHeader {
+    u32 block_size;
+    u64 size;
+    u32 count;
+};
+
+struct PACKED MTPDeltaSignature {
+    u32 weak; // deltaWeakChecksum
+    u64 strong; // XXH3-64
+};
+
+/* rsync's rolling checksum, which a host can slide along its copy one byte at a time */
+class MTPRollingChecksum {
+    public:
+        MTPRollingChecksum() : a(0), b(0), length(0) { }
+
+        void reset(const u8 *data, size_t size);
+        void roll(u8 out, u8 in) {
+            this->a += in - out;
+            this->b += this->a - this->length * out;
+        }
+
+        u32 value() const { return (this->a & 0xFFFF) | (this->b << 16); }
+
+    private:
+        u32 a;
+        u32 b;
+        u32 length;
+};
+
+u32 deltaWeakChecksum(const u8 *data, size_t size);
+u32 deltaBlockSize(u64 size); // What a signature request of block size zero gets
+
+/* Host side: instructions that rebuild data from content with the given signatures */
+void deltaEncode(const MTPDeltaSignatureHeader &header, const std::vector<MTPDeltaSignature> &signatures,
+    const u8 *data, u64 size, std::vector<u8> *out);
@@ -0,0 +1,397 @@
+#ifdef __linux__
+
+#include "ffs.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <endian.h>
+#include <sys/eventfd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "mtp.hpp"
+
+#define FFS_TAG_ENDPOINT 0x100 // user_data of endpoint operations, the low bits are the buffer
+#define FFS_NO_OFFSET ((u64) -1) // Endpoints are streams
+
+struct PACKED FunctionFSEndpoints {
+    usb_interface_descriptor interface;
+    usb_endpoint_descriptor_no_audio in;
+    usb_endpoint_descriptor_no_audio out;
+    usb_endpoint_descriptor_no_audio interrupt;
+};
+
+struct PACKED FunctionFSSuperSpeedEndpoints {
+    usb_interface_descriptor interface;
+    usb_endpoint_descriptor_no_audio in;
+    usb_ss_ep_comp_descriptor in_comp;
+    usb_endpoint_descriptor_no_audio out;
+    usb_ss_ep_comp_descriptor out_comp;
+    usb_endpoint_descriptor_no_audio interrupt;
+    usb_ss_ep_comp_descriptor interrupt_comp;
+};
+
+struct PACKED FunctionFSDescriptors {
+    usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    __le32 ss_count;
+    FunctionFSEndpoints fs;
+    FunctionFSEndpoints hs;
+    FunctionFSSuperSpeedEndpoints ss;
+};
+
+struct PACKED FunctionFSStrings {
+    usb_functionfs_strings_head header;
+    __le16 lang;
+    char interface[sizeof("MTP")];
+};
+
+/* Same interface as on console: still image class, with bulk in, bulk out and interrupt in */
+static usb_interface_descriptor _interface() {
+    return {USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, 3, 6, 1, 1, 1};
+}
+
+static usb_endpoint_descriptor_no_audio _endpoint(u8 address, u8 attributes, u16 packet_size, u8 interval) {
+    return {USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, address, attributes, htole16(packet_size), interval};
+}
+
+static FunctionFSEndpoints _endpoints(u16 bulk_size) {
+    return {
+        _interface(),
+        _endpoint(1 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, bulk_size, 0),
+        _endpoint(2 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, bulk_size, 0),
+        _endpoint(3 | USB_DIR_IN, USB_ENDPOINT_XFER_INT, 0x1c, 6),
+    };
+}
+
+static bool _writeDescriptors(int ep0) {
+    FunctionFSDescriptors descriptors;
+    memset(&descriptors, 0, sizeof(descriptors));
+    descriptors.header.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+    descriptors.header.length = htole32(sizeof(descriptors));
+    descriptors.header.flags = htole32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC);
+    descriptors.fs_count = descriptors.hs_count = htole32(4);
+    descriptors.ss_count = htole32(7);
+    descriptors.fs = _endpoints(0x40);
+    descriptors.hs = _endpoints(0x200);
+
+    usb_ss_ep_comp_descriptor comp = {USB_DT_SS_EP_COMP_SIZE, USB_DT_SS_ENDPOINT_COMP, 0, 0, 0};
+    descriptors.ss = {
+        _interface(),
+        _endpoint(1 | USB_DIR_IN, USB_ENDPOINT_XFER_BULK, 0x400, 0), comp,
+        _endpoint(2 | USB_DIR_OUT, USB_ENDPOINT_XFER_BULK, 0x400, 0), comp,
+        _endpoint(3 | USB_DIR_IN, USB_ENDPOINT_XFER_INT, 0x1c, 6), comp,
+    };
+    descriptors.ss.interrupt_comp.wBytesPerInterval = htole16(0x1c);
+
+    FunctionFSStrings strings = {
+        {htole32(FUNCTIONFS_STRINGS_MAGIC), htole32(sizeof(strings)), htole32(1), htole32(1)},
+        htole16(0x0409), "MTP",
+    };
+
+    return write(ep0, &descriptors, sizeof(descriptors)) == sizeof(descriptors) &&
+        write(ep0, &strings, sizeof(strings)) == sizeof(strings);
+}
+
+/* Answers the still image class requests. Going the wrong way on ep0 stalls anything else */
+static bool _control(int ep0, const usb_ctrlrequest &setup) {
+    u8 data[8];
+    switch (setup.bRequest) {
+        case 0x64: // Cancel Request, with the transaction ID as data
+            return read(ep0, data, std::min<size_t>(le16toh(setup.wLength), sizeof(data))) >= 0;
+        case 0x66: // Device Reset
+            return read(ep0, data, 0) >= 0;
+        case 0x67: { // Get Device Status
+            u16 status[2] = {htole16(4), htole16(ResponseOk)};
+            return write(ep0, status, std::min<size_t>(le16toh(setup.wLength), sizeof(status))) >= 0;
+        }
+    }
+
+    if (setup.bRequestType & USB_DIR_IN)
+        return read(ep0, data, 0) >= 0;
+    return write(ep0, data, 0) >= 0;
+}
+
+FunctionFSTransport::FunctionFSTransport(std::string mount) {
+    this->ep[SlotIn] = this->ep[SlotOut] = this->ep[SlotInterrupt] = -1;
+    this->enabled = false;
+    this->connections = 0;
+    this->stopping = false;
+    this->fixed = false;
+
+    for (int i=0; i<2 * FFS_RING_BATCH; i++)
+        this->buffers[i] = (u8 *) memalign(0x1000, FFS_RING_BUFFER_SIZE);
+
+    this->wake = eventfd(0, 0);
+    this->ep0 = open((mount + "/ep0").c_str(), O_RDWR);
+    if (this->ep0 < 0 || !_writeDescriptors(this->ep0))
+        return;
+
+    /* The endpoint files only show up once the descriptors are in */
+    this->ep[SlotIn] = open((mount + "/ep1").c_str(), O_RDWR);
+    this->ep[SlotOut] = open((mount + "/ep2").c_str(), O_RDWR);
+    this->ep[SlotInterrupt] = open((mount + "/ep3").c_str(), O_RDWR);
+
+    this->control = std::thread(&FunctionFSTransport::handleControl, this);
+
+    /* Without io_uring, endpoint transfers fall back to plain reads and writes and object data
+       goes through the responder like on console */
+    if (this->ready() && this->ring.init(FFS_RING_ENTRIES, true)) {
+        int fds[SlotCount] = {this->ep[SlotIn], this->ep[SlotOut], this->ep[SlotInterrupt], -1};
+        this->fixed = this->ring.registerFiles(fds, SlotCount) &&
+            this->ring.registerBuffers(this->buffers, 2 * FFS_RING_BATCH, FFS_RING_BUFFER_SIZE);
+    }
+}
+
+FunctionFSTransport::~FunctionFSTransport() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cond.notify_all();
+
+    if (this->control.joinable()) {
+        u64 one = 1;
+        if (write(this->wake, &one, sizeof(one)) == sizeof(one))
+            this->control.join();
+        else
+            this->control.detach();
+    }
+
+    for (int i=0; i<SlotObject; i++) {
+        if (this->ep[i] >= 0)
+            close(this->ep[i]);
+    }
+    if (this->ep0 >= 0)
+        close(this->ep0);
+    if (this->wake >= 0)
+        close(this->wake);
+
+    for (int i=0; i<2 * FFS_RING_BATCH; i++)
+        free(this->buffers[i]);
+}
+
+void FunctionFSTransport::handleControl() {
+    pollfd fds[2] = {{this->ep0, POLLIN, 0}, {this->wake, POLLIN, 0}};
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents != 0)
+            break;
+        if ((fds[0].revents & POLLIN) == 0)
+            continue;
+
+        usb_functionfs_event events[4];
+        ssize_t length = read(this->ep0, events, sizeof(events));
+        if (length == 0 || (length < 0 && errno != EINTR && errno != EAGAIN))
+            break;
+
+        for (ssize_t i=0; i<length / (ssize_t) sizeof(events[0]); i++) {
+            switch (events[i].type) {
+                case FUNCTIONFS_ENABLE:
+                case FUNCTIONFS_DISABLE:
+                case FUNCTIONFS_UNBIND: {
+                    /* Transfers still in flight come back with ESHUTDOWN on their own when this goes */
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    bool enabled = (events[i].type == FUNCTIONFS_ENABLE);
+                    if (enabled && !this->enabled)
+                        this->connections++;
+                    this->enabled = enabled;
+                    this->cond.notify_all();
+                } break;
+                case FUNCTIONFS_SETUP:
+                    _control(this->ep0, events[i].u.setup);
+                    break;
+            }
+        }
+    }
+}
+
+bool FunctionFSTransport::waitReady(u64 timeout) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->cond.wait_for(lock, std::chrono::nanoseconds(timeout), [this] { return this->enabled || this->stopping; });
+    return this->enabled;
+}
+
+Result FunctionFSTransport::transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) {
+    /* Waiting for the host to come back would hand a new host the rest of an old transaction */
+    *out_xferd = 0;
+    if (!this->ready() || !this->enabled)
+        return ESHUTDOWN;
+
+    int slot = ep == EndpointIn ? SlotIn : ep == EndpointOut ? SlotOut : SlotInterrupt;
+
+    if (this->fixed) {
+        io_uring_cqe cqe;
+        if (!this->ring.queue(ep != EndpointOut, slot, -1, buf, size, FFS_NO_OFFSET, 0, false) ||
+            !this->ring.submit(1) || !this->ring.reap(&cqe, true))
+            return errno != 0 ? errno : 1;
+        if (cqe.res < 0)
+            return -cqe.res;
+
+        *out_xferd = cqe.res;
+        return 0;
+    }
+
+    ssize_t xferd;
+    do {
+        xferd = ep == EndpointOut ? read(this->ep[slot], buf, size) : write(this->ep[slot], buf, size);
+    } while (xferd < 0 && errno == EINTR);
+
+    if (xferd < 0)
+        return errno;
+
+    *out_xferd = xferd;
+    return 0;
+}
+
+bool FunctionFSTransport::transferFile(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out) {
+    int fd = file->descriptor();
+    if (!this->fixed || !this->enabled || fd < 0 || ep == EndpointInterrupt || !this->ring.updateFile(SlotObject, fd))
+        return false;
+
+    out->rc = 0;
+    out->xferd = 0;
+    out->file_ok = true;
+
+    if (ep == EndpointIn)
+        this->sendFile(offset, size, out);
+    else
+        this->receiveFile(offset, size, out);
+
+    /* The slot holds a reference, which would keep the file open after it's closed */
+    this->ring.updateFile(SlotObject, -1);
+    return true;
+}
+
+unsigned FunctionFSTransport::queueReads(bool endpoint, int half, u64 *pos, u64 offset, u64 size) {
+    unsigned count = 0;
+    for (int i=0; i<FFS_RING_BATCH && *pos < size; i++) {
+        int index = half * FFS_RING_BATCH + i;
+        this->lengths[index] = std::min(size - *pos, FFS_RING_BUFFER_SIZE);
+
+        /* Reads from the endpoint are linked, so a short packet cancels the rest of the half */
+        bool link = endpoint && i + 1 < FFS_RING_BATCH && *pos + this->lengths[index] < size;
+        if (endpoint)
+            this->ring.queue(false, SlotOut, index, this->buffers[index], this->lengths[index], FFS_NO_OFFSET, FFS_TAG_ENDPOINT | index, link);
+        else
+            this->ring.queue(false, SlotObject, index, this->buffers[index], this->lengths[index], offset + *pos, index, false);
+
+        *pos += this->lengths[index];
+        count++;
+    }
+    return count;
+}
+
+/* The buffers are split in two halves that take turns. While one half goes out over the endpoint,
+   the other is read from the file, and both are handed to the kernel with a single submission.
+   The writes of a half are linked to keep them in order on the endpoint, and a half only
+   goes out once the one before it is done */
+void FunctionFSTransport::sendFile(u64 offset, u64 size, MTPFileTransfer *out) {
+    u64 pos = 0;
+    unsigned counts[2];
+    counts[0] = this->queueReads(false, 0, &pos, offset, size);
+
+    unsigned pending = counts[0];
+    for (int half = 0; pending != 0; half ^= 1) {
+        bool failed = !this->ring.submit(pending);
+        for (; pending != 0 && !failed; pending--) {
+            io_uring_cqe cqe;
+            if (!this->ring.reap(&cqe, true)) {
+                failed = true;
+                break;
+            }
+
+            int index = cqe.user_data & 0xFF;
+            if (cqe.user_data & FFS_TAG_ENDPOINT) {
+                if (cqe.res >= 0)
+                    out->xferd += cqe.res;
+                if (cqe.res != (s32) this->lengths[index] && R_SUCCEEDED(out->rc))
+                    out->rc = cqe.res < 0 ? -cqe.res : EIO;
+            } else if (cqe.res != (s32) this->lengths[index]) {
+                /* The length is already promised, so a file that shrank underneath us gets padded out */
+                size_t got = std::max(cqe.res, 0);
+                memset(this->buffers[index] + got, 0, this->lengths[index] - got);
+                out->file_ok = false;
+            }
+        }
+
+        if (failed && R_SUCCEEDED(out->rc))
+            out->rc = errno != 0 ? errno : 1;
+        if (R_FAILED(out->rc) || counts[half] == 0)
+            return;
+
+        for (unsigned i=0; i<counts[half]; i++) {
+            int index = half * FFS_RING_BATCH + i;
+            this->ring.queue(true, SlotIn, index, this->buffers[index], this->lengths[index], FFS_NO_OFFSET, FFS_TAG_ENDPOINT | index, i + 1 < counts[half]);
+        }
+        pending = counts[half];
+
+        counts[half ^ 1] = this->queueReads(false, half ^ 1, &pos, offset, size);
+        pending += counts[half ^ 1];
+    }
+}
+
+/* The reverse: one half is received over the endpoint while the other is written to the file */
+void FunctionFSTransport::receiveFile(u64 offset, u64 size, MTPFileTransfer *out) {
+    u64 pos = 0;
+    size_t received[2 * FFS_RING_BATCH];
+    unsigned counts[2];
+    counts[0] = this->queueReads(true, 0, &pos, offset, size);
+
+    bool ended = false;
+    unsigned pending = counts[0];
+    for (int half = 0; pending != 0; half ^= 1) {
+        bool failed = !this->ring.submit(pending);
+        for (; pending != 0 && !failed; pending--) {
+            io_uring_cqe cqe;
+            if (!this->ring.reap(&cqe, true)) {
+                failed = true;
+                break;
+            }
+
+            int index = cqe.user_data & 0xFF;
+            if (cqe.user_data & FFS_TAG_ENDPOINT) {
+                received[index] = std::max(cqe.res, 0);
+                if (cqe.res < 0 && cqe.res != -ECANCELED && R_SUCCEEDED(out->rc))
+                    out->rc = -cqe.res;
+                if (cqe.res != (s32) this->lengths[index])
+                    ended = true;
+            } else if (cqe.res != (s32) received[index]) {
+                out->file_ok = false;
+            }
+        }
+
+        if (failed && R_SUCCEEDED(out->rc))
+            out->rc = errno != 0 ? errno : 1;
+        if (failed)
+            return;
+
+        pending = 0;
+        for (unsigned i=0; i<counts[half]; i++) {
+            int index = half * FFS_RING_BATCH + i;
+            if (received[index] == 0)
+                continue;
+
+            this->ring.queue(true, SlotObject, index, this->buffers[index], received[index], offset + out->xferd, index, false);
+            out->xferd += received[index];
+            pending++;
+        }
+
+        counts[half ^ 1] = 0;
+        if (!ended && R_SUCCEEDED(out->rc))
+            counts[half ^ 1] = this->queueReads(true, half ^ 1, &pos, offset, size);
+        pending += counts[half ^ 1];
+        counts[half] = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "transport.hpp"
+#include "ring.hpp"
+
+#define FFS_RING_ENTRIES 32
+#define FFS_RING_BATCH 4 // Buffers per half of the pipeline
+#define FFS_RING_BUFFER_SIZE 0x80000UL
+#define FFS_PACKET_SIZE 0x200
+
+/* Registered file slots of the ring */
+enum FunctionFSSlot {
+    SlotIn,
+    SlotOut,
+    SlotInterrupt,
+    SlotObject, // Swapped for whichever file is being transferred
+    SlotCount,
+};
+
+/* A Linux USB gadget function through FunctionFS, for running the responder on a board with a
+   device controller. The function is bound by configfs as usual, and mount is where its
+   functionfs instance is mounted. Every endpoint and file transfer goes through one io_uring */
+class FunctionFSTransport : public MTPTransport {
+    public:
+        FunctionFSTransport(std::string mount);
+        ~FunctionFSTransport();
+
+        bool ready() { return this->ep[SlotIn] >= 0 && this->ep[SlotOut] >= 0 && this->ep[SlotInterrupt] >= 0; }
+
+        Result transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) override;
+        bool transferFile(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out) override;
+        bool waitReady(u64 timeout) override;
+        u32 connection() override { return this->connections; }
+
+    private:
+        int ep0;
+        int ep[SlotObject];
+        int wake; // Gets the control thread out of poll
+
+        std::thread control;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::atomic<bool> enabled;
+        std::atomic<u32> connections; // ENABLE events, each one a new host or a replug
+        bool stopping;
+
+        MTPRing ring;
+        u8 *buffers[2 * FFS_RING_BATCH];
+        size_t lengths[2 * FFS_RING_BATCH];
+        bool fixed; // The buffers and endpoints are registered with the ring
+
+        void handleControl();
+
+        unsigned queueReads(bool endpoint, int half, u64 *pos, u64 offset, u64 size);
+        void sendFile(u64 offset, u64 size, MTPFileTransfer *out);
+        void receiveFile(u64 offset, u64 size, MTPFileTransfer *out);
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "file.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef __SWITCH__
+
+MTPFile::MTPFile() {
+    this->opened = false;
+}
+
+MTPFile::~MTPFile() {
+    this->close();
+}
+
+bool MTPFile::open(const fs::path &path, int mode) {
+    this->close();
+
+    FsFileSystem *fs;
+    char fs_path[FS_MAX_PATH];
+    if (fsdevTranslatePath(path.c_str(), &fs, fs_path) != 0)
+        return false;
+
+    if (mode & FileCreate)
+        fsFsCreateFile(fs, fs_path, 0, 0); // Fails harmlessly when it's already there
+
+    /* Writes can't go past the end of the file without append */
+    int flags = 0;
+    if (mode & FileRead)
+        flags |= FS_OPEN_READ;
+    if (mode & FileWrite)
+        flags |= FS_OPEN_WRITE | FS_OPEN_APPEND;
+
+    if (R_FAILED(fsFsOpenFile(fs, fs_path, flags, &this->file)))
+        return false;
+    this->opened = true;
+
+    if ((mode & FileCreate) && R_FAILED(fsFileSetSize(&this->file, 0))) {
+        this->close();
+        return false;
+    }
+
+    return true;
+}
+
+void MTPFile::close() {
+    if (this->opened)
+        fsFileClose(&this->file);
+    this->opened = false;
+}
+
+bool MTPFile::isOpen() {
+    return this->opened;
+}
+
+s64 MTPFile::read(u64 offset, void *buf, size_t size) {
+    size_t xferd = 0;
+    if (R_FAILED(fsFileRead(&this->file, offset, buf, size, FS_READOPTION_NONE, &xferd)))
+        return -1;
+    return xferd;
+}
+
+s64 MTPFile::write(u64 offset, const void *buf, size_t size) {
+    if (R_FAILED(fsFileWrite(&this->file, offset, buf, size, FS_WRITEOPTION_NONE)))
+        return -1;
+    return size;
+}
+
+u64 MTPFile::size() {
+    s64 size = 0;
+    if (R_FAILED(fsFileGetSize(&this->file, &size)))
+        return 0;
+    return (u64) size;
+}
+
+bool MTPFile::setSize(u64 size) {
+    return R_SUCCEEDED(fsFileSetSize(&this->file, size));
+}
+
+bool MTPFile::reserve(u64 size) {
+    /* FAT has no sparse files, so setting the size allocates every cluster */
+    return this->setSize(size);
+}
+
+#else
+
+MTPFile::MTPFile() {
+    this->fd = -1;
+    this->direct = false;
+}
+
+MTPFile::~MTPFile() {
+    this->close();
+}
+
+bool MTPFile::open(const fs::path &path, int mode) {
+    this->close();
+
+    int flags = O_RDONLY;
+    if ((mode & FileRead) && (mode & FileWrite))
+        flags = O_RDWR;
+    else if (mode & FileWrite)
+        flags = O_WRONLY;
+    if (mode & FileCreate)
+        flags |= O_CREAT | O_TRUNC;
+
+    this->direct = false;
+    if (mode & FileDirect) {
+        this->fd = ::open(path.c_str(), flags | O_DIRECT, 0666);
+        this->direct = (this->fd >= 0);
+    }
+
+    /* Not every filesystem takes O_DIRECT */
+    if (this->fd < 0)
+        this->fd = ::open(path.c_str(), flags, 0666);
+
+    return this->fd >= 0;
+}
+
+void MTPFile::close() {
+    if (this->fd >= 0)
+        ::close(this->fd);
+    this->fd = -1;
+}
+
+bool MTPFile::isOpen() {
+    return this->fd >= 0;
+}
+
+bool MTPFile::aligned(u64 offset, const void *buf, size_t size) {
+    if (!this->direct)
+        return true;
+
+    if ((offset | (uintptr_t) buf | size) % FILE_ALIGNMENT == 0)
+        return true;
+
+    /* Anything unaligned, typically the tail of a file, goes through the page cache from here on */
+    this->direct = false;
+    return fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) & ~O_DIRECT) == 0;
+}
+
+s64 MTPFile::read(u64 offset, void *buf, size_t size) {
+    if (!this->aligned(offset, buf, size))
+        return -1;
+
+    size_t total = 0;
+    while (total < size) {
+        ssize_t xferd = pread(this->fd, (u8 *) buf + total, size - total, offset + total);
+        if (xferd < 0 && errno == EINTR)
+            continue;
+        if (xferd < 0)
+            return -1;
+        if (xferd == 0)
+            break;
+        total += xferd;
+    }
+
+    return total;
+}
+
+s64 MTPFile::write(u64 offset, const void *buf, size_t size) {
+    if (!this->aligned(offset, buf, size))
+        return -1;
+
+    size_t total = 0;
+    while (total < size) {
+        ssize_t xferd = pwrite(this->fd, (const u8 *) buf + total, size - total, offset + total);
+        if (xferd < 0 && errno == EINTR)
+            continue;
+        if (xferd <= 0)
+            return -1;
+        total += xferd;
+    }
+
+    return total;
+}
+
+u64 MTPFile::size() {
+    struct stat file_stat;
+    if (fstat(this->fd, &file_stat) != 0)
+        return 0;
+    return file_stat.st_size;
+}
+
+bool MTPFile::setSize(u64 size) {
+    return ftruncate(this->fd, size) == 0;
+}
+
+bool MTPFile::reserve(u64 size) {
+    return size == 0 || fallocate(this->fd, 0, 0, size) == 0 || errno == EOPNOTSUPP;
+}
+
+int MTPFile::descriptor() {
+    /* Whoever takes the descriptor won't know to keep to the alignment */
+    if (this->direct && !this->aligned(1, NULL, 0))
+        return -1;
+    return this->fd;
+}
+
+#endif
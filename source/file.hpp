@@ -0,0 +1,45 @@
+#pragma once
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "storage.hpp"
+
+#define FILE_ALIGNMENT 0x1000 // What O_DIRECT wants of buffers, offsets and sizes
+
+/* Positional file I/O straight on the filesystem service on console, or on a descriptor elsewhere.
+   There's no buffering at all, so callers are expected to use large, page aligned buffers */
+class MTPFile : public MTPStorageFile {
+    public:
+        MTPFile();
+        ~MTPFile();
+
+        MTPFile(const MTPFile &) = delete;
+        MTPFile &operator=(const MTPFile &) = delete;
+
+        bool open(const fs::path &path, int mode);
+        void close();
+        bool isOpen();
+
+        s64 read(u64 offset, void *buf, size_t size) override;
+        s64 write(u64 offset, const void *buf, size_t size) override;
+
+        u64 size() override;
+        bool setSize(u64 size) override;
+        bool reserve(u64 size) override;
+
+#ifndef __SWITCH__
+        int descriptor() override;
+#endif
+
+    private:
+#ifdef __SWITCH__
+        FsFile file;
+        bool opened;
+#else
+        int fd;
+        bool direct;
+
+        bool aligned(u64 offset, const void *buf, size_t size);
+#endif
+};
@@ -0,0 +1,116 @@
+#include "format.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include "mtp.hpp"
+
+struct FormatExtension {
+    const char *extension;
+    u16 format;
+};
+
+struct FormatMagic {
+    size_t offset;
+    const char *magic;
+    size_t length;
+    u16 format;
+};
+
+static const FormatExtension g_extensions[] = {
+    {".txt", FormatText}, {".log", FormatText}, {".ini", FormatText}, {".cfg", FormatText},
+    {".json", FormatText}, {".md", FormatText}, {".csv", FormatText},
+    {".html", FormatHTML}, {".htm", FormatHTML},
+    {".xml", FormatXML},
+    {".sh", FormatScript}, {".py", FormatScript}, {".lua", FormatScript}, {".js", FormatScript},
+    {".nro", FormatExecutable}, {".nso", FormatExecutable}, {".nsp", FormatExecutable}, {".xci", FormatExecutable},
+    {".nca", FormatExecutable}, {".kip", FormatExecutable}, {".elf", FormatExecutable}, {".exe", FormatExecutable},
+    {".wav", FormatWAV}, {".mp3", FormatMP3}, {".wma", FormatWMA}, {".ogg", FormatOGG}, {".oga", FormatOGG},
+    {".aac", FormatAAC}, {".m4a", FormatAAC}, {".flac", FormatFLAC},
+    {".avi", FormatAVI}, {".mpg", FormatMPEG}, {".mpeg", FormatMPEG}, {".wmv", FormatWMV},
+    {".mp4", FormatMP4}, {".m4v", FormatMP4}, {".3gp", Format3GP}, {".mov", FormatUndefinedVideo},
+    {".mkv", FormatUndefinedVideo}, {".webm", FormatUndefinedVideo},
+    {".jpg", FormatEXIF_JPEG}, {".jpeg", FormatEXIF_JPEG}, {".bmp", FormatBMP}, {".gif", FormatGIF},
+    {".png", FormatPNG}, {".tif", FormatTIFF}, {".tiff", FormatTIFF},
+};
+
+static const FormatMagic g_magics[] = {
+    {0, "\xFF\xD8\xFF", 3, FormatEXIF_JPEG},
+    {0, "\x89PNG\r\n\x1A\n", 8, FormatPNG},
+    {0, "GIF8", 4, FormatGIF},
+    {0, "BM", 2, FormatBMP},
+    {0, "II*\0", 4, FormatTIFF},
+    {0, "MM\0*", 4, FormatTIFF},
+    {8, "WAVE", 4, FormatWAV},
+    {8, "AVI ", 4, FormatAVI},
+    {0, "ID3", 3, FormatMP3},
+    {0, "fLaC", 4, FormatFLAC},
+    {0, "OggS", 4, FormatOGG},
+    {4, "ftyp3g", 6, Format3GP},
+    {4, "ftyp", 4, FormatMP4},
+    {0, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8, FormatUndefinedVideo}, // ASF, can't tell WMA from WMV here
+    {0x10, "NRO0", 4, FormatExecutable},
+    {0, "NSO0", 4, FormatExecutable},
+    {0, "PFS0", 4, FormatExecutable},
+    {0, "\x7F" "ELF", 4, FormatExecutable},
+    {0, "<?xml", 5, FormatXML},
+    {0, "<!DOCTYPE html", 14, FormatHTML},
+    {0, "<html", 5, FormatHTML},
+    {0, "#!", 2, FormatScript},
+};
+
+u16 formatFromExtension(const fs::path &path) {
+    std::string ext = path.extension().string();
+    for (char &c : ext)
+        c = tolower(c);
+
+    for (const FormatExtension &entry : g_extensions) {
+        if (ext == entry.extension)
+            return entry.format;
+    }
+
+    return FormatUndefined;
+}
+
+u16 formatFromMagic(const u8 *data, size_t size) {
+    for (const FormatMagic &entry : g_magics) {
+        if (entry.offset + entry.length <= size && memcmp(data + entry.offset, entry.magic, entry.length) == 0)
+            return entry.format;
+    }
+
+    return FormatUndefined;
+}
+
+u16 formatDetect(MTPStorage *storage, const fs::path &path, bool is_dir) {
+    if (is_dir)
+        return FormatAssociation;
+
+    u16 format = formatFromExtension(path);
+    if (format != FormatUndefined)
+        return format;
+
+    MTPStorageFile *file = storage->open(path, FileRead);
+    if (file == NULL)
+        return FormatUndefined;
+
+    u8 magic[FORMAT_MAGIC_SIZE];
+    s64 size = file->read(0, magic, sizeof(magic));
+    delete file;
+
+    return formatFromMagic(magic, std::max<s64>(size, 0));
+}
+
+const std::vector<u16> &formatsSupported() {
+    static std::vector<u16> formats;
+
+    if (formats.empty()) {
+        formats.push_back(FormatUndefined);
+        formats.push_back(FormatAssociation);
+        for (const FormatExtension &entry : g_extensions) {
+            if (std::find(formats.begin(), formats.end(), entry.format) == formats.end())
+                formats.push_back(entry.format);
+        }
+    }
+
+    return formats;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "platform.hpp"
+#include "storage.hpp"
+
+#define FORMAT_MAGIC_SIZE 0x20 // Bytes formatFromMagic wants to look at
+
+u16 formatFromExtension(const fs::path &path);
+u16 formatFromMagic(const u8 *data, size_t size);
+
+/* The extension decides when it's known, otherwise the first bytes of the file are sniffed */
+u16 formatDetect(MTPStorage *storage, const fs::path &path, bool is_dir);
+
+const std::vector<u16> &formatsSupported();
@@ -0,0 +1,774 @@
+#include "handles.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "memory.hpp"
+#include "stats.hpp"
+
+#define UNWRITTEN ((u32) -1)
+#define DROPPED ((u32) -2)
+
+/* Where each part of a snapshot with that many records starts */
+static u64 _fences(u32 count) { return (count + HANDLE_FENCE_STRIDE - 1) / HANDLE_FENCE_STRIDE; }
+static u64 _recordsAt() { return sizeof(MTPHandleDatabaseHeader); }
+static u64 _indexAt(u32 count) { return _recordsAt() + (u64) count * sizeof(MTPHandleRecord); }
+static u64 _recordFencesAt(u32 count) { return _indexAt(count) + (u64) count * sizeof(MTPHandleIndex); }
+static u64 _namesAt(u32 count) { return _recordFencesAt(count) + _fences(count) * (sizeof(u64) + sizeof(u32)); }
+
+/* What records are sorted by before their name. Everything at the top of a storage is under parent zero */
+static u64 _folder(u32 parent, u32 storage_id) { return parent != 0 ? (u64) parent << 32 : storage_id; }
+static u64 _folder(const MTPHandleRecord &record) { return _folder(record.parent, record.storage_id); }
+
+/* Shorter strings fit in the object itself */
+static size_t _heap(size_t length) { return length > 15 ? length + 1 : 0; }
+
+MTPHandleDatabase::MTPHandleDatabase() {
+    this->journal = NULL;
+    this->snapshot = NULL;
+    this->budget = MEMORY_UNLIMITED;
+    this->reset();
+}
+
+MTPHandleDatabase::~MTPHandleDatabase() {
+    this->close();
+}
+
+void MTPHandleDatabase::reset() {
+    if (this->snapshot != NULL)
+        fclose(this->snapshot);
+    this->snapshot = NULL;
+    this->count = 0;
+    this->names_size = 0;
+    this->record_fences.clear();
+    this->handle_fences.clear();
+
+    this->entries.clear();
+    this->children.clear();
+    this->removed.clear();
+    this->paged.clear();
+    this->runs.clear();
+    this->run_bytes = 0;
+    this->bytes = 0;
+    this->dirty = 0;
+    this->clock = 0;
+    this->evictions = 0;
+    this->journal_entries = 0;
+    this->next_handle = 1; // Object handle of zero is reserved
+    this->next_uid = 1;
+    this->uid_seed = ((u64) time(NULL) << 32) ^ statsNow();
+}
+
+/* Roughly what an entry costs in both maps, going by what libstdc++ allocates for a node */
+size_t MTPHandleDatabase::cost(const Entry &entry) {
+    size_t key = sizeof(u32) + (entry.parent == 0 ? sizeof(u32) : 0) + entry.name.size();
+    return sizeof(std::pair<const u32, Resident>) + sizeof(void *) + _heap(entry.name.size()) +
+        sizeof(std::pair<const std::string, u32>) + 2 * sizeof(void *) + _heap(key);
+}
+
+std::string MTPHandleDatabase::key(u32 parent, u32 storage_id, const std::string &name) {
+    std::string key((const char *) &parent, sizeof(parent));
+    if (parent == 0)
+        key.append((const char *) &storage_id, sizeof(storage_id));
+    return key + name;
+}
+
+void MTPHandleDatabase::put(u32 handle, Entry entry, bool dirty) {
+    this->erase(handle);
+
+    this->bytes += cost(entry);
+    this->dirty += dirty;
+    this->children[this->key(entry.parent, entry.storage_id, entry.name)] = handle;
+    this->next_handle = std::max(this->next_handle, handle + 1);
+    this->next_uid = std::max(this->next_uid, entry.uid + 1);
+    this->entries[handle] = {std::move(entry), ++this->clock, dirty};
+}
+
+void MTPHandleDatabase::erase(u32 handle) {
+    auto it = this->entries.find(handle);
+    if (it == this->entries.end())
+        return;
+
+    const Entry &entry = it->second.entry;
+    auto child = this->children.find(this->key(entry.parent, entry.storage_id, entry.name));
+    if (child != this->children.end() && child->second == handle)
+        this->children.erase(child);
+
+    this->bytes -= cost(entry);
+    this->dirty -= it->second.dirty;
+    this->entries.erase(it);
+}
+
+void MTPHandleDatabase::log(u32 handle, const Entry *entry) {
+    if (this->journal == NULL)
+        return;
+
+    u8 kind = entry != NULL ? JournalPut : JournalRemove;
+    fwrite(&kind, sizeof(kind), 1, this->journal);
+
+    if (entry == NULL) {
+        fwrite(&handle, sizeof(handle), 1, this->journal);
+    } else {
+        MTPHandleRecord record = {handle, entry->parent, entry->storage_id, 0, (u32) entry->name.size(),
+            entry->size, entry->mtime, entry->uid};
+        fwrite(&record, sizeof(record), 1, this->journal);
+        fwrite(entry->name.data(), 1, entry->name.size(), this->journal);
+    }
+
+    this->journal_entries++;
+}
+
+MTPHandleDatabase::Resident *MTPHandleDatabase::resident(u32 handle) {
+    auto it = this->entries.find(handle);
+    if (it == this->entries.end())
+        return NULL;
+
+    it->second.used = ++this->clock;
+    return &it->second;
+}
+
+void MTPHandleDatabase::keepToBudget() {
+    if (this->budget != MEMORY_UNLIMITED && this->memory() > this->budget)
+        this->evictions += this->trim(this->budget - this->budget / 4);
+}
+
+bool MTPHandleDatabase::readRecords(u32 first, u32 count, std::vector<MTPHandleRecord> *records, std::string *names) {
+    records->resize(count);
+    if (count == 0)
+        return true;
+
+    if (fseeko(this->snapshot, _recordsAt() + (u64) first * sizeof(MTPHandleRecord), SEEK_SET) != 0 ||
+            fread(records->data(), sizeof(MTPHandleRecord), count, this->snapshot) != count)
+        return false;
+
+    if (names == NULL)
+        return true;
+
+    /* Names are pooled in record order, so a run of records has its names in one piece */
+    u64 start = records->front().name_offset, end = start;
+    for (MTPHandleRecord &record : *records) {
+        if (record.name_offset < end || (u64) record.name_offset + record.name_length > this->names_size)
+            return false;
+        end = (u64) record.name_offset + record.name_length;
+    }
+
+    names->resize(end - start);
+    if (fseeko(this->snapshot, _namesAt(this->count) + start, SEEK_SET) != 0 ||
+            fread(&(*names)[0], 1, names->size(), this->snapshot) != names->size())
+        return false;
+
+    for (MTPHandleRecord &record : *records)
+        record.name_offset -= start;
+    return true;
+}
+
+void MTPHandleDatabase::pageIn(const MTPHandleRecord &record, std::string name) {
+    /* Whatever's in memory is newer than the snapshot */
+    if (this->removed.count(record.handle) != 0 || this->entries.count(record.handle) != 0 ||
+            this->children.count(this->key(record.parent, record.storage_id, name)) != 0)
+        return;
+
+    this->put(record.handle, {record.parent, record.storage_id, std::move(name), record.size, record.mtime, record.uid}, false);
+}
+
+bool MTPHandleDatabase::pageHandle(u32 handle) {
+    if (this->snapshot == NULL || this->removed.count(handle) != 0)
+        return false;
+
+    auto fence = std::upper_bound(this->handle_fences.begin(), this->handle_fences.end(), handle);
+    if (fence == this->handle_fences.begin())
+        return false;
+
+    u32 first = (u32) (fence - this->handle_fences.begin() - 1) * HANDLE_FENCE_STRIDE;
+    u32 count = std::min<u32>(HANDLE_FENCE_STRIDE, this->count - first);
+    MTPHandleIndex index[HANDLE_FENCE_STRIDE];
+    if (fseeko(this->snapshot, _indexAt(this->count) + (u64) first * sizeof(MTPHandleIndex), SEEK_SET) != 0 ||
+            fread(index, sizeof(MTPHandleIndex), count, this->snapshot) != count)
+        return false;
+
+    MTPHandleIndex *it = std::lower_bound(index, index + count, handle,
+        [](const MTPHandleIndex &index, u32 handle) { return index.handle < handle; });
+
+    std::vector<MTPHandleRecord> records;
+    std::string names;
+    if (it == index + count || it->handle != handle || it->record >= this->count ||
+            !this->readRecords(it->record, 1, &records, &names) || records[0].handle != handle)
+        return false;
+
+    this->pageIn(records[0], std::move(names));
+    return this->entries.count(handle) != 0;
+}
+
+void MTPHandleDatabase::pageChild(u32 parent, u32 storage_id, const std::string &name) {
+    std::string folder = this->key(parent, storage_id, "");
+    if (this->snapshot == NULL || this->paged.count(folder) != 0)
+        return;
+
+    std::vector<MTPHandleRecord> records;
+    std::string names;
+    auto run = this->runs.find(folder);
+    if (run == this->runs.end()) {
+        /* The folder's records start in the block before the first fence at or past it,
+           and end before the first fence past it. One block from each end narrows that down */
+        u64 wanted = _folder(parent, storage_id);
+        auto below = std::lower_bound(this->record_fences.begin(), this->record_fences.end(), wanted);
+        auto above = std::upper_bound(this->record_fences.begin(), this->record_fences.end(), wanted);
+        u32 start = (u32) std::max<ptrdiff_t>(below - this->record_fences.begin() - 1, 0) * HANDLE_FENCE_STRIDE;
+        u32 end = (u32) std::min<u64>((u64) (above - this->record_fences.begin()) * HANDLE_FENCE_STRIDE, this->count);
+
+        if (!this->readRecords(start, std::min<u32>(HANDLE_FENCE_STRIDE, end - start), &records, NULL))
+            return;
+        u32 skipped = 0;
+        while (skipped < records.size() && _folder(records[skipped]) < wanted)
+            skipped++;
+        start += skipped;
+
+        if (start < end) {
+            u32 last = end - start > HANDLE_FENCE_STRIDE ? end - HANDLE_FENCE_STRIDE : start;
+            if (!this->readRecords(last, end - last, &records, NULL))
+                return;
+            u32 kept = records.size();
+            while (kept > 0 && _folder(records[kept - 1]) > wanted)
+                kept--;
+            end = last + kept;
+        }
+
+        if (end <= start || end - start <= HANDLE_PAGE_RUN) {
+            if (!this->readRecords(start, end > start ? end - start : 0, &records, &names))
+                return;
+            for (MTPHandleRecord &record : records)
+                this->pageIn(record, names.substr(record.name_offset, record.name_length));
+            this->paged.insert(folder);
+            return;
+        }
+
+        /* Too many to keep around. Read through once for every HANDLE_FENCE_STRIDE'th name,
+           so after that only the block the name would be in is read */
+        Run sampled = {start, end, {}};
+        for (u32 first = start; first < end; first += HANDLE_PAGE_RUN) {
+            if (!this->readRecords(first, std::min<u32>(HANDLE_PAGE_RUN, end - first), &records, &names))
+                return;
+            for (size_t i=0; i<records.size(); i += HANDLE_FENCE_STRIDE)
+                sampled.names.push_back(names.substr(records[i].name_offset, records[i].name_length));
+        }
+
+        this->run_bytes += sizeof(std::pair<const std::string, Run>) + 2 * sizeof(void *);
+        for (std::string &sample : sampled.names)
+            this->run_bytes += sizeof(std::string) + _heap(sample.size());
+        run = this->runs.emplace(folder, std::move(sampled)).first;
+    }
+
+    auto sample = std::upper_bound(run->second.names.begin(), run->second.names.end(), name);
+    if (sample == run->second.names.begin())
+        return;
+
+    u32 first = run->second.start + (u32) (sample - run->second.names.begin() - 1) * HANDLE_FENCE_STRIDE;
+    if (!this->readRecords(first, std::min<u32>(HANDLE_FENCE_STRIDE, run->second.end - first), &records, &names))
+        return;
+    for (MTPHandleRecord &record : records) {
+        if (names.compare(record.name_offset, record.name_length, name) == 0) {
+            this->pageIn(record, name);
+            return;
+        }
+    }
+}
+
+const MTPHandleDatabase::Entry *MTPHandleDatabase::get(u32 handle) {
+    Resident *resident = this->resident(handle);
+    if (resident == NULL && this->pageHandle(handle))
+        resident = this->resident(handle);
+    if (resident == NULL)
+        return NULL;
+
+    this->keepToBudget();
+    return &resident->entry;
+}
+
+u32 MTPHandleDatabase::find(u32 parent, u32 storage_id, const std::string &name) {
+    std::string key = this->key(parent, storage_id, name);
+    auto it = this->children.find(key);
+    if (it == this->children.end()) {
+        this->pageChild(parent, storage_id, name);
+        it = this->children.find(key);
+        if (it == this->children.end())
+            return 0;
+    }
+
+    u32 handle = it->second;
+    this->resident(handle);
+    this->keepToBudget();
+    return handle;
+}
+
+u32 MTPHandleDatabase::insert(u32 parent, u32 storage_id, const std::string &name) {
+    u32 handle = this->next_handle;
+    this->put(handle, {parent, storage_id, name, 0, 0, this->next_uid}, true);
+    this->log(handle, &this->entries[handle].entry);
+    this->keepToBudget();
+    return handle;
+}
+
+void MTPHandleDatabase::move(u32 handle, u32 parent, u32 storage_id, const std::string &name) {
+    const Entry *entry = this->get(handle);
+    if (entry == NULL)
+        return;
+    Entry moved = *entry;
+
+    /* Whatever was already at the destination got replaced */
+    u32 replaced = this->find(parent, storage_id, name);
+    if (replaced != 0 && replaced != handle)
+        this->remove(replaced);
+
+    moved.parent = parent;
+    moved.storage_id = storage_id;
+    moved.name = name;
+    this->put(handle, std::move(moved), true);
+    this->log(handle, &this->entries[handle].entry);
+    this->keepToBudget();
+}
+
+void MTPHandleDatabase::reserve(size_t count) {
+    this->entries.reserve(this->entries.size() + count);
+    this->children.reserve(this->children.size() + count);
+}
+
+void MTPHandleDatabase::update(u32 handle, u64 size, s64 mtime) {
+    if (this->get(handle) == NULL)
+        return;
+
+    Resident &resident = this->entries[handle];
+    if (resident.entry.size == size && resident.entry.mtime == mtime)
+        return;
+
+    resident.entry.size = size;
+    resident.entry.mtime = mtime;
+    if (!resident.dirty) {
+        resident.dirty = true;
+        this->dirty++;
+    }
+    this->log(handle, &resident.entry);
+}
+
+void MTPHandleDatabase::remove(u32 handle) {
+    if (this->get(handle) == NULL)
+        return;
+
+    /* Anything below it is left dangling and dropped when the snapshot is written */
+    this->erase(handle);
+    if (this->snapshot != NULL)
+        this->removed.insert(handle);
+    this->log(handle, NULL);
+}
+
+void MTPHandleDatabase::uid(u32 handle, u64 *low, u64 *high) {
+    const Entry *entry = this->get(handle);
+    *low = entry != NULL ? entry->uid : 0;
+    *high = entry != NULL ? this->uid_seed : 0;
+}
+
+void MTPHandleDatabase::flush() {
+    if (this->journal != NULL)
+        fflush(this->journal);
+}
+
+void MTPHandleDatabase::setBudget(u64 budget) {
+    this->budget = budget;
+    this->keepToBudget();
+}
+
+size_t MTPHandleDatabase::memory() {
+    size_t buckets = this->entries.bucket_count() + this->children.bucket_count() +
+        this->removed.bucket_count() + this->paged.bucket_count() + this->runs.bucket_count();
+    return this->bytes + this->run_bytes + buckets * sizeof(void *) +
+        this->removed.size() * (sizeof(u32) + sizeof(void *)) +
+        this->paged.size() * (sizeof(std::string) + 2 * sizeof(void *)) +
+        this->record_fences.capacity() * sizeof(u64) + this->handle_fences.capacity() * sizeof(u32);
+}
+
+size_t MTPHandleDatabase::trim(u64 target) {
+    size_t evicted = 0;
+    for (int pass = 0; pass < 2 && this->memory() > target; pass++) {
+        /* What's left is what changed since the snapshot, which has to be folded in before it can go */
+        if (pass != 0 && ((this->dirty == 0 && this->removed.empty()) || !this->fold()))
+            break;
+        if (this->dirty == this->entries.size())
+            continue;
+
+        size_t per_entry = std::max<size_t>(this->bytes / this->entries.size(), 1);
+        u64 clock = this->clock;
+        auto handles = memoryColdest(this->entries, (this->memory() - target + per_entry - 1) / per_entry,
+            [clock](const Resident &resident) { return resident.dirty || resident.used == clock ? U64_MAX : resident.used; });
+
+        for (u32 handle : handles) {
+            /* The one just asked for is left alone, its caller still has it */
+            Resident &cold = this->entries[handle];
+            if (cold.dirty || cold.used == clock)
+                continue;
+
+            /* Its folder isn't all in memory any more */
+            this->paged.erase(this->key(cold.entry.parent, cold.entry.storage_id, ""));
+            this->erase(handle);
+            evicted++;
+        }
+
+        if (this->entries.bucket_count() > 4 * this->entries.size() + 64) {
+            this->entries.rehash(0);
+            this->children.rehash(0);
+            this->paged.rehash(0);
+        }
+    }
+
+    return evicted;
+}
+
+size_t MTPHandleDatabase::takeEvictions() {
+    size_t evictions = this->evictions;
+    this->evictions = 0;
+    return evictions;
+}
+
+bool MTPHandleDatabase::loadLegacy(FILE *f, const MTPHandleDatabaseHeader &header) {
+    std::vector<MTPHandleRecord> records(header.count);
+    std::string names(header.names_size, '\0');
+    if (fread(records.data(), sizeof(MTPHandleRecord), records.size(), f) != records.size() ||
+            fread(&names[0], 1, names.size(), f) != names.size())
+        return false;
+
+    /* Dirty, so it's all written out again in the new layout */
+    for (MTPHandleRecord &record : records) {
+        if ((u64) record.name_offset + record.name_length > names.size())
+            continue;
+        this->put(record.handle, {record.parent, record.storage_id, names.substr(record.name_offset, record.name_length),
+            record.size, record.mtime, record.uid}, true);
+    }
+    return true;
+}
+
+bool MTPHandleDatabase::loadSnapshot(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+
+    MTPHandleDatabaseHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == HANDLE_DB_MAGIC;
+
+    if (ok && header.version == HANDLE_DB_LEGACY_VERSION) {
+        ok = this->loadLegacy(f, header);
+    } else if (ok) {
+        /* Only the fences are read in, the rest is looked up where it is */
+        std::error_code ec;
+        u64 fences = _fences(header.count);
+        ok = header.version == HANDLE_DB_VERSION && fs::file_size(path, ec) >= _namesAt(header.count) + header.names_size && !ec;
+        if (ok) {
+            this->record_fences.resize(fences);
+            this->handle_fences.resize(fences);
+            ok = fseeko(f, _recordFencesAt(header.count), SEEK_SET) == 0 &&
+                fread(this->record_fences.data(), sizeof(u64), fences, f) == fences &&
+                fread(this->handle_fences.data(), sizeof(u32), fences, f) == fences;
+        }
+
+        if (ok) {
+            this->snapshot = f;
+            this->count = header.count;
+            this->names_size = header.names_size;
+        } else {
+            this->record_fences.clear();
+            this->handle_fences.clear();
+        }
+    }
+
+    if (f != this->snapshot)
+        fclose(f);
+    if (!ok)
+        return false;
+
+    /* Removed handles are never handed out again, even though their records are gone */
+    this->next_handle = std::max(this->next_handle, header.next_handle);
+    this->next_uid = std::max(this->next_uid, header.next_uid);
+    this->uid_seed = header.uid_seed;
+    return true;
+}
+
+void MTPHandleDatabase::replayJournal(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return;
+
+    /* A torn entry at the end is what a power cut leaves behind, everything before it still counts */
+    u8 kind;
+    while (fread(&kind, sizeof(kind), 1, f) == 1) {
+        if (kind == JournalRemove) {
+            u32 handle;
+            if (fread(&handle, sizeof(handle), 1, f) != 1)
+                break;
+            this->erase(handle);
+            if (this->snapshot != NULL)
+                this->removed.insert(handle);
+            this->next_handle = std::max(this->next_handle, handle + 1);
+        } else if (kind == JournalPut) {
+            MTPHandleRecord record;
+            if (fread(&record, sizeof(record), 1, f) != 1 || record.name_length > 0x1000)
+                break;
+
+            std::string name(record.name_length, '\0');
+            if (fread(&name[0], 1, name.size(), f) != name.size())
+                break;
+            this->put(record.handle, {record.parent, record.storage_id, name, record.size, record.mtime, record.uid}, true);
+        } else {
+            break;
+        }
+
+        this->journal_entries++;
+    }
+
+    fclose(f);
+}
+
+bool MTPHandleDatabase::writeSnapshot(const std::string &path) {
+    /* Every handle that goes in and its parent, to find the ones whose parent is gone. Only what
+       the snapshot has and memory doesn't needs reading for that, without the names */
+    struct Live {
+        u32 handle;
+        u32 parent;
+        u32 record; // Where it ended up, once written
+    };
+    std::vector<Live> live;
+    live.reserve(this->count + this->entries.size());
+
+    std::vector<MTPHandleRecord> records;
+    for (u32 first = 0; first < this->count; first += HANDLE_PAGE_RUN) {
+        if (!this->readRecords(first, std::min<u32>(HANDLE_PAGE_RUN, this->count - first), &records, NULL))
+            return false;
+        for (MTPHandleRecord &record : records)
+            if (this->removed.count(record.handle) == 0 && this->entries.count(record.handle) == 0)
+                live.push_back({record.handle, record.parent, UNWRITTEN});
+    }
+    for (auto &entry : this->entries)
+        live.push_back({entry.first, entry.second.entry.parent, UNWRITTEN});
+
+    std::sort(live.begin(), live.end(), [](const Live &a, const Live &b) { return a.handle < b.handle; });
+    auto find = [&live](u32 handle) -> Live * {
+        auto it = std::lower_bound(live.begin(), live.end(), handle, [](const Live &live, u32 handle) { return live.handle < handle; });
+        return it != live.end() && it->handle == handle ? &*it : NULL;
+    };
+
+    /* Records whose parent is gone are dropped, along with everything below them */
+    bool dropped = true;
+    while (dropped) {
+        dropped = false;
+        for (Live &object : live) {
+            if (object.record == DROPPED || object.parent == 0)
+                continue;
+            Live *parent = find(object.parent);
+            if (parent == NULL || parent->record == DROPPED) {
+                object.record = DROPPED;
+                dropped = true;
+            }
+        }
+    }
+
+    /* Memory is merged into the snapshot as it's read back, both in the order records are written in */
+    std::vector<std::pair<u32, const Entry *>> in_memory;
+    in_memory.reserve(this->entries.size());
+    for (auto &entry : this->entries)
+        if (find(entry.first)->record != DROPPED)
+            in_memory.emplace_back(entry.first, &entry.second.entry);
+    auto before = [](u64 folder_a, const std::string &a, u64 folder_b, const std::string &b) {
+        return folder_a != folder_b ? folder_a < folder_b : a < b;
+    };
+    std::sort(in_memory.begin(), in_memory.end(), [&before](auto &a, auto &b) {
+        return before(_folder(a.second->parent, a.second->storage_id), a.second->name, _folder(b.second->parent, b.second->storage_id), b.second->name);
+    });
+
+    /* Written aside and renamed over, so there's always one whole snapshot on the card.
+       Names are pooled in a file of their own until the records are all out */
+    std::string temp = path + ".tmp", temp_names = path + ".names";
+    FILE *f = fopen(temp.c_str(), "wb");
+    FILE *names = fopen(temp_names.c_str(), "wb+");
+    if (f == NULL || names == NULL) {
+        if (f != NULL)
+            fclose(f);
+        if (names != NULL)
+            fclose(names);
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, 0x10000);
+    setvbuf(names, NULL, _IOFBF, 0x10000);
+
+    bool ok = fseeko(f, _recordsAt(), SEEK_SET) == 0;
+    u32 written = 0;
+    u64 names_size = 0;
+    std::vector<u64> record_fences;
+    std::vector<u32> handle_fences;
+    auto write = [&](u32 handle, const Entry &entry) {
+        MTPHandleRecord record = {handle, entry.parent, entry.storage_id, (u32) names_size, (u32) entry.name.size(),
+            entry.size, entry.mtime, entry.uid};
+        ok = ok && fwrite(&record, sizeof(record), 1, f) == 1 &&
+            fwrite(entry.name.data(), 1, entry.name.size(), names) == entry.name.size();
+        if (written % HANDLE_FENCE_STRIDE == 0)
+            record_fences.push_back(_folder(record));
+        find(handle)->record = written++;
+        names_size += entry.name.size();
+    };
+
+    size_t next = 0;
+    std::string block_names;
+    for (u32 first = 0; ok && first < this->count; first += HANDLE_PAGE_RUN) {
+        ok = this->readRecords(first, std::min<u32>(HANDLE_PAGE_RUN, this->count - first), &records, &block_names);
+        for (size_t i=0; ok && i<records.size(); i++) {
+            MTPHandleRecord &record = records[i];
+            Live *object = find(record.handle);
+            if (object == NULL || object->record != UNWRITTEN || this->entries.count(record.handle) != 0)
+                continue;
+
+            Entry entry = {record.parent, record.storage_id, block_names.substr(record.name_offset, record.name_length),
+                record.size, record.mtime, record.uid};
+            while (next < in_memory.size() && !before(_folder(entry.parent, entry.storage_id), entry.name,
+                    _folder(in_memory[next].second->parent, in_memory[next].second->storage_id), in_memory[next].second->name)) {
+                write(in_memory[next].first, *in_memory[next].second);
+                next++;
+            }
+            write(record.handle, entry);
+        }
+    }
+    for (; ok && next < in_memory.size(); next++)
+        write(in_memory[next].first, *in_memory[next].second);
+
+    u32 indexed = 0;
+    for (Live &object : live) {
+        if (!ok || object.record == UNWRITTEN || object.record == DROPPED)
+            continue;
+        MTPHandleIndex index = {object.handle, object.record};
+        ok = fwrite(&index, sizeof(index), 1, f) == 1;
+        if (indexed % HANDLE_FENCE_STRIDE == 0)
+            handle_fences.push_back(object.handle);
+        indexed++;
+    }
+
+    ok = ok && indexed == written && (written == 0 ||
+        (fwrite(record_fences.data(), sizeof(u64), record_fences.size(), f) == record_fences.size() &&
+        fwrite(handle_fences.data(), sizeof(u32), handle_fences.size(), f) == handle_fences.size())) &&
+        fflush(names) == 0 && fseeko(names, 0, SEEK_SET) == 0;
+
+    u8 buf[0x4000];
+    size_t read;
+    while (ok && (read = fread(buf, 1, sizeof(buf), names)) != 0)
+        ok = fwrite(buf, 1, read, f) == read;
+
+    MTPHandleDatabaseHeader header = {HANDLE_DB_MAGIC, HANDLE_DB_VERSION, written, this->next_handle,
+        this->next_uid, this->uid_seed, names_size};
+    ok = ok && fseeko(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    fclose(names);
+
+    std::error_code ec;
+    fs::remove(temp_names, ec);
+    if (!ok) {
+        fs::remove(temp, ec);
+        return false;
+    }
+
+    /* The card may not rename over a file that's open */
+    if (this->snapshot != NULL)
+        fclose(this->snapshot);
+    fs::rename(temp, path, ec);
+    this->snapshot = fopen(path.c_str(), "rb");
+    if (ec.value() != 0 || this->snapshot == NULL) {
+        /* Back to the old one, if it's still there */
+        if (this->snapshot == NULL) {
+            this->count = 0;
+            this->record_fences.clear();
+            this->handle_fences.clear();
+        }
+        return false;
+    }
+
+    this->count = written;
+    this->names_size = names_size;
+    this->record_fences = std::move(record_fences);
+    this->handle_fences = std::move(handle_fences);
+    this->removed.clear();
+    this->runs.clear();
+    this->run_bytes = 0;
+
+    /* Everything in memory is as written now. Whatever got dropped goes too,
+       besides the entry just asked for, its caller still has it */
+    std::vector<u32> orphans;
+    for (auto &entry : this->entries) {
+        entry.second.dirty = false;
+        if (find(entry.first)->record == DROPPED && entry.second.used != this->clock)
+            orphans.push_back(entry.first);
+    }
+    this->dirty = 0;
+    for (u32 handle : orphans)
+        this->erase(handle);
+    return true;
+}
+
+bool MTPHandleDatabase::fold() {
+    if (this->journal == NULL || !this->writeSnapshot(this->directory + "/handles.db"))
+        return false;
+
+    this->journal = freopen((this->directory + "/handles.log").c_str(), "wb", this->journal);
+    if (this->journal != NULL)
+        setvbuf(this->journal, NULL, _IOFBF, 0x10000);
+    this->journal_entries = 0;
+    return true;
+}
+
+bool MTPHandleDatabase::open(std::string directory) {
+    this->close();
+    this->reset();
+    this->directory = directory;
+
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+
+    std::string snapshot = directory + "/handles.db", journal = directory + "/handles.log";
+    this->loadSnapshot(snapshot);
+    this->replayJournal(journal);
+
+    /* The journal only ever grows while open, so it's folded in now and started over. So is a snapshot in the old layout */
+    if ((this->journal_entries != 0 || this->dirty != 0 || !fs::exists(snapshot, ec)) && !this->writeSnapshot(snapshot))
+        return false;
+
+    this->journal = fopen(journal.c_str(), "wb");
+    if (this->journal == NULL)
+        return false;
+    setvbuf(this->journal, NULL, _IOFBF, 0x10000);
+    this->journal_entries = 0;
+
+    this->keepToBudget();
+    return true;
+}
+
+void MTPHandleDatabase::close() {
+    if (this->journal != NULL) {
+        fclose(this->journal);
+        this->journal = NULL;
+
+        if ((this->journal_entries != 0 || this->dirty != 0) && this->writeSnapshot(this->directory + "/handles.db")) {
+            FILE *f = fopen((this->directory + "/handles.log").c_str(), "wb");
+            if (f != NULL)
+                fclose(f);
+        }
+    }
+
+    /* What's still in memory stays usable, the rest goes with the snapshot */
+    if (this->snapshot != NULL)
+        fclose(this->snapshot);
+    this->snapshot = NULL;
+    this->count = 0;
+    this->record_fences.clear();
+    this->handle_fences.clear();
+    this->removed.clear();
+    this->paged.clear();
+    this->runs.clear();
+    this->run_bytes = 0;
+
+    this->directory.clear();
+    this->journal_entries = 0;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "platform.hpp"
+
+#define HANDLE_DB_MAGIC 0x44485054 // "TPHD"
+#define HANDLE_DB_VERSION 2
+#define HANDLE_DB_LEGACY_VERSION 1 // Records sorted by handle, then the name pool. Read once and rewritten
+
+#define HANDLE_FENCE_STRIDE 64 // Snapshot records per fence kept in memory
+#define HANDLE_PAGE_RUN 0x1000 // Folders with more entries than this are searched on the card, not paged in whole
+
+/* Snapshot header. After it come the records sorted by parent and name, the handle index sorted by handle,
+   the fences of both and then the name pool */
+struct PACKED MTPHandleDatabaseHeader {
+    u32 magic;
+    u32 version;
+    u32 count;
+    u32 next_handle;
+    u64 next_uid;
+    u64 uid_seed; // Random per database, the high half of every UID it hands out
+    u64 names_size;
+};
+
+/* Fixed size, so a snapshot can be binary searched where it is */
+struct PACKED MTPHandleRecord {
+    u32 handle;
+    u32 parent; // Zero for the top of a storage
+    u32 storage_id;
+    u32 name_offset; // Into the name pool, or the journal entry
+    u32 name_length;
+    u64 size;
+    s64 mtime;
+    u64 uid;
+};
+
+/* Where a handle's record is */
+struct PACKED MTPHandleIndex {
+    u32 handle;
+    u32 record;
+};
+
+/* Journal entries start with one of these. JournalPut is followed by a record and its name,
+   JournalRemove by the handle alone */
+enum MTPHandleJournalKind : u8 {
+    JournalPut = 1,
+    JournalRemove,
+};
+
+/* Handles and persistent UIDs that survive restarts. Objects are stored as a name under a parent handle,
+   so moving a folder is one record. Changes go to an append-only journal, which is folded into the
+   snapshot when the database is opened or closed. Handles and UIDs are never reused.
+
+   Only entries in use are kept in memory, everything else stays in the snapshot on the card and is read
+   back on a miss: by handle through the index, or a whole folder at a time by parent. Entries changed since
+   the snapshot can't be dropped, so once they're what's over budget they're folded into a new snapshot */
+class MTPHandleDatabase {
+    public:
+        struct Entry {
+            u32 parent;
+            u32 storage_id;
+            std::string name;
+            u64 size; // Zero until the object has been looked at
+            s64 mtime;
+            u64 uid;
+        };
+
+        MTPHandleDatabase();
+        ~MTPHandleDatabase();
+
+        /* Starts over from what's in directory. Without a writable one it works the same, only nothing is kept
+           and nothing can be dropped from memory */
+        bool open(std::string directory);
+        void close();
+        bool isOpen() { return !this->directory.empty(); }
+
+        /* Pointers stay good until the next call that can read from the snapshot or insert */
+        const Entry *get(u32 handle);
+        u32 find(u32 parent, u32 storage_id, const std::string &name);
+
+        u32 insert(u32 parent, u32 storage_id, const std::string &name);
+        void move(u32 handle, u32 parent, u32 storage_id, const std::string &name);
+        void update(u32 handle, u64 size, s64 mtime);
+        void remove(u32 handle);
+        void reserve(size_t count); // Room for that many more, ahead of inserting a batch
+
+        void uid(u32 handle, u64 *low, u64 *high);
+
+        void flush(); // Pushes the journal out, once per transaction
+
+        void setBudget(u64 budget); // Kept to as entries are read in, not only when trimmed
+        size_t memory();
+        size_t trim(u64 target); // Drops the entries used longest ago until memory() is down to target
+        size_t takeEvictions(); // Entries dropped since the last call, by trim or to keep to the budget
+
+    private:
+        struct Resident {
+            Entry entry;
+            u64 used;
+            bool dirty; // Not in the snapshot as it is
+        };
+
+        /* Where a big folder's records are in the snapshot, with the name of every HANDLE_FENCE_STRIDE'th one */
+        struct Run {
+            u32 start;
+            u32 end;
+            std::vector<std::string> names;
+        };
+
+        std::string directory;
+        FILE *journal;
+        size_t journal_entries;
+
+        std::unordered_map<u32, Resident> entries;
+        std::unordered_map<std::string, u32> children; // Keyed by parent, storage and name
+        std::unordered_set<u32> removed; // Still in the snapshot, gone since
+        std::unordered_set<std::string> paged; // Folders whose every snapshot entry is in memory, keyed by parent and storage
+        std::unordered_map<std::string, Run> runs; // Folders too big for that, likewise
+        size_t run_bytes;
+        size_t bytes; // What entries and children hold, besides their buckets
+        size_t dirty;
+        u64 clock;
+        u64 budget;
+        size_t evictions;
+        u32 next_handle;
+        u64 next_uid;
+        u64 uid_seed;
+
+        FILE *snapshot;
+        u32 count; // Records in it
+        u64 names_size;
+        std::vector<u64> record_fences; // Folder of every HANDLE_FENCE_STRIDE'th record
+        std::vector<u32> handle_fences; // Likewise for the handle index
+
+        void reset();
+        static size_t cost(const Entry &entry);
+        std::string key(u32 parent, u32 storage_id, const std::string &name);
+        void put(u32 handle, Entry entry, bool dirty);
+        void erase(u32 handle);
+        void log(u32 handle, const Entry *entry);
+        Resident *resident(u32 handle);
+        void keepToBudget();
+
+        bool readRecords(u32 first, u32 count, std::vector<MTPHandleRecord> *records, std::string *names);
+        void pageIn(const MTPHandleRecord &record, std::string name);
+        bool pageHandle(u32 handle);
+        void pageChild(u32 parent, u32 storage_id, const std::string &name);
+
+        bool loadSnapshot(const std::string &path);
+        bool loadLegacy(FILE *f, const MTPHandleDatabaseHeader &header);
+        void replayJournal(const std::string &path);
+        bool writeSnapshot(const std::string &path);
+        bool fold(); // Writes the snapshot while open and starts the journal over
+};
@@ -0,0 +1,576 @@
+#include "hash.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "memory.hpp"
+
+#if defined(__ARM_FEATURE_CRC32) || defined(__ARM_NEON)
+#include <arm_acle.h>
+#include <arm_neon.h>
+#endif
+
+/* Everything here reads its input little endian, which both the console and any host we build for are */
+static inline u32 _read32(const u8 *p) {
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u64 _read64(const u8 *p) {
+    u64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u64 _rotl64(u64 x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+static inline void _writeBE(u8 *p, u64 value, size_t size) {
+    for (size_t i=0; i<size; i++)
+        p[i] = value >> (8 * (size - 1 - i));
+}
+
+/* CRC32C. The Cortex-A57 has an instruction for it, eight bytes at a time */
+class MTPCRC32CHasher : public MTPHasher {
+    public:
+        MTPCRC32CHasher() : crc(0xFFFFFFFF) { }
+
+        void update(const u8 *data, size_t size) override {
+#ifdef __ARM_FEATURE_CRC32
+            for (; size >= 8; data += 8, size -= 8)
+                this->crc = __crc32cd(this->crc, _read64(data));
+            for (; size > 0; data++, size--)
+                this->crc = __crc32cb(this->crc, *data);
+#else
+            static u32 table[256];
+            if (table[1] == 0) {
+                for (u32 i=0; i<256; i++) {
+                    u32 crc = i;
+                    for (int j=0; j<8; j++)
+                        crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+                    table[i] = crc;
+                }
+            }
+
+            for (; size > 0; data++, size--)
+                this->crc = table[(this->crc ^ *data) & 0xFF] ^ (this->crc >> 8);
+#endif
+        }
+
+        size_t finish(u8 *digest) override {
+            _writeBE(digest, ~this->crc, 4);
+            return 4;
+        }
+
+    private:
+        u32 crc;
+};
+
+static const u32 g_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* SHA-256, with the ARMv8 crypto extensions doing four rounds per instruction pair */
+class MTPSHA256Hasher : public MTPHasher {
+    public:
+        MTPSHA256Hasher() : length(0), buffered(0) {
+            static const u32 initial[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+            };
+            memcpy(this->state, initial, sizeof(initial));
+        }
+
+        void update(const u8 *data, size_t size) override {
+            this->length += size;
+
+            if (this->buffered != 0) {
+                size_t chunk = std::min(size, sizeof(this->buffer) - this->buffered);
+                memcpy(this->buffer + this->buffered, data, chunk);
+                this->buffered += chunk;
+                data += chunk;
+                size -= chunk;
+
+                if (this->buffered < sizeof(this->buffer))
+                    return;
+                this->blocks(this->buffer, 1);
+                this->buffered = 0;
+            }
+
+            this->blocks(data, size / 64);
+            memcpy(this->buffer, data + size / 64 * 64, size % 64);
+            this->buffered = size % 64;
+        }
+
+        size_t finish(u8 *digest) override {
+            u8 padding[72] = {0x80};
+            size_t pad = (this->buffered < 56 ? 56 : 120) - this->buffered;
+            _writeBE(padding + pad, this->length * 8, 8);
+            this->update(padding, pad + 8);
+
+            for (int i=0; i<8; i++)
+                _writeBE(digest + 4 * i, this->state[i], 4);
+            return 32;
+        }
+
+    private:
+        u32 state[8];
+        u64 length;
+        u8 buffer[64];
+        size_t buffered;
+
+        void blocks(const u8 *data, size_t count);
+};
+
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+void MTPSHA256Hasher::blocks(const u8 *data, size_t count) {
+    uint32x4_t abcd = vld1q_u32(this->state), efgh = vld1q_u32(this->state + 4);
+
+    for (; count > 0; data += 64, count--) {
+        uint32x4_t abcd_saved = abcd, efgh_saved = efgh;
+
+        uint32x4_t msg[4];
+        for (int i=0; i<4; i++)
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+        /* The schedule is worked out one group of four words ahead of the rounds using it */
+        for (int i=0; i<16; i++) {
+            uint32x4_t words = vaddq_u32(msg[i & 3], vld1q_u32(g_sha256_k + 4 * i));
+            if (i < 12)
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]), msg[(i + 2) & 3], msg[(i + 3) & 3]);
+
+            uint32x4_t abcd_before = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, words);
+            efgh = vsha256h2q_u32(efgh, abcd_before, words);
+        }
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        efgh = vaddq_u32(efgh, efgh_saved);
+    }
+
+    vst1q_u32(this->state, abcd);
+    vst1q_u32(this->state + 4, efgh);
+}
+#else
+static inline u32 _rotr(u32 x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void MTPSHA256Hasher::blocks(const u8 *data, size_t count) {
+    for (; count > 0; data += 64, count--) {
+        u32 w[64];
+        for (int i=0; i<16; i++)
+            w[i] = __builtin_bswap32(_read32(data + 4 * i));
+        for (int i=16; i<64; i++) {
+            u32 s0 = _rotr(w[i - 15], 7) ^ _rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            u32 s1 = _rotr(w[i - 2], 17) ^ _rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        u32 a = this->state[0], b = this->state[1], c = this->state[2], d = this->state[3];
+        u32 e = this->state[4], f = this->state[5], g = this->state[6], h = this->state[7];
+        for (int i=0; i<64; i++) {
+            u32 t1 = h + (_rotr(e, 6) ^ _rotr(e, 11) ^ _rotr(e, 25)) + ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+            u32 t2 = (_rotr(a, 2) ^ _rotr(a, 13) ^ _rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        this->state[0] += a; this->state[1] += b; this->state[2] += c; this->state[3] += d;
+        this->state[4] += e; this->state[5] += f; this->state[6] += g; this->state[7] += h;
+    }
+}
+#endif
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_SECRET_SIZE 192
+#define XXH_STRIPE_LEN 64
+#define XXH_STRIPES_PER_BLOCK ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+#define XXH_SHORT_MAX 240 // Inputs up to this long are hashed in one go, without the accumulators
+
+static const u8 g_xxh3_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline u64 _mulFold(u64 a, u64 b) {
+    unsigned __int128 product = (unsigned __int128) a * b;
+    return (u64) product ^ (u64) (product >> 64);
+}
+
+static inline u64 _xxh64Avalanche(u64 h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static inline u64 _xxh3Avalanche(u64 h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+static inline u64 _mix16(const u8 *input, const u8 *secret) {
+    return _mulFold(_read64(input) ^ _read64(secret), _read64(input + 8) ^ _read64(secret + 8));
+}
+
+static u64 _xxh3Short(const u8 *input, size_t length) {
+    const u8 *secret = g_xxh3_secret;
+
+    if (length == 0)
+        return _xxh64Avalanche(_read64(secret + 56) ^ _read64(secret + 64));
+
+    if (length <= 3) {
+        u32 combined = ((u32) input[0] << 16) | ((u32) input[length >> 1] << 24) | input[length - 1] | ((u32) length << 8);
+        return _xxh64Avalanche(combined ^ (u64) (_read32(secret) ^ _read32(secret + 4)));
+    }
+
+    if (length <= 8) {
+        u64 keyed = ((u64) _read32(input + length - 4) + ((u64) _read32(input) << 32)) ^ (_read64(secret + 8) ^ _read64(secret + 16));
+        keyed ^= _rotl64(keyed, 49) ^ _rotl64(keyed, 24);
+        keyed *= 0x9FB21C651E98DF25ULL;
+        keyed ^= (keyed >> 35) + length;
+        keyed *= 0x9FB21C651E98DF25ULL;
+        return keyed ^ (keyed >> 28);
+    }
+
+    if (length <= 16) {
+        u64 low = _read64(input) ^ (_read64(secret + 24) ^ _read64(secret + 32));
+        u64 high = _read64(input + length - 8) ^ (_read64(secret + 40) ^ _read64(secret + 48));
+        return _xxh3Avalanche(length + __builtin_bswap64(low) + high + _mulFold(low, high));
+    }
+
+    u64 acc = length * XXH_PRIME64_1;
+    if (length <= 128) {
+        if (length > 32) {
+            if (length > 64) {
+                if (length > 96) {
+                    acc += _mix16(input + 48, secret + 96);
+                    acc += _mix16(input + length - 64, secret + 112);
+                }
+                acc += _mix16(input + 32, secret + 64);
+                acc += _mix16(input + length - 48, secret + 80);
+            }
+            acc += _mix16(input + 16, secret + 32);
+            acc += _mix16(input + length - 32, secret + 48);
+        }
+        acc += _mix16(input, secret);
+        acc += _mix16(input + length - 16, secret + 16);
+        return _xxh3Avalanche(acc);
+    }
+
+    for (int i=0; i<8; i++)
+        acc += _mix16(input + 16 * i, secret + 16 * i);
+    acc = _xxh3Avalanche(acc);
+
+    for (size_t i=8; i<length / 16; i++)
+        acc += _mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+    acc += _mix16(input + length - 16, secret + 136 - 17);
+    return _xxh3Avalanche(acc);
+}
+
+/* One 64 byte stripe into the eight accumulators. This is where nearly all the time goes */
+static inline void _xxh3Accumulate(u64 *acc, const u8 *input, const u8 *secret) {
+#ifdef __ARM_NEON
+    uint64x2_t *lanes = (uint64x2_t *) acc;
+    for (int i=0; i<4; i++) {
+        uint64x2_t data = vreinterpretq_u64_u8(vld1q_u8(input + 16 * i));
+        uint64x2_t keyed = veorq_u64(data, vreinterpretq_u64_u8(vld1q_u8(secret + 16 * i)));
+        lanes[i] = vaddq_u64(lanes[i], vextq_u64(data, data, 1));
+        lanes[i] = vmlal_u32(lanes[i], vmovn_u64(keyed), vshrn_n_u64(keyed, 32));
+    }
+#else
+    for (int i=0; i<8; i++) {
+        u64 data = _read64(input + 8 * i);
+        u64 keyed = data ^ _read64(secret + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (u32) keyed * (keyed >> 32);
+    }
+#endif
+}
+
+static inline void _xxh3Scramble(u64 *acc) {
+    const u8 *secret = g_xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN;
+    for (int i=0; i<8; i++)
+        acc[i] = (acc[i] ^ (acc[i] >> 47) ^ _read64(secret + 8 * i)) * XXH_PRIME32_1;
+}
+
+/* XXH3-64, streamed. Input is held back until more arrives, because the last stripe is treated
+   differently and an input of XXH_SHORT_MAX or less is hashed another way altogether */
+class MTPXXH3Hasher : public MTPHasher {
+    public:
+        MTPXXH3Hasher() : length(0), buffered(0), stripes(0) {
+            static const u64 initial[8] = {
+                XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3, XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1,
+            };
+            memcpy(this->acc, initial, sizeof(initial));
+        }
+
+        void update(const u8 *data, size_t size) override {
+            this->length += size;
+
+            if (this->buffered + size <= sizeof(this->buffer)) {
+                memcpy(this->buffer + this->buffered, data, size);
+                this->buffered += size;
+                return;
+            }
+
+            if (this->buffered != 0) {
+                size_t chunk = sizeof(this->buffer) - this->buffered;
+                memcpy(this->buffer + this->buffered, data, chunk);
+                data += chunk;
+                size -= chunk;
+                this->consume(this->acc, &this->stripes, this->buffer, sizeof(this->buffer) / XXH_STRIPE_LEN);
+                this->buffered = 0;
+            }
+
+            if (size > sizeof(this->buffer)) {
+                for (; size > sizeof(this->buffer); data += sizeof(this->buffer), size -= sizeof(this->buffer))
+                    this->consume(this->acc, &this->stripes, data, sizeof(this->buffer) / XXH_STRIPE_LEN);
+
+                /* The last stripe may need to be made up from what was already consumed */
+                memcpy(this->buffer + sizeof(this->buffer) - XXH_STRIPE_LEN, data - XXH_STRIPE_LEN, XXH_STRIPE_LEN);
+            }
+
+            memcpy(this->buffer, data, size);
+            this->buffered = size;
+        }
+
+        size_t finish(u8 *digest) override {
+            u64 hash;
+            if (this->length <= XXH_SHORT_MAX) {
+                hash = _xxh3Short(this->buffer, this->length);
+            } else {
+                u64 acc[8];
+                size_t stripes = this->stripes;
+                memcpy(acc, this->acc, sizeof(acc));
+
+                u8 last[XXH_STRIPE_LEN];
+                const u8 *last_stripe;
+                if (this->buffered >= XXH_STRIPE_LEN) {
+                    this->consume(acc, &stripes, this->buffer, (this->buffered - 1) / XXH_STRIPE_LEN);
+                    last_stripe = this->buffer + this->buffered - XXH_STRIPE_LEN;
+                } else {
+                    size_t catchup = XXH_STRIPE_LEN - this->buffered;
+                    memcpy(last, this->buffer + sizeof(this->buffer) - catchup, catchup);
+                    memcpy(last + catchup, this->buffer, this->buffered);
+                    last_stripe = last;
+                }
+                _xxh3Accumulate(acc, last_stripe, g_xxh3_secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+
+                hash = this->length * XXH_PRIME64_1;
+                for (int i=0; i<4; i++)
+                    hash += _mulFold(acc[2 * i] ^ _read64(g_xxh3_secret + 11 + 16 * i), acc[2 * i + 1] ^ _read64(g_xxh3_secret + 19 + 16 * i));
+                hash = _xxh3Avalanche(hash);
+            }
+
+            _writeBE(digest, hash, 8);
+            return 8;
+        }
+
+    private:
+        alignas(16) u64 acc[8];
+        u64 length;
+        u8 buffer[256]; // Whole stripes, and more than XXH_SHORT_MAX
+        size_t buffered;
+        size_t stripes; // Into the current block
+
+        void consume(u64 *acc, size_t *stripes, const u8 *data, size_t count) {
+            for (size_t i=0; i<count; i++) {
+                _xxh3Accumulate(acc, data + XXH_STRIPE_LEN * i, g_xxh3_secret + 8 * *stripes);
+                if (++*stripes == XXH_STRIPES_PER_BLOCK) {
+                    _xxh3Scramble(acc);
+                    *stripes = 0;
+                }
+            }
+        }
+};
+
+MTPHasher *MTPHasher::create(u16 algorithm) {
+    switch (algorithm) {
+        case HashCRC32C:
+            return new MTPCRC32CHasher();
+        case HashSHA256:
+            return new MTPSHA256Hasher();
+        case HashXXH3:
+            return new MTPXXH3Hasher();
+    }
+
+    return NULL;
+}
+
+size_t hashDigestLength(u16 algorithm) {
+    switch (algorithm) {
+        case HashCRC32C:
+            return 4;
+        case HashSHA256:
+            return 32;
+        case HashXXH3:
+            return 8;
+    }
+
+    return 0;
+}
+
+u64 hashXXH3(const u8 *data, size_t size) {
+    if (size <= XXH_SHORT_MAX)
+        return _xxh3Short(data, size);
+
+    MTPXXH3Hasher hasher;
+    u8 digest[8];
+    hasher.update(data, size);
+    hasher.finish(digest);
+    return __builtin_bswap64(_read64(digest));
+}
+
+MTPHashCache::MTPHashCache() {
+    this->log = NULL;
+    this->clock = 0;
+    this->trimmed = false;
+}
+
+MTPHashCache::~MTPHashCache() {
+    this->close();
+}
+
+std::string MTPHashCache::key(u64 uid, u16 algorithm, u64 offset, u64 length) {
+    u64 parts[3] = {uid, offset, length};
+    std::string key((const char *) parts, sizeof(parts));
+    return key.append((const char *) &algorithm, sizeof(algorithm));
+}
+
+void MTPHashCache::open(std::string directory) {
+    this->close();
+
+    std::string path = directory + "/hashes.log";
+    FILE *f = fopen(path.c_str(), "rb");
+    size_t count = 0;
+    if (f != NULL) {
+        u32 header[2];
+        std::vector<MTPHashRecord> loaded;
+        std::unordered_map<u64, size_t> forgotten; // Uid to the last record that dropped it
+        MTPHashRecord record;
+        if (fread(header, sizeof(header), 1, f) == 1 && header[0] == HASH_CACHE_MAGIC && header[1] == HASH_CACHE_VERSION) {
+            for (; fread(&record, sizeof(record), 1, f) == 1; count++) {
+                if (record.algorithm == HASH_RECORD_FORGET)
+                    forgotten[record.uid] = count;
+                loaded.push_back(record);
+            }
+        }
+        fclose(f);
+
+        for (size_t i=0; i<loaded.size(); i++) {
+            auto it = forgotten.find(loaded[i].uid);
+            if (loaded[i].algorithm != HASH_RECORD_FORGET && (it == forgotten.end() || it->second < i))
+                this->records[this->key(loaded[i].uid, loaded[i].algorithm, loaded[i].offset, loaded[i].length)] = {loaded[i], 0};
+        }
+    }
+
+    /* Superseded records pile up at the end, so the file is rewritten once they outnumber the rest */
+    bool rewrite = f == NULL || count > 2 * this->records.size();
+    this->log = fopen(path.c_str(), rewrite ? "wb" : "ab");
+    if (this->log == NULL || !rewrite)
+        return;
+
+    u32 header[2] = {HASH_CACHE_MAGIC, HASH_CACHE_VERSION};
+    fwrite(header, sizeof(header), 1, this->log);
+    for (auto &record : this->records)
+        fwrite(&record.second.record, sizeof(record.second.record), 1, this->log);
+    fflush(this->log);
+}
+
+void MTPHashCache::close() {
+    if (this->log != NULL)
+        fclose(this->log);
+    this->log = NULL;
+    this->records.clear();
+    this->trimmed = false;
+}
+
+bool MTPHashCache::lookup(u64 uid, u64 size, s64 mtime, u16 algorithm, u64 offset, u64 length, u8 *digest) {
+    auto it = this->records.find(this->key(uid, algorithm, offset, length));
+    if (it == this->records.end() || it->second.record.size != size || it->second.record.mtime != mtime)
+        return false;
+
+    it->second.used = ++this->clock;
+    memcpy(digest, it->second.record.digest, hashDigestLength(algorithm));
+    return true;
+}
+
+void MTPHashCache::store(u64 uid, u64 size, s64 mtime, u16 algorithm, u64 offset, u64 length, const u8 *digest) {
+    MTPHashRecord record = {uid, size, mtime, offset, length, algorithm, {}};
+    memcpy(record.digest, digest, hashDigestLength(algorithm));
+    this->records[this->key(uid, algorithm, offset, length)] = {record, ++this->clock};
+
+    if (this->log != NULL) {
+        fwrite(&record, sizeof(record), 1, this->log);
+        fflush(this->log);
+    }
+}
+
+/* Records are keyed by range, so every one of them has to be looked at. There's only as many as fit the budget */
+void MTPHashCache::forget(u64 uid) {
+    bool found = false;
+    for (auto it = this->records.begin(); it != this->records.end();) {
+        if (it->second.record.uid == uid) {
+            it = this->records.erase(it);
+            found = true;
+        } else {
+            ++it;
+        }
+    }
+
+    /* Otherwise the log would bring the old digests back next time. Not needed if it never had any */
+    if (this->log != NULL && (found || this->trimmed)) {
+        MTPHashRecord record = {uid, 0, 0, 0, 0, HASH_RECORD_FORGET, {}};
+        fwrite(&record, sizeof(record), 1, this->log);
+        fflush(this->log);
+    }
+}
+
+size_t MTPHashCache::memory() {
+    return this->records.bucket_count() * sizeof(void *) +
+        this->records.size() * (sizeof(std::pair<std::string, Entry>) + sizeof(void *));
+}
+
+size_t MTPHashCache::trim(u64 target) {
+    size_t per_record = sizeof(std::pair<std::string, Entry>) + sizeof(void *);
+    size_t memory = this->memory();
+    if (memory <= target)
+        return 0;
+
+    auto keys = memoryColdest(this->records, (memory - target + per_record - 1) / per_record,
+        [](const Entry &entry) { return entry.used; });
+    for (auto &key : keys)
+        this->records.erase(key);
+    this->trimmed = this->trimmed || !keys.empty();
+    return keys.size();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+
+#include "platform.hpp"
+
+#define HASH_CACHE_MAGIC 0x48485054 // "TPHH"
+#define HASH_CACHE_VERSION 1
+#define HASH_DIGEST_MAX 32
+#define HASH_RECORD_FORGET 0 // Algorithm of a log record that drops every earlier one for its uid
+
+enum MTPHashAlgorithm : u16 {
+    HashCRC32C = 1,
+    HashSHA256,
+    HashXXH3, // The 64 bit variant, unseeded
+};
+
+/* Digests come out in the order their reference tools print them, so CRC32C and XXH3 are big endian */
+class MTPHasher {
+    public:
+        virtual ~MTPHasher() { }
+
+        virtual void update(const u8 *data, size_t size) = 0;
+        virtual size_t finish(u8 *digest) = 0; // Returns the digest length
+
+        static MTPHasher *create(u16 algorithm); // NULL for an algorithm we don't have
+};
+
+/* On-SD record, appended every time a digest is worked out. A later record for the same key wins */
+struct PACKED MTPHashRecord {
+    u64 uid; // Persistent UID of the object, so renames keep the digest
+    u64 size;
+    s64 mtime;
+    u64 offset;
+    u64 length;
+    u16 algorithm;
+    u8 digest[HASH_DIGEST_MAX];
+};
+
+/* Digests of whole objects and ranges of them, kept as long as the size and mtime they were
+   worked out for still hold */
+class MTPHashCache {
+    public:
+        MTPHashCache();
+        ~MTPHashCache();
+
+        void open(std::string directory);
+        void close();
+
+        bool lookup(u64 uid, u64 size, s64 mtime, u16 algorithm, u64 offset, u64 length, u8 *digest);
+        void store(u64 uid, u64 size, s64 mtime, u16 algorithm, u64 offset, u64 length, const u8 *digest);
+        void forget(u64 uid); // The object was rewritten, maybe too quickly for its mtime to change
+
+        size_t memory();
+        size_t trim(u64 target); // Drops the least recently used records until memory() is down to target, they're still in the log
+
+    private:
+        struct Entry {
+            MTPHashRecord record;
+            u64 used;
+        };
+
+        std::unordered_map<std::string, Entry> records;
+        FILE *log;
+        u64 clock;
+        bool trimmed; // Some of what's in the log isn't in records any more
+
+        std::string key(u64 uid, u16 algorithm, u64 offset, u64 length);
+};
+
+size_t hashDigestLength(u16 algorithm);
+u64 hashXXH3(const u8 *data, size_t size);
@@ -4,6 +4,8 @@
 #include <switch.h>
 
 #include "mtp.hpp"
+#include "usb.hpp"
+#include "capture.hpp"
 
 int main(int argc, char **argv) {
     //consoleInit(NULL);
@@ -15,7 +17,9 @@ int main(int argc, char **argv) {
     printf("Tuphlos: An MTP Responder for the Nintendo Switch\n");
     consoleUpdate(NULL);
 
-    MTPResponder responder;
+    USBTransport usb;
+    CaptureTransport capture(&usb);
+    MTPResponder responder(&capture);
     responder.insertStorage(0x00010001, "sdmc", u"SD Card");
 
     FsFileSystem fs;
@@ -30,6 +34,23 @@ int main(int argc, char **argv) {
         if (kDown & KEY_PLUS)
             break;
 
+        if (kDown & KEY_MINUS) {
+            responder.stats.print(stdout);
+            responder.stats.dump("sdmc:/tuphlos_stats.txt");
+            responder.memoryReport().print(stdout);
+            consoleUpdate(NULL);
+        }
+
+        if (kDown & KEY_Y) {
+            if (capture.active()) {
+                capture.stop();
+                printf("Capture saved to sdmc:/tuphlos.cap\n");
+            } else if (capture.start("sdmc:/tuphlos.cap")) {
+                printf("Capturing to sdmc:/tuphlos.cap\n");
+            }
+            consoleUpdate(NULL);
+        }
+
         responder.loop();
     }
 
@@ -0,0 +1,50 @@
+#include "memory.hpp"
+
+#include "content.hpp"
+
+static const char *_memoryNames[MemorySubsystems] = {
+    "paths", "handles", "hashes", "thumbnails", "contents", "buffers",
+};
+
+MTPMemoryAccountant::MTPMemoryAccountant() {
+    for (u16 i=0; i<MemorySubsystems; i++)
+        this->subsystems[i] = {i, 0, MEMORY_UNLIMITED, 0, 0};
+
+    this->subsystems[MemoryObjectPaths].budget = MEMORY_PATH_BUDGET;
+    this->subsystems[MemoryHandles].budget = MEMORY_HANDLE_BUDGET;
+    this->subsystems[MemoryHashes].budget = MEMORY_HASH_BUDGET;
+    this->subsystems[MemoryThumbnails].budget = MEMORY_THUMBNAIL_BUDGET;
+    this->subsystems[MemoryContents].budget = CONTENT_CACHE_BUDGET;
+}
+
+void MTPMemoryAccountant::setBudget(u16 subsystem, u64 budget) {
+    if (subsystem < MemorySubsystems)
+        this->subsystems[subsystem].budget = budget;
+}
+
+bool MTPMemoryAccountant::update(u16 subsystem, u64 used) {
+    MTPMemoryUsage *usage = &this->subsystems[subsystem];
+    usage->used = used;
+    usage->peak = std::max(usage->peak, used);
+    return used > usage->budget;
+}
+
+u64 MTPMemoryAccountant::total() const {
+    u64 total = 0;
+    for (auto &usage : this->subsystems)
+        total += usage.used;
+    return total;
+}
+
+void MTPMemoryAccountant::print(FILE *f) const {
+    fprintf(f, "%-10s %12s %12s %12s %10s\n", "MEMORY", "USED(B)", "BUDGET(B)", "PEAK(B)", "EVICTED");
+
+    for (auto &usage : this->subsystems) {
+        if (usage.budget == MEMORY_UNLIMITED)
+            fprintf(f, "%-10s %12lu %12s %12lu %10lu\n", _memoryNames[usage.subsystem], usage.used, "-", usage.peak, usage.evictions);
+        else
+            fprintf(f, "%-10s %12lu %12lu %12lu %10lu\n", _memoryNames[usage.subsystem], usage.used, usage.budget, usage.peak, usage.evictions);
+    }
+
+    fprintf(f, "%-10s %12lu\n", "total", this->total());
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdio.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "platform.hpp"
+
+#define MEMORY_UNLIMITED ((u64) -1) // Reported, never trimmed
+
+/* Defaults, in bytes. What the applet heap has to spare on a card with hundreds of thousands of files */
+#define MEMORY_PATH_BUDGET 0x400000UL
+#define MEMORY_HANDLE_BUDGET 0x400000UL
+#define MEMORY_HASH_BUDGET 0x100000UL
+#define MEMORY_THUMBNAIL_BUDGET 0x40000UL
+
+enum MTPMemorySubsystem : u16 {
+    MemoryObjectPaths, // Paths cached for handles, all of them worked out again from the database on a miss
+    MemoryHandles, // The handle database entries in use, the rest is read back from the snapshot on the SD card
+    MemoryHashes,
+    MemoryThumbnails,
+    MemoryContents,
+    MemoryBuffers, // Transfer buffers and the pools of whatever has been started, fixed once they're there
+    MemorySubsystems,
+};
+
+/* Laid out so it can be sent to the host as-is through PropertyTuphlosMemory */
+struct PACKED MTPMemoryUsage {
+    u16 subsystem;
+    u64 used;
+    u64 budget;
+    u64 peak;
+    u64 evictions; // Entries dropped to get back under budget
+};
+
+/* Keeps track of what every subsystem holds against what it's allowed. Each one counts its own bytes
+   as it goes, so checking them after a transaction costs nothing until one goes over */
+class MTPMemoryAccountant {
+    public:
+        MTPMemoryAccountant();
+
+        void setBudget(u16 subsystem, u64 budget);
+        u64 budget(u16 subsystem) const { return this->subsystems[subsystem].budget; }
+
+        /* Where to trim back to once over budget, so it isn't trimmed again a few entries later */
+        u64 target(u16 subsystem) const { return this->budget(subsystem) - this->budget(subsystem) / 4; }
+
+        /* True if that's more than the budget */
+        bool update(u16 subsystem, u64 used);
+        void evicted(u16 subsystem, u64 count) { this->subsystems[subsystem].evictions += count; }
+
+        const MTPMemoryUsage *usage() const { return this->subsystems; }
+        u64 total() const;
+
+        void print(FILE *f) const;
+
+    private:
+        MTPMemoryUsage subsystems[MemorySubsystems];
+};
+
+/* Keys of the count entries of map that were used longest ago, going by the stamp stamp() finds in each value */
+template <class Map, class Stamp>
+std::vector<typename Map::key_type> memoryColdest(const Map &map, size_t count, Stamp stamp) {
+    std::vector<std::pair<u64, typename Map::key_type>> entries;
+    entries.reserve(map.size());
+    for (auto &entry : map)
+        entries.emplace_back(stamp(entry.second), entry.first);
+
+    count = std::min(count, entries.size());
+    auto by_stamp = [](auto &a, auto &b) { return a.first < b.first; };
+    if (count < entries.size())
+        std::nth_element(entries.begin(), entries.begin() + count, entries.end(), by_stamp);
+
+    std::vector<typename Map::key_type> keys;
+    keys.reserve(count);
+    for (size_t i=0; i<count; i++)
+        keys.push_back(std::move(entries[i].second));
+    return keys;
+}
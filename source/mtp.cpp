@@ -1,305 +1,50 @@
 #include "mtp.hpp"
+#include "format.hpp"
 
 #include <cstring>
 #include <ctime>
 #include <iomanip>
-#include <fstream>
 
 #include <malloc.h>
 #include <stdio.h>
-#include <sys/statvfs.h>
-#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
 
+#ifdef NDEBUG
+#define DEBUG_PRINT(x, ...) (0 ? (void) printf(x __VA_OPT__(,) __VA_ARGS__) : (void) 0)
+#else
 #define DEBUG_PRINT(x, ...) (printf("[DEBUG] %s:%d | " x "\n", __PRETTY_FUNCTION__, __LINE__ __VA_OPT__(,) __VA_ARGS__))
+#endif
 
 #define BUF_SIZE 0x200UL
+#define OBJECT_BUFFER_SIZE 0x100000UL // Multiple of BUF_SIZE
+#define READY_TIMEOUT_NS 50000000UL // How long loop waits for a host, or an operation from it, before handing control back
 
-UsbDsInterface *g_interface;
-UsbDsEndpoint *g_endpoint_in, *g_endpoint_out, *g_endpoint_interr;
-
-bool g_initialized = false;
-
-/* Lots of low level USB stuff taken from libnx and Atmosphere's tma_usb_comms */
-
-static Result _usbCommsInterfaceInit1x() {
-    Result rc = 0;
-
-    u8 mtp_index;
-    usbDsAddUsbStringDescriptor(&mtp_index, "MTP");
-
-    struct usb_interface_descriptor interface_descriptor = {
-        .bLength = USB_DT_INTERFACE_SIZE,
-        .bDescriptorType = USB_DT_INTERFACE,
-        .bInterfaceNumber = 4,
-        .bNumEndpoints = 3,
-        .bInterfaceClass = 6,
-        .bInterfaceSubClass = 1,
-        .bInterfaceProtocol = 1,
-        .iInterface = mtp_index,
-    };
-
-    struct usb_endpoint_descriptor endpoint_descriptor_in = {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = USB_ENDPOINT_IN,
-        .bmAttributes = USB_TRANSFER_TYPE_BULK,
-        .wMaxPacketSize = 0x200,
-    };
-
-    struct usb_endpoint_descriptor endpoint_descriptor_out = {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = USB_ENDPOINT_OUT,
-        .bmAttributes = USB_TRANSFER_TYPE_BULK,
-        .wMaxPacketSize = 0x200,
-    };
-
-    struct usb_endpoint_descriptor endpoint_descriptor_interr = {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = USB_ENDPOINT_IN,
-        .bmAttributes = USB_TRANSFER_TYPE_INTERRUPT,
-        .wMaxPacketSize = 0x1c,
-        .bInterval = 6,
-    };
-
-    if (R_FAILED(rc)) return rc;
-
-    //Setup interface.
-    rc = usbDsGetDsInterface(&g_interface, &interface_descriptor, "usb");
-    if (R_FAILED(rc)) return rc;
-
-    //Setup endpoints.
-    rc = usbDsInterface_GetDsEndpoint(g_interface, &g_endpoint_in, &endpoint_descriptor_in);//device->host
-    if (R_FAILED(rc)) return rc;
-
-    rc = usbDsInterface_GetDsEndpoint(g_interface, &g_endpoint_out, &endpoint_descriptor_out);//host->device
-    if (R_FAILED(rc)) return rc;
-
-    rc = usbDsInterface_GetDsEndpoint(g_interface, &g_endpoint_interr, &endpoint_descriptor_interr);
-
-    return rc;
-}
-
-static Result _usbCommsInterfaceInit5x() {
-    Result rc = 0;
-    
-    u8 iManufacturer, iProduct, iSerialNumber;
-    static const u16 supported_langs[1] = {0x0409};
-    // Send language descriptor
-    rc = usbDsAddUsbLanguageStringDescriptor(NULL, supported_langs, sizeof(supported_langs)/sizeof(u16));
-    // Send manufacturer
-    if (R_SUCCEEDED(rc)) rc = usbDsAddUsbStringDescriptor(&iManufacturer, "Nintendo");
-    // Send product
-    if (R_SUCCEEDED(rc)) rc = usbDsAddUsbStringDescriptor(&iProduct, "Nintendo Switch");
-    // Send serial number
-    if (R_SUCCEEDED(rc)) rc = usbDsAddUsbStringDescriptor(&iSerialNumber, "SerialNumber");
-
-    // Send device descriptors
-    struct usb_device_descriptor device_descriptor = {
-        .bLength = USB_DT_DEVICE_SIZE,
-        .bDescriptorType = USB_DT_DEVICE,
-        .bcdUSB = 0x0110,
-        .bDeviceClass = 0x00,
-        .bDeviceSubClass = 0x00,
-        .bDeviceProtocol = 0x00,
-        .bMaxPacketSize0 = 0x40,
-        .idVendor = 0x057e,
-        .idProduct = 0x3000,
-        .bcdDevice = 0x0100,
-        .iManufacturer = iManufacturer,
-        .iProduct = iProduct,
-        .iSerialNumber = iSerialNumber,
-        .bNumConfigurations = 0x01
-    };
-    // Full Speed is USB 1.1
-    if (R_SUCCEEDED(rc)) rc = usbDsSetUsbDeviceDescriptor(UsbDeviceSpeed_Full, &device_descriptor);
-    
-    // High Speed is USB 2.0
-    device_descriptor.bcdUSB = 0x0200;
-    if (R_SUCCEEDED(rc)) rc = usbDsSetUsbDeviceDescriptor(UsbDeviceSpeed_High, &device_descriptor);
-    
-    // Super Speed is USB 3.0
-    device_descriptor.bcdUSB = 0x0300;
-    // Upgrade packet size to 512
-    device_descriptor.bMaxPacketSize0 = 0x09;
-    if (R_SUCCEEDED(rc)) rc = usbDsSetUsbDeviceDescriptor(UsbDeviceSpeed_Super, &device_descriptor);
-    
-    // Define Binary Object Store
-    u8 bos[0x16] = {
-        0x05, // .bLength
-        USB_DT_BOS, // .bDescriptorType
-        0x16, 0x00, // .wTotalLength
-        0x02, // .bNumDeviceCaps
-        
-        // USB 2.0
-        0x07, // .bLength
-        USB_DT_DEVICE_CAPABILITY, // .bDescriptorType
-        0x02, // .bDevCapabilityType
-        0x02, 0x00, 0x00, 0x00, // dev_capability_data
-        
-        // USB 3.0
-        0x0A, // .bLength
-        USB_DT_DEVICE_CAPABILITY, // .bDescriptorType
-        0x03, // .bDevCapabilityType
-        0x00, 0x0E, 0x00, 0x03, 0x00, 0x00, 0x00
-    };
-    if (R_SUCCEEDED(rc)) rc = usbDsSetBinaryObjectStore(bos, sizeof(bos));
-    
-    if (R_FAILED(rc)) return rc;
-
-    u8 mtp_index;
-    usbDsAddUsbStringDescriptor(&mtp_index, "MTP");
-    
-    struct usb_interface_descriptor interface_descriptor = {
-        .bLength = USB_DT_INTERFACE_SIZE,
-        .bDescriptorType = USB_DT_INTERFACE,
-        .bInterfaceNumber = 4,
-        .bNumEndpoints = 3,
-        .bInterfaceClass = 6,
-        .bInterfaceSubClass = 1,
-        .bInterfaceProtocol = 1,
-        .iInterface = mtp_index,
-    };
-
-    struct usb_endpoint_descriptor endpoint_descriptor_in = {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = USB_ENDPOINT_IN,
-        .bmAttributes = USB_TRANSFER_TYPE_BULK,
-        .wMaxPacketSize = 0x40,
-    };
-
-    struct usb_endpoint_descriptor endpoint_descriptor_out = {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = USB_ENDPOINT_OUT,
-        .bmAttributes = USB_TRANSFER_TYPE_BULK,
-        .wMaxPacketSize = 0x40,
-    };
-
-    struct usb_endpoint_descriptor endpoint_descriptor_interr = {
-        .bLength = USB_DT_ENDPOINT_SIZE,
-        .bDescriptorType = USB_DT_ENDPOINT,
-        .bEndpointAddress = USB_ENDPOINT_IN,
-        .bmAttributes = USB_TRANSFER_TYPE_INTERRUPT,
-        .wMaxPacketSize = 0x1c,
-        .bInterval = 6,
-    };
-    
-    struct usb_ss_endpoint_companion_descriptor endpoint_companion = {
-        .bLength = sizeof(struct usb_ss_endpoint_companion_descriptor),
-        .bDescriptorType = USB_DT_SS_ENDPOINT_COMPANION,
-        .bMaxBurst = 0x0F,
-        .bmAttributes = 0x00,
-        .wBytesPerInterval = 0x00,
-    };
-    
-    rc = usbDsRegisterInterface(&g_interface);
-    if (R_FAILED(rc)) return rc;
-    
-    interface_descriptor.bInterfaceNumber = g_interface->interface_index;
-    endpoint_descriptor_in.bEndpointAddress += interface_descriptor.bInterfaceNumber + 1;
-    endpoint_descriptor_out.bEndpointAddress += interface_descriptor.bInterfaceNumber + 1;
-    endpoint_descriptor_interr.bEndpointAddress += interface_descriptor.bInterfaceNumber +2;
-    
-    // Full Speed Config
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &interface_descriptor, USB_DT_INTERFACE_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &endpoint_descriptor_in, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &endpoint_descriptor_out, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &endpoint_descriptor_interr, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    
-    // High Speed Config
-    endpoint_descriptor_in.wMaxPacketSize = 0x200;
-    endpoint_descriptor_out.wMaxPacketSize = 0x200;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &interface_descriptor, USB_DT_INTERFACE_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &endpoint_descriptor_in, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &endpoint_descriptor_out, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &endpoint_descriptor_interr, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    
-    // Super Speed Config
-    endpoint_descriptor_in.wMaxPacketSize = 0x400;
-    endpoint_descriptor_out.wMaxPacketSize = 0x400;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &interface_descriptor, USB_DT_INTERFACE_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_descriptor_in, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_companion, USB_DT_SS_ENDPOINT_COMPANION_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_descriptor_out, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_companion, USB_DT_SS_ENDPOINT_COMPANION_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_descriptor_interr, USB_DT_ENDPOINT_SIZE);
-    if (R_FAILED(rc)) return rc;
-    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_companion, USB_DT_SS_ENDPOINT_COMPANION_SIZE);
-    if (R_FAILED(rc)) return rc;
-    
-    //Setup endpoints.    
-    rc = usbDsInterface_RegisterEndpoint(g_interface, &g_endpoint_in, endpoint_descriptor_in.bEndpointAddress);
-    if (R_FAILED(rc)) return rc;
-    
-    rc = usbDsInterface_RegisterEndpoint(g_interface, &g_endpoint_out, endpoint_descriptor_out.bEndpointAddress);
-    if (R_FAILED(rc)) return rc;
-
-    rc = usbDsInterface_RegisterEndpoint(g_interface, &g_endpoint_interr, endpoint_descriptor_interr.bEndpointAddress);
-    if (R_FAILED(rc)) return rc;
-    
-    return rc;
-}
-
-static Result _usbCommsInterfaceInit() {
-    if (hosversionAtLeast(5,0,0)) {
-        return _usbCommsInterfaceInit5x();
-    } else {
-        return _usbCommsInterfaceInit1x();
+static bool _modifiesObjects(u16 code) {
+    switch (code) {
+        case OperationOpenSession:
+        case OperationCloseSession:
+        case OperationDeleteObject:
+        case OperationSendObjectInfo:
+        case OperationSendObject:
+        case OperationMoveObject:
+        case OperationCopyObject:
+        case OperationSetObjectPropValue:
+        case OperationTuphlosSendDelta:
+        case OperationTuphlosSendArchive:
+        case OperationTuphlosSendBatch:
+            return true;
+        default:
+            return false;
     }
 }
 
-static Result _usbCommsInitialize() {
-    Result rc = 0;
-
-    if (g_initialized)
-        return rc;
-
-    rc = usbDsInitialize();
-    if (R_FAILED(rc))
-        return rc;
-
-    rc = _usbCommsInterfaceInit();
-    if (R_FAILED(rc))
-        return rc;
-
-    rc = usbDsInterface_EnableInterface(g_interface);
-    if (R_FAILED(rc))
-        return rc;
-
-    rc = usbDsEnable();
-    if (R_FAILED(rc))
-        return rc;
-
-    g_initialized = true;
-
-    return rc;
-}
-
-static void _usbCommsExit() {
-    usbDsExit();
-    g_initialized = false;
-}
-
-MTPContainer::MTPContainer(MTPContainerHeader header) {
+MTPContainer::MTPContainer(MTPContainerHeader header, MTPArena *arena) {
     this->header = header;
     this->data = NULL;
     this->read_cursor = 0;
+    this->arena = arena;
+    this->capacity = 0;
 }
 
 MTPContainer::MTPContainer() {
@@ -311,12 +56,39 @@ MTPContainer::MTPContainer() {
     };
     this->data = NULL;
     this->read_cursor = 0;
+    this->arena = NULL;
+    this->capacity = 0;
+}
+
+MTPContainer::MTPContainer(MTPContainer &&other) {
+    this->header = other.header;
+    this->data = other.data;
+    this->read_cursor = other.read_cursor;
+    this->arena = other.arena;
+    this->capacity = other.capacity;
+    other.data = NULL;
+    other.capacity = 0;
 }
 
+MTPContainer &MTPContainer::operator=(MTPContainer &&other) {
+    if (this != &other) {
+        if (this->arena == NULL)
+            free(this->data);
+        this->header = other.header;
+        this->data = other.data;
+        this->read_cursor = other.read_cursor;
+        this->arena = other.arena;
+        this->capacity = other.capacity;
+        other.data = NULL;
+        other.capacity = 0;
+    }
+    return *this;
+}
 
 MTPContainer::~MTPContainer() {
     DEBUG_PRINT("BEFORE FREE");
-    free(this->data);
+    if (this->arena == NULL)
+        free(this->data);
     DEBUG_PRINT("AFTER_FREE");
 }
 
@@ -328,53 +100,118 @@ void MTPContainer::read(void *buffer, size_t size) {
     this->read_cursor += size;
 }
 
-void MTPContainer::write(const void *buffer, size_t size) {
-    this->data = (u8 *) realloc(this->data, this->header.length - sizeof(MTPContainerHeader) + size);
-    memcpy(this->data + this->header.length - sizeof(MTPContainerHeader), buffer, size);
-    this->header.length += size;
+/* Grows by doubling, rather than by however much the next write needs */
+void MTPContainer::reserve(size_t size) {
+    if (size <= this->capacity)
+        return;
+
+    size_t used = this->header.length - sizeof(MTPContainerHeader);
+    size_t capacity = std::max({size, 2 * this->capacity, (size_t) 64});
+    if (this->arena != NULL) {
+        u8 *grown = (u8 *) this->arena->grow(this->data, used, capacity);
+        if (grown != NULL) {
+            this->data = grown;
+            this->capacity = capacity;
+            return;
+        }
+
+        /* Too big for what's left of the arena, so this one goes to the heap */
+        grown = (u8 *) malloc(capacity);
+        if (used != 0)
+            memcpy(grown, this->data, used);
+        this->data = grown;
+        this->arena = NULL;
+    } else {
+        this->data = (u8 *) realloc(this->data, capacity);
+    }
+    this->capacity = capacity;
 }
 
-template<typename T>
-std::enable_if_t<std::is_arithmetic_v<T>, T> MTPContainer::read() {
-    T var;
-    this->read(&var, sizeof(var));
-    return var;
+void MTPContainer::write(const void *buffer, size_t size) {
+    size_t used = this->header.length - sizeof(MTPContainerHeader);
+    this->reserve(used + size);
+    memcpy(this->data + used, buffer, size);
+    this->header.length += size;
 }
 
 std::u16string MTPContainer::read() {
     u8 length = this->read<u8>();
     DEBUG_PRINT("LENGTH: %#x", length);
     std::u16string var;
+    var.reserve(length);
 
     for (int i=0; i<length; i++) {
         var.push_back((char16_t) this->read<u16>());
     }
 
+    /* Hosts count the terminator in the length, it isn't part of the name */
+    if (!var.empty() && var.back() == 0)
+        var.pop_back();
+
     return var;
 }
 
-template<typename T>
-std::enable_if_t<std::is_arithmetic_v<T>, void> MTPContainer::write(T var) {
-    this->write(&var, sizeof(var));
+void MTPContainer::write(const std::u16string &var) {
+    this->writeString(var.data(), var.size());
+}
+
+void MTPContainer::write(const char16_t *var) {
+    this->writeString(var, std::char_traits<char16_t>::length(var));
 }
 
-void MTPContainer::write(std::u16string var) {
-    if (var.empty()) {
+void MTPContainer::writeString(const char16_t *var, size_t length) {
+    if (length == 0) {
         this->write<u8>(0);
     } else {
-        this->write((u8) (var.size()));
-        for (size_t i=0; i<var.size(); i++) {
+        this->write((u8) length);
+        this->reserve(this->header.length - sizeof(MTPContainerHeader) + length * sizeof(u16));
+        for (size_t i=0; i<length; i++) {
             this->write((u16) var[i]);
         }
     }
 }
 
-template <class T> void MTPContainer::write(std::vector<T> var) {
-    u32 length = var.size();
-    this->write(length);
-    for (u32 i=0; i<length; i++) {
-        this->write(var[i]);
+/* Same as write(path.filename().u16string()), minus the two strings that would take on the heap */
+void MTPContainer::writeFilename(const fs::path &path) {
+    const std::string &name = path.native();
+    size_t start = name.rfind('/');
+    start = start == std::string::npos ? 0 : start + 1;
+
+    /* Length goes in once it's known. A name never has fewer UTF-8 bytes than UTF-16 units */
+    size_t length_at = this->header.length - sizeof(MTPContainerHeader);
+    this->write<u8>(0);
+    this->reserve(length_at + 1 + (name.size() - start) * sizeof(u16));
+
+    size_t length = 0;
+    for (size_t i=start; i<name.size();) {
+        u32 c = (u8) name[i];
+        size_t extra = c < 0xC0 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+        if (extra != 0)
+            c &= 0x3F >> extra;
+
+        size_t j = 1;
+        for (; j<=extra && i+j<name.size() && ((u8) name[i+j] & 0xC0) == 0x80; j++)
+            c = (c << 6) | ((u8) name[i+j] & 0x3F);
+
+        /* Cut short, or a stray continuation byte */
+        if (j != extra + 1 || (c >= 0x80 && extra == 0)) {
+            c = 0xFFFD;
+            j = 1;
+        }
+        i += j;
+
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            this->write((u16) (0xD800 | (c >> 10)));
+            this->write((u16) (0xDC00 | (c & 0x3FF)));
+            length += 2;
+        } else {
+            this->write((u16) c);
+            length++;
+        }
     }
+
+    this->data[length_at] = (u8) length;
 }
 
 MTPOperation MTPContainer::toOperation() {
@@ -393,77 +230,206 @@ MTPOperation MTPContainer::toOperation() {
     return op;
 }
 
-MTPResponder::MTPResponder() {
-    _usbCommsInitialize();
-    usbDsWaitReady(U64_MAX);
+MTPResponder::MTPResponder(MTPTransport *transport) : arena(TRANSACTION_ARENA_SIZE) {
+    this->transport = transport;
+    this->connection = transport->connection();
 
     this->read_buffer = (u8 *) memalign(0x1000, BUF_SIZE);
     this->write_buffer = (u8 *) memalign(0x1000, BUF_SIZE);
+    this->object_buffer = (u8 *) memalign(0x1000, OBJECT_BUFFER_SIZE);
     this->read_cursor = 0;
     this->read_transferred = 0;
+    this->write_cursor = 0;
 
     this->session_id = 0;
     this->send_object_handle = 0;
+    this->send_object_file = NULL;
+    this->compression = CompressionNone;
+    this->compressor = NULL;
+    this->archive_reader = NULL;
+    this->archive_writer = NULL;
+    this->readahead = NULL;
+    this->cache_directory = "sdmc:/switch/Tuphlos";
+    this->path_clock = 0;
+    this->path_bytes = 0;
+    this->handles.setBudget(this->memory.budget(MemoryHandles));
 }
 
 MTPResponder::~MTPResponder() {
-    _usbCommsExit();
+    this->abortSendObject();
+
+    this->capacity.stop();
+    delete this->compressor;
+    delete this->archive_reader;
+    delete this->archive_writer;
+    delete this->readahead;
+    for (auto &store : this->storages)
+        delete store.second.first;
+    free(this->read_buffer);
+    free(this->write_buffer);
+    free(this->object_buffer);
 }
 
 void MTPResponder::loop() {
     DEBUG_PRINT("LOOP");
+
+    /* Unplugged, the caller gets its main loop back instead of sitting in a transfer */
+    if (!this->transport->waitReady(READY_TIMEOUT_NS))
+        return;
+    if (this->transport->connection() != this->connection)
+        this->resetConnection();
+
+    /* Nothing from the last transaction is left by now */
+    this->arena.reset();
+
+    /* Same for a host that's there but has nothing to ask. What's posted for it stays for next time */
+    if (this->read_cursor >= this->read_transferred && !this->transport->waitReceive(this->read_buffer, BUF_SIZE, READY_TIMEOUT_NS))
+        return;
+
     MTPContainer op_cont = this->readContainer();
+    if (op_cont.header.type == ContainerTypeUndefined)
+        return;
 
+    u64 parse_start = statsNow();
     MTPOperation op = op_cont.toOperation();
     DEBUG_PRINT("OPERATION: %#x %ld", op.code, op.params.size());
+    this->stats.beginTransaction(op.code, op_cont.header.length, statsNow() - parse_start);
 
     MTPResponse resp = this->parseOperation(op);
     DEBUG_PRINT("RESPONSE: %#x %ld", resp.code, resp.params.size());
 
-    MTPContainer *resp_cont = this->createResponseContainer(resp);
-    this->writeContainer(*resp_cont);
-    delete resp_cont;
+    /* The host that asked went away partway through, nobody is left to take the response */
+    if (this->transport->connection() != this->connection) {
+        this->stats.endTransaction(false);
+        this->resetConnection();
+        return;
+    }
+
+    MTPContainer resp_cont = this->createResponseContainer(resp);
+    this->writeContainer(resp_cont);
+
+    this->stats.endTransaction(resp.code == ResponseOk);
+    this->handles.flush();
+    this->trimMemory();
+
+    MTPCapacityEvent event;
+    while (this->capacity.pollEvent(&event))
+        this->sendEvent(event.code, {event.storage_id});
+}
+
+/* Only what belonged to the old host goes. Handles, paths and the caches stay warm for the next one */
+void MTPResponder::resetConnection() {
+    DEBUG_PRINT("CONNECTION: %u -> %u", this->connection, this->transport->connection());
+    this->connection = this->transport->connection();
+
+    this->abortSendObject();
+    this->send_object_handle = 0;
+    this->session_id = 0;
+    this->compression = CompressionNone;
+
+    this->read_cursor = 0;
+    this->read_transferred = 0;
+    this->write_cursor = 0;
+
+    this->handles.flush();
+}
+
+void MTPResponder::setCacheDirectory(std::string directory) {
+    this->thumbnails.setDirectory(directory + "/thumbs");
+
+    /* The handle database is opened with the first session, from wherever this says by then */
+    this->cache_directory = directory;
+    this->handles.close();
+    this->hashes.close();
+}
+
+void MTPResponder::setMemoryBudget(u16 subsystem, u64 budget) {
+    this->memory.setBudget(subsystem, budget);
+
+    /* The content cache and the handle database keep to their budgets as they read in,
+       rather than being trimmed afterwards */
+    if (subsystem == MemoryContents)
+        this->contents.setBudget(budget);
+    if (subsystem == MemoryHandles)
+        this->handles.setBudget(budget);
+}
+
+size_t MTPResponder::objectHandleMemory() {
+    return this->objectPathMemory() + this->handles.memory();
+}
+
+/* The buffers only change size when something's started, so they're worked out when somebody asks */
+const MTPMemoryAccountant &MTPResponder::memoryReport() {
+    size_t buffers = 2 * BUF_SIZE + OBJECT_BUFFER_SIZE + this->arena.size();
+    if (this->compressor != NULL)
+        buffers += 2 * COMPRESS_SLOTS * COMPRESS_BLOCK_SIZE;
+    if (this->archive_reader != NULL)
+        buffers += ARCHIVE_SLOTS * ARCHIVE_SLOT_SIZE;
+    if (this->archive_writer != NULL)
+        buffers += ARCHIVE_SLOTS * ARCHIVE_SLOT_SIZE;
+    if (this->readahead != NULL)
+        buffers += READAHEAD_BUFFERS * READAHEAD_WINDOW;
+    this->memory.update(MemoryBuffers, buffers);
+
+    this->trimMemory();
+    return this->memory;
+}
+
+/* Every cache counts its own bytes as it goes, so this is only a few comparisons until one is over.
+   Anything trimmed is worked out again or read back from the SD card the next time it's needed */
+void MTPResponder::trimMemory() {
+    if (this->memory.update(MemoryObjectPaths, this->objectPathMemory()))
+        this->memory.evicted(MemoryObjectPaths, this->trimObjectPaths(this->memory.target(MemoryObjectPaths)));
+    if (this->memory.update(MemoryHandles, this->handles.memory()))
+        this->memory.evicted(MemoryHandles, this->handles.trim(this->memory.target(MemoryHandles)));
+    this->memory.evicted(MemoryHandles, this->handles.takeEvictions());
+    if (this->memory.update(MemoryHashes, this->hashes.memory()))
+        this->memory.evicted(MemoryHashes, this->hashes.trim(this->memory.target(MemoryHashes)));
+    if (this->memory.update(MemoryThumbnails, this->thumbnails.memory()))
+        this->memory.evicted(MemoryThumbnails, this->thumbnails.trim(this->memory.target(MemoryThumbnails)));
+
+    this->memory.update(MemoryObjectPaths, this->objectPathMemory());
+    this->memory.update(MemoryHandles, this->handles.memory());
+    this->memory.update(MemoryHashes, this->hashes.memory());
+    this->memory.update(MemoryThumbnails, this->thumbnails.memory());
+    this->memory.update(MemoryContents, this->contents.memory());
 }
 
 void MTPResponder::insertStorage(const u32 id, const std::string drive, const std::u16string name) {
-    this->storages[id] = std::pair<std::string, std::u16string>(drive, name);
+    this->insertStorage(id, new MTPNativeStorage(drive), name);
+}
+
+void MTPResponder::insertStorage(const u32 id, MTPStorage *storage, const std::u16string name) {
+    this->storages[id] = std::pair<MTPStorage *, std::u16string>(storage, name);
+    this->capacity.insert(id, storage);
 }
 
-/* Taken from Atmosphere's tma_usb_comms */
-Result MTPResponder::UsbXfer(UsbDsEndpoint *ep, size_t *out_xferd, void *buf, size_t size) {
+Result MTPResponder::UsbXfer(MTPEndpoint ep, size_t *out_xferd, void *buf, size_t size) {
     DEBUG_PRINT("XFER: %#lx", size);
-    Result rc = 0;
-    u32 urbId = 0;
-    u32 total_xferd = 0;
-    UsbDsReportData reportdata;
-    
-    if (size) {
-        /* Start transfer. */
-        rc = usbDsEndpoint_PostBufferAsync(ep, buf, size, &urbId);
-
-        if (R_FAILED(rc)) return rc;
-        
-        u64 wait;
-        if (ep == g_endpoint_in)
-            wait = 1e+6L;
-        else
-            wait = U64_MAX;
-        /* Wait for transfer to complete. */
-        eventWait(&ep->CompletionEvent, wait);
-        eventClear(&ep->CompletionEvent);
-        
-        rc = usbDsEndpoint_GetReportData(ep, &reportdata);
-        if (R_FAILED(rc)) return rc;
-
-        rc = usbDsParseReportData(&reportdata, urbId, NULL, &total_xferd);
-        if (R_FAILED(rc)) return rc;
-    }
-    
+    size_t total_xferd = 0;
+    u64 start = statsNow();
+
+    Result rc = this->transport->transfer(ep, buf, size, &total_xferd);
+
     if (out_xferd) *out_xferd = total_xferd;
-    
+
+    this->stats.addTransfer(ep == EndpointIn, statsNow() - start, total_xferd);
+
     return rc;
 }
 
+bool MTPResponder::fileXfer(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out) {
+    DEBUG_PRINT("FILE XFER: %#lx", size);
+    u64 start = statsNow();
+
+    if (!this->transport->transferFile(ep, file, offset, size, out))
+        return false;
+
+    this->stats.addTransfer(ep == EndpointIn, statsNow() - start, out->xferd);
+
+    return true;
+}
+
 Result MTPResponder::read(void *buffer, size_t size) {
     Result rc = 0;
 
@@ -473,7 +439,7 @@ Result MTPResponder::read(void *buffer, size_t size) {
     if (this->read_cursor >= this->read_transferred) {
         this->read_transferred = 0;
         this->read_cursor = 0;
-        rc = UsbXfer(g_endpoint_out, &this->read_transferred, this->read_buffer, BUF_SIZE /*size*/);
+        rc = UsbXfer(EndpointOut, &this->read_transferred, this->read_buffer, BUF_SIZE /*size*/);
         if (R_FAILED(rc))
             return rc;
     }
@@ -492,27 +458,180 @@ Result MTPResponder::write(const void *buffer, size_t size) {
 
     memcpy(this->write_buffer, buffer, size);
 
-    UsbXfer(g_endpoint_in, NULL, this->write_buffer, size);
+    UsbXfer(EndpointIn, NULL, this->write_buffer, size);
+
+    return rc;
+}
+
+Result MTPResponder::sendEvent(u16 code, const MTPParams &params) {
+    DEBUG_PRINT("EVENT: %#x", code);
+
+    /* Transfer buffers have to be page aligned, so this borrows write_buffer between transactions */
+    size_t count = std::min(params.size(), 3UL);
+    MTPContainerHeader header = {(u32) (sizeof(header) + count * sizeof(u32)), ContainerTypeEvent, code, 0xFFFFFFFF};
+    memcpy(this->write_buffer, &header, sizeof(header));
+    memcpy(this->write_buffer + sizeof(header), params.data(), count * sizeof(u32));
+
+    return UsbXfer(EndpointInterrupt, NULL, this->write_buffer, header.length);
+}
+
+Result MTPResponder::beginData(const MTPOperation &op, u64 size) {
+    MTPContainerHeader header = this->createDataHeader(op, size);
+    memcpy(this->write_buffer, &header, sizeof(header));
+    this->write_cursor = sizeof(header);
+
+    return 0;
+}
+
+Result MTPResponder::writeData(const void *buffer, size_t size) {
+    Result rc = 0;
+    const u8 *data = (const u8 *) buffer;
+
+    while (R_SUCCEEDED(rc) && size > 0) {
+        size_t chunk = std::min(size, BUF_SIZE - this->write_cursor);
+        memcpy(this->write_buffer + this->write_cursor, data, chunk);
+        this->write_cursor += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (this->write_cursor == BUF_SIZE)
+            rc = this->flushData();
+    }
+
+    return rc;
+}
+
+Result MTPResponder::flushData() {
+    Result rc = 0;
+
+    if (this->write_cursor != 0)
+        rc = UsbXfer(EndpointIn, NULL, this->write_buffer, this->write_cursor);
+    this->write_cursor = 0;
 
     return rc;
 }
 
+void MTPResponder::beginBulk(const MTPOperation &op, u64 size) {
+    MTPContainerHeader header = this->createDataHeader(op, size);
+    memcpy(this->object_buffer, &header, sizeof(header));
+    this->bulk_fill = sizeof(header);
+    this->bulk_ok = true;
+}
+
+void MTPResponder::writeBulk(const void *buffer, size_t size) {
+    for (const u8 *data = (const u8 *) buffer; this->bulk_ok && size > 0;) {
+        size_t chunk = std::min(size, OBJECT_BUFFER_SIZE - this->bulk_fill);
+        memcpy(this->object_buffer + this->bulk_fill, data, chunk);
+        this->bulk_fill += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (this->bulk_fill == OBJECT_BUFFER_SIZE) {
+            this->bulk_ok = R_SUCCEEDED(this->UsbXfer(EndpointIn, NULL, this->object_buffer, this->bulk_fill));
+            this->bulk_fill = 0;
+        }
+    }
+}
+
+bool MTPResponder::endBulk() {
+    if (this->bulk_ok && this->bulk_fill != 0)
+        this->bulk_ok = R_SUCCEEDED(this->UsbXfer(EndpointIn, NULL, this->object_buffer, this->bulk_fill));
+    this->bulk_fill = 0;
+
+    return this->bulk_ok;
+}
+
+bool MTPResponder::beginStream() {
+    this->stream_cursor = 0;
+    this->stream_available = 0;
+    this->stream_remaining = 0;
+    this->stream_ended = true;
+
+    MTPContainer cont = this->readContainer();
+    if (cont.header.type != ContainerTypeData)
+        return false;
+
+    /* The first transfer came in with the header. If it wasn't a full one, that was all of it */
+    size_t first = std::min(cont.header.length, (u32) BUF_SIZE) - sizeof(MTPContainerHeader);
+    memcpy(this->object_buffer, cont.data, first);
+    this->stream_available = first;
+    this->stream_ended = this->read_transferred < BUF_SIZE;
+
+    /* Objects of 4GiB or more don't fit the length field, so the host ends them with a short packet */
+    if (cont.header.length == 0xFFFFFFFF)
+        this->stream_remaining = U64_MAX;
+    else
+        this->stream_remaining = cont.header.length - sizeof(MTPContainerHeader) - first;
+
+    return true;
+}
+
+size_t MTPResponder::streamNext(const u8 **data, size_t max) {
+    if (this->stream_cursor == this->stream_available) {
+        if (this->stream_ended || this->stream_remaining == 0)
+            return 0;
+
+        size_t xferd = 0;
+        size_t to_read = std::min<u64>(this->stream_remaining, OBJECT_BUFFER_SIZE);
+        if (R_FAILED(this->UsbXfer(EndpointOut, &xferd, this->object_buffer, to_read)))
+            xferd = 0;
+
+        this->stream_ended = xferd < to_read;
+        this->stream_remaining -= xferd;
+        this->stream_cursor = 0;
+        this->stream_available = xferd;
+        if (xferd == 0)
+            return 0;
+    }
+
+    size_t size = std::min(max, this->stream_available - this->stream_cursor);
+    *data = this->object_buffer + this->stream_cursor;
+    this->stream_cursor += size;
+    return size;
+}
+
+bool MTPResponder::streamRead(void *buffer, size_t size) {
+    const u8 *data;
+    for (size_t pos = 0; pos < size;) {
+        size_t chunk = this->streamNext(&data, size - pos);
+        if (chunk == 0)
+            return false;
+
+        memcpy((u8 *) buffer + pos, data, chunk);
+        pos += chunk;
+    }
+
+    return true;
+}
+
+void MTPResponder::endStream() {
+    const u8 *data;
+    while (this->streamNext(&data, OBJECT_BUFFER_SIZE) != 0)
+        ;
+}
+
 MTPContainer MTPResponder::readContainer() {
     MTPContainerHeader header;
 
-    this->read(&header, sizeof(header));
+    Result rc = this->read(&header, sizeof(header));
+    if (R_FAILED(rc) || header.length < sizeof(header))
+        header = {sizeof(header), ContainerTypeUndefined, 0, 0};
 
-    MTPContainer cont(header);
+    MTPContainer cont(header, &this->arena);
+    if (cont.header.type == ContainerTypeUndefined)
+        return cont;
 
+    /* Only the first transfer is read here, whatever comes after it is up to the handler */
     u32 size = std::min(cont.header.length, (u32) BUF_SIZE);
-
-    cont.data = (u8 *) malloc(size - sizeof(MTPContainerHeader));
+    cont.header.length = sizeof(MTPContainerHeader);
+    cont.reserve(size - sizeof(MTPContainerHeader));
     this->read(cont.data, size - sizeof(MTPContainerHeader));
+    cont.header.length = header.length;
 
     return cont;
 }
 
-Result MTPResponder::writeContainer(MTPContainer &cont) {
+Result MTPResponder::writeContainer(const MTPContainer &cont) {
     DEBUG_PRINT("WRITE CONTAINER: %#x", cont.header.length);
 
     u32 size = std::min(cont.header.length, (u32) BUF_SIZE);
@@ -520,29 +639,201 @@ Result MTPResponder::writeContainer(MTPContainer &cont) {
     memcpy(this->write_buffer, &cont.header, sizeof(cont.header));
     memcpy(this->write_buffer + sizeof(cont.header), cont.data, size - sizeof(cont.header));
 
-    Result rc = UsbXfer(g_endpoint_in, NULL, this->write_buffer, size);
+    Result rc = UsbXfer(EndpointIn, NULL, this->write_buffer, size);
+
+    /* Anything that didn't fit in the first packet follows in BUF_SIZE chunks */
+    u32 pos = size - sizeof(cont.header);
+    while (R_SUCCEEDED(rc) && pos < cont.header.length - sizeof(cont.header)) {
+        size = std::min(cont.header.length - sizeof(cont.header) - pos, BUF_SIZE);
+        memcpy(this->write_buffer, cont.data + pos, size);
+        rc = UsbXfer(EndpointIn, NULL, this->write_buffer, size);
+        pos += size;
+    }
 
     return rc;
 }
 
+u32 MTPResponder::getStorageId(const fs::path &object) {
+    std::string drive = object.string();
+    size_t colon = drive.find(":");
+    if (colon == std::string::npos)
+        return 0;
+    drive.resize(colon);
+    DEBUG_PRINT("DRIVE: %s", drive.c_str());
+
+    for (auto &store : this->storages) {
+        if (store.second.first->drive == drive)
+            return store.first;
+    }
+
+    return 0;
+}
+
+MTPStorage *MTPResponder::getStorage(u32 storage_id) {
+    auto it = this->storages.find(storage_id);
+    return it != this->storages.end() ? it->second.first : NULL;
+}
+
+MTPStorage *MTPResponder::getObjectStorage(const fs::path &object) {
+    return this->getStorage(this->getStorageId(object));
+}
+
 u32 MTPResponder::getObjectHandle(fs::path object) {
-    u32 handle;
-    for(handle=1; handle <= this->object_handles.size(); handle++) { // Object handle of zero is reserved
-        if (this->object_handles[handle] == object) {
-            break;
-        }
+    auto it = this->object_paths.find(object.native());
+    if (it != this->object_paths.end()) {
+        this->object_handles[it->second].used = ++this->path_clock;
+        return it->second;
     }
 
-    if (handle == this->object_handles.size() + 1)
-        this->object_handles.insert({handle, object});
+    /* Objects at the top of a storage have no parent handle */
+    u32 storage_id = this->getStorageId(object);
+    MTPStorage *storage = this->getStorage(storage_id);
+    fs::path parent = object.parent_path();
+    u32 parent_handle = 0;
+    if (storage != NULL && parent.string() != storage->drive + ":")
+        parent_handle = this->getObjectHandle(parent);
 
+    std::string name = object.filename().string();
+    u32 handle = this->handles.find(parent_handle, storage_id, name);
+    if (handle == 0)
+        handle = this->handles.insert(parent_handle, storage_id, name);
+
+    this->cacheObjectPath(handle, object);
     return handle;
 }
 
-MTPResponse MTPResponder::parseOperation(MTPOperation op) {
+fs::path MTPResponder::getObjectPath(u32 handle) {
+    auto it = this->object_handles.find(handle);
+    if (it != this->object_handles.end()) {
+        it->second.used = ++this->path_clock;
+        return it->second.path;
+    }
+
+    const MTPHandleDatabase::Entry *entry = this->handles.get(handle);
+    if (entry == NULL)
+        return fs::path();
+
+    fs::path parent;
+    if (entry->parent != 0) {
+        parent = this->getObjectPath(entry->parent);
+    } else {
+        MTPStorage *storage = this->getStorage(entry->storage_id);
+        if (storage != NULL)
+            parent = storage->drive + ":";
+    }
+
+    if (parent.empty())
+        return fs::path();
+
+    /* Looking the parent up may have moved the entry */
+    fs::path object = parent / this->handles.get(handle)->name;
+    this->cacheObjectPath(handle, object);
+    return object;
+}
+
+/* Roughly what an entry costs in each map, going by what libstdc++ allocates for a node */
+static size_t _pathCacheCost(const std::string &path) {
+    return sizeof(std::pair<const u32, fs::path>) + sizeof(u64) + sizeof(std::pair<const std::string, u32>) +
+        4 * sizeof(void *) + 2 * (path.size() + 1);
+}
+
+void MTPResponder::cacheObjectPath(u32 handle, const fs::path &object) {
+    auto it = this->object_handles.find(handle);
+    if (it != this->object_handles.end())
+        this->uncacheObjectPath(it);
+
+    auto other = this->object_paths.find(object.native());
+    if (other != this->object_paths.end())
+        this->uncacheObjectPath(this->object_handles.find(other->second));
+
+    this->object_handles[handle] = {object, ++this->path_clock};
+    this->object_paths[object.native()] = handle;
+    this->path_bytes += _pathCacheCost(object.native());
+
+    /* One transaction can go through a whole card, so this doesn't wait for it to end. Callers
+       only ever hold on to copies of paths, never to the cache's own */
+    if (this->objectPathMemory() > this->memory.budget(MemoryObjectPaths))
+        this->memory.evicted(MemoryObjectPaths, this->trimObjectPaths(this->memory.target(MemoryObjectPaths)));
+}
+
+std::unordered_map<u32, MTPResponder::CachedPath>::iterator MTPResponder::uncacheObjectPath(std::unordered_map<u32, CachedPath>::iterator it) {
+    this->path_bytes -= _pathCacheCost(it->second.path.native());
+    this->object_paths.erase(it->second.path.native());
+    return this->object_handles.erase(it);
+}
+
+void MTPResponder::clearObjectPaths() {
+    this->object_handles.clear();
+    this->object_paths.clear();
+    this->path_bytes = 0;
+}
+
+size_t MTPResponder::objectPathMemory() {
+    return (this->object_handles.bucket_count() + this->object_paths.bucket_count()) * sizeof(void *) + this->path_bytes;
+}
+
+/* Whatever hasn't been looked at for longest goes first, and on a big card that's whole folders
+   the host browsed once and moved on from. Every path can be worked out again from the database */
+size_t MTPResponder::trimObjectPaths(u64 target) {
+    size_t memory = this->objectPathMemory();
+    if (memory <= target || this->object_handles.empty())
+        return 0;
+
+    size_t per_entry = this->path_bytes / this->object_handles.size();
+    auto cold = memoryColdest(this->object_handles, (memory - target + per_entry - 1) / per_entry,
+        [](const CachedPath &cached) { return cached.used; });
+    for (u32 handle : cold)
+        this->uncacheObjectPath(this->object_handles.find(handle));
+    return cold.size();
+}
+
+void MTPResponder::forgetObjectPaths(u32 handle) {
+    auto it = this->object_handles.find(handle);
+    if (it == this->object_handles.end())
+        return;
+
+    std::string prefix = it->second.path.native() + "/";
+    for (auto child = this->object_handles.begin(); child != this->object_handles.end();) {
+        if (child->first == handle || child->second.path.native().compare(0, prefix.size(), prefix) == 0) {
+            child = this->uncacheObjectPath(child);
+        } else {
+            child++;
+        }
+    }
+}
+
+void MTPResponder::setObjectPath(u32 handle, fs::path object) {
+    /* Whatever was cached below the old path is stale now, the database has the new one */
+    this->forgetObjectPaths(handle);
+
+    u32 storage_id = this->getStorageId(object);
+    MTPStorage *storage = this->getStorage(storage_id);
+    fs::path parent = object.parent_path();
+    u32 parent_handle = 0;
+    if (storage != NULL && parent.string() != storage->drive + ":")
+        parent_handle = this->getObjectHandle(parent);
+
+    /* An object that was replaced at the destination loses its handle */
+    auto replaced = this->object_paths.find(object.native());
+    if (replaced != this->object_paths.end())
+        this->forgetObjectPaths(replaced->second);
+
+    this->handles.move(handle, parent_handle, storage_id, object.filename().string());
+    this->cacheObjectPath(handle, object);
+}
+
+MTPResponse MTPResponder::parseOperation(const MTPOperation &op) {
     MTPResponse resp(ResponseOperationNotSupported);
     resp.transaction_id = op.transaction_id;
 
+    /* Files kept open for partial reads can keep objects from being renamed or deleted, and anything
+       that's written has to be read again */
+    if (_modifiesObjects(op.code)) {
+        if (this->readahead != NULL)
+            this->readahead->clear();
+        this->contents.clear();
+    }
+
     switch(op.code) {
         case OperationGetDeviceInfo:
             this->GetDeviceInfo(op, &resp);
@@ -571,6 +862,9 @@ MTPResponse MTPResponder::parseOperation(MTPOperation op) {
         case OperationGetObject:
             this->GetObject(op, &resp);
             break;
+        case OperationGetThumb:
+            this->GetThumb(op, &resp);
+            break;
         case OperationDeleteObject:
             this->DeleteObject(op, &resp);
             break;
@@ -600,40 +894,73 @@ MTPResponse MTPResponder::parseOperation(MTPOperation op) {
             break;
         case OperationCopyObject:
             this->CopyObject(op, &resp);
+            break;
+        case OperationTuphlosHashObject:
+            this->HashObject(op, &resp);
+            break;
+        case OperationTuphlosGetSignatures:
+            this->GetSignatures(op, &resp);
+            break;
+        case OperationTuphlosSendDelta:
+            this->SendDelta(op, &resp);
+            break;
+        case OperationTuphlosSetCompression:
+            this->SetCompression(op, &resp);
+            break;
+        case OperationTuphlosSendArchiveList:
+            this->SendArchiveList(op, &resp);
+            break;
+        case OperationTuphlosGetArchive:
+            this->GetArchive(op, &resp);
+            break;
+        case OperationTuphlosSendArchive:
+            this->SendArchive(op, &resp);
+            break;
+        case OperationTuphlosSendBatch:
+            this->SendBatch(op, &resp);
+            break;
+        case OperationTuphlosGetBatchResults:
+            this->GetBatchResults(op, &resp);
+            break;
     }
 
     DEBUG_PRINT("BEFORE RET RESP");
     return resp;
 }
 
-MTPContainer MTPResponder::createDataContainer(MTPOperation op) {
+MTPContainer MTPResponder::createDataContainer(const MTPOperation &op) {
     MTPContainerHeader header;
     header.length = sizeof(MTPContainerHeader);
     header.type = ContainerTypeData;
     header.code = op.code;
     header.transaction_id = op.transaction_id;
 
-    MTPContainer cont(header);
-    return cont;
+    return MTPContainer(header, &this->arena);
+}
+
+MTPContainerHeader MTPResponder::createDataHeader(const MTPOperation &op, u64 size) {
+    MTPContainerHeader header;
+    header.length = sizeof(MTPContainerHeader) + std::min(size, 0xFFFFFFFFUL - sizeof(MTPContainerHeader));
+    header.type = ContainerTypeData;
+    header.code = op.code;
+    header.transaction_id = op.transaction_id;
+
+    return header;
 }
 
-MTPContainer *MTPResponder::createResponseContainer(MTPResponse resp) {
+MTPContainer MTPResponder::createResponseContainer(const MTPResponse &resp) {
     MTPContainerHeader header;
     header.length = sizeof(MTPContainerHeader);
     header.type = ContainerTypeResponse;
     header.code = resp.code;
     header.transaction_id = resp.transaction_id;
 
-    MTPContainer *cont = new MTPContainer(header);
-
-    for (auto param : resp.params) {
-        cont->write(param);
-    }
-
+    MTPContainer cont(header, &this->arena);
+    cont.write(resp.params.data(), resp.params.size() * sizeof(u32));
     return cont;
 }
 
-void MTPResponder::GetDeviceInfo(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::GetDeviceInfo(const MTPOperation &op, MTPResponse *resp) {
     MTPContainer cont = this->createDataContainer(op);
     cont.write<u16>(100); // Standard Version
     cont.write<u32>(0xFFFFFFFF); // Vendor Extension ID
@@ -641,7 +968,8 @@ void MTPResponder::GetDeviceInfo(MTPOperation op, MTPResponse *resp) {
     cont.write(u"microsoft.com: 1.0;"); // Extensions
     cont.write<u16>(0); // Functional mode
 
-    std::vector<u16> operations_supported({
+    /* These never change, so they're only built the first time */
+    static const std::vector<u16> operations_supported({
         OperationGetDeviceInfo,
         OperationOpenSession,
         OperationCloseSession,
@@ -650,6 +978,7 @@ void MTPResponder::GetDeviceInfo(MTPOperation op, MTPResponse *resp) {
         OperationGetObjectHandles,
         OperationGetObjectInfo,
         OperationGetObject,
+        OperationGetThumb,
         OperationDeleteObject,
         OperationSendObjectInfo,
         OperationSendObject,
@@ -661,23 +990,35 @@ void MTPResponder::GetDeviceInfo(MTPOperation op, MTPResponse *resp) {
         OperationGetObjectPropValue,
         OperationMoveObject,
         OperationCopyObject,
+        OperationTuphlosHashObject,
+        OperationTuphlosGetSignatures,
+        OperationTuphlosSendDelta,
+        OperationTuphlosSetCompression,
+        OperationTuphlosSendArchiveList,
+        OperationTuphlosGetArchive,
+        OperationTuphlosSendArchive,
+        OperationTuphlosSendBatch,
+        OperationTuphlosGetBatchResults,
     });
     cont.write(operations_supported);
 
-    cont.write<u32>(0); // Events supported :(
+    /* Only the capacity cache sends any, once a storage fills up or its free space has moved a lot */
+    static const std::vector<u16> events_supported({
+        EventStoreFull,
+        EventStorageInfoChanged,
+    });
+    cont.write(events_supported);
 
-    std::vector<u16> properties_supported({
+    static const std::vector<u16> properties_supported({
         PropertyDeviceFriendlyName,
+        PropertyTuphlosStatistics,
+        PropertyTuphlosMemory,
     });
     cont.write(properties_supported);
 
     cont.write<u32>(0); // Capture formats
 
-    std::vector<u16> formats_supported({
-        FormatUndefined,
-        FormatAssociation,
-    });
-    cont.write(formats_supported); // Playback formats
+    cont.write(formatsSupported()); // Playback formats
 
     cont.write(u"Nintendo"); // Manufacturer
     cont.write(u"Nintendo Switch"); // Model
@@ -689,25 +1030,35 @@ void MTPResponder::GetDeviceInfo(MTPOperation op, MTPResponse *resp) {
     resp->code = ResponseOk;
 }
 
-void MTPResponder::OpenSession(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::OpenSession(const MTPOperation &op, MTPResponse *resp) {
     if (this->session_id == 0) {
         this->session_id = op.params[0];
+        this->compression = CompressionNone;
+
+        /* Handles from an earlier session, or an earlier run, stay valid */
+        if (!this->handles.isOpen()) {
+            this->clearObjectPaths();
+            this->handles.open(this->cache_directory);
+            this->hashes.open(this->cache_directory);
+        }
+
         resp->code = ResponseOk;
     } else {
         resp->code = ResponseSessionAlreadyOpen;
     }
 }
 
-void MTPResponder::CloseSession(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::CloseSession(const MTPOperation &op, MTPResponse *resp) {
     if (this->session_id == 0) {
         resp->code = ResponseSessionNotOpen;
     } else {
         this->session_id = 0;
+        this->compression = CompressionNone;
         resp->code = ResponseOk;
     }
 }
 
-void MTPResponder::GetStorageIds(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::GetStorageIds(const MTPOperation &op, MTPResponse *resp) {
     MTPContainer cont = this->createDataContainer(op);
     cont.write((u32) this->storages.size());
     for (auto store : this->storages) {
@@ -718,116 +1069,168 @@ void MTPResponder::GetStorageIds(MTPOperation op, MTPResponse *resp) {
     resp->code = ResponseOk;
 }
 
-void MTPResponder::GetStorageInfo(MTPOperation op, MTPResponse *resp) {
-    MTPContainer cont = this->createDataContainer(op);
+void MTPResponder::GetStorageInfo(const MTPOperation &op, MTPResponse *resp) {
+    MTPStorage *storage = this->getStorage(op.params[0]);
+    if (storage == NULL) {
+        resp->code = ResponseInvalidStorageId;
+        return;
+    }
 
-    auto info = this->storages[op.params[0]];
-    
-    if (info.first == "sdmc")
-        cont.write<u16>(4); // Storage type
-    else 
-        cont.write<u16>(1);
+    MTPContainer cont = this->createDataContainer(op);
 
+    cont.write(storage->storageType()); // Storage type
     cont.write<u16>(2); // Filesystem Type
+    cont.write(storage->accessCapability()); // Access Capability
 
-    if (info.first == "sdmc")
-        cont.write<u16>(0); // Access Capability
-    else
-        cont.write<u16>(2);
-
-    struct statvfs stat;
-    int rc = statvfs((info.first + ":/").c_str(), &stat);
-    u64 total = stat.f_bsize * stat.f_blocks;
-    u64 free = stat.f_bsize * stat.f_bfree;
-    DEBUG_PRINT("TOTAL: %#lx; FREE: %#lx; ERROR: %d", total, free, rc);
+    u64 total = 0, free = 0;
+    this->capacity.get(op.params[0], &total, &free);
+    DEBUG_PRINT("TOTAL: %#lx; FREE: %#lx", total, free);
 
     cont.write(total); // Max Capacity
     cont.write(free); // Free Space in bytes
 
     cont.write<u32>(0xFFFFFFFF); // Free space in objects
-    cont.write(info.second); // Storage Description
-    cont.write(info.second); // Volume Identifier
+    cont.write(this->storages[op.params[0]].second); // Storage Description
+    cont.write(this->storages[op.params[0]].second); // Volume Identifier
 
     this->writeContainer(cont);
 
     resp->code = ResponseOk;
 }
 
-void MTPResponder::GetObjectHandles(MTPOperation op, MTPResponse *resp) {
-    auto info = this->storages[op.params[0]];
+bool MTPResponder::streamObjectHandles(const MTPOperation &op, std::vector<MTPStorage *> roots, u16 format) {
+    u32 count = 0;
+    for (MTPStorage *storage : roots) {
+        storage->walk(storage->root(), [storage, format, &count](const fs::path &path, bool is_dir) {
+            if (format == 0 || formatDetect(storage, path, is_dir) == format)
+                count++;
+            return true;
+        });
+    }
+    DEBUG_PRINT("COUNT: %u", count);
+
+    this->beginData(op, sizeof(u32) + (u64) count * sizeof(u32));
+    this->writeData(&count, sizeof(count));
+
+    /* The length is already on the wire, so objects that turned up between the passes are left out */
+    u32 sent = 0, handle = 0;
+    for (MTPStorage *storage : roots) {
+        if (sent == count)
+            break;
+
+        storage->walk(storage->root(), [this, storage, format, count, &sent, &handle](const fs::path &path, bool is_dir) {
+            if (sent == count)
+                return false;
+            if (format != 0 && formatDetect(storage, path, is_dir) != format)
+                return true;
+
+            handle = this->getObjectHandle(path);
+            this->writeData(&handle, sizeof(handle));
+            return ++sent < count;
+        });
+    }
+
+    /* and ones that vanished are made up for by repeating the last handle. With none sent there's
+       no real one to repeat, so the data phase ends short, which the count and header keep off a
+       packet boundary */
+    bool complete = sent != 0 || count == 0;
+    for (; sent < count && sent != 0; sent++)
+        this->writeData(&handle, sizeof(handle));
+
+    this->flushData();
+    return complete;
+}
+
+void MTPResponder::GetObjectHandles(const MTPOperation &op, MTPResponse *resp) {
+    /* A parent of zero asks for every object in the storage. The tree is walked twice,
+       once to count and once to send, so the reply is never held in memory */
+    if (op.params[2] == 0) {
+        std::vector<MTPStorage *> roots;
+        for (auto &store : this->storages) {
+            if (op.params[0] == 0xFFFFFFFF || op.params[0] == store.first)
+                roots.push_back(store.second.first);
+        }
+
+        if (roots.empty()) {
+            resp->code = ResponseInvalidStorageId;
+            return;
+        }
+
+        resp->code = this->streamObjectHandles(op, roots, op.params[1]) ? ResponseOk : ResponseIncompleteTransfer;
+        return;
+    }
+
+    MTPStorage *storage = this->getStorage(op.params[0]);
+    if (storage == NULL) {
+        resp->code = ResponseInvalidStorageId;
+        return;
+    }
 
     MTPContainer cont = this->createDataContainer(op);
-    std::vector<u32> handles;
+    cont.write<u32>(0); // Count, filled in once the folder's been listed
+    u32 count = 0;
 
-    std::string dir;
+    fs::path dir;
 
     if (op.params[2] == 0xFFFFFFFF) 
-        dir = info.first + ":/";
+        dir = storage->root();
     else
-        dir = this->object_handles[op.params[2]];
+        dir = this->getObjectPath(op.params[2]);
     DEBUG_PRINT("DIR: %s", dir.c_str());
 
-    for (const auto & entry : fs::directory_iterator(dir)) {
-        fs::path path = entry.path();
+    /* Filtering here saves the host an ObjectInfo round trip for every object it isn't interested in */
+    u16 format = op.params[1];
+
+    storage->list(dir, [this, storage, format, &cont, &count](const fs::path &path, bool is_dir) {
+        if (format != 0 && formatDetect(storage, path, is_dir) != format)
+            return true;
 
         u32 handle = this->getObjectHandle(path);
         DEBUG_PRINT("OBJECT: 0x%x %s", handle, path.c_str());
 
-        handles.push_back(handle);
-    }
+        cont.write(handle);
+        count++;
+        return true;
+    });
 
-    cont.write(handles);
+    memcpy(cont.data, &count, sizeof(count));
     this->writeContainer(cont);
 
     resp->code = ResponseOk;
 }
 
-void MTPResponder::GetObjectInfo(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::GetObjectInfo(const MTPOperation &op, MTPResponse *resp) {
     DEBUG_PRINT("GetObjectInfo");
     MTPContainer cont = this->createDataContainer(op);
 
-    fs::path path = this->object_handles[op.params[0]];
+    fs::path path = this->getObjectPath(op.params[0]);
     DEBUG_PRINT("PATH: %s", path.c_str());
 
-    std::string drive = path.string();
-    drive.resize(drive.find(":"));
-    drive.shrink_to_fit();
-    DEBUG_PRINT("DRIVE: %s", drive.c_str());
-
-    u32 storage_id;
-    for (auto store : this->storages) {
-        if (store.second.first == drive) {
-            storage_id = store.first;
-            break;
-        }
-    }
+    u32 storage_id = this->getStorageId(path);
+    MTPStorage *storage = this->getStorage(storage_id);
     DEBUG_PRINT("STORAGE ID: %#x", storage_id);
 
-    cont.write(storage_id); // Storage ID
-
-    std::error_code ec;
-    DEBUG_PRINT("CHECK DIRECTORY");
-    bool is_dir = fs::is_directory(path, ec);
-    if (ec.value() != 0)
-        is_dir = false;
+    MTPStorageStat path_stat;
+    if (storage == NULL || !storage->stat(path, &path_stat)) {
+        resp->code = ResponseInvalidObjectHandle;
+        return;
+    }
 
-    if (is_dir)
-        cont.write<u16>(FormatAssociation); // Object Format
-    else
-        cont.write<u16>(FormatUndefined);
+    this->handles.update(op.params[0], path_stat.size, path_stat.mtime);
 
+    cont.write(storage_id); // Storage ID
+    cont.write(formatDetect(storage, path, path_stat.is_dir)); // Object Format
     cont.write<u16>(0); // Protection Status
+    cont.write((u32) std::min<u64>(path_stat.size, 0xFFFFFFFF)); // Object Compressed Size
 
-    DEBUG_PRINT("FILE SIZE");
-    u32 size = fs::file_size(path, ec);
-    if (ec.value() < 0)
-        size = 0;
-    cont.write(size); // Object Compressed Size
+    MTPThumbnail thumb = {FormatUndefined, 0, 0, 0};
+    if (!path_stat.is_dir && !this->thumbnails.cached(path, path_stat.size, path_stat.mtime, &thumb))
+        thumb = {FormatUndefined, 0, 0, 0};
 
-    cont.write<u16>(FormatUndefined); // Thumb Format
-    cont.write<u32>(0); // Thumb Compressed Size
-    cont.write<u32>(0); // Thumb Pix Width
-    cont.write<u32>(0); // Thumb Pix Height
+    cont.write(thumb.format); // Thumb Format
+    cont.write(thumb.size); // Thumb Compressed Size
+    cont.write(thumb.width); // Thumb Pix Width
+    cont.write(thumb.height); // Thumb Pix Height
     cont.write<u32>(0); // Image Pix Width
     cont.write<u32>(0); // Image Pix Height
     cont.write<u32>(0); // Image Bit Depth
@@ -835,7 +1238,7 @@ void MTPResponder::GetObjectInfo(MTPOperation op, MTPResponse *resp) {
     fs::path parent = path.parent_path();
     DEBUG_PRINT("FILENAME: %s", path.filename().c_str());
     DEBUG_PRINT("PARENT: %s", parent.c_str());
-    if (parent.string() == this->storages[storage_id].first + ":")
+    if (parent.string() == storage->drive + ":")
         cont.write<u32>(0); // Parent Object
     else
         cont.write(this->getObjectHandle(parent.string()));
@@ -843,20 +1246,18 @@ void MTPResponder::GetObjectInfo(MTPOperation op, MTPResponse *resp) {
     cont.write<u16>(1); // Association Type
     cont.write<u32>(1); // Association Description
     cont.write<u32>(0); // Sequence Number
-    cont.write(path.filename().u16string()); // Filename
-
-    struct stat path_stat;
-    stat(path.c_str(), &path_stat);
+    cont.writeFilename(path); // Filename
 
     char date[16];
     char16_t date16[16];
 
-    strftime(date, 16, "%Y%m%dT%H%M%S", localtime(&path_stat.st_ctime));
+    time_t ctime = path_stat.ctime, mtime = path_stat.mtime;
+    strftime(date, 16, "%Y%m%dT%H%M%S", localtime(&ctime));
     DEBUG_PRINT("CREATED: %s", date);
     std::copy(date, date + 16, date16);
     cont.write(date16); // Date created
 
-    strftime(date, 16, "%Y%m%dT%H%M%S", localtime(&path_stat.st_mtime));
+    strftime(date, 16, "%Y%m%dT%H%M%S", localtime(&mtime));
     DEBUG_PRINT("MODIFIED: %s", date);
     std::copy(date, date + 16, date16);
     cont.write(date16); // Date modified
@@ -868,108 +1269,206 @@ void MTPResponder::GetObjectInfo(MTPOperation op, MTPResponse *resp) {
     resp->code = ResponseOk;
 }
 
-void MTPResponder::GetDevicePropValue(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::GetDevicePropValue(const MTPOperation &op, MTPResponse *resp) {
     resp->code = ResponseDevicePropNotSupported;
 
     switch (op.params[0]) {
-        case PropertyDeviceFriendlyName:
+        case PropertyDeviceFriendlyName: {
             MTPContainer cont = this->createDataContainer(op);
             cont.write(u"Nintendo Switch");
             this->writeContainer(cont);
             resp->code = ResponseOk;
-            break;
+        } break;
+        case PropertyTuphlosStatistics: {
+            MTPContainer cont = this->createDataContainer(op);
+            u32 length = this->stats.operationCount() * sizeof(MTPOperationStats);
+            cont.write(length);
+            cont.write(this->stats.operations(), length);
+            this->writeContainer(cont);
+            resp->code = ResponseOk;
+        } break;
+        case PropertyTuphlosMemory: {
+            MTPContainer cont = this->createDataContainer(op);
+            u32 length = MemorySubsystems * sizeof(MTPMemoryUsage);
+            cont.write(length);
+            cont.write(this->memoryReport().usage(), length);
+            this->writeContainer(cont);
+            resp->code = ResponseOk;
+        } break;
     }
 }
 
-void MTPResponder::GetObject(MTPOperation op, MTPResponse *resp) {
+/* The header shares the first transfer with the start of the data. After that the file
+   is read straight into the buffer the transfer is posted from */
+bool MTPResponder::sendFile(const MTPOperation &op, MTPStorageFile *file, u64 offset, u64 size) {
+    MTPContainerHeader header = this->createDataHeader(op, size);
+    memcpy(this->object_buffer, &header, sizeof(header));
+
+    bool ok = true;
+    u64 pos = 0;
+    size_t prefix = sizeof(header);
+    do {
+        size_t to_read = std::min(size - pos, OBJECT_BUFFER_SIZE - prefix);
+        DEBUG_PRINT("TO READ: %#lx; POS: %#lx", to_read, pos);
+
+        /* The length is already promised, so a file that shrank underneath us gets padded out */
+        s64 xferd = file->read(offset + pos, this->object_buffer + prefix, to_read);
+        if (xferd != (s64) to_read) {
+            xferd = std::max<s64>(xferd, 0);
+            memset(this->object_buffer + prefix + xferd, 0, to_read - xferd);
+            ok = false;
+        }
 
-    fs::path path = this->object_handles[op.params[0]];
-    DEBUG_PRINT("PATH: %s", path.c_str());
+        if (R_FAILED(this->UsbXfer(EndpointIn, NULL, this->object_buffer, prefix + to_read)))
+            return false;
 
-    std::ifstream ifs(path, std::ios::binary);
+        pos += to_read;
+        prefix = 0;
 
-    if (ifs.good()) {
-        u64 size = fs::file_size(path), pos = 0;
-        DEBUG_PRINT("SIZE: %#lx", size);
-        u64 to_read = std::min(size, BUF_SIZE - sizeof(MTPContainerHeader));
+        /* The header had to go out first, the transport may be able to take it from here */
+        MTPFileTransfer xfer;
+        if (pos < size && this->fileXfer(EndpointIn, file, offset + pos, size - pos, &xfer))
+            return R_SUCCEEDED(xfer.rc) && xfer.file_ok && ok;
+    } while (pos < size);
 
-        /* Put this in its own scope so that the MTPContainer gets dealt with */
-        {
-            MTPContainer cont = this->createDataContainer(op);
-            cont.header.length += std::min(size, 0xFFFFFFFFUL - sizeof(MTPContainerHeader));
-            DEBUG_PRINT("TO READ: %#lx", to_read);
-            cont.data = (u8 *) malloc(to_read);
-            ifs.read((char *) cont.data, to_read);
-            pos += to_read;
-            this->writeContainer(cont);
-        }
+    return ok;
+}
 
-        while (pos < size) {
-            to_read = std::min(size - pos, BUF_SIZE);
-            DEBUG_PRINT("TO READ: %#lx; POS: %#lx", to_read, pos);
+void MTPResponder::GetObject(const MTPOperation &op, MTPResponse *resp) {
+    fs::path path = this->getObjectPath(op.params[0]);
+    DEBUG_PRINT("PATH: %s", path.c_str());
 
-            ifs.read((char *) this->write_buffer, to_read);
+    /* Small objects that were sent before go out from memory, without touching the storage at all */
+    const std::vector<u8> *cached = this->compression == CompressionNone ? this->contents.lookup(op.params[0]) : NULL;
+    if (cached != NULL) {
+        DEBUG_PRINT("CACHED: %#lx", cached->size());
+        this->beginBulk(op, cached->size());
+        this->writeBulk(cached->data(), cached->size());
+        resp->code = this->endBulk() ? ResponseOk : ResponseIncompleteTransfer;
+        return;
+    }
 
-            pos += to_read;
-            this->UsbXfer(g_endpoint_in, NULL, this->write_buffer, to_read);
-        }
+    MTPStorage *storage = this->getObjectStorage(path);
+    MTPStorageFile *file = storage != NULL ? storage->open(path, FileRead) : NULL;
+    if (file == NULL) {
+        resp->code = ResponseAccessDenied;
+        return;
+    }
 
-        resp->code = ResponseOk;
+    u64 size = file->size();
+    DEBUG_PRINT("SIZE: %#lx", size);
+
+    bool ok;
+    if (this->compression != CompressionNone) {
+        ok = this->sendCompressed(op, file, size);
+    } else if (this->contents.wants(size)) {
+        std::vector<u8> data(size);
+        if (file->read(0, data.data(), size) == (s64) size) {
+            this->beginBulk(op, size);
+            this->writeBulk(data.data(), size);
+            ok = this->endBulk();
+            if (ok)
+                this->contents.store(op.params[0], std::move(data));
+        } else {
+            ok = this->sendFile(op, file, 0, size);
+        }
     } else {
-        resp->code = ResponseAccessDenied;
+        ok = this->sendFile(op, file, 0, size);
+    }
+
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
+    delete file;
+}
+
+void MTPResponder::GetThumb(const MTPOperation &op, MTPResponse *resp) {
+    fs::path path = this->getObjectPath(op.params[0]);
+    DEBUG_PRINT("PATH: %s", path.c_str());
+
+    MTPStorage *storage = this->getObjectStorage(path);
+    MTPStorageStat path_stat;
+    std::vector<u8> thumb;
+    if (storage == NULL || !storage->stat(path, &path_stat) ||
+        !this->thumbnails.read(storage, path, path_stat.size, path_stat.mtime, &thumb)) {
+        resp->code = ResponseNoThumbnailPresent;
+        return;
     }
-    ifs.close();
+
+    MTPContainer cont = this->createDataContainer(op);
+    cont.write(thumb.data(), thumb.size());
+    this->writeContainer(cont);
+
+    resp->code = ResponseOk;
 }
 
-void MTPResponder::DeleteObject(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::DeleteObject(const MTPOperation &op, MTPResponse *resp) {
     if (op.params[0] == 0xFFFFFFFF) { // Sorry, but I'm not gonna let the user delete everything on a storage in one fell swoop
         resp->code = ResponseObjectWriteProtected;
     } else {
-        fs::path path = this->object_handles[op.params[0]];
+        fs::path path = this->getObjectPath(op.params[0]);
         DEBUG_PRINT("PATH: %s", path.c_str());
-        std::error_code ec;
-        bool is_dir = fs::is_directory(path, ec);
-        if (ec.value() != 0) {
+
+        u32 storage_id = this->getStorageId(path);
+        MTPStorage *storage = this->getStorage(storage_id);
+        MTPStorageStat path_stat;
+        if (storage == NULL || !storage->stat(path, &path_stat) || !storage->remove(path)) {
             resp->code = ResponseAccessDenied;
             return;
         }
-        if (is_dir) {
-            fs::remove_all(path, ec);
-            if (rmdir(path.c_str()) == 0)
-                ec.clear();
 
-        } else {
-            fs::remove(path, ec);
-        }
+        /* What a whole tree freed up isn't worth walking it for, the storage gets asked instead */
+        if (path_stat.is_dir)
+            this->capacity.invalidate(storage_id);
+        else
+            this->capacity.adjust(storage_id, -(s64) path_stat.size);
 
-        DEBUG_PRINT("ERROR: %#x %s", ec.value(), ec.message().c_str());
+        this->forgetObjectPaths(op.params[0]);
+        this->handles.remove(op.params[0]);
 
-        if (ec.value() != 0)
-            resp->code = ResponseAccessDenied;
-        else
-            resp->code = ResponseOk;
+        resp->code = ResponseOk;
     }
 }
 
-void MTPResponder::SendObjectInfo(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::abortSendObject() {
+    if (this->send_object_file == NULL)
+        return;
+
+    /* Nothing was sent for it, so it's left empty like it would have been before */
+    this->send_object_file->setSize(0);
+    delete this->send_object_file;
+    this->send_object_file = NULL;
+}
+
+void MTPResponder::SendObjectInfo(const MTPOperation &op, MTPResponse *resp) {
     DEBUG_PRINT("SEND OBJECT INFO");
     MTPContainer cont = this->readContainer();
 
-    auto store_info = this->storages[op.params[0]];
+    MTPStorage *storage = this->getStorage(op.params[0]);
+    if (storage == NULL) {
+        resp->code = ResponseInvalidStorageId;
+        return;
+    }
+
     fs::path parent;
     if (op.params[1] == 0xFFFFFFFF)
-        parent = store_info.first + ":";
+        parent = storage->drive + ":";
     else
-        parent = this->object_handles[op.params[1]];
+        parent = this->getObjectPath(op.params[1]);
     DEBUG_PRINT("PARENT: %s", parent.c_str());
 
+    if (parent.empty()) {
+        resp->code = ResponseInvalidParentObject;
+        return;
+    }
+
     cont.read<u32>(); // Unused StorageID
     bool is_dir = (cont.read<u16>() == FormatAssociation); // Object Format
     DEBUG_PRINT("IS DIR: %d", is_dir);
     cont.read<u16>(); // Unused Protection Status
-    cont.read<u32>(); // Object Compressed Size
+    u32 size = cont.read<u32>(); // Object Compressed Size, 0xFFFFFFFF if it's 4GiB or more
+    DEBUG_PRINT("SIZE: %#x", size);
 
-    for (int i=0; i<7; i++) // A whole bunch of unused stuff
+    cont.read<u16>(); // Unused Thumb Format
+    for (int i=0; i<7; i++) // A whole bunch of unused stuff, up to and including the Parent Object
         cont.read<u32>();
 
     cont.read<u16>(); // Unused Association Type
@@ -986,22 +1485,29 @@ void MTPResponder::SendObjectInfo(MTPOperation op, MTPResponse *resp) {
     DEBUG_PRINT("NAME: %s", fs::path(name).c_str());
 
     if (is_dir) {
-        std::error_code ec;
-        fs::create_directory(parent / fs::path(name), ec);
-        if (ec.value() == 0)
+        if (storage->createDirectory(parent / fs::path(name)))
             resp->code = ResponseOk;
         else
             resp->code = ResponseAccessDenied;
+    } else if (size != 0xFFFFFFFF && size > this->capacity.available(op.params[0])) {
+        resp->code = ResponseStoreFull;
     } else {
-        std::ofstream ofs(parent / fs::path(name));
+        this->abortSendObject();
 
-        if (ofs.good()) {
-            ofs << "";
-            resp->code = ResponseOk;
-        } else {
+        /* Reserving the whole object up front keeps its clusters contiguous, and running
+           out of space is found out now rather than partway through the transfer */
+        fs::path path = parent / fs::path(name);
+        this->send_object_file = storage->open(path, FileWrite | FileCreate);
+        if (this->send_object_file == NULL) {
             resp->code = ResponseAccessDenied;
+        } else if (size != 0xFFFFFFFF && !this->send_object_file->reserve(size)) {
+            delete this->send_object_file;
+            this->send_object_file = NULL;
+            storage->remove(path);
+            resp->code = ResponseStoreFull;
+        } else {
+            resp->code = ResponseOk;
         }
-        ofs.close();
     }
 
     if (resp->code == ResponseOk) {
@@ -1014,48 +1520,135 @@ void MTPResponder::SendObjectInfo(MTPOperation op, MTPResponse *resp) {
     }
 }
 
-void MTPResponder::SendObject(MTPOperation op, MTPResponse *resp) {
-    if (this->send_object_handle == 0) {
-        resp->code = ResponseNoValidObjectInfo;
-    } else {
-        fs::path path = this->object_handles[this->send_object_handle];
+/* The first transfer comes in with the header. The transport may be able to write the rest to the file
+   by itself, if not it lands in object_buffer a whole transfer at a time and is written from there */
+bool MTPResponder::receiveFile(MTPStorageFile *file, u64 *out_size) {
+    u64 size, pos = 0;
+    bool ok = true;
+
+    /*  Put this in its own scope so that the MTPContainer gets dealt with */
+    {
+        MTPContainer cont = this->readContainer();
+        size = cont.header.length - sizeof(MTPContainerHeader);
+        u64 to_write = std::min(cont.header.length, (u32) BUF_SIZE) - sizeof(MTPContainerHeader);
+        ok = file->write(0, cont.data, to_write) == (s64) to_write;
+        pos += to_write;
+
+        /* Objects of 4GiB or more don't fit the length field, so the host ends them with a short packet */
+        if (cont.header.length == 0xFFFFFFFF)
+            size = U64_MAX;
+    }
 
-        std::ofstream ofs(path, std::ios::binary);
+    MTPFileTransfer xfer;
+    bool offloaded = pos < size && this->fileXfer(EndpointOut, file, pos, size - pos, &xfer);
+    if (offloaded) {
+        ok = ok && R_SUCCEEDED(xfer.rc) && xfer.file_ok;
+        pos += xfer.xferd;
+    }
 
-        if (ofs.good()) {
-            u64 size, pos = 0, to_write;
+    while (!offloaded && pos < size) {
+        size_t xferd = 0;
+        size_t to_read = std::min(size - pos, OBJECT_BUFFER_SIZE);
+        if (R_FAILED(this->UsbXfer(EndpointOut, &xferd, this->object_buffer, to_read)))
+            break;
 
-            /*  Put this in its own scope so that the MTPContainer gets dealt with */
-            {
-                MTPContainer cont = this->readContainer();
-                size = cont.header.length - sizeof(MTPContainerHeader);
-                to_write = std::min(cont.header.length, (u32) BUF_SIZE) - sizeof(MTPContainerHeader);
-                ofs.write((char *) cont.data, to_write);
-                pos += to_write;
-            }
+        ok = ok && file->write(pos, this->object_buffer, xferd) == (s64) xferd;
+        pos += xferd;
 
-            while (pos < size) {
-                to_write = std::min(size - pos, BUF_SIZE);
-                this->UsbXfer(g_endpoint_out, NULL, this->read_buffer, to_write);
-                ofs.write((char *) this->read_buffer, to_write);
-                pos += to_write;
-            }
+        if (xferd < to_read)
+            break;
+    }
 
-            this->send_object_handle = 0;
+    *out_size = pos;
+    return ok;
+}
 
-            resp->code = ResponseOk;
-        } else {
-            resp->code = ResponseAccessDenied;
+/* Blocks are packed by the compressor's workers while the ones before them are sent */
+bool MTPResponder::sendCompressed(const MTPOperation &op, MTPStorageFile *file, u64 size) {
+    this->beginBulk(op, U64_MAX);
+    this->compressor->startRead(file, size);
+
+    MTPCompressedBlock *block;
+    while (this->bulk_ok && (block = this->compressor->next()) != NULL) {
+        if (block->raw_size != 0) {
+            MTPCompressedBlockHeader header = {block->raw_size, block->packed_size};
+            this->writeBulk(&header, sizeof(header));
+            this->writeBulk(block->packed_size == block->raw_size ? block->raw : block->packed, block->packed_size);
         }
+        this->compressor->release(block);
+    }
+
+    bool ok = this->compressor->finish(NULL);
+
+    /* Rather than a zero length transfer, which a host with bigger packets would take for the
+       next container, an empty block is added to keep the end off a packet boundary */
+    if (this->bulk_fill % 0x200 == 0) {
+        MTPCompressedBlockHeader empty = {0, 0};
+        this->writeBulk(&empty, sizeof(empty));
+    }
+
+    return this->endBulk() && ok;
+}
+
+bool MTPResponder::receiveCompressed(MTPStorageFile *file, u64 *out_size) {
+    this->beginStream();
+    this->compressor->startWrite(file);
+
+    bool ok = true;
+    MTPCompressedBlockHeader header;
+    while (ok && this->streamRead(&header, sizeof(header))) {
+        ok = header.raw_size <= COMPRESS_BLOCK_SIZE && header.packed_size <= header.raw_size;
+        if (!ok)
+            break;
+
+        MTPCompressedBlock *block = this->compressor->acquire();
+        block->raw_size = header.raw_size;
+        block->packed_size = header.packed_size;
+        block->ok = this->streamRead(block->packed, header.packed_size);
+        ok = block->ok;
+        this->compressor->submit(block);
     }
+    this->endStream();
+
+    return this->compressor->finish(out_size) && ok;
 }
 
-void MTPResponder::GetObjectPropsSupported(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::SendObject(const MTPOperation &op, MTPResponse *resp) {
+    if (this->send_object_handle == 0 || this->send_object_file == NULL) {
+        resp->code = ResponseNoValidObjectInfo;
+        return;
+    }
+
+    u32 handle = this->send_object_handle;
+    fs::path path = this->getObjectPath(handle);
+    MTPStorageFile *file = this->send_object_file;
+    this->send_object_file = NULL;
+    this->send_object_handle = 0;
+
+    u64 pos = 0;
+    bool ok;
+    if (this->compression != CompressionNone)
+        ok = this->receiveCompressed(file, &pos);
+    else
+        ok = this->receiveFile(file, &pos);
+
+    /* The host may have sent less than it declared */
+    ok = file->setSize(pos) && ok;
+    delete file;
+
+    this->capacity.adjust(this->getStorageId(path), pos);
+    this->forgetHashes(handle);
+
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
+}
+
+void MTPResponder::GetObjectPropsSupported(const MTPOperation &op, MTPResponse *resp) {
     MTPContainer cont = this->createDataContainer(op);
 
-    std::vector<u16> obj_props_supported = {
+    static const std::vector<u16> obj_props_supported = {
         PropertyFileName,
         PropertyObjectSize,
+        PropertyPersistentUniqueObjectIdentifier,
     };
     cont.write(obj_props_supported);
 
@@ -1064,7 +1657,7 @@ void MTPResponder::GetObjectPropsSupported(MTPOperation op, MTPResponse *resp) {
     resp->code = ResponseOk;
 }
 
-void MTPResponder::GetObjectPropDesc(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::GetObjectPropDesc(const MTPOperation &op, MTPResponse *resp) {
     resp->code = ResponseInvalidObjectPropCode;
 
     switch (op.params[0]) {
@@ -1096,35 +1689,54 @@ void MTPResponder::GetObjectPropDesc(MTPOperation op, MTPResponse *resp) {
             cont.write<u32>(0);
             cont.write<u8>(0);
 
+            this->writeContainer(cont);
+            resp->code = ResponseOk;
+        } break;
+        case PropertyPersistentUniqueObjectIdentifier: {
+            MTPContainer cont = this->createDataContainer(op);
+
+            cont.write<u16>(PropertyPersistentUniqueObjectIdentifier);
+            cont.write<u16>(TypeU128);
+            cont.write<u8>(0);
+            cont.write<u64>(0); // Default Value, low half
+            cont.write<u64>(0); // High half
+            cont.write<u32>(0);
+            cont.write<u8>(0);
+
             this->writeContainer(cont);
             resp->code = ResponseOk;
         } break;
     }
 }
 
-void MTPResponder::SetObjectPropValue(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::SetObjectPropValue(const MTPOperation &op, MTPResponse *resp) {
     resp->code = ResponseInvalidObjectPropCode;
 
     switch (op.params[1]) {
         case PropertyFileName:
-            fs::path path = this->object_handles[op.params[0]];
+            fs::path path = this->getObjectPath(op.params[0]);
             DEBUG_PRINT("PATH: %s", path.c_str());
             MTPContainer cont = this->readContainer();
 
+            MTPStorage *storage = this->getObjectStorage(path);
+            if (storage == NULL) {
+                resp->code = ResponseInvalidObjectHandle;
+                break;
+            }
+
             std::u16string name = cont.read();
             if (name.length() == 0) {
-                if (fs::is_directory(path))
+                MTPStorageStat stat;
+                if (storage->stat(path, &stat) && stat.is_dir)
                     name = u"Untitled Folder";
                 else
                     name = u"Untitled Document";
             }
             DEBUG_PRINT("NAME: %s", fs::path(name).c_str());
 
-            std::error_code ec;
             fs::path parent = path.parent_path();
-            fs::rename(path, parent / name, ec);
-            if (ec.value() == 0) {
-                this->object_handles[op.params[0]] = parent / name;
+            if (storage->rename(path, parent / name)) {
+                this->setObjectPath(op.params[0], parent / name);
                 resp->code = ResponseOk;
             }
             else
@@ -1134,126 +1746,888 @@ void MTPResponder::SetObjectPropValue(MTPOperation op, MTPResponse *resp) {
     }
 }
 
-void MTPResponder::GetObjectPropValue(MTPOperation op, MTPResponse *resp) {
+void MTPResponder::GetObjectPropValue(const MTPOperation &op, MTPResponse *resp) {
     resp->code = ResponseInvalidObjectPropCode;
 
     switch (op.params[1]) {
         case PropertyFileName: {
-            fs::path path = this->object_handles[op.params[0]];
+            fs::path path = this->getObjectPath(op.params[0]);
             DEBUG_PRINT("PATH: %s", path.c_str());
 
             MTPContainer cont = this->createDataContainer(op);
-            cont.write(path.filename().u16string());
+            cont.writeFilename(path);
             this->writeContainer(cont);
             resp->code = ResponseOk;
         } break;
         case PropertyObjectSize: {
-            fs::path path = this->object_handles[op.params[0]];
+            fs::path path = this->getObjectPath(op.params[0]);
             DEBUG_PRINT("PATH: %s", path.c_str());
 
             MTPContainer cont = this->createDataContainer(op);
 
-            std::error_code ec;
-            u64 size = fs::file_size(path, ec);
-            if (ec.value() != 0)
-                size = 0;
-            cont.write(size);
+            MTPStorage *storage = this->getObjectStorage(path);
+            MTPStorageStat stat;
+            if (storage == NULL || !storage->stat(path, &stat))
+                stat.size = 0;
+            cont.write(stat.size);
 
             this->writeContainer(cont);
             resp->code = ResponseOk;
         } break;
+        case PropertyPersistentUniqueObjectIdentifier: {
+            /* Stays with the object across sessions, restarts and renames, unlike its handle on other responders */
+            u64 low, high;
+            this->handles.uid(op.params[0], &low, &high);
+            if (low == 0) {
+                resp->code = ResponseInvalidObjectHandle;
+                break;
+            }
+
+            MTPContainer cont = this->createDataContainer(op);
+            cont.write(low);
+            cont.write(high);
+            this->writeContainer(cont);
+            resp->code = ResponseOk;
+        } break;
     }
 }
 
-void MTPResponder::GetPartialObject(MTPOperation op, MTPResponse *resp) {
-    fs::path path = this->object_handles[op.params[0]];
+void MTPResponder::GetPartialObject(const MTPOperation &op, MTPResponse *resp) {
+    fs::path path = this->getObjectPath(op.params[0]);
     DEBUG_PRINT("PATH: %s", path.c_str());
 
-    std::ifstream ifs(path, std::ios::binary);
-
-    if (ifs.good()) {
-        u64 size = op.params[2], pos = 0;
-        if (size == 0xFFFFFFFF)
-            size = fs::file_size(path);
-        DEBUG_PRINT("SIZE: %#lx", size);
-
-        ifs.seekg(op.params[1]);
-
-        u64 to_read = std::min(size, BUF_SIZE - sizeof(MTPContainerHeader));
-
-        /* Put this in its own scope so that the MTPContainer gets dealt with */
-        {
-            MTPContainer cont = this->createDataContainer(op);
-            cont.header.length += std::min(size, 0xFFFFFFFFUL - sizeof(MTPContainerHeader));
-            DEBUG_PRINT("TO READ: %#lx", to_read);
-            cont.data = (u8 *) malloc(to_read);
-            ifs.read((char *) cont.data, to_read);
-            pos += to_read;
-            this->writeContainer(cont);
-        }
+    if (this->readahead == NULL)
+        this->readahead = new MTPReadAhead();
 
-        while (pos < size) {
-            to_read = std::min(size - pos, BUF_SIZE);
-            DEBUG_PRINT("TO READ: %#lx; POS: %#lx", to_read, pos);
+    MTPStorage *storage = this->getObjectStorage(path);
+    u64 file_size;
+    MTPStorageFile *file = storage != NULL ? this->readahead->open(op.params[0], storage, path, &file_size) : NULL;
+    if (file == NULL) {
+        resp->code = ResponseAccessDenied;
+        return;
+    }
 
-            ifs.read((char *) this->write_buffer, to_read);
+    /* Only what's actually there gets sent, the response says how much that was */
+    u64 offset = std::min<u64>(op.params[1], file_size);
+    u64 size = std::min<u64>(op.params[2], file_size - offset);
+    DEBUG_PRINT("OFFSET: %#lx; SIZE: %#lx", offset, size);
 
-            pos += to_read;
-            this->UsbXfer(g_endpoint_in, NULL, this->write_buffer, to_read);
-        }
+    /* What's been read ahead goes out from memory, anything else straight from the file */
+    bool ok;
+    this->beginBulk(op, size);
+    if (this->readahead->read(op.params[0], offset, size, [this](const u8 *data, size_t chunk) { this->writeBulk(data, chunk); }))
+        ok = this->endBulk();
+    else
+        ok = this->sendFile(op, file, offset, size);
+    this->readahead->advance(op.params[0], offset, size);
 
-        resp->params.push_back((u32) pos);
-        resp->code = ResponseOk;
-    } else {
-        resp->code = ResponseAccessDenied;
-    }
-    ifs.close();
+    resp->params.push_back((u32) size);
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
 }
 
-void MTPResponder::MoveObject(MTPOperation op, MTPResponse *resp) {
-    auto store_info = this->storages[op.params[1]];
+void MTPResponder::MoveObject(const MTPOperation &op, MTPResponse *resp) {
+    MTPStorage *storage = this->getStorage(op.params[1]);
+    if (storage == NULL) {
+        resp->code = ResponseInvalidStorageId;
+        return;
+    }
 
     fs::path parent;
     if (op.params[2] == 0)
-        parent = store_info.first + ":";
+        parent = storage->drive + ":";
     else
-        parent = this->object_handles[op.params[2]];
+        parent = this->getObjectPath(op.params[2]);
 
-    fs::path path = this->object_handles[op.params[0]];
+    fs::path path = this->getObjectPath(op.params[0]);
     DEBUG_PRINT("PATH: %s; PARENT: %s", path.c_str(), parent.c_str());
 
-    std::error_code ec;
-    fs::rename(path, parent / path.filename(), ec);
+    if (parent.empty()) {
+        resp->code = ResponseInvalidParentObject;
+        return;
+    }
 
-    if (ec.value() == 0)
+    /* Moving between storages isn't a rename, and the source provider refuses it */
+    MTPStorage *src_storage = this->getObjectStorage(path);
+    if (src_storage != NULL && src_storage->rename(path, parent / path.filename())) {
+        this->setObjectPath(op.params[0], parent / path.filename());
         resp->code = ResponseOk;
+    }
     else
         resp->code = ResponseAccessDenied;
 }
 
-void MTPResponder::CopyObject(MTPOperation op, MTPResponse *resp) {
-    auto store_info = this->storages[op.params[1]];
+/* Folders are copied with everything in them. The archive reader reads ahead on its own thread
+   while the files it's read are written here, so the two cards' worth of I/O overlap */
+void MTPResponder::CopyObject(const MTPOperation &op, MTPResponse *resp) {
+    MTPStorage *dst_storage = this->getStorage(op.params[1]);
+    if (dst_storage == NULL) {
+        resp->code = ResponseInvalidStorageId;
+        return;
+    }
 
     fs::path parent;
     if (op.params[2] == 0)
-        parent = store_info.first + ":";
+        parent = dst_storage->drive + ":";
     else
-        parent = this->object_handles[op.params[2]];
+        parent = this->getObjectPath(op.params[2]);
 
-    fs::path path = this->object_handles[op.params[0]];
+    fs::path path = this->getObjectPath(op.params[0]);
     DEBUG_PRINT("PATH: %s; PARENT: %s", path.c_str(), parent.c_str());
 
+    if (parent.empty()) {
+        resp->code = ResponseInvalidParentObject;
+        return;
+    }
+
+    /* Opening the destination would truncate the source, and a folder can't go inside itself */
     fs::path new_path = parent / path.filename();
-    
-    std::ifstream src(path, std::ios::binary);
-    std::ofstream dst(new_path, std::ios::binary);
+    std::string prefix = path.native() + "/";
+    if (new_path == path || parent == path || parent.native().compare(0, prefix.size(), prefix) == 0) {
+        resp->code = ResponseInvalidParentObject;
+        return;
+    }
 
-    if (src.good() && dst.good()) {
-        dst << src.rdbuf();
+    MTPStorage *src_storage = this->getObjectStorage(path);
+    MTPStorageStat stat;
+    if (src_storage == NULL || !src_storage->stat(path, &stat)) {
+        resp->code = ResponseAccessDenied;
+        return;
+    }
+
+    u64 size = stat.size;
+    if (stat.is_dir) {
+        size = 0;
+        src_storage->walk(path, [src_storage, &size](const fs::path &child, bool is_dir) {
+            MTPStorageStat child_stat;
+            if (!is_dir && src_storage->stat(child, &child_stat))
+                size += child_stat.size;
+            return true;
+        });
+    }
+
+    if (size > this->capacity.available(op.params[1])) {
+        resp->code = ResponseStoreFull;
+        return;
+    }
 
-        resp->params.push_back(this->getObjectHandle(new_path));
+    if (this->archive_reader == NULL)
+        this->archive_reader = new MTPArchiveReader();
+    if (this->archive_writer == NULL)
+        this->archive_writer = new MTPArchiveWriter();
+
+    /* Both ends stay block aligned until the tail of every file, so this can skip the page cache entirely */
+    this->archive_reader->start({{src_storage, path}}, FileDirect);
+    this->archive_writer->begin(dst_storage, parent, FileDirect);
+
+    MTPArchivePiece *piece;
+    while ((piece = this->archive_reader->next()) != NULL) {
+        this->archive_writer->write(piece);
+        this->archive_reader->release(piece);
+    }
+
+    this->archive_writer->end();
+    bool ok = this->archive_reader->finish();
+    this->registerEntries(op.params[1], op.params[2], &ok);
+
+    /* A single file that didn't make it isn't left behind half written. A folder keeps whatever did */
+    if (!ok) {
+        if (!stat.is_dir) {
+            dst_storage->remove(new_path);
+            this->capacity.invalidate(op.params[1]);
+        }
+        resp->code = ResponseAccessDenied;
+        return;
+    }
+
+    resp->params.push_back(this->getObjectHandle(new_path));
+    resp->code = ResponseOk;
+}
+
+void MTPResponder::forgetHashes(u32 handle) {
+    u64 uid, seed;
+    this->handles.uid(handle, &uid, &seed);
+    this->hashes.forget(uid);
+}
+
+/* Params are the handle, the algorithm, the offset as two halves and the length, zero meaning up to the end.
+   The data phase says what was hashed, as the algorithm, offset, length and digest */
+void MTPResponder::HashObject(const MTPOperation &op, MTPResponse *resp) {
+    fs::path path = this->getObjectPath(op.params[0]);
+    DEBUG_PRINT("PATH: %s; ALGORITHM: %u", path.c_str(), op.params[1]);
+
+    MTPStorage *storage = this->getObjectStorage(path);
+    MTPStorageStat stat;
+    if (storage == NULL || !storage->stat(path, &stat) || stat.is_dir) {
+        resp->code = ResponseInvalidObjectHandle;
+        return;
+    }
+
+    u16 algorithm = op.params[1];
+    if (hashDigestLength(algorithm) == 0) {
+        resp->code = ResponseInvalidParameter;
+        return;
+    }
+
+    u64 offset = std::min(op.params[2] | ((u64) op.params[3] << 32), stat.size);
+    u64 length = op.params[4] == 0 ? stat.size - offset : std::min<u64>(op.params[4], stat.size - offset);
+
+    /* Checking a whole card against a backup mostly asks about files that haven't changed since last time */
+    u64 uid, seed;
+    u8 digest[HASH_DIGEST_MAX];
+    this->handles.uid(op.params[0], &uid, &seed);
+    if (!this->hashes.lookup(uid, stat.size, stat.mtime, algorithm, offset, length, digest)) {
+        MTPStorageFile *file = storage->open(path, FileRead | FileDirect);
+        if (file == NULL) {
+            resp->code = ResponseAccessDenied;
+            return;
+        }
+
+        MTPHasher *hasher = MTPHasher::create(algorithm);
+        bool ok = true;
+        for (u64 pos = 0; ok && pos < length;) {
+            s64 xferd = file->read(offset + pos, this->object_buffer, std::min(length - pos, OBJECT_BUFFER_SIZE));
+            ok = xferd > 0;
+            if (ok)
+                hasher->update(this->object_buffer, xferd);
+            pos += std::max<s64>(xferd, 0);
+        }
+        hasher->finish(digest);
+        delete hasher;
+        delete file;
+
+        if (!ok) {
+            resp->code = ResponseGeneralError;
+            return;
+        }
+
+        if (uid != 0)
+            this->hashes.store(uid, stat.size, stat.mtime, algorithm, offset, length, digest);
+    }
+
+    MTPContainer cont = this->createDataContainer(op);
+    cont.write(algorithm);
+    cont.write(offset);
+    cont.write(length);
+    cont.write(digest, hashDigestLength(algorithm));
+    this->writeContainer(cont);
+
+    resp->code = ResponseOk;
+}
+
+void MTPResponder::GetSignatures(const MTPOperation &op, MTPResponse *resp) {
+    fs::path path = this->getObjectPath(op.params[0]);
+    DEBUG_PRINT("PATH: %s; BLOCK SIZE: %u", path.c_str(), op.params[1]);
+
+    MTPStorage *storage = this->getObjectStorage(path);
+    MTPStorageStat stat;
+    if (storage == NULL || !storage->stat(path, &stat) || stat.is_dir) {
+        resp->code = ResponseInvalidObjectHandle;
+        return;
+    }
+
+    MTPStorageFile *file = storage->open(path, FileRead | FileDirect);
+    if (file == NULL) {
+        resp->code = ResponseAccessDenied;
+        return;
+    }
+
+    u32 block_size = op.params[1] == 0 ? deltaBlockSize(stat.size) : std::clamp<u32>(op.params[1], DELTA_BLOCK_MIN, DELTA_BLOCK_MAX);
+    MTPDeltaSignatureHeader header = {block_size, stat.size, (u32) ((stat.size + block_size - 1) / block_size)};
+    this->beginData(op, sizeof(header) + (u64) header.count * sizeof(MTPDeltaSignature));
+    this->writeData(&header, sizeof(header));
+
+    /* The length is already promised, so blocks that can't be read still get signatures, of zeros */
+    bool ok = true;
+    size_t chunk_size = OBJECT_BUFFER_SIZE / block_size * block_size;
+    for (u64 pos = 0; pos < stat.size; pos += chunk_size) {
+        size_t chunk = std::min<u64>(stat.size - pos, chunk_size);
+        s64 xferd = file->read(pos, this->object_buffer, chunk);
+        if (xferd != (s64) chunk) {
+            memset(this->object_buffer + std::max<s64>(xferd, 0), 0, chunk - std::max<s64>(xferd, 0));
+            ok = false;
+        }
+
+        for (size_t offset = 0; offset < chunk; offset += block_size) {
+            size_t length = std::min<size_t>(chunk - offset, block_size);
+            MTPDeltaSignature signature = {
+                deltaWeakChecksum(this->object_buffer + offset, length),
+                hashXXH3(this->object_buffer + offset, length),
+            };
+            this->writeData(&signature, sizeof(signature));
+        }
+    }
+    this->flushData();
+    delete file;
+
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
+}
+
+void MTPResponder::SendDelta(const MTPOperation &op, MTPResponse *resp) {
+    fs::path path = this->getObjectPath(op.params[0]);
+    DEBUG_PRINT("PATH: %s; BLOCK SIZE: %u", path.c_str(), op.params[1]);
+
+    /* The data phase has to be taken in whatever happens, the response can only come after it */
+    this->beginStream();
+
+    u32 storage_id = this->getStorageId(path);
+    MTPStorage *storage = this->getStorage(storage_id);
+    MTPStorageStat stat;
+    if (storage == NULL || !storage->stat(path, &stat) || stat.is_dir) {
+        this->endStream();
+        resp->code = ResponseInvalidObjectHandle;
+        return;
+    }
+
+    u64 block_size = op.params[1];
+    u64 size;
+    if (block_size == 0 || !this->streamRead(&size, sizeof(size))) {
+        this->endStream();
+        resp->code = ResponseInvalidParameter;
+        return;
+    }
+
+    /* The old content stays until the new one is complete, so both have to fit */
+    if (size > this->capacity.available(storage_id)) {
+        this->endStream();
+        resp->code = ResponseStoreFull;
+        return;
+    }
+
+    fs::path temp = path.parent_path() / ("." + path.filename().string() + ".delta");
+    MTPStorageFile *base = storage->open(path, FileRead);
+    MTPStorageFile *file = storage->open(temp, FileWrite | FileCreate);
+    if (base == NULL || file == NULL || !file->reserve(size)) {
+        this->endStream();
+        resp->code = file == NULL || base == NULL ? ResponseAccessDenied : ResponseStoreFull;
+        delete base;
+        delete file;
+        if (file != NULL)
+            storage->remove(temp);
+        return;
+    }
+
+    /* object_buffer holds the stream, copies from the old content need their own */
+    u8 *copy_buffer = (u8 *) memalign(0x1000, OBJECT_BUFFER_SIZE);
+    u64 expected = ((u64) op.params[2] << 32) | op.params[3];
+    MTPHasher *hasher = expected != 0 ? MTPHasher::create(HashXXH3) : NULL;
+
+    u64 pos = 0;
+    bool ok = true, ended = false;
+    while (ok && !ended) {
+        u8 instruction;
+        ok = this->streamRead(&instruction, sizeof(instruction));
+        if (!ok)
+            break;
+
+        switch (instruction) {
+            case DeltaEnd:
+                ended = true;
+                break;
+            case DeltaCopy: {
+                u32 blocks[2];
+                ok = this->streamRead(blocks, sizeof(blocks));
+                u64 from = std::min(blocks[0] * block_size, stat.size);
+                u64 length = std::min(blocks[1] * block_size, stat.size - from);
+                ok = ok && pos + length <= size;
+
+                for (u64 copied = 0; ok && copied < length;) {
+                    s64 xferd = base->read(from + copied, copy_buffer, std::min(length - copied, OBJECT_BUFFER_SIZE));
+                    ok = xferd > 0 && file->write(pos, copy_buffer, xferd) == xferd;
+                    if (ok && hasher != NULL)
+                        hasher->update(copy_buffer, xferd);
+                    copied += std::max<s64>(xferd, 0);
+                    pos += std::max<s64>(xferd, 0);
+                }
+                break;
+            }
+            case DeltaLiteral: {
+                u32 length;
+                ok = this->streamRead(&length, sizeof(length)) && pos + length <= size;
+
+                /* Literals go to the file straight from the transfer they came in */
+                while (ok && length > 0) {
+                    const u8 *data;
+                    size_t chunk = this->streamNext(&data, length);
+                    ok = chunk > 0 && file->write(pos, data, chunk) == (s64) chunk;
+                    if (ok && hasher != NULL)
+                        hasher->update(data, chunk);
+                    pos += chunk;
+                    length -= chunk;
+                }
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+    }
+    this->endStream();
+    free(copy_buffer);
+    delete base;
+
+    bool complete = ok && ended && pos == size;
+    complete = file->setSize(pos) && complete;
+    delete file;
+
+    bool verified = complete;
+    if (complete && hasher != NULL) {
+        u8 digest[sizeof(u64)];
+        hasher->finish(digest);
+        verified = __builtin_bswap64(*(u64 *) digest) == expected;
+    }
+    delete hasher;
+
+    if (!verified || !storage->replace(temp, path)) {
+        storage->remove(temp);
+        resp->code = !complete ? ResponseIncompleteTransfer : !verified ? ResponseGeneralError : ResponseAccessDenied;
+        return;
+    }
+
+    this->capacity.adjust(storage_id, (s64) size - (s64) stat.size);
+    this->forgetHashes(op.params[0]);
+    resp->code = ResponseOk;
+}
+
+void MTPResponder::SetCompression(const MTPOperation &op, MTPResponse *resp) {
+    DEBUG_PRINT("COMPRESSION: %u", op.params[0]);
+
+    if (op.params[0] > CompressionLZ4) {
+        resp->code = ResponseInvalidParameter;
+        return;
+    }
+
+    if (op.params[0] != CompressionNone && this->compressor == NULL)
+        this->compressor = new MTPCompressor();
+
+    this->compression = op.params[0];
+    resp->code = ResponseOk;
+}
+
+void MTPResponder::SendArchiveList(const MTPOperation &op, MTPResponse *resp) {
+    this->archive_handles.clear();
+
+    u32 count = 0;
+    bool ok = this->beginStream() && this->streamRead(&count, sizeof(count));
+    for (u32 i=0; ok && i<count; i++) {
+        u32 handle;
+        ok = this->streamRead(&handle, sizeof(handle));
+        if (ok)
+            this->archive_handles.push_back(handle);
+    }
+    this->endStream();
+    DEBUG_PRINT("ARCHIVE HANDLES: %lu", this->archive_handles.size());
+
+    if (!ok)
+        this->archive_handles.clear();
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
+}
+
+void MTPResponder::GetArchive(const MTPOperation &op, MTPResponse *resp) {
+    std::vector<std::pair<MTPStorage *, fs::path>> roots;
+
+    if (op.params[0] != 0) {
+        fs::path folder = this->getObjectPath(op.params[0]);
+        DEBUG_PRINT("FOLDER: %s", folder.c_str());
+
+        MTPStorage *storage = this->getObjectStorage(folder);
+        MTPStorageStat stat;
+        if (storage == NULL || !storage->stat(folder, &stat) || !stat.is_dir) {
+            resp->code = ResponseInvalidObjectHandle;
+            return;
+        }
+
+        storage->list(folder, [storage, &roots](const fs::path &path, bool is_dir) {
+            roots.push_back({storage, path});
+            return true;
+        });
+    } else {
+        for (u32 handle : this->archive_handles) {
+            fs::path path = this->getObjectPath(handle);
+            MTPStorage *storage = this->getObjectStorage(path);
+            if (storage == NULL) {
+                resp->code = ResponseInvalidObjectHandle;
+                return;
+            }
+
+            roots.push_back({storage, path});
+        }
+    }
+
+    if (this->archive_reader == NULL)
+        this->archive_reader = new MTPArchiveReader();
+    this->archive_reader->start(roots);
+
+    /* The reader has the files open and read well before they're due, this only puts the tar together */
+    static const u8 zeros[TAR_BLOCK_SIZE] = {};
+    std::vector<u8> header;
+    u64 entry_size = 0, pos = 0;
+
+    this->beginBulk(op, U64_MAX);
+
+    MTPArchivePiece *piece;
+    while (this->bulk_ok && (piece = this->archive_reader->next()) != NULL) {
+        if (piece->first) {
+            header.clear();
+            tarHeader(piece->name, piece->size, piece->mtime, piece->is_dir, &header);
+            this->writeBulk(header.data(), header.size());
+            entry_size = piece->size;
+            pos = 0;
+        }
+
+        this->writeBulk(piece->data, piece->length);
+        pos += piece->length;
+        if (pos == entry_size)
+            this->writeBulk(zeros, tarPadding(entry_size));
+
+        this->archive_reader->release(piece);
+    }
+
+    bool ok = this->archive_reader->finish();
+
+    /* Two zero blocks end the archive. Everything is whole blocks after the container header,
+       so the last transfer always comes up short of a packet */
+    this->writeBulk(zeros, sizeof(zeros));
+    this->writeBulk(zeros, sizeof(zeros));
+
+    ok = this->endBulk() && ok;
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
+}
+
+/* Everything the writer made is registered in one go once it's done, with each folder's handle
+   kept for what's in it rather than looked up again by path. Returns how many objects there are */
+u32 MTPResponder::registerEntries(u32 storage_id, u32 parent_handle, bool *ok) {
+    std::unordered_map<std::string, u32> folder_handles = {{"", parent_handle}};
+    s64 adjust = 0;
+    u32 written = 0;
+
+    this->handles.reserve(this->archive_writer->entries.size());
+    for (const MTPArchiveWriter::Entry &entry : this->archive_writer->entries) {
+        adjust += (s64) entry.size - (s64) entry.replaced;
+        *ok = *ok && entry.ok;
+
+        size_t slash = entry.name.rfind('/');
+        std::string folder = slash != std::string::npos ? entry.name.substr(0, slash) : "";
+        std::string name = slash != std::string::npos ? entry.name.substr(slash + 1) : entry.name;
+        auto it = folder_handles.find(folder);
+        if (it == folder_handles.end())
+            continue;
+
+        /* A file that was there already was written over, even if it didn't all make it */
+        u32 handle = this->handles.find(it->second, storage_id, name);
+        if (handle != 0 && !entry.is_dir)
+            this->forgetHashes(handle);
+        if (!entry.ok)
+            continue;
+
+        if (handle == 0)
+            handle = this->handles.insert(it->second, storage_id, name);
+        if (entry.is_dir)
+            folder_handles[entry.name] = handle;
+        written++;
+    }
+
+    this->capacity.adjust(storage_id, adjust);
+    DEBUG_PRINT("ENTRIES: %lu; WRITTEN: %u", this->archive_writer->entries.size(), written);
+
+    return written;
+}
+
+/* Headers are parsed here as the data comes in, the writer creates and fills everything behind it.
+   Whatever doesn't fit, or isn't a folder or a regular file, is skipped over */
+void MTPResponder::SendArchive(const MTPOperation &op, MTPResponse *resp) {
+    this->beginStream();
+
+    u32 storage_id = op.params[0];
+    MTPStorage *storage = this->getStorage(storage_id);
+    if (storage == NULL) {
+        this->endStream();
+        resp->code = ResponseInvalidStorageId;
+        return;
+    }
+
+    u32 parent_handle = op.params[1] == 0xFFFFFFFF ? 0 : op.params[1];
+    fs::path parent = parent_handle == 0 ? fs::path(storage->drive + ":") : this->getObjectPath(parent_handle);
+    MTPStorageStat stat;
+    if (parent.empty() || this->getStorageId(parent) != storage_id || !storage->stat(parent, &stat) || !stat.is_dir) {
+        this->endStream();
+        resp->code = ResponseInvalidParentObject;
+        return;
+    }
+    DEBUG_PRINT("ARCHIVE PARENT: %s", parent.c_str());
+
+    if (this->archive_writer == NULL)
+        this->archive_writer = new MTPArchiveWriter();
+    this->archive_writer->start(storage, parent);
+
+    auto skip = [this](u64 size) {
+        const u8 *data;
+        while (size != 0) {
+            size_t chunk = this->streamNext(&data, std::min<u64>(size, OBJECT_BUFFER_SIZE));
+            if (chunk == 0)
+                return false;
+            size -= chunk;
+        }
+        return true;
+    };
+
+    auto queue = [this](const std::string &name, u64 size, bool is_dir) {
+        MTPArchivePiece *piece = this->archive_writer->acquire();
+        piece->first = true;
+        piece->name = name;
+        piece->size = size;
+        piece->mtime = 0;
+        piece->is_dir = is_dir;
+        piece->length = 0;
+        return piece;
+    };
+
+    std::unordered_set<std::string> folders;
+    std::string long_name;
+    u64 available = this->capacity.available(storage_id), pending = 0, long_size = U64_MAX;
+    bool ok = true, full = false;
+    int zero_blocks = 0;
+
+    MTPTarHeader header;
+    while (ok && zero_blocks < 2) {
+        ok = this->streamRead(&header, sizeof(header));
+        if (!ok)
+            break;
+
+        static const u8 zeros[TAR_BLOCK_SIZE] = {};
+        if (memcmp(&header, zeros, sizeof(header)) == 0) {
+            zero_blocks++;
+            continue;
+        }
+        zero_blocks = 0;
+
+        std::string name;
+        u64 size;
+        ok = tarRead(&header, &name, &size);
+        if (!ok)
+            break;
+
+        /* GNU long names and pax headers say something about the entry after them */
+        if (header.type == 'L' || header.type == 'x') {
+            std::vector<char> content(size);
+            ok = size < ARCHIVE_SLOT_SIZE && this->streamRead(content.data(), size) && skip(tarPadding(size));
+            if (!ok)
+                break;
+
+            if (header.type == 'L') {
+                long_name.assign(content.data(), strnlen(content.data(), size));
+                continue;
+            }
+
+            /* Records are "<length> <key>=<value>\n" */
+            for (size_t pos = 0; pos < size;) {
+                size_t length = strtoul(content.data() + pos, NULL, 10);
+                const char *space = (const char *) memchr(content.data() + pos, ' ', size - pos);
+                if (length == 0 || pos + length > size || space == NULL || space >= content.data() + pos + length)
+                    break;
+
+                std::string record(space + 1, (const char *) content.data() + pos + length - 1);
+                if (record.compare(0, 5, "path=") == 0)
+                    long_name = record.substr(5);
+                else if (record.compare(0, 5, "size=") == 0)
+                    long_size = strtoull(record.c_str() + 5, NULL, 10);
+                pos += length;
+            }
+            continue;
+        }
+
+        if (!long_name.empty())
+            name = long_name;
+        if (long_size != U64_MAX)
+            size = long_size;
+        long_name.clear();
+        long_size = U64_MAX;
+
+        bool is_dir = header.type == '5' || (header.type == '0' && !name.empty() && name.back() == '/');
+        bool is_file = !is_dir && (header.type == '0' || header.type == '\0');
+        u64 content_size = header.type == '5' ? 0 : size;
+
+        /* Nothing gets out of the folder it's unpacked in */
+        std::string path;
+        if (!tarPath(name, &path)) {
+            DEBUG_PRINT("ARCHIVE NAME REJECTED: %s", name.c_str());
+            ok = false;
+            break;
+        } else if ((!is_dir && !is_file) || path.empty()) {
+            ok = skip(content_size + tarPadding(content_size));
+            continue;
+        }
+
+        if (is_file && pending + size > available) {
+            full = true;
+            ok = skip(content_size + tarPadding(content_size));
+            continue;
+        }
+
+        /* Archives don't have to list a folder before what's in it, but the writer needs it made first */
+        for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+            std::string folder = path.substr(0, slash);
+            if (folders.insert(folder).second)
+                this->archive_writer->submit(queue(folder, 0, true));
+        }
+
+        if (is_dir) {
+            if (folders.insert(path).second)
+                this->archive_writer->submit(queue(path, 0, true));
+            ok = skip(content_size + tarPadding(content_size));
+            continue;
+        }
+
+        MTPArchivePiece *piece = queue(path, size, false);
+        u64 pos = 0;
+        do {
+            piece->length = std::min<u64>(size - pos, ARCHIVE_SLOT_SIZE);
+            ok = this->streamRead(piece->data, piece->length);
+            if (!ok)
+                piece->length = 0;
+
+            this->archive_writer->submit(piece);
+            pos += piece->length;
+            if (ok && pos < size) {
+                piece = this->archive_writer->acquire();
+                piece->first = false;
+            }
+        } while (ok && pos < size);
+
+        pending += size;
+        ok = ok && skip(tarPadding(size));
+    }
+
+    this->endStream();
+    this->archive_writer->finish();
+
+    u32 written = this->registerEntries(storage_id, parent_handle, &ok);
+
+    if (!ok)
+        resp->code = ResponseIncompleteTransfer;
+    else if (full)
+        resp->code = ResponseStoreFull;
+    else
         resp->code = ResponseOk;
+    resp->params.push_back(written);
+}
+
+/* forgetObjectPaths scans the whole cache, which adds up over a batch. A file only has its own entry,
+   and for a folder the cache is dropped instead. Everything in it is still in the database */
+void MTPResponder::dropObjectPath(u32 handle, const fs::path &object, bool is_dir) {
+    if (is_dir) {
+        this->clearObjectPaths();
     } else {
-        resp->code = ResponseAccessDenied;
+        auto it = this->object_handles.find(handle);
+        if (it != this->object_handles.end())
+            this->uncacheObjectPath(it);
+    }
+}
+
+/* Same checks and bookkeeping as DeleteObject, MoveObject and a FileName SetObjectPropValue */
+u16 MTPResponder::batchEntry(const MTPBatchEntry &entry, const std::u16string &name) {
+    fs::path path = this->getObjectPath(entry.handle);
+    u32 storage_id = this->getStorageId(path);
+    MTPStorage *storage = this->getStorage(storage_id);
+    const MTPHandleDatabase::Entry *record = this->handles.get(entry.handle);
+    MTPStorageStat stat;
+    if (path.empty() || storage == NULL || record == NULL || !storage->stat(path, &stat))
+        return ResponseInvalidObjectHandle;
+
+    u32 parent_handle = record->parent; // The record can be paged out by any other lookup
+    fs::path parent;
+    std::string new_name;
+    switch (entry.action) {
+        case BatchDelete:
+            if (!storage->remove(path))
+                return ResponseAccessDenied;
+
+            if (stat.is_dir)
+                this->capacity.invalidate(storage_id);
+            else
+                this->capacity.adjust(storage_id, -(s64) stat.size);
+
+            this->dropObjectPath(entry.handle, path, stat.is_dir);
+            this->handles.remove(entry.handle);
+            return ResponseOk;
+        case BatchMove:
+            if (this->getStorage(entry.storage_id) == NULL)
+                return ResponseInvalidStorageId;
+            if (entry.storage_id != storage_id) // Not a rename, same as MoveObject
+                return ResponseAccessDenied;
+
+            parent_handle = entry.parent;
+            parent = parent_handle == 0 ? fs::path(storage->drive + ":") : this->getObjectPath(parent_handle);
+            if (parent.empty() || this->getStorageId(parent) != storage_id)
+                return ResponseInvalidParentObject;
+            new_name = path.filename().string();
+            break;
+        case BatchRename:
+            new_name = fs::path(name).string();
+            if (new_name.empty() || new_name.find('/') != std::string::npos || new_name == "." || new_name == "..")
+                return ResponseInvalidObjectPropValue;
+
+            parent = path.parent_path();
+            break;
+        default:
+            return ResponseInvalidParameter;
     }
+
+    fs::path new_path = parent / new_name;
+    if (new_path == path)
+        return ResponseOk;
+    if (!storage->rename(path, new_path))
+        return ResponseAccessDenied;
+
+    /* Anything replaced at the destination was a file or an empty folder, so it only had its own entry */
+    this->dropObjectPath(entry.handle, path, stat.is_dir);
+    auto replaced = this->object_paths.find(new_path.native());
+    if (replaced != this->object_paths.end())
+        this->dropObjectPath(replaced->second, new_path, false);
+
+    this->handles.move(entry.handle, parent_handle, storage_id, new_name);
+    this->cacheObjectPath(entry.handle, new_path);
+    return ResponseOk;
+}
+
+/* Entries are carried out as they come in, in order, so later ones can refer to where earlier ones put things.
+   A failed entry doesn't stop the rest. The handle journal goes out once for the lot, with the response */
+void MTPResponder::SendBatch(const MTPOperation &op, MTPResponse *resp) {
+    this->batch_results.clear();
+
+    u32 count = 0, succeeded = 0;
+    bool ok = this->beginStream() && this->streamRead(&count, sizeof(count));
+    this->batch_results.reserve(std::min<u32>(count, 0x10000));
+
+    for (u32 i=0; ok && i<count; i++) {
+        MTPBatchEntry entry;
+        std::u16string name;
+        ok = this->streamRead(&entry, sizeof(entry));
+        if (ok && entry.action == BatchRename) {
+            name.resize(entry.name_length);
+            ok = this->streamRead(&name[0], entry.name_length * sizeof(char16_t));
+        }
+        if (!ok)
+            break;
+
+        u16 code = this->batchEntry(entry, name);
+        this->batch_results.push_back(code);
+        if (code == ResponseOk)
+            succeeded++;
+    }
+    this->endStream();
+    DEBUG_PRINT("BATCH: %lu OF %u; SUCCEEDED: %u", this->batch_results.size(), count, succeeded);
+
+    resp->code = ok ? ResponseOk : ResponseIncompleteTransfer;
+    resp->params.push_back(succeeded);
+    resp->params.push_back(this->batch_results.size() - succeeded);
+}
+
+void MTPResponder::GetBatchResults(const MTPOperation &op, MTPResponse *resp) {
+    u32 count = this->batch_results.size();
+
+    this->beginBulk(op, sizeof(count) + count * sizeof(u16));
+    this->writeBulk(&count, sizeof(count));
+    this->writeBulk(this->batch_results.data(), count * sizeof(u16));
+
+    resp->code = this->endBulk() ? ResponseOk : ResponseIncompleteTransfer;
 }
\ No newline at end of file
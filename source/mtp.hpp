@@ -1,9 +1,25 @@
+#pragma once
+
 #include <vector>
 #include <filesystem>
 namespace fs = std::filesystem;
 #include <unordered_map>
 
-#include <switch.h>
+#include "platform.hpp"
+#include "stats.hpp"
+#include "capacity.hpp"
+#include "handles.hpp"
+#include "hash.hpp"
+#include "delta.hpp"
+#include "compress.hpp"
+#include "archive.hpp"
+#include "readahead.hpp"
+#include "content.hpp"
+#include "memory.hpp"
+#include "arena.hpp"
+#include "storage.hpp"
+#include "thumb.hpp"
+#include "transport.hpp"
 
 enum MTPOperationCode : u16 {
     OperationGetDeviceInfo = 0x1001,
@@ -34,6 +50,15 @@ enum MTPOperationCode : u16 {
     OperationCopyObject,
     OperationGetPartialObject,
     OperationInitiateOpenCapture,
+    OperationTuphlosHashObject = 0x9301, // Vendor: digest of an object, or of a range of one
+    OperationTuphlosGetSignatures, // Vendor: block signatures of an object, for building a delta against it
+    OperationTuphlosSendDelta, // Vendor: rebuilds an object from a delta stream
+    OperationTuphlosSetCompression, // Vendor: picks an MTPCompression for object data phases, until the session ends
+    OperationTuphlosSendArchiveList, // Vendor: handles for the next GetArchive, as an AUINT32
+    OperationTuphlosGetArchive, // Vendor: a tar of a folder's contents, or of the objects last sent with SendArchiveList
+    OperationTuphlosSendArchive, // Vendor: unpacks a tar under a parent folder, params are the storage and parent like SendObjectInfo
+    OperationTuphlosSendBatch, // Vendor: deletes, moves and renames a list of objects, response params are how many succeeded and failed
+    OperationTuphlosGetBatchResults, // Vendor: a response code for every entry of the last SendBatch, as an AUINT16
     OperationGetObjectPropsSupported = 0x9801,
     OperationGetObjectPropDesc,
     OperationGetObjectPropValue,
@@ -153,16 +178,43 @@ enum MTPDevicePropertyCode : u16 {
     PropertyPlaybackContainerIndex,
     PropertySessionInitiatorVersionInfo,
     PropertyPerceivedDeviceType,
+    PropertyTuphlosStatistics = 0xD301, // Vendor: packed MTPOperationStats records as an AUINT8
+    PropertyTuphlosMemory, // Vendor: packed MTPMemoryUsage records as an AUINT8
 };
 
 enum MTPObjectFormatCode : u16 { // I would add all of them but I don't hate myself *that* much
     FormatUndefined = 0x3000,
     FormatAssociation,
+    FormatScript,
+    FormatExecutable,
+    FormatText,
+    FormatHTML,
+    FormatWAV = 0x3008,
+    FormatMP3,
+    FormatAVI,
+    FormatMPEG,
+    FormatEXIF_JPEG = 0x3801,
+    FormatBMP = 0x3804,
+    FormatGIF = 0x3807,
+    FormatJFIF,
+    FormatPNG = 0x380B,
+    FormatTIFF = 0x380D,
+    FormatUndefinedAudio = 0xB900,
+    FormatWMA,
+    FormatOGG,
+    FormatAAC,
+    FormatFLAC = 0xB906,
+    FormatUndefinedVideo = 0xB980,
+    FormatWMV,
+    FormatMP4,
+    Format3GP = 0xB984,
+    FormatXML = 0xBA82,
 };
 
 enum MTPObjectPropCode : u16 {
     PropertyObjectSize = 0xDC04,
     PropertyFileName = 0xDC07,
+    PropertyPersistentUniqueObjectIdentifier = 0xDC41,
 };
 
 enum MTPTypeCode : u16 {
@@ -198,6 +250,22 @@ enum MTPContainerType : u16 {
     ContainerTypeEvent,
 };
 
+enum MTPBatchAction : u16 {
+    BatchDelete = 1,
+    BatchMove,
+    BatchRename,
+};
+
+/* SendBatch data phases are a u32 count and then these, each rename followed by name_length
+   UTF-16 code units of the new name */
+struct PACKED MTPBatchEntry {
+    u16 action;
+    u16 name_length;
+    u32 handle;
+    u32 storage_id; // Moves only
+    u32 parent; // Moves only, zero for the top of the storage
+};
+
 struct PACKED MTPContainerHeader {
     u32 length;
     u16 type;
@@ -205,12 +273,41 @@ struct PACKED MTPContainerHeader {
     u32 transaction_id;
 };
 
+#define MTP_MAX_PARAMS 5
+
+/* Operations and responses never carry more than five, so they're kept inline instead of on the heap.
+   Anything past the fifth is dropped. One the host left out reads as zero, like an unused parameter */
+class MTPParams {
+    public:
+        MTPParams() : values{}, count(0) { }
+        MTPParams(std::initializer_list<u32> values) : MTPParams() {
+            for (u32 value : values)
+                this->push_back(value);
+        }
+
+        void push_back(u32 value) {
+            if (this->count < MTP_MAX_PARAMS)
+                this->values[this->count++] = value;
+        }
+
+        size_t size() const { return this->count; }
+        bool empty() const { return this->count == 0; }
+        u32 operator[](size_t i) const { return i < this->count ? this->values[i] : 0; }
+        const u32 *data() const { return this->values; }
+        const u32 *begin() const { return this->values; }
+        const u32 *end() const { return this->values + this->count; }
+
+    private:
+        u32 values[MTP_MAX_PARAMS];
+        u8 count;
+};
+
 class MTPResponse {
     public:
         MTPResponse(u16 code) : code(code) { };
         u16 code;
         u32 transaction_id;
-        std::vector<u32> params;
+        MTPParams params;
 };
 
 class MTPOperation : public MTPResponse {
@@ -218,10 +315,16 @@ class MTPOperation : public MTPResponse {
         MTPOperation(u16 code) : MTPResponse(code) { }
 };
 
+/* Owns data, so it can be moved but not copied. With an arena, data lives in it and goes with the
+   transaction, otherwise it's malloc'ed and freed along with the container */
 class MTPContainer {
     public:
-        MTPContainer(MTPContainerHeader header);
+        MTPContainer(MTPContainerHeader header, MTPArena *arena = NULL);
         MTPContainer();
+        MTPContainer(MTPContainer &&other);
+        MTPContainer &operator=(MTPContainer &&other);
+        MTPContainer(const MTPContainer &) = delete;
+        MTPContainer &operator=(const MTPContainer &) = delete;
         ~MTPContainer();
 
         MTPContainerHeader header;
@@ -229,6 +332,7 @@ class MTPContainer {
 
         void read(void *buffer, size_t size);
         void write(const void *buffer, size_t size);
+        void reserve(size_t size); // Room for this many bytes after the header, so writes up to there don't move data
 
         size_t read_cursor;
 
@@ -238,22 +342,64 @@ class MTPContainer {
 
         template<typename T>
         std::enable_if_t<std::is_arithmetic_v<T>, void> write(T var);
-        void write(std::u16string var);
-        template <class T> void write(std::vector<T> var);
+        void write(const std::u16string &var);
+        void write(const char16_t *var); // Literals go straight in, without a std::u16string in between
+        void writeFilename(const fs::path &path); // Last component of path, turned into UTF-16 as it goes in
+        template <class T> void write(const std::vector<T> &var);
 
         MTPOperation toOperation();
+
+    private:
+        MTPArena *arena;
+        size_t capacity;
+
+        void writeString(const char16_t *var, size_t length);
 };
 
+template<typename T>
+std::enable_if_t<std::is_arithmetic_v<T>, T> MTPContainer::read() {
+    T var = 0;
+    this->read(&var, sizeof(var));
+    return var;
+}
+
+template<typename T>
+std::enable_if_t<std::is_arithmetic_v<T>, void> MTPContainer::write(T var) {
+    this->write(&var, sizeof(var));
+}
+
+template <class T> void MTPContainer::write(const std::vector<T> &var) {
+    u32 length = var.size();
+    this->reserve(this->header.length - sizeof(MTPContainerHeader) + sizeof(length) + length * sizeof(T));
+    this->write(length);
+    for (u32 i=0; i<length; i++) {
+        this->write(var[i]);
+    }
+}
+
 class MTPResponder {
     public:
-        MTPResponder();
+        MTPResponder(MTPTransport *transport);
         ~MTPResponder();
 
         void loop();
 
         void insertStorage(const u32 id, std::string drive, std::u16string name);
+        void insertStorage(const u32 id, MTPStorage *storage, std::u16string name); // Takes ownership
+
+        void setCacheDirectory(std::string directory);
+        void setMemoryBudget(u16 subsystem, u64 budget); // Bytes an MTPMemorySubsystem may keep between transactions
+
+        size_t objectHandleMemory(); // Rough estimate of the handle table's footprint in bytes
+        const MTPMemoryAccountant &memoryReport(); // Brought up to date first
+
+        MTPStats stats;
     private:
-        Result UsbXfer(UsbDsEndpoint *ep, size_t *out_xferd, void *buf, size_t size);
+        MTPTransport *transport;
+        u32 connection; // The transport's, as of the last transaction
+        void resetConnection();
+        Result UsbXfer(MTPEndpoint ep, size_t *out_xferd, void *buf, size_t size);
+        bool fileXfer(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out); // False if the transport can't
         u8 *read_buffer;
         size_t read_transferred;
         size_t read_cursor;
@@ -261,37 +407,133 @@ class MTPResponder {
         Result read(void *buffer, size_t size);
         Result write(const void *buffer, size_t size);
 
+        /* Every container of the transaction in progress is built in here, and it's emptied before the next */
+        MTPArena arena;
+
+        /* Data phases too big to build as a container are staged through write_buffer instead */
+        size_t write_cursor;
+        Result beginData(const MTPOperation &op, u64 size);
+        Result writeData(const void *buffer, size_t size);
+        Result flushData();
+
+        /* Host to device data phases that are parsed as they arrive, a whole transfer at a time through object_buffer */
+        size_t stream_cursor;
+        size_t stream_available;
+        u64 stream_remaining;
+        bool stream_ended; // The host ended it with a short transfer
+        bool beginStream();
+        size_t streamNext(const u8 **data, size_t max); // Zero once the data phase is over
+        bool streamRead(void *buffer, size_t size);
+        void endStream(); // Takes in whatever the host still has to send
+
+        /* Device to host data phases built up as they go, gathered into object_buffer so they leave a whole
+           transfer at a time. One of unknown length ends at a short packet, so it mustn't end on a whole one */
+        size_t bulk_fill;
+        bool bulk_ok;
+        void beginBulk(const MTPOperation &op, u64 size);
+        void writeBulk(const void *buffer, size_t size);
+        bool endBulk();
+
         MTPContainer readContainer();
-        Result writeContainer(MTPContainer &cont);
+        Result writeContainer(const MTPContainer &cont);
 
-        MTPContainer createDataContainer(MTPOperation op);
-        MTPResponse parseOperation(MTPOperation op);
-        MTPContainer *createResponseContainer(MTPResponse resp);
+        MTPContainer createDataContainer(const MTPOperation &op);
+        MTPContainerHeader createDataHeader(const MTPOperation &op, u64 size);
+        MTPResponse parseOperation(const MTPOperation &op);
+        MTPContainer createResponseContainer(const MTPResponse &resp);
 
         u32 session_id;
-        std::unordered_map<u32, std::pair<std::string, std::u16string>> storages;
-        std::unordered_map<u32, fs::path> object_handles;
+        std::unordered_map<u32, std::pair<MTPStorage *, std::u16string>> storages;
+        /* Handles come from the database and are kept across sessions. Their paths are worked out on
+           demand and cached here, since a handle only knows its parent and name */
+        MTPHandleDatabase handles;
+        std::string cache_directory;
+        struct CachedPath {
+            fs::path path;
+            u64 used; // Stamp from path_clock, the oldest go first when the cache is over budget
+        };
+        std::unordered_map<u32, CachedPath> object_handles;
+        std::unordered_map<std::string, u32> object_paths; // Reverse of object_handles
+        u64 path_clock;
+        size_t path_bytes; // Entries in both maps, without their buckets
+        void cacheObjectPath(u32 handle, const fs::path &object);
+        std::unordered_map<u32, CachedPath>::iterator uncacheObjectPath(std::unordered_map<u32, CachedPath>::iterator it);
+        void clearObjectPaths();
+        size_t objectPathMemory();
+        size_t trimObjectPaths(u64 target);
         u32 send_object_handle;
+        MTPStorageFile *send_object_file; // Opened and preallocated by SendObjectInfo, filled in by SendObject
+        void abortSendObject();
+
+        /* Object data goes between the file and USB through this, without any copies in between */
+        u8 *object_buffer;
+        bool sendFile(const MTPOperation &op, MTPStorageFile *file, u64 offset, u64 size);
+        bool receiveFile(MTPStorageFile *file, u64 *out_size);
+
+        /* GetObject and SendObject data phases as MTPCompressedBlocks, once a host has asked for them */
+        u32 compression;
+        MTPCompressor *compressor; // Only started the first time compression is asked for
+        bool sendCompressed(const MTPOperation &op, MTPStorageFile *file, u64 size);
+        bool receiveCompressed(MTPStorageFile *file, u64 *out_size);
+
+        std::vector<u32> archive_handles;
+        MTPArchiveReader *archive_reader; // Only started with the first archive
+        MTPArchiveWriter *archive_writer; // Likewise, for the first one sent or copied
+        u32 registerEntries(u32 storage_id, u32 parent_handle, bool *ok);
+
+        MTPReadAhead *readahead; // Only started with the first GetPartialObject
+
+        std::vector<u16> batch_results;
+        u16 batchEntry(const MTPBatchEntry &entry, const std::u16string &name);
+        void dropObjectPath(u32 handle, const fs::path &object, bool is_dir);
+
+        MTPThumbnailCache thumbnails;
+        MTPContentCache contents;
+        MTPCapacityCache capacity;
+        MTPHashCache hashes;
+        void forgetHashes(u32 handle); // After writing to it, whatever its mtime says
+
+        MTPMemoryAccountant memory;
+        void trimMemory(); // After every transaction, for whatever went over budget in it
+
+        Result sendEvent(u16 code, const MTPParams &params);
 
         u32 getObjectHandle(fs::path object);
+        fs::path getObjectPath(u32 handle); // Empty if there's no such object
+        void forgetObjectPaths(u32 handle); // Drops the cached paths of handle and everything below it
+        u32 getStorageId(const fs::path &object);
+        MTPStorage *getStorage(u32 storage_id);
+        MTPStorage *getObjectStorage(const fs::path &object);
+        void setObjectPath(u32 handle, fs::path object);
+        bool streamObjectHandles(const MTPOperation &op, std::vector<MTPStorage *> roots, u16 format); // False if it had to end short
 
-        void GetDeviceInfo(MTPOperation op, MTPResponse *resp);
-        void OpenSession(MTPOperation op, MTPResponse *resp);
-        void CloseSession(MTPOperation op, MTPResponse *resp);
-        void GetStorageIds(MTPOperation op, MTPResponse *resp);
-        void GetStorageInfo(MTPOperation op, MTPResponse *resp);
-        void GetObjectHandles(MTPOperation op, MTPResponse *resp);
-        void GetObjectInfo(MTPOperation op, MTPResponse *resp);
-        void GetDevicePropValue(MTPOperation op, MTPResponse *resp);
-        void GetObject(MTPOperation op, MTPResponse *resp);
-        void DeleteObject(MTPOperation op, MTPResponse *resp);
-        void SendObjectInfo(MTPOperation op, MTPResponse *resp);
-        void SendObject(MTPOperation op, MTPResponse *resp);
-        void GetObjectPropsSupported(MTPOperation op, MTPResponse *resp);
-        void GetObjectPropDesc(MTPOperation op, MTPResponse *resp);
-        void SetObjectPropValue(MTPOperation op, MTPResponse *resp);
-        void GetObjectPropValue(MTPOperation op, MTPResponse *resp);
-        void GetPartialObject(MTPOperation op, MTPResponse *resp);
-        void CopyObject(MTPOperation op, MTPResponse *resp);
-        void MoveObject(MTPOperation op, MTPResponse *resp);
+        void GetDeviceInfo(const MTPOperation &op, MTPResponse *resp);
+        void OpenSession(const MTPOperation &op, MTPResponse *resp);
+        void CloseSession(const MTPOperation &op, MTPResponse *resp);
+        void GetStorageIds(const MTPOperation &op, MTPResponse *resp);
+        void GetStorageInfo(const MTPOperation &op, MTPResponse *resp);
+        void GetObjectHandles(const MTPOperation &op, MTPResponse *resp);
+        void GetObjectInfo(const MTPOperation &op, MTPResponse *resp);
+        void GetDevicePropValue(const MTPOperation &op, MTPResponse *resp);
+        void GetObject(const MTPOperation &op, MTPResponse *resp);
+        void GetThumb(const MTPOperation &op, MTPResponse *resp);
+        void DeleteObject(const MTPOperation &op, MTPResponse *resp);
+        void SendObjectInfo(const MTPOperation &op, MTPResponse *resp);
+        void SendObject(const MTPOperation &op, MTPResponse *resp);
+        void GetObjectPropsSupported(const MTPOperation &op, MTPResponse *resp);
+        void GetObjectPropDesc(const MTPOperation &op, MTPResponse *resp);
+        void SetObjectPropValue(const MTPOperation &op, MTPResponse *resp);
+        void GetObjectPropValue(const MTPOperation &op, MTPResponse *resp);
+        void GetPartialObject(const MTPOperation &op, MTPResponse *resp);
+        void CopyObject(const MTPOperation &op, MTPResponse *resp);
+        void MoveObject(const MTPOperation &op, MTPResponse *resp);
+        void HashObject(const MTPOperation &op, MTPResponse *resp);
+        void GetSignatures(const MTPOperation &op, MTPResponse *resp);
+        void SendDelta(const MTPOperation &op, MTPResponse *resp);
+        void SetCompression(const MTPOperation &op, MTPResponse *resp);
+        void SendArchiveList(const MTPOperation &op, MTPResponse *resp);
+        void GetArchive(const MTPOperation &op, MTPResponse *resp);
+        void SendArchive(const MTPOperation &op, MTPResponse *resp);
+        void SendBatch(const MTPOperation &op, MTPResponse *resp);
+        void GetBatchResults(const MTPOperation &op, MTPResponse *resp);
 };
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+
+#ifdef __SWITCH__
+
+#include <switch.h>
+
+#else
+
+/* Just enough of libnx's vocabulary to build the responder as a host binary */
+
+#include <cstdint>
+#include <cstddef>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef u32 Result;
+
+#define PACKED __attribute__((packed))
+#define R_SUCCEEDED(res) ((res) == 0)
+#define R_FAILED(res) ((res) != 0)
+#define U64_MAX UINT64_MAX
+
+#endif
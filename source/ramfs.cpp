@@ -0,0 +1,264 @@
+#include "ramfs.hpp"
+
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <thread>
+
+MTPMemoryStorage::MTPMemoryStorage(std::string drive, u64 limit) : MTPStorage(drive) {
+    this->top.is_dir = true;
+    this->top.ctime = time(NULL);
+    this->limit = limit;
+    this->used = 0;
+    this->read_latency = 0;
+    this->read_rate = 0;
+}
+
+void MTPMemoryStorage::setReadCost(u64 latency_ns, u64 rate) {
+    this->read_latency = latency_ns;
+    this->read_rate = rate;
+}
+
+u16 MTPMemoryStorage::storageType() {
+    return 3; // Fixed RAM
+}
+
+u16 MTPMemoryStorage::accessCapability() {
+    return 0; // Read-write
+}
+
+bool MTPMemoryStorage::capacity(MTPStorageCapacity *capacity) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    capacity->total = this->limit;
+    capacity->free = this->limit - this->used;
+    capacity->block_size = 1;
+    return true;
+}
+
+MTPMemoryStorage::Node *MTPMemoryStorage::find(const fs::path &path) {
+    std::string str = path.string();
+    if (str.compare(0, this->drive.size() + 1, this->drive + ":") != 0)
+        return NULL;
+
+    Node *node = &this->top;
+    for (const fs::path &part : fs::path(str.substr(this->drive.size() + 1)).relative_path()) {
+        if (part.empty() || part == ".")
+            continue;
+
+        auto it = node->children.find(part.string());
+        if (!node->is_dir || it == node->children.end())
+            return NULL;
+        node = it->second.get();
+    }
+
+    return node;
+}
+
+bool MTPMemoryStorage::resize(Contents &contents, u64 size) {
+    u64 old_size = contents.bytes.size();
+    if (!contents.removed && size > old_size && size - old_size > this->limit - this->used)
+        return false;
+
+    contents.bytes.resize(size);
+    contents.mtime = time(NULL);
+
+    if (!contents.removed)
+        this->used = this->used - old_size + size;
+    return true;
+}
+
+void MTPMemoryStorage::release(Node &node) {
+    if (node.contents) {
+        this->used -= node.contents->bytes.size();
+        node.contents->removed = true;
+    }
+
+    for (auto &child : node.children)
+        this->release(*child.second);
+}
+
+bool MTPMemoryStorage::list(const fs::path &dir, const MTPStorageListCallback &callback) {
+    /* Names are gathered first so the callback is free to call back into the storage */
+    std::vector<std::pair<std::string, bool>> entries;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        Node *node = this->find(dir);
+        if (node == NULL || !node->is_dir)
+            return false;
+
+        entries.reserve(node->children.size());
+        for (auto &child : node->children)
+            entries.push_back({child.first, child.second->is_dir});
+    }
+
+    for (auto &entry : entries) {
+        if (!callback(dir / entry.first, entry.second))
+            break;
+    }
+
+    return true;
+}
+
+bool MTPMemoryStorage::stat(const fs::path &path, MTPStorageStat *stat) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Node *node = this->find(path);
+    if (node == NULL)
+        return false;
+
+    stat->is_dir = node->is_dir;
+    stat->size = node->contents ? node->contents->bytes.size() : 0;
+    stat->ctime = node->ctime;
+    stat->mtime = node->contents ? node->contents->mtime : node->ctime;
+    return true;
+}
+
+MTPStorageFile *MTPMemoryStorage::open(const fs::path &path, int mode) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Node *node = this->find(path);
+
+    if (node == NULL && (mode & FileCreate)) {
+        Node *parent = this->find(path.parent_path());
+        if (parent == NULL || !parent->is_dir || path.filename().empty())
+            return NULL;
+
+        std::unique_ptr<Node> &child = parent->children[path.filename().string()];
+        child.reset(new Node());
+        child->is_dir = false;
+        child->ctime = time(NULL);
+        child->contents = std::make_shared<Contents>();
+        child->contents->mtime = child->ctime;
+        child->contents->removed = false;
+        node = child.get();
+    }
+
+    if (node == NULL || node->is_dir)
+        return NULL;
+
+    if (mode & FileCreate)
+        this->resize(*node->contents, 0);
+
+    return new File(this, node->contents);
+}
+
+bool MTPMemoryStorage::createDirectory(const fs::path &path) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Node *parent = this->find(path.parent_path());
+    if (parent == NULL || !parent->is_dir || path.filename().empty())
+        return false;
+
+    std::unique_ptr<Node> &child = parent->children[path.filename().string()];
+    if (child)
+        return child->is_dir;
+
+    child.reset(new Node());
+    child->is_dir = true;
+    child->ctime = time(NULL);
+    return true;
+}
+
+bool MTPMemoryStorage::rename(const fs::path &from, const fs::path &to) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Node *from_parent = this->find(from.parent_path());
+    Node *to_parent = this->find(to.parent_path());
+    if (from_parent == NULL || to_parent == NULL || !to_parent->is_dir)
+        return false;
+
+    auto it = from_parent->children.find(from.filename().string());
+    if (it == from_parent->children.end() || to_parent->children.count(to.filename().string()) != 0)
+        return false;
+
+    /* A directory can't go inside itself */
+    if (it->second->is_dir && to.string().compare(0, from.string().size() + 1, from.string() + "/") == 0)
+        return false;
+
+    std::unique_ptr<Node> node = std::move(it->second);
+    from_parent->children.erase(it);
+    to_parent->children[to.filename().string()] = std::move(node);
+    return true;
+}
+
+bool MTPMemoryStorage::replace(const fs::path &from, const fs::path &to) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Node *from_parent = this->find(from.parent_path());
+    Node *to_parent = this->find(to.parent_path());
+    if (from_parent == NULL || to_parent == NULL)
+        return false;
+
+    auto from_it = from_parent->children.find(from.filename().string());
+    auto to_it = to_parent->children.find(to.filename().string());
+    if (from_it == from_parent->children.end() || to_it == to_parent->children.end() ||
+        from_it->second->is_dir || to_it->second->is_dir || from == to)
+        return false;
+
+    this->release(*to_it->second);
+    to_it->second = std::move(from_it->second);
+    from_parent->children.erase(from_it);
+    return true;
+}
+
+bool MTPMemoryStorage::remove(const fs::path &path) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Node *parent = this->find(path.parent_path());
+    if (parent == NULL)
+        return false;
+
+    auto it = parent->children.find(path.filename().string());
+    if (it == parent->children.end())
+        return false;
+
+    this->release(*it->second);
+    parent->children.erase(it);
+    return true;
+}
+
+MTPMemoryStorage::File::File(MTPMemoryStorage *storage, std::shared_ptr<Contents> contents) {
+    this->storage = storage;
+    this->contents = contents;
+}
+
+s64 MTPMemoryStorage::File::read(u64 offset, void *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(this->storage->mutex);
+    std::vector<u8> &bytes = this->contents->bytes;
+    if (offset >= bytes.size())
+        return 0;
+
+    size = std::min<u64>(size, bytes.size() - offset);
+    memcpy(buf, bytes.data() + offset, size);
+
+    u64 cost = this->storage->read_latency;
+    if (this->storage->read_rate != 0)
+        cost += size * 1000000000UL / this->storage->read_rate;
+    if (cost != 0)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(cost));
+
+    return size;
+}
+
+s64 MTPMemoryStorage::File::write(u64 offset, const void *buf, size_t size) {
+    std::lock_guard<std::mutex> lock(this->storage->mutex);
+    if (offset + size > this->contents->bytes.size() && !this->storage->resize(*this->contents, offset + size))
+        return -1;
+
+    memcpy(this->contents->bytes.data() + offset, buf, size);
+    this->contents->mtime = time(NULL);
+    return size;
+}
+
+u64 MTPMemoryStorage::File::size() {
+    std::lock_guard<std::mutex> lock(this->storage->mutex);
+    return this->contents->bytes.size();
+}
+
+bool MTPMemoryStorage::File::setSize(u64 size) {
+    std::lock_guard<std::mutex> lock(this->storage->mutex);
+    return this->storage->resize(*this->contents, size);
+}
+
+bool MTPMemoryStorage::File::reserve(u64 size) {
+    std::lock_guard<std::mutex> lock(this->storage->mutex);
+    if (size <= this->contents->bytes.size())
+        return true;
+
+    /* Like preallocating on disk, the bytes count against the budget from here on */
+    return this->storage->resize(*this->contents, size);
+}
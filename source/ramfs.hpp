@@ -0,0 +1,72 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <vector>
+
+#include "storage.hpp"
+
+/* A storage that only exists in RAM, with a fixed byte budget. Takes the SD card out of the
+   picture for benchmarks, and makes for scratch space that's gone when the responder exits */
+class MTPMemoryStorage : public MTPStorage {
+    public:
+        MTPMemoryStorage(std::string drive, u64 limit);
+
+        /* For benchmarks: every read takes latency_ns plus its size at rate bytes per second, one at a time,
+           roughly like an SD card. Zero for either leaves it out */
+        void setReadCost(u64 latency_ns, u64 rate);
+
+        u16 storageType() override;
+        u16 accessCapability() override;
+        bool capacity(MTPStorageCapacity *capacity) override;
+
+        bool list(const fs::path &dir, const MTPStorageListCallback &callback) override;
+        bool stat(const fs::path &path, MTPStorageStat *stat) override;
+        MTPStorageFile *open(const fs::path &path, int mode) override;
+        bool createDirectory(const fs::path &path) override;
+        bool rename(const fs::path &from, const fs::path &to) override;
+        bool replace(const fs::path &from, const fs::path &to) override;
+        bool remove(const fs::path &path) override;
+
+    private:
+        /* Shared with open files, so removing a file that's open is fine */
+        struct Contents {
+            std::vector<u8> bytes;
+            s64 mtime;
+            bool removed; // Doesn't count against the budget anymore
+        };
+
+        struct Node {
+            bool is_dir;
+            s64 ctime;
+            std::shared_ptr<Contents> contents;
+            std::map<std::string, std::unique_ptr<Node>> children;
+        };
+
+        class File : public MTPStorageFile {
+            public:
+                File(MTPMemoryStorage *storage, std::shared_ptr<Contents> contents);
+
+                s64 read(u64 offset, void *buf, size_t size) override;
+                s64 write(u64 offset, const void *buf, size_t size) override;
+                u64 size() override;
+                bool setSize(u64 size) override;
+                bool reserve(u64 size) override;
+
+            private:
+                MTPMemoryStorage *storage;
+                std::shared_ptr<Contents> contents;
+        };
+
+        std::mutex mutex; // The capacity refresher asks from its own thread
+        Node top;
+        u64 limit;
+        u64 used;
+        u64 read_latency;
+        u64 read_rate;
+
+        Node *find(const fs::path &path);
+        bool resize(Contents &contents, u64 size);
+        void release(Node &node);
+};
@@ -0,0 +1,216 @@
+#include "readahead.hpp"
+
+#include <algorithm>
+#include <malloc.h>
+
+MTPReadAhead::MTPReadAhead() {
+    for (Buffer &buffer : this->buffers) {
+        buffer.data = (u8 *) memalign(0x1000, READAHEAD_WINDOW);
+        buffer.state = BufferFree;
+        buffer.handle = 0;
+    }
+
+    this->tick = 0;
+    this->running = true;
+    this->thread = std::thread(&MTPReadAhead::reader, this);
+}
+
+MTPReadAhead::~MTPReadAhead() {
+    this->clear();
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->cond.notify_all();
+    this->thread.join();
+
+    for (Buffer &buffer : this->buffers)
+        free(buffer.data);
+}
+
+/* Only the responder's thread touches files, the lock is for the buffers the reader shares */
+MTPReadAhead::File *MTPReadAhead::find(u32 handle) {
+    for (File &file : this->files) {
+        if (file.handle == handle)
+            return &file;
+    }
+
+    return NULL;
+}
+
+MTPReadAhead::Buffer *MTPReadAhead::lookup(u32 handle, u64 window) {
+    for (Buffer &buffer : this->buffers) {
+        if (buffer.state != BufferFree && buffer.handle == handle && buffer.window == window)
+            return &buffer;
+    }
+
+    return NULL;
+}
+
+MTPStorageFile *MTPReadAhead::open(u32 handle, MTPStorage *storage, const fs::path &path, u64 *size) {
+    File *file = this->find(handle);
+    if (file == NULL) {
+        MTPStorageFile *opened = storage->open(path, FileRead);
+        if (opened == NULL)
+            return NULL;
+
+        if (this->files.size() == READAHEAD_FILES) {
+            auto oldest = std::min_element(this->files.begin(), this->files.end(), [](const File &a, const File &b) {
+                return a.used < b.used;
+            });
+
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->close(lock, *oldest);
+            this->files.erase(oldest);
+        }
+
+        this->files.push_back({handle, opened, opened->size(), U64_MAX, 0});
+        file = &this->files.back();
+    }
+
+    file->used = ++this->tick;
+    *size = file->size;
+    return file->file;
+}
+
+bool MTPReadAhead::read(u32 handle, u64 offset, u64 size, const MTPReadAheadSink &sink) {
+    if (size == 0)
+        return false;
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    std::vector<Buffer *> covering;
+    for (u64 window = offset / READAHEAD_WINDOW; window <= (offset + size - 1) / READAHEAD_WINDOW; window++) {
+        Buffer *buffer = this->lookup(handle, window);
+        if (buffer == NULL)
+            return false;
+        covering.push_back(buffer);
+    }
+
+    this->cond.wait(lock, [&covering] {
+        return std::none_of(covering.begin(), covering.end(), [](Buffer *buffer) {
+            return buffer->state == BufferQueued || buffer->state == BufferReading;
+        });
+    });
+
+    for (Buffer *buffer : covering) {
+        if (buffer->state != BufferReady)
+            return false;
+    }
+
+    /* Ready buffers are only ever changed from this thread, so they can be sent from without the lock */
+    lock.unlock();
+    for (Buffer *buffer : covering) {
+        u64 base = buffer->window * READAHEAD_WINDOW;
+        u64 start = std::max(offset, base) - base;
+        u64 end = std::min(offset + size, base + buffer->length) - base;
+        sink(buffer->data + start, end - start);
+    }
+    lock.lock();
+
+    /* Sequential readers never come back for a window they've finished with */
+    for (Buffer *buffer : covering) {
+        if (offset + size >= buffer->window * READAHEAD_WINDOW + buffer->length)
+            buffer->state = BufferFree;
+        else
+            buffer->used = ++this->tick;
+    }
+
+    return true;
+}
+
+void MTPReadAhead::advance(u32 handle, u64 offset, u64 size) {
+    File *file = this->find(handle);
+    if (file == NULL)
+        return;
+
+    bool sequential = offset == file->next;
+    file->next = offset + size;
+    if (!sequential || size == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    u64 first = file->next / READAHEAD_WINDOW;
+    for (u64 window = first; window < first + READAHEAD_DEPTH && window * READAHEAD_WINDOW < file->size; window++) {
+        if (this->lookup(handle, window) != NULL)
+            continue;
+
+        /* A free buffer, or else the one that's gone longest without being used. Never one that's
+           still to be read, or that this reader is about to want */
+        Buffer *victim = NULL;
+        for (Buffer &buffer : this->buffers) {
+            bool wanted = buffer.handle == handle && buffer.window >= first;
+            if (buffer.state == BufferFree) {
+                victim = &buffer;
+                break;
+            } else if ((buffer.state == BufferReady || buffer.state == BufferFailed) && !wanted &&
+                    (victim == NULL || buffer.used < victim->used)) {
+                victim = &buffer;
+            }
+        }
+
+        if (victim == NULL)
+            break;
+
+        victim->state = BufferQueued;
+        victim->handle = handle;
+        victim->file = file->file;
+        victim->window = window;
+        victim->length = std::min<u64>(file->size - window * READAHEAD_WINDOW, READAHEAD_WINDOW);
+        victim->used = ++this->tick;
+        this->queue.push_back(victim);
+    }
+
+    this->cond.notify_all();
+}
+
+void MTPReadAhead::clear() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (File &file : this->files)
+        this->close(lock, file);
+
+    this->files.clear();
+}
+
+/* The reader may be partway through one of its windows, which has to finish before the file can go */
+void MTPReadAhead::close(std::unique_lock<std::mutex> &lock, File &file) {
+    u32 handle = file.handle;
+    this->cond.wait(lock, [this, handle] {
+        return std::none_of(std::begin(this->buffers), std::end(this->buffers), [handle](const Buffer &buffer) {
+            return buffer.state == BufferReading && buffer.handle == handle;
+        });
+    });
+
+    this->queue.erase(std::remove_if(this->queue.begin(), this->queue.end(), [handle](Buffer *buffer) {
+        return buffer->handle == handle;
+    }), this->queue.end());
+
+    for (Buffer &buffer : this->buffers) {
+        if (buffer.state != BufferFree && buffer.handle == handle)
+            buffer.state = BufferFree;
+    }
+
+    delete file.file;
+}
+
+void MTPReadAhead::reader() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->cond.wait(lock, [this] { return !this->running || !this->queue.empty(); });
+        if (!this->running)
+            break;
+
+        Buffer *buffer = this->queue.front();
+        this->queue.pop_front();
+        buffer->state = BufferReading;
+
+        lock.unlock();
+        s64 xferd = buffer->file->read(buffer->window * READAHEAD_WINDOW, buffer->data, buffer->length);
+        lock.lock();
+
+        buffer->state = xferd == (s64) buffer->length ? BufferReady : BufferFailed;
+        this->cond.notify_all();
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include "platform.hpp"
+#include "storage.hpp"
+
+#define READAHEAD_FILES 8 // Open files kept between GetPartialObject calls
+#define READAHEAD_WINDOW 0x100000 // Read ahead in windows this big, aligned to it
+#define READAHEAD_BUFFERS 8 // One window each, shared between every open file
+#define READAHEAD_DEPTH 4 // Windows kept ahead of a sequential reader
+
+typedef std::function<void(const u8 *data, size_t size)> MTPReadAheadSink;
+
+/* Hosts that mount the device as a filesystem read files as a run of GetPartialObjects. Files stay
+   open between them, and one read that starts where the last one ended gets the windows after it
+   read on a thread of its own while the host is busy with what it has. Handles are the keys */
+class MTPReadAhead {
+    public:
+        MTPReadAhead();
+        ~MTPReadAhead();
+
+        /* The handle's file, opened the first time it's asked for. NULL if it can't be */
+        MTPStorageFile *open(u32 handle, MTPStorage *storage, const fs::path &path, u64 *size);
+
+        /* Gives sink the range out of memory if all of it has been asked to be read ahead, waiting for what
+           hasn't arrived yet. False, with nothing given to sink, if any of it wasn't or couldn't be read */
+        bool read(u32 handle, u64 offset, u64 size, const MTPReadAheadSink &sink);
+
+        /* A read of that range went out */
+        void advance(u32 handle, u64 offset, u64 size);
+
+        /* Closes everything. Objects are about to change, and an open file can keep one from being
+           renamed or deleted */
+        void clear();
+
+    private:
+        enum BufferState {
+            BufferFree,
+            BufferQueued,
+            BufferReading,
+            BufferReady,
+            BufferFailed,
+        };
+
+        struct File {
+            u32 handle;
+            MTPStorageFile *file;
+            u64 size;
+            u64 next; // Where a sequential read would start
+            u64 used;
+        };
+
+        struct Buffer {
+            u8 *data;
+            BufferState state;
+            u32 handle;
+            MTPStorageFile *file;
+            u64 window;
+            u32 length;
+            u64 used;
+        };
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::thread thread;
+        bool running;
+
+        std::vector<File> files;
+        Buffer buffers[READAHEAD_BUFFERS];
+        std::deque<Buffer *> queue;
+        u64 tick;
+
+        File *find(u32 handle);
+        Buffer *lookup(u32 handle, u64 window);
+        void close(std::unique_lock<std::mutex> &lock, File &file);
+        void reader();
+};
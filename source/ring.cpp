@@ -0,0 +1,186 @@
+#ifdef __linux__
+
+#include "ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+MTPRing::MTPRing() {
+    this->fd = -1;
+    this->sq_ring = MAP_FAILED;
+    this->cq_ring = MAP_FAILED;
+    this->sqes = (io_uring_sqe *) MAP_FAILED;
+}
+
+MTPRing::~MTPRing() {
+    if (this->sqes != MAP_FAILED)
+        munmap(this->sqes, this->sqes_size);
+    if (this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring)
+        munmap(this->cq_ring, this->cq_ring_size);
+    if (this->sq_ring != MAP_FAILED)
+        munmap(this->sq_ring, this->sq_ring_size);
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+bool MTPRing::init(unsigned entries, bool sqpoll) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 100; // ms, long enough to cover the gap between transactions of a sync
+    }
+
+    this->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (this->fd < 0 && sqpoll)
+        return this->init(entries, false);
+    if (this->fd < 0)
+        return false;
+
+    this->sqpoll = sqpoll;
+    this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    /* Newer kernels share one mapping between both rings */
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+
+    this->sq_ring = mmap(NULL, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+    if (this->sq_ring == MAP_FAILED)
+        return false;
+
+    this->cq_ring = single ? this->sq_ring :
+        mmap(NULL, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_CQ_RING);
+    if (this->cq_ring == MAP_FAILED)
+        return false;
+
+    this->sqes = (io_uring_sqe *) mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQES);
+    if (this->sqes == MAP_FAILED)
+        return false;
+
+    u8 *sq = (u8 *) this->sq_ring, *cq = (u8 *) this->cq_ring;
+    this->sq_head = (unsigned *) (sq + params.sq_off.head);
+    this->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    this->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    this->sq_flags = (unsigned *) (sq + params.sq_off.flags);
+    this->sq_array = (unsigned *) (sq + params.sq_off.array);
+    this->cq_head = (unsigned *) (cq + params.cq_off.head);
+    this->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    this->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    this->cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    this->sq_local_tail = *this->sq_tail;
+    this->queued = 0;
+
+    return true;
+}
+
+bool MTPRing::registerBuffers(u8 **buffers, unsigned count, size_t size) {
+    std::vector<iovec> iovs(count);
+    for (unsigned i=0; i<count; i++)
+        iovs[i] = {buffers[i], size};
+
+    return syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_BUFFERS, iovs.data(), count) == 0;
+}
+
+bool MTPRing::registerFiles(const int *fds, unsigned count) {
+    return syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_FILES, fds, count) == 0;
+}
+
+bool MTPRing::updateFile(unsigned slot, int fd) {
+    io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (u64) (uintptr_t) &fd;
+
+    return syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+bool MTPRing::queue(bool write, unsigned slot, int buffer, void *buf, size_t size, u64 offset, u64 user_data, bool link) {
+    unsigned head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    if (this->sq_local_tail - head > *this->sq_mask)
+        return false;
+
+    unsigned index = this->sq_local_tail & *this->sq_mask;
+    io_uring_sqe *sqe = &this->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (buffer >= 0) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = buffer;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE | (link ? IOSQE_IO_LINK : 0);
+    sqe->addr = (u64) (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    this->sq_array[index] = index;
+    this->sq_local_tail++;
+    this->queued++;
+
+    return true;
+}
+
+int MTPRing::enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, this->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+bool MTPRing::submit(unsigned wait_nr) {
+    unsigned to_submit = this->queued;
+    __atomic_store_n(this->sq_tail, this->sq_local_tail, __ATOMIC_RELEASE);
+    this->queued = 0;
+
+    unsigned flags = 0;
+    if (this->sqpoll) {
+        /* The poller picks the entries up by itself unless it went to sleep */
+        if (to_submit != 0 && (__atomic_load_n(this->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP))
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        to_submit = 0;
+    }
+
+    if (wait_nr != 0) {
+        unsigned ready = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE) - *this->cq_head;
+        if (ready >= wait_nr)
+            wait_nr = 0;
+        else
+            flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    if (to_submit == 0 && flags == 0)
+        return true;
+    return this->enter(to_submit, wait_nr, flags) >= 0;
+}
+
+bool MTPRing::reap(io_uring_cqe *cqe, bool wait) {
+    while (true) {
+        unsigned head = *this->cq_head;
+        if (head != __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = this->cqes[head & *this->cq_mask];
+            __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        if (!wait || this->enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+            return false;
+    }
+}
+
+#endif
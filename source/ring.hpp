@@ -0,0 +1,64 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+
+#include "platform.hpp"
+
+/* A bare io_uring, driven through the raw syscalls so nothing beyond the kernel headers is needed.
+   Submissions are only published by submit(), and completions are taken straight off the shared
+   ring, so the kernel is only entered when there's something to hand over or nothing to reap */
+class MTPRing {
+    public:
+        MTPRing();
+        ~MTPRing();
+
+        MTPRing(const MTPRing &) = delete;
+        MTPRing &operator=(const MTPRing &) = delete;
+
+        /* With sqpoll a kernel thread picks up submissions, which needs privileges on older kernels */
+        bool init(unsigned entries, bool sqpoll);
+        bool isOpen() { return this->fd >= 0; }
+
+        /* Buffers are pinned once, so the fixed reads and writes skip the per-request page walk */
+        bool registerBuffers(u8 **buffers, unsigned count, size_t size);
+
+        /* Descriptors are looked up once. A slot of -1 is left empty for updateFile to fill in */
+        bool registerFiles(const int *fds, unsigned count);
+        bool updateFile(unsigned slot, int fd);
+
+        /* Queues a read or write on a registered file slot. A buffer index of -1 means buf isn't registered.
+           A linked operation only starts once this one succeeded in full, otherwise it's cancelled */
+        bool queue(bool write, unsigned slot, int buffer, void *buf, size_t size, u64 offset, u64 user_data, bool link);
+
+        /* Hands everything queued to the kernel, and waits for at least wait_nr completions */
+        bool submit(unsigned wait_nr);
+
+        /* Takes one completion, waiting for it if wait is set */
+        bool reap(io_uring_cqe *cqe, bool wait);
+
+        unsigned pending() { return this->queued; }
+
+    private:
+        int fd;
+        bool sqpoll;
+
+        void *sq_ring;
+        void *cq_ring;
+        io_uring_sqe *sqes;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+        size_t sqes_size;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        io_uring_cqe *cqes;
+
+        unsigned sq_local_tail; // Filled in but not yet published to the kernel
+        unsigned queued;
+
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+static size_t _statsBucket(u64 ns) {
+    u64 us = ns / 1000;
+    size_t bucket = 0;
+    while (us > 1 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* The given percentile in microseconds, interpolated within the bucket holding it. The top bucket's
+   bound can be far past anything seen, so it's never more than the maximum */
+static u64 _statsPercentile(const MTPOperationStats *op, u64 percentile) {
+    u64 target = (op->calls * percentile + 99) / 100, seen = 0;
+    for (size_t i=0; i<STATS_HISTOGRAM_BUCKETS; i++) {
+        if (op->histogram[i] == 0 || seen + op->histogram[i] < target) {
+            seen += op->histogram[i];
+            continue;
+        }
+
+        u64 low = i == 0 ? 0 : 1UL << i, high = 2UL << i;
+        u64 us = low + (high - low) * (target - seen) / op->histogram[i];
+        return std::min(us, op->max_ns / 1000);
+    }
+    return 0;
+}
+
+MTPStats::MTPStats() {
+    this->reset();
+}
+
+void MTPStats::reset() {
+    memset(this->ops, 0, sizeof(this->ops));
+    this->count = 0;
+    this->current = NULL;
+    this->transaction_start = 0;
+    this->transaction_parse_ns = 0;
+    this->transaction_usb_ns = 0;
+}
+
+MTPOperationStats *MTPStats::find(u16 code) {
+    for (size_t i=0; i<this->count; i++) {
+        if (this->ops[i].code == code)
+            return &this->ops[i];
+    }
+
+    if (this->count == STATS_MAX_OPERATIONS)
+        return NULL;
+
+    MTPOperationStats *op = &this->ops[this->count++];
+    op->code = code;
+    return op;
+}
+
+void MTPStats::beginTransaction(u16 code, size_t op_length, u64 parse_ns) {
+    this->current = this->find(code);
+    this->transaction_start = statsNow() - parse_ns;
+    this->transaction_parse_ns = parse_ns;
+    this->transaction_usb_ns = 0;
+
+    if (this->current != NULL)
+        this->current->bytes_in += op_length;
+}
+
+void MTPStats::endTransaction(bool ok) {
+    MTPOperationStats *op = this->current;
+    if (op == NULL)
+        return;
+    this->current = NULL;
+
+    u64 total = statsNow() - this->transaction_start;
+    u64 handler = total - this->transaction_parse_ns;
+
+    op->calls++;
+    if (!ok)
+        op->errors++;
+    op->total_ns += total;
+    if (total > op->max_ns)
+        op->max_ns = total;
+    op->parse_ns += this->transaction_parse_ns;
+    op->usb_ns += this->transaction_usb_ns;
+    if (handler > this->transaction_usb_ns)
+        op->fs_ns += handler - this->transaction_usb_ns;
+    op->histogram[_statsBucket(total)]++;
+}
+
+void MTPStats::addTransfer(bool in, u64 ns, size_t bytes) {
+    /* Time spent waiting for the next operation isn't attributed to anything */
+    if (this->current == NULL)
+        return;
+
+    this->transaction_usb_ns += ns;
+    if (in)
+        this->current->bytes_out += bytes;
+    else
+        this->current->bytes_in += bytes;
+}
+
+void MTPStats::print(FILE *f) const {
+    fprintf(f, "%-6s %8s %6s %9s %9s %9s %9s %9s %9s %12s %12s\n",
+        "OP", "CALLS", "ERRS", "AVG(us)", "P50(us)", "P99(us)", "MAX(us)", "FS(ms)", "USB(ms)", "IN(B)", "OUT(B)");
+
+    for (size_t i=0; i<this->count; i++) {
+        const MTPOperationStats *op = &this->ops[i];
+        if (op->calls == 0)
+            continue;
+
+        fprintf(f, "%#06x %8lu %6lu %9lu %9lu %9lu %9lu %9lu %9lu %12lu %12lu\n",
+            op->code, op->calls, op->errors,
+            op->total_ns / op->calls / 1000,
+            _statsPercentile(op, 50), _statsPercentile(op, 99),
+            op->max_ns / 1000,
+            op->fs_ns / 1000000, op->usb_ns / 1000000,
+            op->bytes_in, op->bytes_out);
+    }
+}
+
+bool MTPStats::dump(const char *path) const {
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+
+    this->print(f);
+    fclose(f);
+    return true;
+}
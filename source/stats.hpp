@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+#include "platform.hpp"
+
+#define STATS_MAX_OPERATIONS 64
+#define STATS_HISTOGRAM_BUCKETS 24 // Bucket i holds latencies in [2^i, 2^(i+1)) microseconds
+
+static inline u64 statsNow() {
+#ifdef __SWITCH__
+    return armTicksToNs(armGetSystemTick());
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/* Laid out so it can be sent to the host as-is through PropertyTuphlosStatistics */
+struct PACKED MTPOperationStats {
+    u16 code;
+    u64 calls;
+    u64 errors; // Transactions that didn't end with ResponseOk
+    u64 total_ns;
+    u64 max_ns;
+    u64 parse_ns;
+    u64 fs_ns; // Time spent in the handler outside of USB transfers
+    u64 usb_ns;
+    u64 bytes_in;
+    u64 bytes_out;
+    u32 histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+class MTPStats {
+    public:
+        MTPStats();
+
+        void reset();
+
+        void beginTransaction(u16 code, size_t op_length, u64 parse_ns);
+        void endTransaction(bool ok);
+        void addTransfer(bool in, u64 ns, size_t bytes);
+
+        const MTPOperationStats *operations() const { return this->ops; }
+        size_t operationCount() const { return this->count; }
+
+        void print(FILE *f) const;
+        bool dump(const char *path) const;
+
+    private:
+        MTPOperationStats ops[STATS_MAX_OPERATIONS];
+        size_t count;
+
+        MTPOperationStats *current;
+        u64 transaction_start;
+        u64 transaction_parse_ns;
+        u64 transaction_usb_ns;
+
+        MTPOperationStats *find(u16 code);
+};
@@ -0,0 +1,122 @@
+#include "storage.hpp"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "file.hpp"
+
+bool MTPStorage::walk(const fs::path &dir, const MTPStorageListCallback &callback) {
+    bool more = true;
+
+    /* The listing stays open while we descend, so only one level of it per depth is ever held */
+    this->list(dir, [this, &callback, &more](const fs::path &path, bool is_dir) {
+        more = callback(path, is_dir) && (!is_dir || this->walk(path, callback));
+        return more;
+    });
+
+    return more;
+}
+
+u16 MTPNativeStorage::storageType() {
+    return this->drive == "sdmc" ? 4 : 1; // Removable RAM, Fixed ROM
+}
+
+u16 MTPNativeStorage::accessCapability() {
+    return this->drive == "sdmc" ? 0 : 2; // Read-write, read-only with deletion
+}
+
+bool MTPNativeStorage::capacity(MTPStorageCapacity *capacity) {
+    struct statvfs stat;
+    if (statvfs(this->root().c_str(), &stat) != 0)
+        return false;
+
+    capacity->total = (u64) stat.f_bsize * stat.f_blocks;
+    capacity->free = (u64) stat.f_bsize * stat.f_bfree;
+    capacity->block_size = stat.f_bsize;
+    return true;
+}
+
+bool MTPNativeStorage::list(const fs::path &dir, const MTPStorageListCallback &callback) {
+    std::error_code ec;
+    fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+    if (ec)
+        return false;
+
+    for (; !ec && it != end; it.increment(ec)) {
+        std::error_code type_ec;
+        if (!callback(it->path(), it->is_directory(type_ec)))
+            break;
+    }
+
+    return true;
+}
+
+bool MTPNativeStorage::stat(const fs::path &path, MTPStorageStat *out) {
+    struct stat path_stat;
+    if (::stat(path.c_str(), &path_stat) != 0)
+        return false;
+
+    out->is_dir = S_ISDIR(path_stat.st_mode);
+    out->size = out->is_dir ? 0 : path_stat.st_size;
+    out->ctime = path_stat.st_ctime;
+    out->mtime = path_stat.st_mtime;
+    return true;
+}
+
+MTPStorageFile *MTPNativeStorage::open(const fs::path &path, int mode) {
+    MTPFile *file = new MTPFile();
+    if (!file->open(path, mode)) {
+        delete file;
+        return NULL;
+    }
+
+    return file;
+}
+
+bool MTPNativeStorage::createDirectory(const fs::path &path) {
+    std::error_code ec;
+    fs::create_directory(path, ec);
+    return ec.value() == 0;
+}
+
+bool MTPNativeStorage::rename(const fs::path &from, const fs::path &to) {
+    std::error_code ec;
+    fs::rename(from, to, ec);
+    return ec.value() == 0;
+}
+
+bool MTPNativeStorage::replace(const fs::path &from, const fs::path &to) {
+    std::error_code ec;
+#ifdef __SWITCH__
+    /* fsdev won't rename over a file. The old one is moved aside and only removed once the new one
+       is in place, so a power cut leaves one or the other */
+    fs::path aside = to.string() + ".old";
+    fs::rename(to, aside, ec);
+    if (ec.value() != 0)
+        return false;
+
+    fs::rename(from, to, ec);
+    if (ec.value() != 0) {
+        fs::rename(aside, to, ec);
+        return false;
+    }
+
+    fs::remove(aside, ec);
+    return true;
+#else
+    fs::rename(from, to, ec);
+    return ec.value() == 0;
+#endif
+}
+
+bool MTPNativeStorage::remove(const fs::path &path) {
+    std::error_code ec;
+    fs::remove_all(path, ec);
+
+    /* fsdev can refuse to remove_all the directory itself once it's empty */
+    if (ec.value() != 0 && rmdir(path.c_str()) == 0)
+        ec.clear();
+
+    return ec.value() == 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <functional>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "platform.hpp"
+
+enum MTPFileMode {
+    FileRead = 1 << 0,
+    FileWrite = 1 << 1,
+    FileCreate = 1 << 2, // Truncates it if it already exists
+    FileDirect = 1 << 3, // Bypass the page cache where there is one, for as long as everything stays aligned
+};
+
+struct MTPStorageCapacity {
+    u64 total;
+    u64 free;
+    u64 block_size; // Files take up whole blocks
+};
+
+struct MTPStorageStat {
+    bool is_dir;
+    u64 size;
+    s64 ctime;
+    s64 mtime;
+};
+
+/* An open file on some storage. Reads and writes are positional and unbuffered */
+class MTPStorageFile {
+    public:
+        virtual ~MTPStorageFile() { }
+
+        /* Both return how many bytes were transferred, or -1 */
+        virtual s64 read(u64 offset, void *buf, size_t size) = 0;
+        virtual s64 write(u64 offset, const void *buf, size_t size) = 0;
+
+        virtual u64 size() = 0;
+        virtual bool setSize(u64 size) = 0;
+
+        /* Allocates size bytes ahead of writing them. Failing means there isn't room */
+        virtual bool reserve(u64 size) = 0;
+
+        /* For transports that can do the I/O themselves, -1 if there's no descriptor behind the file */
+        virtual int descriptor() { return -1; }
+};
+
+typedef std::function<bool(const fs::path &path, bool is_dir)> MTPStorageListCallback; // Return false to stop
+
+/* Where a storage's objects actually live. Paths are always full "drive:/..." paths, so
+   handles stay unique across storages and a path alone says which storage it's on */
+class MTPStorage {
+    public:
+        MTPStorage(std::string drive) : drive(drive) { }
+        virtual ~MTPStorage() { }
+
+        const std::string drive;
+        fs::path root() { return this->drive + ":/"; }
+
+        virtual u16 storageType() = 0;
+        virtual u16 accessCapability() = 0;
+        virtual bool capacity(MTPStorageCapacity *capacity) = 0; // Can be slow, e.g. a FAT scan
+
+        virtual bool list(const fs::path &dir, const MTPStorageListCallback &callback) = 0;
+        virtual bool stat(const fs::path &path, MTPStorageStat *stat) = 0;
+
+        /* The caller deletes the file when it's done. NULL if it can't be opened */
+        virtual MTPStorageFile *open(const fs::path &path, int mode) = 0;
+
+        virtual bool createDirectory(const fs::path &path) = 0;
+        virtual bool rename(const fs::path &from, const fs::path &to) = 0;
+        virtual bool remove(const fs::path &path) = 0; // Directories go with everything in them
+
+        /* Puts the file from in place of the file to. Whoever looks at to sees either one or the other */
+        virtual bool replace(const fs::path &from, const fs::path &to) = 0;
+
+        /* Depth first, every directory before what's in it */
+        bool walk(const fs::path &dir, const MTPStorageListCallback &callback);
+};
+
+/* A devoptab mount, e.g. sdmc */
+class MTPNativeStorage : public MTPStorage {
+    public:
+        MTPNativeStorage(std::string drive) : MTPStorage(drive) { }
+
+        u16 storageType() override;
+        u16 accessCapability() override;
+        bool capacity(MTPStorageCapacity *capacity) override;
+
+        bool list(const fs::path &dir, const MTPStorageListCallback &callback) override;
+        bool stat(const fs::path &path, MTPStorageStat *stat) override;
+        MTPStorageFile *open(const fs::path &path, int mode) override;
+        bool createDirectory(const fs::path &path) override;
+        bool rename(const fs::path &from, const fs::path &to) override;
+        bool remove(const fs::path &path) override;
+        bool replace(const fs::path &from, const fs::path &to) override;
+};
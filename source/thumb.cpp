@@ -0,0 +1,370 @@
+#include "thumb.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#include "mtp.hpp"
+#include "format.hpp"
+#include "memory.hpp"
+
+static u16 _be16(const u8 *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static u32 _be32(const u8 *p) {
+    return ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static u16 _tiff16(const u8 *p, bool big) {
+    return big ? _be16(p) : (p[1] << 8) | p[0];
+}
+
+static u32 _tiff32(const u8 *p, bool big) {
+    return big ? _be32(p) : ((u32) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static u64 _fnv1a(const std::string &str) {
+    u64 hash = 0xCBF29CE484222325UL;
+    for (char c : str) {
+        hash ^= (u8) c;
+        hash *= 0x100000001B3UL;
+    }
+    return hash;
+}
+
+/* Reads the dimensions from the first SOF marker of a JPEG in memory */
+static bool _jpegSize(const u8 *data, size_t size, u32 *width, u32 *height) {
+    size_t pos = 2;
+    while (pos + 9 < size) {
+        if (data[pos] != 0xFF)
+            return false;
+
+        u8 marker = data[pos + 1];
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            *height = _be16(data + pos + 5);
+            *width = _be16(data + pos + 7);
+            return true;
+        }
+
+        pos += 2 + _be16(data + pos + 2);
+    }
+
+    return false;
+}
+
+/* Finds the thumbnail referenced by IFD1 of an EXIF APP1 segment. Offsets come straight from the
+   file, so everything they're added to is worked out in u64 where it can't wrap */
+static bool _exifThumbnail(const u8 *tiff, size_t size, u32 *offset, u32 *length) {
+    if (size < 8)
+        return false;
+
+    bool big = tiff[0] == 'M';
+    u64 ifd = _tiff32(tiff + 4, big);
+    if (ifd + 2 > size)
+        return false;
+
+    u64 count = _tiff16(tiff + ifd, big);
+    if (ifd + 2 + count * 12 + 4 > size)
+        return false;
+
+    ifd = _tiff32(tiff + ifd + 2 + count * 12, big); // IFD1
+    if (ifd == 0 || ifd + 2 > size)
+        return false;
+
+    count = _tiff16(tiff + ifd, big);
+    *offset = 0;
+    *length = 0;
+    for (u64 i=0; i<count && ifd + 2 + (i + 1) * 12 <= size; i++) {
+        const u8 *entry = tiff + ifd + 2 + i * 12;
+        u16 tag = _tiff16(entry, big);
+        if (tag == 0x0201)
+            *offset = _tiff32(entry + 8, big);
+        else if (tag == 0x0202)
+            *length = _tiff32(entry + 8, big);
+    }
+
+    return *offset != 0 && *length != 0 && (u64) *offset + *length <= size;
+}
+
+/* Sequential reads over a positional file, so the parsers below can be written like stream code */
+struct ThumbReader {
+    MTPStorageFile *file;
+    u64 pos;
+    bool good;
+
+    void read(void *buf, size_t size) {
+        this->good = this->good && this->file->read(this->pos, buf, size) == (s64) size;
+        this->pos += size;
+    }
+};
+
+static bool _jpegThumbnail(ThumbReader &reader, MTPThumbnail *thumb, std::vector<u8> *data) {
+    u8 marker[4];
+    reader.read(marker, 2);
+    if (!reader.good || _be16(marker) != 0xFFD8)
+        return false;
+
+    u64 pos = 2;
+    while (pos < THUMB_SCAN_MAX) {
+        reader.read(marker, 4);
+        if (!reader.good || marker[0] != 0xFF || marker[1] == 0xDA || marker[1] == 0xD9)
+            return false;
+
+        u16 length = _be16(marker + 2);
+        if (marker[1] == 0xE1 && length > 8) {
+            std::vector<u8> segment(length - 2);
+            reader.read(segment.data(), segment.size());
+
+            u32 offset, size;
+            if (reader.good && memcmp(segment.data(), "Exif\0\0", 6) == 0 &&
+                _exifThumbnail(segment.data() + 6, segment.size() - 6, &offset, &size)) {
+                data->assign(segment.begin() + 6 + offset, segment.begin() + 6 + offset + size);
+                thumb->format = FormatJFIF;
+                thumb->size = size;
+                return _jpegSize(data->data(), data->size(), &thumb->width, &thumb->height);
+            }
+        } else {
+            reader.pos += length - 2;
+        }
+
+        pos += 2 + length;
+    }
+
+    return false;
+}
+
+/* Walks moov/udta/meta/ilst/covr looking for embedded cover art */
+static bool _mp4Cover(ThumbReader &reader, u64 start, u64 end, int depth, MTPThumbnail *thumb, std::vector<u8> *data) {
+    u64 pos = start;
+    while (pos + 8 <= end && depth < 6) {
+        u8 atom[16];
+        reader.pos = pos;
+        reader.read(atom, 8);
+        if (!reader.good)
+            return false;
+
+        u64 size = _be32(atom), header = 8;
+        if (size == 1) {
+            reader.read(atom + 8, 8);
+            size = ((u64) _be32(atom + 8) << 32) | _be32(atom + 12);
+            header = 16;
+        } else if (size == 0) {
+            size = end - pos;
+        }
+        if (size < header || pos + size > end)
+            return false;
+
+        if (!memcmp(atom + 4, "moov", 4) || !memcmp(atom + 4, "udta", 4) || !memcmp(atom + 4, "ilst", 4) || !memcmp(atom + 4, "covr", 4)) {
+            if (_mp4Cover(reader, pos + header, pos + size, depth + 1, thumb, data))
+                return true;
+        } else if (!memcmp(atom + 4, "meta", 4)) {
+            if (_mp4Cover(reader, pos + header + 4, pos + size, depth + 1, thumb, data)) // meta is a full box
+                return true;
+        } else if (!memcmp(atom + 4, "data", 4) && size > header + 8 && size - header - 8 < 0x1000000) {
+            u8 type[8];
+            reader.read(type, 8);
+            u32 kind = _be32(type);
+
+            data->resize(size - header - 8);
+            reader.read(data->data(), data->size());
+            if (!reader.good)
+                return false;
+
+            thumb->size = data->size();
+            if (kind == 13) { // JPEG
+                thumb->format = FormatJFIF;
+                return _jpegSize(data->data(), data->size(), &thumb->width, &thumb->height);
+            } else if (kind == 14 && data->size() >= 24) { // PNG, dimensions are in IHDR
+                thumb->format = FormatPNG;
+                thumb->width = _be32(data->data() + 16);
+                thumb->height = _be32(data->data() + 20);
+                return true;
+            }
+        }
+
+        pos += size;
+    }
+
+    return false;
+}
+
+bool thumbExtract(MTPStorage *storage, const fs::path &path, MTPThumbnail *thumb, std::vector<u8> *data) {
+    u16 format = formatFromExtension(path);
+    if (format != FormatEXIF_JPEG && format != FormatMP4 && format != Format3GP && format != FormatUndefinedVideo)
+        return false;
+
+    MTPStorageFile *file = storage->open(path, FileRead);
+    if (file == NULL)
+        return false;
+
+    ThumbReader reader = {file, 0, true};
+    bool found;
+    if (format == FormatEXIF_JPEG)
+        found = _jpegThumbnail(reader, thumb, data);
+    else
+        found = _mp4Cover(reader, 0, file->size(), 0, thumb, data);
+
+    delete file;
+    return found;
+}
+
+static bool _hasThumbnail(const fs::path &path) {
+    u16 format = formatFromExtension(path);
+    return format == FormatEXIF_JPEG || format == FormatMP4 || format == Format3GP || format == FormatUndefinedVideo;
+}
+
+MTPThumbnailCache::MTPThumbnailCache() {
+    this->directory = "sdmc:/switch/Tuphlos/thumbs";
+    this->clock = 0;
+    this->key_bytes = 0;
+}
+
+void MTPThumbnailCache::setDirectory(std::string directory) {
+    this->directory = directory;
+    this->entries.clear();
+    this->key_bytes = 0;
+}
+
+std::string MTPThumbnailCache::cachePath(const std::string &path) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016lx.thm", _fnv1a(path));
+    return this->directory + name;
+}
+
+bool MTPThumbnailCache::load(const std::string &path, u64 size, s64 mtime, Entry *entry, std::vector<u8> *data) {
+    std::ifstream ifs(this->cachePath(path), std::ios::binary);
+    if (!ifs.good())
+        return false;
+
+    MTPThumbnailCacheHeader header;
+    ifs.read((char *) &header, sizeof(header));
+    if (!ifs.good() || header.magic != THUMB_CACHE_MAGIC || header.version != THUMB_CACHE_VERSION ||
+        header.source_size != size || header.source_mtime != mtime || header.path_length != path.size())
+        return false;
+
+    /* Different paths can share a hash, so the path itself is checked too */
+    std::string stored(header.path_length, '\0');
+    ifs.read(&stored[0], stored.size());
+    if (!ifs.good() || stored != path)
+        return false;
+
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->thumb = {header.format, header.length, header.width, header.height};
+
+    if (data != NULL) {
+        data->resize(header.length);
+        ifs.read((char *) data->data(), data->size());
+        return ifs.good();
+    }
+
+    return true;
+}
+
+void MTPThumbnailCache::store(const std::string &path, Entry &entry, std::vector<u8> &data) {
+    std::error_code ec;
+    fs::create_directories(this->directory, ec);
+
+    std::ofstream ofs(this->cachePath(path), std::ios::binary);
+    if (!ofs.good())
+        return;
+
+    MTPThumbnailCacheHeader header = {
+        THUMB_CACHE_MAGIC, THUMB_CACHE_VERSION, entry.size, entry.mtime,
+        entry.thumb.format, entry.thumb.width, entry.thumb.height, entry.thumb.size, (u32) path.size(),
+    };
+    ofs.write((char *) &header, sizeof(header));
+    ofs.write(path.data(), path.size());
+    ofs.write((char *) data.data(), entry.thumb.size);
+}
+
+bool MTPThumbnailCache::lookup(MTPStorage *storage, const fs::path &path, u64 size, s64 mtime, MTPThumbnail *thumb) {
+    std::string key = path.string();
+
+    auto it = this->entries.find(key);
+    if (it != this->entries.end() && it->second.size == size && it->second.mtime == mtime) {
+        it->second.used = ++this->clock;
+        *thumb = it->second.thumb;
+        return thumb->size != 0;
+    }
+
+    if (!_hasThumbnail(path))
+        return false;
+
+    Entry entry;
+    if (!this->load(key, size, mtime, &entry, NULL)) {
+        std::vector<u8> data;
+        entry.size = size;
+        entry.mtime = mtime;
+        entry.thumb = {FormatUndefined, 0, 0, 0};
+        if (!thumbExtract(storage, path, &entry.thumb, &data))
+            entry.thumb = {FormatUndefined, 0, 0, 0};
+
+        this->store(key, entry, data);
+    }
+
+    entry.used = ++this->clock;
+    if (this->entries.find(key) == this->entries.end())
+        this->key_bytes += key.size() + 1;
+    this->entries[key] = entry;
+    *thumb = entry.thumb;
+    return thumb->size != 0;
+}
+
+/* For listings, which go through far too many objects to extract anything. A thumbnail only
+   shows up here once GetThumb has worked it out, here or in an earlier run */
+bool MTPThumbnailCache::cached(const fs::path &path, u64 size, s64 mtime, MTPThumbnail *thumb) {
+    std::string key = path.string();
+
+    auto it = this->entries.find(key);
+    if (it != this->entries.end() && it->second.size == size && it->second.mtime == mtime) {
+        it->second.used = ++this->clock;
+        *thumb = it->second.thumb;
+        return thumb->size != 0;
+    }
+
+    Entry entry;
+    if (!_hasThumbnail(path) || !this->load(key, size, mtime, &entry, NULL))
+        return false;
+
+    entry.used = ++this->clock;
+    if (this->entries.find(key) == this->entries.end())
+        this->key_bytes += key.size() + 1;
+    this->entries[key] = entry;
+    *thumb = entry.thumb;
+    return thumb->size != 0;
+}
+
+size_t MTPThumbnailCache::memory() {
+    return this->entries.bucket_count() * sizeof(void *) + this->key_bytes +
+        this->entries.size() * (sizeof(std::pair<std::string, Entry>) + sizeof(void *));
+}
+
+/* Whatever goes is still in the cache directory, so it only costs a read to get it back */
+size_t MTPThumbnailCache::trim(u64 target) {
+    size_t memory = this->memory();
+    if (memory <= target || this->entries.empty())
+        return 0;
+
+    size_t per_entry = (memory - this->entries.bucket_count() * sizeof(void *)) / this->entries.size();
+    auto keys = memoryColdest(this->entries, (memory - target + per_entry - 1) / per_entry,
+        [](const Entry &entry) { return entry.used; });
+    for (auto &key : keys) {
+        this->key_bytes -= key.size() + 1;
+        this->entries.erase(key);
+    }
+    return keys.size();
+}
+
+bool MTPThumbnailCache::read(MTPStorage *storage, const fs::path &path, u64 size, s64 mtime, std::vector<u8> *data) {
+    MTPThumbnail thumb;
+    if (!this->lookup(storage, path, size, mtime, &thumb))
+        return false;
+
+    Entry entry;
+    if (this->load(path.string(), size, mtime, &entry, data))
+        return true;
+
+    /* The cache directory might not be writable */
+    return thumbExtract(storage, path, &thumb, data);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+namespace fs = std::filesystem;
+#include <unordered_map>
+
+#include "platform.hpp"
+#include "storage.hpp"
+
+#define THUMB_CACHE_MAGIC 0x48545054 // "TPTH"
+#define THUMB_CACHE_VERSION 1
+#define THUMB_SCAN_MAX 0x40000UL // How far into a JPEG we look for the EXIF segment
+
+struct MTPThumbnail {
+    u16 format;
+    u32 size;
+    u32 width;
+    u32 height;
+};
+
+/* On-SD cache entry, followed by the source path and the thumbnail itself.
+   An entry with length zero records that the source has no thumbnail */
+struct PACKED MTPThumbnailCacheHeader {
+    u32 magic;
+    u32 version;
+    u64 source_size;
+    s64 source_mtime;
+    u16 format;
+    u32 width;
+    u32 height;
+    u32 length;
+    u32 path_length;
+};
+
+/* Thumbnails sliced out of media files without decoding anything: the EXIF thumbnail of a
+   JPEG, or the cover art of an MP4. Results are persisted keyed by path, size and mtime */
+class MTPThumbnailCache {
+    public:
+        MTPThumbnailCache();
+
+        void setDirectory(std::string directory);
+
+        bool lookup(MTPStorage *storage, const fs::path &path, u64 size, s64 mtime, MTPThumbnail *thumb);
+        bool cached(const fs::path &path, u64 size, s64 mtime, MTPThumbnail *thumb); // Never opens the media file itself
+        bool read(MTPStorage *storage, const fs::path &path, u64 size, s64 mtime, std::vector<u8> *data);
+
+        size_t memory();
+        size_t trim(u64 target); // Drops the least recently used entries until memory() is down to target
+
+    private:
+        struct Entry {
+            u64 size;
+            s64 mtime;
+            MTPThumbnail thumb;
+            u64 used;
+        };
+
+        std::string directory;
+        std::unordered_map<std::string, Entry> entries;
+        u64 clock;
+        size_t key_bytes; // Paths the entries are keyed by
+
+        std::string cachePath(const std::string &path);
+        bool load(const std::string &path, u64 size, s64 mtime, Entry *entry, std::vector<u8> *data);
+        void store(const std::string &path, Entry &entry, std::vector<u8> &data);
+};
+
+bool thumbExtract(MTPStorage *storage, const fs::path &path, MTPThumbnail *thumb, std::vector<u8> *data);
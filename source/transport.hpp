@@ -0,0 +1,43 @@
+#pragma once
+
+#include "platform.hpp"
+
+class MTPStorageFile;
+
+enum MTPEndpoint {
+    EndpointIn, // Device to host
+    EndpointOut, // Host to device
+    EndpointInterrupt,
+};
+
+struct MTPFileTransfer {
+    Result rc; // Of the endpoint side
+    u64 xferd; // Bytes that went over the endpoint
+    bool file_ok; // The file side moved everything it was asked to
+};
+
+/* Moves raw bytes between the responder and the host. A transfer on EndpointOut completes
+   once the buffer is full or the host ends the transfer with a short packet */
+class MTPTransport {
+    public:
+        virtual ~MTPTransport() { }
+
+        virtual Result transfer(MTPEndpoint ep, void *buf, size_t size, size_t *out_xferd) = 0;
+
+        /* Optionally moves object data between an endpoint and a file without it passing through the
+           responder. EndpointIn sends size bytes of the file from offset, EndpointOut writes what arrives
+           until size bytes or a short packet. False means it can't for this file and nothing was moved */
+        virtual bool transferFile(MTPEndpoint ep, MTPStorageFile *file, u64 offset, u64 size, MTPFileTransfer *out) { return false; }
+
+        /* Waits up to timeout nanoseconds for a host to be attached. Transfers fail while there isn't one */
+        virtual bool waitReady(u64 timeout) { return true; }
+
+        /* Waits up to timeout nanoseconds for the host to send something into buf, for when it might be idle.
+           True once there's something for an EndpointOut transfer with the same buf and size to take. Ones that
+           can't tell say true, and that transfer waits for as long as it takes */
+        virtual bool waitReceive(void *buf, size_t size, u64 timeout) { return true; }
+
+        /* Goes up every time a host attaches. A change means the last one left, and its session
+           and anything it had in flight went with it */
+        virtual u32 connection() { return 0; }
+};
@@ -0,0 +1,486 @@
+#ifdef __SWITCH__
+
+#include "usb.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#define USB_ERROR_DISCONNECTED MAKERESULT(Module_Libnx, LibnxError_NotInitialized)
+
+UsbDsInterface *g_interface;
+UsbDsEndpoint *g_endpoint_in, *g_endpoint_out, *g_endpoint_interr;
+
+bool g_initialized = false;
+
+/* Lots of low level USB stuff taken from libnx and Atmosphere's tma_usb_comms */
+
+static Result _usbCommsInterfaceInit1x() {
+    Result rc = 0;
+
+    u8 mtp_index;
+    usbDsAddUsbStringDescriptor(&mtp_index, "MTP");
+
+    struct usb_interface_descriptor interface_descriptor = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 4,
+        .bNumEndpoints = 3,
+        .bInterfaceClass = 6,
+        .bInterfaceSubClass = 1,
+        .bInterfaceProtocol = 1,
+        .iInterface = mtp_index,
+    };
+
+    struct usb_endpoint_descriptor endpoint_descriptor_in = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_IN,
+        .bmAttributes = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize = 0x200,
+    };
+
+    struct usb_endpoint_descriptor endpoint_descriptor_out = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_OUT,
+        .bmAttributes = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize = 0x200,
+    };
+
+    struct usb_endpoint_descriptor endpoint_descriptor_interr = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_IN,
+        .bmAttributes = USB_TRANSFER_TYPE_INTERRUPT,
+        .wMaxPacketSize = 0x1c,
+        .bInterval = 6,
+    };
+
+    if (R_FAILED(rc)) return rc;
+
+    //Setup interface.
+    rc = usbDsGetDsInterface(&g_interface, &interface_descriptor, "usb");
+    if (R_FAILED(rc)) return rc;
+
+    //Setup endpoints.
+    rc = usbDsInterface_GetDsEndpoint(g_interface, &g_endpoint_in, &endpoint_descriptor_in);//device->host
+    if (R_FAILED(rc)) return rc;
+
+    rc = usbDsInterface_GetDsEndpoint(g_interface, &g_endpoint_out, &endpoint_descriptor_out);//host->device
+    if (R_FAILED(rc)) return rc;
+
+    rc = usbDsInterface_GetDsEndpoint(g_interface, &g_endpoint_interr, &endpoint_descriptor_interr);
+
+    return rc;
+}
+
+static Result _usbCommsInterfaceInit5x() {
+    Result rc = 0;
+    
+    u8 iManufacturer, iProduct, iSerialNumber;
+    static const u16 supported_langs[1] = {0x0409};
+    // Send language descriptor
+    rc = usbDsAddUsbLanguageStringDescriptor(NULL, supported_langs, sizeof(supported_langs)/sizeof(u16));
+    // Send manufacturer
+    if (R_SUCCEEDED(rc)) rc = usbDsAddUsbStringDescriptor(&iManufacturer, "Nintendo");
+    // Send product
+    if (R_SUCCEEDED(rc)) rc = usbDsAddUsbStringDescriptor(&iProduct, "Nintendo Switch");
+    // Send serial number
+    if (R_SUCCEEDED(rc)) rc = usbDsAddUsbStringDescriptor(&iSerialNumber, "SerialNumber");
+
+    // Send device descriptors
+    struct usb_device_descriptor device_descriptor = {
+        .bLength = USB_DT_DEVICE_SIZE,
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = 0x0110,
+        .bDeviceClass = 0x00,
+        .bDeviceSubClass = 0x00,
+        .bDeviceProtocol = 0x00,
+        .bMaxPacketSize0 = 0x40,
+        .idVendor = 0x057e,
+        .idProduct = 0x3000,
+        .bcdDevice = 0x0100,
+        .iManufacturer = iManufacturer,
+        .iProduct = iProduct,
+        .iSerialNumber = iSerialNumber,
+        .bNumConfigurations = 0x01
+    };
+    // Full Speed is USB 1.1
+    if (R_SUCCEEDED(rc)) rc = usbDsSetUsbDeviceDescriptor(UsbDeviceSpeed_Full, &device_descriptor);
+    
+    // High Speed is USB 2.0
+    device_descriptor.bcdUSB = 0x0200;
+    if (R_SUCCEEDED(rc)) rc = usbDsSetUsbDeviceDescriptor(UsbDeviceSpeed_High, &device_descriptor);
+    
+    // Super Speed is USB 3.0
+    device_descriptor.bcdUSB = 0x0300;
+    // Upgrade packet size to 512
+    device_descriptor.bMaxPacketSize0 = 0x09;
+    if (R_SUCCEEDED(rc)) rc = usbDsSetUsbDeviceDescriptor(UsbDeviceSpeed_Super, &device_descriptor);
+    
+    // Define Binary Object Store
+    u8 bos[0x16] = {
+        0x05, // .bLength
+        USB_DT_BOS, // .bDescriptorType
+        0x16, 0x00, // .wTotalLength
+        0x02, // .bNumDeviceCaps
+        
+        // USB 2.0
+        0x07, // .bLength
+        USB_DT_DEVICE_CAPABILITY, // .bDescriptorType
+        0x02, // .bDevCapabilityType
+        0x02, 0x00, 0x00, 0x00, // dev_capability_data
+        
+        // USB 3.0
+        0x0A, // .bLength
+        USB_DT_DEVICE_CAPABILITY, // .bDescriptorType
+        0x03, // .bDevCapabilityType
+        0x00, 0x0E, 0x00, 0x03, 0x00, 0x00, 0x00
+    };
+    if (R_SUCCEEDED(rc)) rc = usbDsSetBinaryObjectStore(bos, sizeof(bos));
+    
+    if (R_FAILED(rc)) return rc;
+
+    u8 mtp_index;
+    usbDsAddUsbStringDescriptor(&mtp_index, "MTP");
+    
+    struct usb_interface_descriptor interface_descriptor = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 4,
+        .bNumEndpoints = 3,
+        .bInterfaceClass = 6,
+        .bInterfaceSubClass = 1,
+        .bInterfaceProtocol = 1,
+        .iInterface = mtp_index,
+    };
+
+    struct usb_endpoint_descriptor endpoint_descriptor_in = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_IN,
+        .bmAttributes = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize = 0x40,
+    };
+
+    struct usb_endpoint_descriptor endpoint_descriptor_out = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_OUT,
+        .bmAttributes = USB_TRANSFER_TYPE_BULK,
+        .wMaxPacketSize = 0x40,
+    };
+
+    struct usb_endpoint_descriptor endpoint_descriptor_interr = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_ENDPOINT_IN,
+        .bmAttributes = USB_TRANSFER_TYPE_INTERRUPT,
+        .wMaxPacketSize = 0x1c,
+        .bInterval = 6,
+    };
+    
+    struct usb_ss_endpoint_companion_descriptor endpoint_companion = {
+        .bLength = sizeof(struct usb_ss_endpoint_companion_descriptor),
+        .bDescriptorType = USB_DT_SS_ENDPOINT_COMPANION,
+        .bMaxBurst = 0x0F,
+        .bmAttributes = 0x00,
+        .wBytesPerInterval = 0x00,
+    };
+    
+    rc = usbDsRegisterInterface(&g_interface);
+    if (R_FAILED(rc)) return rc;
+    
+    interface_descriptor.bInterfaceNumber = g_interface->interface_index;
+    endpoint_descriptor_in.bEndpointAddress += interface_descriptor.bInterfaceNumber + 1;
+    endpoint_descriptor_out.bEndpointAddress += interface_descriptor.bInterfaceNumber + 1;
+    endpoint_descriptor_interr.bEndpointAddress += interface_descriptor.bInterfaceNumber +2;
+    
+    // Full Speed Config
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &interface_descriptor, USB_DT_INTERFACE_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &endpoint_descriptor_in, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &endpoint_descriptor_out, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Full, &endpoint_descriptor_interr, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    
+    // High Speed Config
+    endpoint_descriptor_in.wMaxPacketSize = 0x200;
+    endpoint_descriptor_out.wMaxPacketSize = 0x200;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &interface_descriptor, USB_DT_INTERFACE_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &endpoint_descriptor_in, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &endpoint_descriptor_out, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_High, &endpoint_descriptor_interr, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    
+    // Super Speed Config
+    endpoint_descriptor_in.wMaxPacketSize = 0x400;
+    endpoint_descriptor_out.wMaxPacketSize = 0x400;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &interface_descriptor, USB_DT_INTERFACE_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_descriptor_in, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_companion, USB_DT_SS_ENDPOINT_COMPANION_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_descriptor_out, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_companion, USB_DT_SS_ENDPOINT_COMPANION_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_descriptor_interr, USB_DT_ENDPOINT_SIZE);
+    if (R_FAILED(rc)) return rc;
+    rc = usbDsInterface_AppendConfigurationData(g_interface, UsbDeviceSpeed_Super, &endpoint_companion, USB_DT_SS_ENDPOINT_COMPANION_SIZE);
+    if (R_FAILED(rc)) return rc;
+    
+    //Setup endpoints.    
+    rc = usbDsInterface_RegisterEndpoint(g_interface, &g_endpoint_in, endpoint_descriptor_in.bEndpointAddress);
+    if (R_FAILED(rc)) return rc;
+    
+    rc = usbDsInterface_RegisterEndpoint(g_interface, &g_endpoint_out, endpoint_descriptor_out.bEndpointAddress);
+    if (R_FAILED(rc)) return rc;
+
+    rc = usbDsInterface_RegisterEndpoint(g_interface, &g_endpoint_interr, endpoint_descriptor_interr.bEndpointAddress);
+    if (R_FAILED(rc)) return rc;
+    
+    return rc;
+}
+
+static Result _usbCommsInterfaceInit() {
+    if (hosversionAtLeast(5,0,0)) {
+        return _usbCommsInterfaceInit5x();
+    } else {
+        return _usbCommsInterfaceInit1x();
+    }
+}
+
+static Result _usbCommsInitialize() {
+    Result rc = 0;
+
+    if (g_initialized)
+        return rc;
+
+    rc = usbDsInitialize();
+    if (R_FAILED(rc))
+        return rc;
+
+    rc = _usbCommsInterfaceInit();
+    if (R_FAILED(rc))
+        return rc;
+
+    rc = usbDsInterface_EnableInterface(g_interface);
+    if (R_FAILED(rc))
+        return rc;
+
+    rc = usbDsEnable();
+    if (R_FAILED(rc))
+        return rc;
+
+    g_initialized = true;
+
+    return rc;
+}
+
+static void _usbCommsExit() {
+    usbDsExit();
+    g_initialized = false;
+}
+
+USBTransport::USBTransport() {
+    this->configured = false;
+    this->stopping = false;
+    this->connections = 0;
+    this->receive = {};
+
+    if (R_SUCCEEDED(_usbCommsInitialize()))
+        this->watcher = std::thread(&USBTransport::watchState, this);
+}
+
+USBTransport::~USBTransport() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cond.notify_all();
+
+    if (this->watcher.joinable())
+        this->watcher.join();
+
+    _usbCommsExit();
+}
+
+void USBTransport::watchState() {
+    Event *event = usbDsGetStateChangeEvent();
+
+    while (true) {
+        UsbState state = UsbState_Detached;
+        bool configured = R_SUCCEEDED(usbDsGetState(&state)) && state == UsbState_Configured;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stopping)
+                break;
+
+            /* Every time the host configures us is a new connection, even if it's the same host */
+            if (configured && !this->configured)
+                this->connections++;
+            this->configured = configured;
+        }
+        this->cond.notify_all();
+
+        while (R_FAILED(eventWait(event, USB_STATE_POLL_NS))) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stopping)
+                return;
+        }
+        eventClear(event);
+    }
+}
+
+bool USBTransport::waitReady(u64 timeout) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->cond.wait_for(lock, std::chrono::nanoseconds(timeout), [this] { return this->configured || this->stopping; });
+    return this->configured;
+}
+
+u32 USBTransport::connection() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->connections;
+}
+
+bool USBTransport::attached(u32 connection) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->configured && this->connections == connection;
+}
+
+/* Waits for urb in slices, so a pulled cable or a host that stopped reading gets it cancelled rather
+   than the responder stuck on it. With keep, running out of time leaves it posted */
+Result USBTransport::complete(UsbDsEndpoint *ep, u32 urb, u32 connection, u64 timeout, bool keep, u32 *out_xferd) {
+    u64 waited = 0;
+    while (R_FAILED(eventWait(&ep->CompletionEvent, std::min(timeout, USB_XFER_SLICE_NS)))) {
+        waited += USB_XFER_SLICE_NS;
+        bool gone = !this->attached(connection);
+        if (!gone && keep && waited >= timeout)
+            return KERNELRESULT(TimedOut);
+        if (gone || waited >= timeout) {
+            usbDsEndpoint_Cancel(ep);
+            eventWait(&ep->CompletionEvent, USB_XFER_SLICE_NS);
+            eventClear(&ep->CompletionEvent);
+            return gone ? USB_ERROR_DISCONNECTED : KERNELRESULT(TimedOut);
+        }
+    }
+    eventClear(&ep->CompletionEvent);
+
+    UsbDsReportData reportdata;
+    Result rc = usbDsEndpoint_GetReportData(ep, &reportdata);
+    if (R_FAILED(rc)) return rc;
+
+    return usbDsParseReportData(&reportdata, urb, NULL, out_xferd);
+}
+
+void USBTransport::dropReceive() {
+    if (this->receive.posted) {
+        usbDsEndpoint_Cancel(g_endpoint_out);
+        eventWait(&g_endpoint_out->CompletionEvent, USB_XFER_SLICE_NS);
+        eventClear(&g_endpoint_out->CompletionEvent);
+    }
+    this->receive.posted = false;
+    this->receive.done = false;
+}
+
+bool USBTransport::waitReceive(void *buf, size_t size, u64 timeout) {
+    u32 connection = this->connection();
+    if (!this->attached(connection)) {
+        this->dropReceive();
+        return false;
+    }
+
+    if (this->receive.done)
+        return true;
+
+    if (!this->receive.posted || this->receive.buf != buf || this->receive.size != size || this->receive.connection != connection) {
+        this->dropReceive();
+        if (R_FAILED(usbDsEndpoint_PostBufferAsync(g_endpoint_out, buf, size, &this->receive.urb)))
+            return false;
+
+        this->receive.buf = buf;
+        this->receive.size = size;
+        this->receive.connection = connection;
+        this->receive.posted = true;
+    }
+
+    u32 xferd = 0;
+    Result rc = this->complete(g_endpoint_out, this->receive.urb, connection, timeout, true, &xferd);
+    if (rc == KERNELRESULT(TimedOut))
+        return false;
+
+    this->receive.posted = false;
+    this->receive.done = true;
+    this->receive.rc = rc;
+    this->receive.xferd = xferd;
+    return true;
+}
+
+/* Taken from Atmosphere's tma_usb_comms */
+Result USBTransport::transfer(MTPEndpoint endpoint, void *buf, size_t size, size_t *out_xferd) {
+    Result rc = 0;
+    u32 urbId = 0;
+    u32 total_xferd = 0;
+    UsbDsEndpoint *ep;
+    u64 timeout;
+
+    switch (endpoint) {
+        case EndpointIn:
+            ep = g_endpoint_in;
+            timeout = USB_IN_TIMEOUT_NS;
+            break;
+        case EndpointOut:
+            ep = g_endpoint_out;
+            timeout = U64_MAX; // The host takes as long as it likes to send the rest of a transaction
+            break;
+        default:
+            ep = g_endpoint_interr;
+            timeout = USB_INTERRUPT_TIMEOUT_NS;
+            break;
+    }
+
+    u32 connection = this->connection();
+    if (!this->attached(connection))
+        return USB_ERROR_DISCONNECTED;
+
+    /* Picks up what waitReceive left, anything else means it's not wanted any more */
+    if (endpoint == EndpointOut && (this->receive.posted || this->receive.done)) {
+        bool same = this->receive.buf == buf && this->receive.size == size && this->receive.connection == connection;
+        if (same && this->receive.done) {
+            this->receive.done = false;
+            if (out_xferd) *out_xferd = this->receive.xferd;
+            return this->receive.rc;
+        } else if (same) {
+            this->receive.posted = false;
+            rc = this->complete(ep, this->receive.urb, connection, timeout, false, &total_xferd);
+            if (out_xferd) *out_xferd = total_xferd;
+            return rc;
+        }
+        this->dropReceive();
+    }
+
+    if (size) {
+        /* Start transfer. */
+        rc = usbDsEndpoint_PostBufferAsync(ep, buf, size, &urbId);
+
+        if (R_FAILED(rc)) return rc;
+
+        /* Wait for transfer to complete. */
+        rc = this->complete(ep, urbId, connection, timeout, false, &total_xferd);
+        if (R_FAILED(rc)) return rc;
+    }
+    
+    if (out_xferd) *out_xferd = total_xferd;
+
+    return rc;
+}
+
+#endif
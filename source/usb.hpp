@@ -0,0 +1,50 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "transport.hpp"
+
+#define USB_STATE_POLL_NS 100000000UL // How often the watcher checks whether it should stop
+#define USB_XFER_SLICE_NS 50000000UL // How often a waiting transfer checks the cable is still there
+#define USB_IN_TIMEOUT_NS 5000000000UL
+#define USB_INTERRUPT_TIMEOUT_NS 1000000000UL // Plenty of hosts never read events at all
+
+/* The console's USB device interface, through usb:ds. It comes up without waiting for a host,
+   and a thread follows the state of the cable so unplugging cancels whatever was in flight */
+class USBTransport : public MTPTransport {
+    public:
+        USBTransport();
+        ~USBTransport();
+
+        Result transfer(MTPEndpoint endpoint, void *buf, size_t size, size_t *out_xferd) override;
+        bool waitReady(u64 timeout) override;
+        bool waitReceive(void *buf, size_t size, u64 timeout) override;
+        u32 connection() override;
+
+    private:
+        std::thread watcher;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool configured;
+        bool stopping;
+        u32 connections;
+
+        /* What waitReceive posted on EndpointOut. It stays there between calls, for the transfer after it */
+        struct {
+            void *buf;
+            size_t size;
+            u32 urb;
+            u32 connection;
+            bool posted;
+            bool done; // Completed already, with rc and xferd
+            Result rc;
+            u32 xferd;
+        } receive;
+
+        void watchState();
+        bool attached(u32 connection);
+        Result complete(UsbDsEndpoint *ep, u32 urb, u32 connection, u64 timeout, bool keep, u32 *out_xferd);
+        void dropReceive();
+};